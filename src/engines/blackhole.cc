@@ -53,18 +53,32 @@ KVStatus Blackhole::Get(const int32_t limit, const int32_t keybytes, int32_t* va
     return NOT_FOUND;
 }
 
-KVStatus Blackhole::Get(const string& key, string* value) {
-    LOG("Get for key=" << key.c_str());
+KVStatus Blackhole::Get(const Slice& key, string* value) {
+    LOG("Get for key=" << key.ToString());
     return NOT_FOUND;
 }
 
-KVStatus Blackhole::Put(const string& key, const string& value) {
-    LOG("Put key=" << key.c_str() << ", value.size=" << to_string(value.size()));
+KVStatus Blackhole::Get(const Slice& key, void* context, KVGetCallback* callback) {
+    LOG("Get for key=" << key.ToString());
+    return NOT_FOUND;
+}
+
+void Blackhole::MultiGet(const vector<string>& keys, void* context, KVMultiGetCallback* callback) {
+    LOG("MultiGet for count=" << to_string(keys.size()));
+}
+
+KVStatus Blackhole::Put(const Slice& key, const Slice& value) {
+    LOG("Put key=" << key.ToString() << ", value.size=" << to_string(value.size()));
+    return OK;
+}
+
+KVStatus Blackhole::Remove(const Slice& key) {
+    LOG("Remove key=" << key.ToString());
     return OK;
 }
 
-KVStatus Blackhole::Remove(const string& key) {
-    LOG("Remove key=" << key.c_str());
+KVStatus Blackhole::Write(const WriteBatch& batch) {
+    LOG("Write batch.count=" << to_string(batch.Count()));
     return OK;
 }
 
@@ -50,16 +50,28 @@ class Blackhole : public KVEngine {
                  int32_t* valuebytes,
                  const char* key,
                  char* value) final;
-    KVStatus Get(const string& key,                        // append value to std::string
+    KVStatus Get(const Slice& key,                         // append value to std::string
                  string* value) final;
-    KVStatus Put(const string& key,                        // copy value from std::string
-                 const string& value) final;
-    KVStatus Remove(const string& key) final;              // remove value for key
+    KVStatus Get(const Slice& key,                         // pass value to callback without copy
+                 void* context,
+                 KVGetCallback* callback) final;
+    void MultiGet(const vector<string>& keys,              // pass each value found to callback
+                  void* context,
+                  KVMultiGetCallback* callback) final;
+    KVStatus Put(const Slice& key,                         // copy value from slice
+                 const Slice& value) final;
+    KVStatus Remove(const Slice& key) final;               // remove value for key
+    KVStatus Write(const WriteBatch& batch) final;         // apply all updates or none
+    KVIterator* NewIterator() final { return nullptr; }    // iteration not supported
 
     PMEMoid GetRootOid() final;
     PMEMobjpool* GetPool() final;
 
 
+    void AllKeys(void* context,                            // nothing stored to list
+                 KVAllKeysCallback* callback) final {}
+    void AllKeyValues(void* context,                       // nothing stored to list
+                      KVAllKeyValuesCallback* callback) final {}
     void ListAllKeyValuePairs(vector<string>& kv_pairs) final { return; }
     void ListAllKeys(vector<string>& keys) final { return; }
     size_t TotalNumKeys() final {return 0;}
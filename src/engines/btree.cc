@@ -67,41 +67,119 @@ BTreeEngine::~BTreeEngine() {
     LOG("Closed ok");
 }
 
+void BTreeEngine::AllKeys(void* context, KVAllKeysCallback* callback) {
+    LOG("AllKeys");
+    for (auto it = my_btree->begin(); it != my_btree->end(); ++it) {
+        if (!(*callback)(context, (int32_t) it->first.size(), it->first.c_str())) return;
+    }
+}
+
+void BTreeEngine::AllKeyValues(void* context, KVAllKeyValuesCallback* callback) {
+    LOG("AllKeyValues");
+    for (auto it = my_btree->begin(); it != my_btree->end(); ++it) {
+        if (!(*callback)(context, (int32_t) it->first.size(), it->first.c_str(),
+                         (int32_t) it->second.size(), it->second.c_str())) return;
+    }
+}
+
+void BTreeEngine::ListAllKeyValuePairs(vector<string>& kv_pairs) {
+    LOG("Listing");
+    AllKeyValues(&kv_pairs, [](void* context, int32_t keybytes, const char* key,
+                               int32_t valuebytes, const char* value) {
+        auto kv_pairs = (vector<string>*) context;
+        kv_pairs->push_back(string(key, (size_t) keybytes));
+        kv_pairs->push_back(string(value, (size_t) valuebytes));
+        return true;
+    });
+}
+
+void BTreeEngine::ListAllKeys(vector<string>& keys) {
+    LOG("Listing");
+    AllKeys(&keys, [](void* context, int32_t keybytes, const char* key) {
+        ((vector<string>*) context)->push_back(string(key, (size_t) keybytes));
+        return true;
+    });
+}
+
 KVStatus BTreeEngine::Get(const int32_t limit, const int32_t keybytes, int32_t* valuebytes,
                         const char* key, char* value) {
     LOG("Get for key=" << key);
     return NOT_FOUND;
 }
 
-KVStatus BTreeEngine::Get(const string& key, string* value) {
-    LOG("Get for key=" << key.c_str());
-    btree_type::iterator it = my_btree->find( pstring<20>(key) );
+KVStatus BTreeEngine::Get(const Slice& key, string* value) {
+    LOG("Get for key=" << key.ToString());
+    btree_type::iterator it = my_btree->find( pstring<MAX_KEY_SIZE>(key.data(), key.size()) );
     if ( it == my_btree->end() ) {
-        LOG("Key=" << key.c_str() << " not found");
+        LOG("Key=" << key.ToString() << " not found");
         return NOT_FOUND;
     }
     value->append( it->second.c_str(), it->second.size() );
     return OK;
 }
 
-KVStatus BTreeEngine::Put(const string& key, const string& value) {
-    LOG("Put key=" << key.c_str() << ", value.size=" << to_string(value.size()));
-    std::pair<typename btree_type::iterator, bool> res = my_btree->insert(std::make_pair(pstring<MAX_KEY_SIZE>(key), pstring<MAX_VALUE_SIZE>(value)));
-    if(!res.second) { // Key already exist.
+KVStatus BTreeEngine::Get(const Slice& key, void* context, KVGetCallback* callback) {
+    LOG("Get for key=" << key.ToString());
+    btree_type::iterator it = my_btree->find( pstring<MAX_KEY_SIZE>(key.data(), key.size()) );
+    if ( it == my_btree->end() ) {
+        LOG("Key=" << key.ToString() << " not found");
+        return NOT_FOUND;
+    }
+    (*callback)(context, (int32_t) it->second.size(), it->second.c_str());
+    return OK;
+}
+
+void BTreeEngine::MultiGet(const vector<string>& keys, void* context, KVMultiGetCallback* callback) {
+    LOG("MultiGet for count=" << to_string(keys.size()));
+    for (int32_t i = 0; i < (int32_t) keys.size(); i++) {
+        btree_type::iterator it = my_btree->find( pstring<MAX_KEY_SIZE>(keys[i]) );
+        if ( it != my_btree->end() ) {
+            (*callback)(context, i, (int32_t) it->second.size(), it->second.c_str());
+        }
+    }
+}
+
+KVStatus BTreeEngine::Put(const Slice& key, const Slice& value) {
+    LOG("Put key=" << key.ToString() << ", value.size=" << to_string(value.size()));
+    std::pair<typename btree_type::iterator, bool> res = my_btree->insert(std::make_pair(pstring<MAX_KEY_SIZE>(key.data(), key.size()), pstring<MAX_VALUE_SIZE>(value.data(), value.size())));
+    if(res.second) { // New key inserted.
+        key_count++;
+    } else { // Key already exist.
         // update value
         typename btree_type::value_type& entry = *res.first;
         transaction::manual tx( pmpool );
         conditional_add_to_tx(&(entry.second));
-        entry.second = value;
+        entry.second = pstring<MAX_VALUE_SIZE>(value.data(), value.size());
         transaction::commit();
     }
     return OK;
 }
 
-KVStatus BTreeEngine::Remove(const string& key) {
-    LOG("Remove key=" << key.c_str());
+KVStatus BTreeEngine::Remove(const Slice& key) {
+    LOG("Remove key=" << key.ToString());
     return FAILED;
 }
+
+KVStatus BTreeEngine::Write(const WriteBatch& batch) {
+    LOG("Write batch.count=" << to_string(batch.Count()));
+    for (auto& op : batch.Ops()) {
+        if (op.remove) {
+            LOG("   removes not supported");                    // fail before any update
+            return FAILED;
+        }
+    }
+    // b_tree allocates nodes atomically, so updates cannot share one transaction
+    for (auto& op : batch.Ops()) {
+        auto status = Put(op.key, op.value);
+        if (status != OK) return status;                        // earlier puts are kept
+    }
+    return OK;
+}
+KVIterator* BTreeEngine::NewIterator() {
+    LOG("NewIterator");
+    return new BTreeIterator(this);
+}
+
 PMEMoid BTreeEngine::GetRootOid() {
     return pmpool.get_root().raw();
 }
@@ -121,6 +199,60 @@ void BTreeEngine::Recover() {
         make_persistent_atomic<btree_type>(pmpool, root_data->btree_ptr);
         my_btree = root_data->btree_ptr.get();
     }
+
+    key_count = 0;
+    for (auto it = my_btree->begin(); it != my_btree->end(); ++it) key_count++;
+}
+
+BTreeIterator::BTreeIterator(BTreeEngine* engine)             // unpositioned until seek
+        : tree(engine->my_btree), it(tree->end()), valid(false) {}
+
+void BTreeIterator::SeekToFirst() {
+    it = tree->begin();
+    valid = (it != tree->end());
+}
+
+void BTreeIterator::SeekToLast() {
+    SeekToFirst();
+    if (!valid) return;                                         // tree is empty
+    it = tree->end();
+    --it;
+}
+
+void BTreeIterator::Seek(const Slice& key) {
+    if (key.size() > MAX_KEY_SIZE) {                            // longer than any stored key
+        const Slice prefix(key.data(), MAX_KEY_SIZE);
+        Seek(prefix);
+        if (valid && Key() == prefix) Next();
+        return;
+    }
+    it = tree->lower_bound(pstring<MAX_KEY_SIZE>(key.data(), key.size()));
+    valid = (it != tree->end());
+}
+
+void BTreeIterator::Next() {
+    assert(valid);
+    ++it;
+    valid = (it != tree->end());
+}
+
+void BTreeIterator::Prev() {
+    assert(valid);
+    if (it == tree->begin()) {
+        valid = false;                                          // no lower keys remain
+    } else {
+        --it;
+    }
+}
+
+Slice BTreeIterator::Key() {
+    assert(valid);
+    return Slice(it->first.c_str(), it->first.size());
+}
+
+Slice BTreeIterator::Value() {
+    assert(valid);
+    return Slice(it->second.c_str(), it->second.size());
 }
 
 } // namespace btree
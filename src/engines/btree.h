@@ -66,24 +66,59 @@ class BTreeEngine : public KVEngine {
                  int32_t* valuebytes,
                  const char* key,
                  char* value) final;
-    KVStatus Get(const string& key,                             // append value to std::string
+    KVStatus Get(const Slice& key,                              // append value to std::string
                  string* value) final;
-    KVStatus Put(const string& key,                             // copy value from std::string
-                 const string& value) final;
-    KVStatus Remove(const string& key) final;                   // remove value for key
+    KVStatus Get(const Slice& key,                              // pass value to callback without copy
+                 void* context,
+                 KVGetCallback* callback) final;
+    void MultiGet(const vector<string>& keys,                   // pass each value found to callback
+                  void* context,
+                  KVMultiGetCallback* callback) final;
+    KVStatus Put(const Slice& key,                              // copy value from slice
+                 const Slice& value) final;
+    KVStatus Remove(const Slice& key) final;                    // remove value for key (not
+                                                                // supported, always FAILED)
+    KVStatus Write(const WriteBatch& batch) final;              // apply puts one at a time (not
+                                                                // atomic, FAILED without changes
+                                                                // if batch holds any remove)
+    KVIterator* NewIterator() final;                            // ordered iterator over all keys
 
     PMEMoid GetRootOid() final;
     PMEMobjpool* GetPool() final;
 
-    void ListAllKeyValuePairs(vector<string>& kv_pairs) final {return;}  
-    void ListAllKeys(vector<string>& keys) final {return;}
-    size_t TotalNumKeys() final {return 0;}
+    void AllKeys(void* context,                                 // pass each key to callback
+                 KVAllKeysCallback* callback) final;
+    void AllKeyValues(void* context,                            // pass each key & value to callback
+                      KVAllKeyValuesCallback* callback) final;
+    void ListAllKeyValuePairs(vector<string>& kv_pairs) final;  // list all key value pairs
+    void ListAllKeys(vector<string>& keys) final;               // list all keys
+    size_t TotalNumKeys() final { return key_count; }           // count of keys in constant time
 
   private:
+    friend class BTreeIterator;                                 // iterator walks leaf links
     void Recover();
 
     pool<RootData> pmpool;                                      // pool for persistent root
     btree_type* my_btree;
+    size_t key_count;                                           // count of keys in tree
+};
+
+class BTreeIterator final : public KVIterator {                 // iterator over linked b-tree leaves
+  public:
+    explicit BTreeIterator(BTreeEngine* engine);                // default constructor
+
+    bool Valid() final { return valid; }                        // positioned at a key?
+    void SeekToFirst() final;                                   // position at lowest key
+    void SeekToLast() final;                                    // position at highest key
+    void Seek(const Slice& key) final;                          // position at first key >= given key
+    void Next() final;                                          // advance to next higher key
+    void Prev() final;                                          // back up to next lower key
+    Slice Key() final;                                          // current key (valid until moved)
+    Slice Value() final;                                        // current value (valid until moved)
+  private:
+    BTreeEngine::btree_type* tree;                              // tree being iterated
+    BTreeEngine::btree_type::iterator it;                       // current position within leaves
+    bool valid;                                                 // indicates position is at a key
 };
 
 } // namespace btree
@@ -243,6 +243,12 @@ namespace internal {
                 return end();
         }
 
+        iterator lower_bound( const key_type& key ) {
+            return std::lower_bound( begin(), end(), key, [] ( const_reference entry, const TKey& key ) {
+                return entry.first < key;
+            } );
+        }
+
         /**
         * Return begin iterator on an array of correct indexs.
         */
@@ -627,7 +633,7 @@ namespace internal {
                 leaf_node_ptr tmp = current_node->get_prev().get();
                 if ( tmp ) {
                     current_node = tmp;
-                    leaf_it = current_node->last();
+                    leaf_it = current_node->end() - 1;
                 }
             }
             else {
@@ -986,10 +992,23 @@ namespace internal {
             return const_iterator( leaf, leaf_it );
         }
         
+        iterator lower_bound( const key_type& key ) {
+            leaf_node_type* leaf = find_leaf_node( key );
+            if (leaf == nullptr) return end();
+
+            typename leaf_node_type::iterator leaf_it = leaf->lower_bound( key );
+            if (leaf->end() != leaf_it) return iterator( leaf, leaf_it );
+
+            // all keys in this leaf are lower, so continue with the first key of the next leaf
+            if (leaf->get_next() == nullptr) return end();
+            return iterator( leaf->get_next().get() );
+        }
+
         void garbage_collection();
         
         iterator begin() {
 			leaf_node_type* leaf = head.get();
+            if (leaf == nullptr) return end();
             return iterator(leaf);
         }
 
@@ -1000,6 +1019,7 @@ namespace internal {
 
         const_iterator begin() const {
 			const leaf_node_type* leaf = head.get();
+            if (leaf == nullptr) return end();
             return const_iterator(leaf);
         }
 
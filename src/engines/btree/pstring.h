@@ -44,6 +44,10 @@ public:
         init(s.c_str(), s.size());
     }
 
+    pstring(const char* s, size_t size) {
+        init(s, size);
+    }
+
     pstring(const pstring& other) {
         init(other.c_str(), other.size());
     }
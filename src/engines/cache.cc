@@ -0,0 +1,314 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <functional>
+#include <iostream>
+#include "cache.h"
+
+#define DO_LOG 0
+#define LOG(msg) if (DO_LOG) std::cout << "[cache] " << msg << "\n"
+
+namespace pmemkv {
+namespace cache {
+
+CachedEngine::CachedEngine(KVEngine* engine, const size_t capacity)
+        : engine(engine), shard_capacity(capacity / CACHE_SHARDS),
+          shards(new CacheShard[CACHE_SHARDS]), hits(0), misses(0) {
+    LOG("Opened ok, engine=" << engine->Engine() << ", capacity=" << to_string(capacity));
+}
+
+CachedEngine::~CachedEngine() {
+    LOG("Closing");
+    KVEngine::Close(engine);
+    LOG("Closed ok");
+}
+
+string CachedEngine::Engine() {
+    return ENGINE + ":" + engine->Engine();
+}
+
+// ===============================================================================================
+// KEY/VALUE METHODS
+// ===============================================================================================
+
+void CachedEngine::Analyze(CacheAnalysis& analysis) {
+    analysis.hits = hits;
+    analysis.misses = misses;
+    analysis.bytes = 0;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        std::lock_guard<std::mutex> guard(shards[i].lock);
+        analysis.bytes += shards[i].a1in_bytes + shards[i].am_bytes;
+    }
+    analysis.capacity = shard_capacity * CACHE_SHARDS;
+}
+
+KVStatus CachedEngine::Get(const int32_t limit, const int32_t keybytes, int32_t* valuebytes,
+                           const char* key, char* value) {
+    const string ckey(key, (size_t) keybytes);
+    string cached;
+    uint64_t generation;
+    if (CacheLookup(ckey, &cached, &generation)) {
+        *valuebytes = (int32_t) cached.size();
+        if (*valuebytes > limit) return FAILED;
+        memcpy(value, cached.data(), cached.size());
+        return OK;
+    }
+    auto s = engine->Get(ckey, &cached);
+    if (s == OK) {
+        CacheInsert(ckey, cached, generation);
+        *valuebytes = (int32_t) cached.size();
+        if (*valuebytes > limit) return FAILED;
+        memcpy(value, cached.data(), cached.size());
+    }
+    return s;
+}
+
+KVStatus CachedEngine::Get(const Slice& key, string* value) {
+    const string ckey = key.ToString();
+    string cached;
+    uint64_t generation;
+    if (CacheLookup(ckey, &cached, &generation)) {
+        value->append(cached);
+        return OK;
+    }
+    auto s = engine->Get(ckey, &cached);
+    if (s == OK) {
+        CacheInsert(ckey, cached, generation);
+        value->append(cached);
+    }
+    return s;
+}
+
+KVStatus CachedEngine::Get(const Slice& key, void* context, KVGetCallback* callback) {
+    const string ckey = key.ToString();
+    string cached;
+    uint64_t generation;
+    if (!CacheLookup(ckey, &cached, &generation)) {
+        auto s = engine->Get(ckey, &cached);
+        if (s != OK) return s;
+        CacheInsert(ckey, cached, generation);
+    }
+    (*callback)(context, (int32_t) cached.size(), cached.data());
+    return OK;
+}
+
+struct CacheMultiGetContext {                                            // collects values of
+    vector<string>* values;                                              // keys that missed
+    vector<bool>* found;
+};
+
+void CachedEngine::MultiGet(const vector<string>& keys, void* context, KVMultiGetCallback* callback) {
+    LOG("MultiGet for count=" << to_string(keys.size()));
+    vector<string> missed_keys;
+    vector<int32_t> missed_indexes;
+    vector<uint64_t> missed_generations;
+    string cached;
+    for (int32_t i = 0; i < (int32_t) keys.size(); i++) {
+        uint64_t generation;
+        cached.clear();
+        if (CacheLookup(keys[i], &cached, &generation)) {
+            (*callback)(context, i, (int32_t) cached.size(), cached.data());
+        } else {
+            missed_keys.push_back(keys[i]);
+            missed_indexes.push_back(i);
+            missed_generations.push_back(generation);
+        }
+    }
+    if (missed_keys.empty()) return;
+    vector<string> values(missed_keys.size());
+    vector<bool> found(missed_keys.size(), false);
+    CacheMultiGetContext mc = {&values, &found};
+    engine->MultiGet(missed_keys, &mc, [](void* context, int32_t index, int32_t valuebytes,
+                                          const char* value) {
+        auto mc = (CacheMultiGetContext*) context;
+        (*mc->values)[index].assign(value, (size_t) valuebytes);
+        (*mc->found)[index] = true;
+    });
+    for (size_t i = 0; i < missed_keys.size(); i++) {
+        if (!found[i]) continue;
+        CacheInsert(missed_keys[i], values[i], missed_generations[i]);
+        (*callback)(context, missed_indexes[i], (int32_t) values[i].size(), values[i].data());
+    }
+}
+
+KVStatus CachedEngine::Put(const Slice& key, const Slice& value) {
+    auto s = engine->Put(key, value);
+    CacheInvalidate(key.ToString());                                     // even if put failed
+    return s;
+}
+
+KVStatus CachedEngine::Remove(const Slice& key) {
+    auto s = engine->Remove(key);
+    CacheInvalidate(key.ToString());
+    return s;
+}
+
+KVStatus CachedEngine::Write(const WriteBatch& batch) {
+    auto s = engine->Write(batch);
+    for (auto& op : batch.Ops()) CacheInvalidate(op.key.ToString());
+    return s;
+}
+
+KVIterator* CachedEngine::NewIterator() {
+    return engine->NewIterator();
+}
+
+PMEMoid CachedEngine::GetRootOid() {
+    return engine->GetRootOid();
+}
+
+PMEMobjpool* CachedEngine::GetPool() {
+    return engine->GetPool();
+}
+
+void CachedEngine::AllKeys(void* context, KVAllKeysCallback* callback) {
+    engine->AllKeys(context, callback);
+}
+
+void CachedEngine::AllKeyValues(void* context, KVAllKeyValuesCallback* callback) {
+    engine->AllKeyValues(context, callback);
+}
+
+void CachedEngine::ListAllKeyValuePairs(vector<string>& kv_pairs) {
+    engine->ListAllKeyValuePairs(kv_pairs);
+}
+
+void CachedEngine::ListAllKeys(vector<string>& keys) {
+    engine->ListAllKeys(keys);
+}
+
+size_t CachedEngine::TotalNumKeys() {
+    return engine->TotalNumKeys();
+}
+
+// ===============================================================================================
+// PROTECTED CACHE METHODS
+// ===============================================================================================
+
+CacheShard& CachedEngine::ShardFor(const string& key) {
+    return shards[std::hash<string>()(key) % CACHE_SHARDS];
+}
+
+bool CachedEngine::CacheLookup(const string& key, string* value, uint64_t* generation) {
+    auto& shard = ShardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    *generation = shard.generation;
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end() || it->second.queue == A1OUT) {
+        misses++;
+        return false;
+    }
+    auto& entry = it->second;
+    if (entry.queue == AM) shard.am.splice(shard.am.begin(), shard.am, entry.pos);  // A1IN keeps
+    value->assign(entry.value);                                                      // FIFO order
+    hits++;
+    return true;
+}
+
+void CachedEngine::CacheInsert(const string& key, const string& value, const uint64_t generation) {
+    const size_t charge = key.size() + value.size() + CACHE_ENTRY_OVERHEAD;
+    if (charge > shard_capacity / 4) return;                             // would flush whole A1IN
+    auto& shard = ShardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    if (shard.generation != generation) return;                          // value may be stale
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end()) {                                     // first sighting
+        it = shard.entries.emplace(key, CacheEntry()).first;
+        it->second.value = value;
+        it->second.queue = A1IN;
+        shard.a1in.push_front(&it->first);
+        it->second.pos = shard.a1in.begin();
+        shard.a1in_bytes += charge;
+    } else if (it->second.queue == A1OUT) {                              // seen again, promote
+        shard.a1out.erase(it->second.pos);
+        shard.a1out_bytes -= key.size() + CACHE_ENTRY_OVERHEAD;
+        it->second.value = value;
+        it->second.queue = AM;
+        shard.am.push_front(&it->first);
+        it->second.pos = shard.am.begin();
+        shard.am_bytes += charge;
+    } else {
+        return;                                                          // cached by another thread
+    }
+    CacheEvict(shard);
+}
+
+void CachedEngine::CacheInvalidate(const string& key) {
+    auto& shard = ShardFor(key);
+    std::lock_guard<std::mutex> guard(shard.lock);
+    shard.generation++;                                                  // fail concurrent inserts
+    auto it = shard.entries.find(key);
+    if (it == shard.entries.end() || it->second.queue == A1OUT) return;  // ghosts hold no value
+    auto& entry = it->second;
+    const size_t charge = key.size() + entry.value.size() + CACHE_ENTRY_OVERHEAD;
+    if (entry.queue == A1IN) {
+        shard.a1in.erase(entry.pos);
+        shard.a1in_bytes -= charge;
+    } else {
+        shard.am.erase(entry.pos);
+        shard.am_bytes -= charge;
+    }
+    shard.entries.erase(it);
+}
+
+void CachedEngine::CacheEvict(CacheShard& shard) {
+    while (shard.a1in_bytes + shard.am_bytes > shard_capacity) {
+        if (shard.a1in_bytes > shard_capacity / 4 || shard.am.empty()) {
+            // oldest single-use entry becomes a ghost, so a second use promotes it to AM
+            const string* key = shard.a1in.back();
+            shard.a1in.pop_back();
+            auto& entry = shard.entries.find(*key)->second;
+            shard.a1in_bytes -= key->size() + entry.value.size() + CACHE_ENTRY_OVERHEAD;
+            string().swap(entry.value);
+            entry.queue = A1OUT;
+            shard.a1out.push_front(key);
+            entry.pos = shard.a1out.begin();
+            shard.a1out_bytes += key->size() + CACHE_ENTRY_OVERHEAD;
+        } else {
+            const string* key = shard.am.back();
+            shard.am.pop_back();
+            auto it = shard.entries.find(*key);
+            shard.am_bytes -= key->size() + it->second.value.size() + CACHE_ENTRY_OVERHEAD;
+            shard.entries.erase(it);
+        }
+    }
+    while (shard.a1out_bytes > shard_capacity / 2) {                     // remember limited history
+        const string* key = shard.a1out.back();
+        shard.a1out.pop_back();
+        shard.a1out_bytes -= key->size() + CACHE_ENTRY_OVERHEAD;
+        shard.entries.erase(shard.entries.find(*key));
+    }
+}
+
+} // namespace cache
+} // namespace pmemkv
@@ -0,0 +1,145 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include "../pmemkv.h"
+
+namespace pmemkv {
+namespace cache {
+
+const string ENGINE = "cache";                             // engine identifier, used as prefix
+                                                           // ("cache:kvtree2")
+
+#define DEFAULT_CACHE_BYTES (64 * 1024 * 1024)             // budget unless given ("cache=N:...")
+#define CACHE_SHARDS 16                                    // independently locked partitions
+#define CACHE_ENTRY_OVERHEAD 64                            // bytes charged per entry beyond data
+
+enum CacheQueue : uint8_t {                                // 2Q queue holding an entry
+    A1IN,                                                  // seen once, FIFO order
+    AM,                                                    // seen again, LRU order
+    A1OUT                                                  // recently evicted from A1IN (key only)
+};
+
+struct CacheEntry {                                        // cached value for one key
+    string value;                                          // copy of value (empty if A1OUT)
+    CacheQueue queue;                                      // queue currently holding entry
+    std::list<const string*>::iterator pos;                // position within that queue
+};
+
+struct CacheShard {                                        // partition of keys by hash
+    std::mutex lock;                                       // guards all fields below
+    std::unordered_map<string, CacheEntry> entries;        // entries by key
+    std::list<const string*> a1in;                         // newest at front
+    std::list<const string*> am;                           // most recently used at front
+    std::list<const string*> a1out;                        // newest at front
+    size_t a1in_bytes = 0;                                 // charged bytes in A1IN
+    size_t am_bytes = 0;                                   // charged bytes in AM
+    size_t a1out_bytes = 0;                                // charged bytes of A1OUT keys
+    uint64_t generation = 0;                               // bumped when any key is invalidated
+};
+
+struct CacheAnalysis {                                     // cache analysis structure
+    uint64_t hits;                                         // reads served from cache
+    uint64_t misses;                                       // reads passed to engine
+    size_t bytes;                                          // charged bytes of cached values
+    size_t capacity;                                       // byte budget
+};
+
+class CachedEngine : public KVEngine {                     // 2Q value cache over another engine
+  public:
+    CachedEngine(KVEngine* engine,                         // default constructor
+                 size_t capacity);                         // (takes ownership of engine)
+    ~CachedEngine();                                       // default destructor
+
+    string Engine() final;                                 // "cache:" + engine identifier
+    KVStatus Get(int32_t limit,                            // copy value to fixed-size buffer
+                 int32_t keybytes,
+                 int32_t* valuebytes,
+                 const char* key,
+                 char* value) final;
+    KVStatus Get(const Slice& key,                         // append value to std::string
+                 string* value) final;
+    KVStatus Get(const Slice& key,                         // pass value to callback
+                 void* context,
+                 KVGetCallback* callback) final;
+    void MultiGet(const vector<string>& keys,              // pass each value found to callback
+                  void* context,
+                  KVMultiGetCallback* callback) final;
+    KVStatus Put(const Slice& key,                         // copy value from slice
+                 const Slice& value) final;
+    KVStatus Remove(const Slice& key) final;               // remove value for key
+    KVStatus Write(const WriteBatch& batch) final;         // apply all updates or none
+    KVIterator* NewIterator() final;                       // iterator of underlying engine
+
+    PMEMoid GetRootOid() final;
+    PMEMobjpool* GetPool() final;
+
+    void Analyze(CacheAnalysis& analysis);                 // report hit & miss counts
+
+    void AllKeys(void* context,                            // pass each key to callback
+                 KVAllKeysCallback* callback) final;
+    void AllKeyValues(void* context,                       // pass each key & value to callback
+                      KVAllKeyValuesCallback* callback) final;
+    void ListAllKeyValuePairs(vector<string>& kv_pairs) final;      // list all the key value pairs
+    void ListAllKeys(vector<string>& keys) final;          // list all the keys
+    size_t TotalNumKeys() final;                           // count of keys in engine
+
+    KVEngine* Underlying() { return engine; }              // engine behind the cache
+  protected:
+    CacheShard& ShardFor(const string& key);               // shard owning key
+    bool CacheLookup(const string& key,                    // copy cached value if present
+                     string* value,
+                     uint64_t* generation);                // (generation to pass to CacheInsert)
+    void CacheInsert(const string& key,                    // add value read from engine, unless
+                     const string& value,                  // key was invalidated since lookup
+                     uint64_t generation);
+    void CacheInvalidate(const string& key);               // drop value after update
+    void CacheEvict(CacheShard& shard);                    // enforce budget of shard
+  private:
+    CachedEngine(const CachedEngine&);                     // prevent copying
+    void operator=(const CachedEngine&);                   // prevent assigning
+    KVEngine* const engine;                                // engine being cached
+    const size_t shard_capacity;                           // byte budget of each shard
+    std::unique_ptr<CacheShard[]> shards;                  // partitions of cache
+    std::atomic<uint64_t> hits;                            // reads served from cache
+    std::atomic<uint64_t> misses;                          // reads passed to engine
+};
+
+} // namespace cache
+} // namespace pmemkv
@@ -0,0 +1,454 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include "fnv.h"
+#include "hashmap.h"
+
+#define DO_LOG 0
+#define LOG(msg) if (DO_LOG) std::cout << "[hashmap] " << msg << "\n"
+
+namespace pmemkv {
+namespace hashmap {
+
+HashMap::HashMap(const string& path, const size_t size) : pmpath(path) {
+    if ((access(path.c_str(), F_OK) != 0) && (size > 0)) {
+        LOG("Creating filesystem pool, path=" << path << ", size=" << to_string(size));
+        pmpool = pool<HMRoot>::create(path.c_str(), LAYOUT, size, S_IRWXU);
+    } else {
+        LOG("Opening pool, path=" << path);
+        pmpool = pool<HMRoot>::open(path.c_str(), LAYOUT);
+    }
+    Recover();
+    LOG("Opened ok");
+}
+
+HashMap::~HashMap() {
+    LOG("Closing");
+    pmpool.close();
+    LOG("Closed ok");
+}
+
+// ===============================================================================================
+// KEY/VALUE METHODS
+// ===============================================================================================
+
+void HashMap::Analyze(HashMapAnalysis& analysis) {
+    LOG("Analyzing");
+    WriteGuard table_guard(table_lock);
+    auto root = pmpool.get_root();
+    analysis.buckets = root->table->count;
+    analysis.buckets_draining = root->old_table ? (size_t) root->old_table->count : 0;
+    analysis.path = pmpath;
+    LOG("Analyzed ok");
+}
+
+void HashMap::AllKeys(void* context, KVAllKeysCallback* callback) {
+    LOG("AllKeys");
+    VisitAll(false, [&](const string& key, const string&) {
+        return (*callback)(context, (int32_t) key.size(), key.data());
+    });
+}
+
+void HashMap::AllKeyValues(void* context, KVAllKeyValuesCallback* callback) {
+    LOG("AllKeyValues");
+    VisitAll(true, [&](const string& key, const string& value) {
+        return (*callback)(context, (int32_t) key.size(), key.data(),
+                           (int32_t) value.size(), value.data());
+    });
+}
+
+void HashMap::ListAllKeyValuePairs(vector<string>& kv_pairs) {
+    LOG("Listing");
+    AllKeyValues(&kv_pairs, [](void* context, int32_t keybytes, const char* key,
+                               int32_t valuebytes, const char* value) {
+        auto kv_pairs = (vector<string>*) context;
+        kv_pairs->push_back(string(key, (size_t) keybytes));
+        kv_pairs->push_back(string(value, (size_t) valuebytes));
+        return true;
+    });
+    LOG("List ok");
+}
+
+void HashMap::ListAllKeys(vector<string>& keys) {
+    LOG("Listing");
+    AllKeys(&keys, [](void* context, int32_t keybytes, const char* key) {
+        ((vector<string>*) context)->push_back(string(key, (size_t) keybytes));
+        return true;
+    });
+    LOG("List ok");
+}
+
+void HashMap::VisitAll(const bool values, const std::function<bool(const string&, const string&)>& visit) {
+    vector<std::pair<string, string>> records;                           // copied from one stripe
+    for (int stripe = 0; stripe < LOCK_STRIPES; stripe++) {
+        records.clear();
+        {   // entries only migrate between buckets of the same stripe, so copying both tables
+            // under one stripe lock sees each of its keys once
+            ReadGuard table_guard(table_lock);
+            ReadGuard stripe_guard(stripes[stripe]);
+            auto root = pmpool.get_root();
+            for (auto table : {root->old_table, root->table}) {
+                if (!table) continue;
+                for (uint64_t bucket = stripe; bucket < table->count; bucket += LOCK_STRIPES) {
+                    for (auto entry = table->buckets[bucket]; entry; entry = entry->next) {
+                        auto& kv = entry->slot.get_ro();
+                        records.emplace_back(string(kv.key(), kv.keysize()),
+                                             values ? string(kv.val(), kv.valsize()) : string());
+                    }
+                }
+            }
+        }
+        for (auto& record : records) if (!visit(record.first, record.second)) return;
+    }
+}
+
+KVStatus HashMap::Get(const int32_t limit, const int32_t keybytes, int32_t* valuebytes,
+                      const char* key, char* value) {
+    const Slice ckey(key, (size_t) keybytes);
+    LOG("Get for key=" << ckey.ToString());
+    const uint64_t hash = Hash(ckey);
+    ReadGuard table_guard(table_lock);
+    ReadGuard stripe_guard(stripes[hash % LOCK_STRIPES]);
+    auto entry = EntrySearch(hash, ckey);
+    if (!entry) {
+        LOG("   could not find key");
+        return NOT_FOUND;
+    }
+    auto& kv = entry->slot.get_ro();
+    auto vs = kv.valsize();
+    *valuebytes = vs;
+    if ((int32_t) vs > limit) {
+        LOG("   buffer too small, size=" << to_string(vs));
+        return FAILED;
+    }
+    memcpy(value, kv.val(), vs);
+    return OK;
+}
+
+KVStatus HashMap::Get(const Slice& key, string* value) {
+    LOG("Get for key=" << key.ToString());
+    const uint64_t hash = Hash(key);
+    ReadGuard table_guard(table_lock);
+    ReadGuard stripe_guard(stripes[hash % LOCK_STRIPES]);
+    auto entry = EntrySearch(hash, key);
+    if (!entry) {
+        LOG("   could not find key");
+        return NOT_FOUND;
+    }
+    auto& kv = entry->slot.get_ro();
+    value->append(kv.val(), kv.valsize());
+    return OK;
+}
+
+KVStatus HashMap::Get(const Slice& key, void* context, KVGetCallback* callback) {
+    LOG("Get for key=" << key.ToString());
+    const uint64_t hash = Hash(key);
+    ReadGuard table_guard(table_lock);
+    ReadGuard stripe_guard(stripes[hash % LOCK_STRIPES]);
+    auto entry = EntrySearch(hash, key);
+    if (!entry) {
+        LOG("   could not find key");
+        return NOT_FOUND;
+    }
+    auto& kv = entry->slot.get_ro();
+    (*callback)(context, (int32_t) kv.valsize(), kv.val());
+    return OK;
+}
+
+void HashMap::MultiGet(const vector<string>& keys, void* context, KVMultiGetCallback* callback) {
+    LOG("MultiGet for count=" << to_string(keys.size()));
+    ReadGuard table_guard(table_lock);
+    for (int32_t i = 0; i < (int32_t) keys.size(); i++) {
+        const uint64_t hash = Hash(keys[i]);
+        ReadGuard stripe_guard(stripes[hash % LOCK_STRIPES]);
+        auto entry = EntrySearch(hash, keys[i]);
+        if (entry) {
+            auto& kv = entry->slot.get_ro();
+            (*callback)(context, i, (int32_t) kv.valsize(), kv.val());
+        }
+    }
+}
+
+KVStatus HashMap::Put(const Slice& key, const Slice& value) {
+    LOG("Put key=" << key.ToString() << ", value.size=" << to_string(value.size()));
+    const uint64_t hash = Hash(key);
+    try {
+        ReadGuard table_guard(table_lock);
+        WriteGuard stripe_guard(stripes[hash % LOCK_STRIPES]);
+        ApplyPut(hash, key, value);
+    } catch (pmem::transaction_alloc_error) {
+        return FAILED;
+    } catch (pmem::transaction_error) {
+        return FAILED;
+    }
+    Rebalance();
+    return OK;
+}
+
+KVStatus HashMap::Remove(const Slice& key) {
+    LOG("Remove key=" << key.ToString());
+    const uint64_t hash = Hash(key);
+    try {
+        ReadGuard table_guard(table_lock);
+        WriteGuard stripe_guard(stripes[hash % LOCK_STRIPES]);
+        ApplyRemove(hash, key);
+    } catch (pmem::transaction_alloc_error) {
+        return FAILED;
+    } catch (pmem::transaction_error) {
+        return FAILED;
+    }
+    Rebalance();
+    return OK;
+}
+
+KVStatus HashMap::Write(const WriteBatch& batch) {
+    LOG("Write batch.count=" << to_string(batch.Count()));
+    try {
+        WriteGuard table_guard(table_lock);
+        try {
+            transaction::exec_tx(pmpool, [&] {                           // nested tx calls join this one
+                for (auto& op : batch.Ops()) {
+                    if (op.remove) {
+                        ApplyRemove(Hash(op.key), op.key);
+                    } else {
+                        ApplyPut(Hash(op.key), op.key, op.value);
+                    }
+                }
+            });
+        } catch (pmem::transaction_error) {
+            Recover();                                                   // recount keys
+            throw;
+        }
+    } catch (pmem::transaction_alloc_error) {
+        return FAILED;
+    } catch (pmem::transaction_error) {
+        return FAILED;
+    }
+    Rebalance();
+    return OK;
+}
+
+PMEMoid HashMap::GetRootOid() {
+    return pmpool.get_root().raw();
+}
+
+PMEMobjpool* HashMap::GetPool() {
+    return pmpool.get_handle();
+}
+
+// ===============================================================================================
+// PROTECTED TABLE METHODS
+// ===============================================================================================
+
+void HashMap::ApplyPut(const uint64_t hash, const Slice& key, const Slice& value) {
+    auto root = pmpool.get_root();
+    if (root->old_table) {                                               // key now lives in new table
+        BucketMigrate(root->old_table, hash & (root->old_table->count - 1));
+    }
+    auto table = root->table;
+    auto& head = table->buckets[hash & (table->count - 1)];
+    for (auto entry = head; entry; entry = entry->next) {
+        auto& kv = entry->slot.get_ro();
+        if (entry->hash == hash && key.compare(Slice(kv.key(), kv.keysize())) == 0) {
+            LOG("   replacing value");
+            transaction::exec_tx(pmpool, [&] {
+                auto& kvslot = entry->slot.get_rw();
+                const KVSlot old = kvslot;                               // set keeps old buffer
+                kvslot.set((uint8_t) (hash | 1), key, value, nullptr);
+                SlotFree(old);
+            });
+            return;
+        }
+    }
+    LOG("   adding entry");
+    transaction::exec_tx(pmpool, [&] {
+        auto entry = make_persistent<HMEntry>();
+        entry->hash = hash;
+        entry->slot.get_rw().set((uint8_t) (hash | 1), key, value, nullptr);  // nonzero like Pearson hash
+        entry->next = head;
+        head = entry;
+    });
+    key_count++;
+}
+
+void HashMap::ApplyRemove(const uint64_t hash, const Slice& key) {
+    auto root = pmpool.get_root();
+    if (root->old_table) {
+        BucketMigrate(root->old_table, hash & (root->old_table->count - 1));
+    }
+    auto table = root->table;
+    auto link = &table->buckets[hash & (table->count - 1)];
+    while (*link) {
+        auto entry = *link;
+        auto& kv = entry->slot.get_ro();
+        if (entry->hash == hash && key.compare(Slice(kv.key(), kv.keysize())) == 0) {
+            LOG("   freeing entry");
+            transaction::exec_tx(pmpool, [&] {
+                *link = entry->next;
+                SlotFree(entry->slot.get_ro());
+                entry->slot.get_rw().clear();
+                delete_persistent<HMEntry>(entry);
+            });
+            key_count--;
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+void HashMap::SlotFree(const KVSlot& kvslot) {
+    char* buffer = kvslot.buffer();
+    if (!buffer) return;
+    delete_persistent<char[]>(persistent_ptr<char[]>(pmemobj_oid(buffer)), kvslot.recordsize());
+}
+
+HMEntry* HashMap::EntrySearch(const uint64_t hash, const Slice& key) {
+    auto root = pmpool.get_root();
+    for (auto table : {root->old_table, root->table}) {                  // undrained buckets first
+        if (!table) continue;
+        for (auto entry = table->buckets[hash & (table->count - 1)]; entry; entry = entry->next) {
+            auto& kv = entry->slot.get_ro();
+            if (entry->hash == hash && key.compare(Slice(kv.key(), kv.keysize())) == 0) {
+                return entry.get();
+            }
+        }
+    }
+    return nullptr;
+}
+
+void HashMap::BucketMigrate(persistent_ptr<HMTable> old_table, const uint64_t bucket) {
+    auto& head = old_table->buckets[bucket];
+    if (!head) return;
+    LOG("   migrating bucket=" << to_string(bucket));
+    auto table = pmpool.get_root()->table;
+    transaction::exec_tx(pmpool, [&] {
+        while (head) {
+            auto entry = head;
+            head = entry->next;
+            auto& target = table->buckets[entry->hash & (table->count - 1)];
+            assert((entry->hash & (table->count - 1)) % LOCK_STRIPES == bucket % LOCK_STRIPES);
+            entry->next = target;
+            target = entry;
+        }
+    });
+}
+
+void HashMap::Rebalance() {
+    try {
+        RebalanceStep();
+    } catch (pmem::transaction_error) {
+        LOG("   rebalance failed, will retry on next update");           // table stays usable
+    }
+}
+
+void HashMap::RebalanceStep() {
+    {   // drain a few old buckets, each under its own stripe lock
+        ReadGuard table_guard(table_lock);
+        auto root = pmpool.get_root();
+        auto old_table = root->old_table;
+        if (old_table) {
+            for (int i = 0; i < MIGRATE_BATCH; i++) {
+                const uint64_t bucket = migrate_cursor++;
+                if (bucket >= old_table->count) break;
+                WriteGuard stripe_guard(stripes[bucket % LOCK_STRIPES]);
+                BucketMigrate(old_table, bucket);
+            }
+            if (migrate_cursor < old_table->count) return;
+        } else if (key_count <= root->table->count * MAX_LOAD) {
+            return;
+        }
+    }
+
+    // swap tables while no other thread holds the table lock
+    WriteGuard table_guard(table_lock);
+    auto root = pmpool.get_root();
+    if (root->old_table) {
+        if (migrate_cursor < root->old_table->count) return;
+        LOG("Retiring table, buckets=" << to_string(root->old_table->count));
+        transaction::exec_tx(pmpool, [&] {
+            auto old_table = root->old_table;
+            delete_persistent<persistent_ptr<HMEntry>[]>(old_table->buckets, old_table->count);
+            delete_persistent<HMTable>(old_table);
+            root->old_table = nullptr;
+        });
+    } else if (key_count > root->table->count * MAX_LOAD) {
+        const uint64_t count = root->table->count * 2;
+        LOG("Growing table, buckets=" << to_string(count));
+        transaction::exec_tx(pmpool, [&] {
+            auto table = make_persistent<HMTable>();
+            table->count = count;
+            table->buckets = make_persistent<persistent_ptr<HMEntry>[]>(count);
+            root->old_table = root->table;
+            root->table = table;
+        });
+        migrate_cursor = 0;
+    }
+}
+
+uint64_t HashMap::Hash(const Slice& key) {
+    return FNV1aHash(key);                                               // placement is persistent
+}
+
+// ===============================================================================================
+// PROTECTED LIFECYCLE METHODS
+// ===============================================================================================
+
+void HashMap::Recover() {
+    LOG("Recovering");
+    auto root = pmpool.get_root();
+    if (!root->table) {
+        LOG("   creating table, buckets=" << to_string(INITIAL_BUCKETS));
+        transaction::exec_tx(pmpool, [&] {
+            auto table = make_persistent<HMTable>();
+            table->count = INITIAL_BUCKETS;
+            table->buckets = make_persistent<persistent_ptr<HMEntry>[]>(INITIAL_BUCKETS);
+            root->table = table;
+        });
+    }
+    key_count = 0;
+    migrate_cursor = 0;                                                  // drain restarts from top
+    for (auto table : {root->old_table, root->table}) {
+        if (!table) continue;
+        for (uint64_t bucket = 0; bucket < table->count; bucket++) {
+            for (auto entry = table->buckets[bucket]; entry; entry = entry->next) key_count++;
+        }
+    }
+    LOG("Recovered ok");
+}
+
+} // namespace hashmap
+} // namespace pmemkv
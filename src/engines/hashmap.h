@@ -0,0 +1,153 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include "../pmemkv.h"
+#include "kvslot.h"
+#include "rwlock.h"
+
+using pmem::obj::p;
+using pmem::obj::persistent_ptr;
+using pmem::obj::make_persistent;
+using pmem::obj::transaction;
+using pmem::obj::delete_persistent;
+using pmem::obj::pool;
+using pmem::obj::pool_base;
+
+namespace pmemkv {
+namespace hashmap {
+
+const string ENGINE = "hashmap";                           // engine identifier
+
+#define INITIAL_BUCKETS 1024                               // buckets in newly created table
+#define LOCK_STRIPES 256                                   // locks shared by buckets (divides
+                                                           // every table size)
+#define MAX_LOAD 1                                         // keys per bucket that trigger growth
+#define MIGRATE_BATCH 2                                    // old buckets moved per update
+
+struct HMEntry {                                           // persistent chained entry
+    p<uint64_t> hash;                                      // full hash of key
+    p<KVSlot> slot;                                        // buffer for key & value
+    persistent_ptr<HMEntry> next;                          // next entry in same bucket
+};
+
+struct HMTable {                                           // persistent bucket array
+    p<uint64_t> count;                                     // number of buckets (power of two)
+    persistent_ptr<persistent_ptr<HMEntry>[]> buckets;     // head of each bucket's chain
+};
+
+struct HMRoot {                                            // persistent root object
+    persistent_ptr<HMTable> table;                         // table receiving new entries
+    persistent_ptr<HMTable> old_table;                     // table being drained (null if none)
+};
+
+struct HashMapAnalysis {                                   // hash map analysis structure
+    size_t buckets;                                        // buckets in current table
+    size_t buckets_draining;                               // buckets in old table (0 if none)
+    string path;                                           // path when constructed
+};
+
+class HashMap : public KVEngine {                          // persistent chained hash table
+  public:
+    HashMap(const string& path, size_t size);              // default constructor
+    ~HashMap();                                            // default destructor
+
+    string Engine() final { return ENGINE; }               // engine identifier
+    KVStatus Get(int32_t limit,                            // copy value to fixed-size buffer
+                 int32_t keybytes,
+                 int32_t* valuebytes,
+                 const char* key,
+                 char* value) final;
+    KVStatus Get(const Slice& key,                         // append value to std::string
+                 string* value) final;
+    KVStatus Get(const Slice& key,                         // pass value to callback without copy
+                 void* context,
+                 KVGetCallback* callback) final;
+    void MultiGet(const vector<string>& keys,              // pass each value found to callback
+                  void* context,
+                  KVMultiGetCallback* callback) final;
+    KVStatus Put(const Slice& key,                         // copy value from slice
+                 const Slice& value) final;
+    KVStatus Remove(const Slice& key) final;               // remove value for key
+    KVStatus Write(const WriteBatch& batch) final;         // apply all updates or none
+    KVIterator* NewIterator() final { return nullptr; }    // keys are not kept in order
+
+    PMEMoid GetRootOid() final;
+    PMEMobjpool* GetPool() final;
+
+    void Analyze(HashMapAnalysis& analysis);               // report on internal state & stats
+
+    void AllKeys(void* context,                            // pass each key to callback
+                 KVAllKeysCallback* callback) final;
+    void AllKeyValues(void* context,                       // pass each key & value to callback
+                      KVAllKeyValuesCallback* callback) final;
+    void ListAllKeyValuePairs(vector<string>& kv_pairs) final;      // list all the key value pairs
+    void ListAllKeys(vector<string>& keys) final;          // list all the keys
+    size_t TotalNumKeys() final { return key_count; }      // count of keys in constant time
+
+  protected:
+    void ApplyPut(uint64_t hash,                           // put value, letting errors propagate
+                  const Slice& key,
+                  const Slice& value);
+    void ApplyRemove(uint64_t hash,                        // remove key, letting errors propagate
+                     const Slice& key);
+    static void SlotFree(const KVSlot& kvslot);            // free record buffer held by slot
+                                                           // (inside transaction)
+    void VisitAll(bool values,                             // copy entries stripe by stripe,
+                  const std::function<bool(const string&,  // visiting copies with no lock held
+                                           const string&)>& visit);  // (stops on false)
+    HMEntry* EntrySearch(uint64_t hash,                    // find entry for key (null if none)
+                         const Slice& key);
+    void BucketMigrate(persistent_ptr<HMTable> old_table,  // move bucket's entries to new table
+                       uint64_t bucket);
+    void Rebalance();                                      // drain old table or start growing
+    void RebalanceStep();                                  // rebalance, letting errors propagate
+    uint64_t Hash(const Slice& key);                       // calculate 8-byte hash for key
+    void Recover();                                        // reload state from persistent pool
+  private:
+    HashMap(const HashMap&);                               // prevent copying
+    void operator=(const HashMap&);                        // prevent assigning
+    const string pmpath;                                   // path when constructed
+    pool<HMRoot> pmpool;                                   // pool for persistent root
+    std::atomic<size_t> key_count;                         // count of keys in both tables
+    std::atomic<uint64_t> migrate_cursor;                  // next old bucket to drain
+    RWLock table_lock;                                     // shared for key access, exclusive
+                                                           // to swap tables
+    RWLock stripes[LOCK_STRIPES];                          // locks for buckets by hash
+};
+
+} // namespace hashmap
+} // namespace pmemkv
@@ -0,0 +1,99 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "kvslot.h"
+
+namespace pmemkv {
+
+// ===============================================================================================
+// SLOT CLASS METHODS
+// ===============================================================================================
+
+bool KVSlot::empty() {
+    if (kv)
+        return false;
+    else
+        return true;
+}
+
+void KVSlot::clear() {
+    kv = nullptr;
+}
+
+void KVSlot::overwrite(const uint8_t hash, const Slice& value) {
+    char* p = kv.get();
+    const size_t vsize = value.size();
+    char* vptr = p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t) + get_ks_direct(p) + 1;
+    if (pmemobj_tx_add_range_direct(p + sizeof(uint32_t), sizeof(uint32_t) + sizeof(uint8_t)) ||
+        pmemobj_tx_add_range_direct(vptr, vsize + 1))
+        throw pmem::transaction_error("failed to snapshot slot value");
+    set_vs_direct(p, (uint32_t) vsize);
+    set_ph_direct(p, hash);
+    memcpy(vptr, value.data(), vsize);                                      // copy value into buffer
+    vptr[vsize] = 0;                                                        // terminate shorter value
+}
+
+void KVSlot::relocate(const char* from, char* to) {
+    if (!kv || kv.get() != from) return;
+    const size_t size = recordsize();
+    if (pmemobj_tx_add_range_direct(to, size)) throw pmem::transaction_error("failed to snapshot slot");
+    memcpy(to, from, size);
+    kv = persistent_ptr<char[]>(pmemobj_oid(to));
+}
+
+void KVSlot::set(const uint8_t hash, const Slice& key, const Slice& value, char* buffer) {
+    size_t ksize;
+    size_t vsize;
+    ksize = key.size();
+    vsize = value.size();
+    size_t size = recordsize(ksize, vsize);
+    if (buffer) {                                                           // region of leaf or slab
+        if (pmemobj_tx_add_range_direct(buffer, size))                      // may hold freed record
+            throw pmem::transaction_error("failed to snapshot slot");
+        kv = persistent_ptr<char[]>(pmemobj_oid(buffer));
+    } else {
+        kv = make_persistent<char[]>(size);
+    }
+    char* p = kv.get();
+    set_ph_direct(p, hash);
+    set_ks_direct(p, (uint32_t) ksize);
+    set_vs_direct(p, (uint32_t) vsize);
+    char* kvptr = p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
+    memcpy(kvptr, key.data(), ksize);                                       // copy key into buffer
+    kvptr[ksize] = 0;                                                       // terminate key
+    kvptr += ksize + 1;                                                     // advance ptr past key
+    memcpy(kvptr, value.data(), vsize);                                     // copy value into buffer
+    kvptr[vsize] = 0;                                                       // terminate value
+}
+
+} // namespace pmemkv
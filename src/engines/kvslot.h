@@ -0,0 +1,91 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include "../pmemkv.h"
+
+using pmem::obj::p;
+using pmem::obj::persistent_ptr;
+using pmem::obj::make_persistent;
+
+namespace pmemkv {
+
+// Records are laid out in one buffer as [key size u32][value size u32][hash u8][key]\0[value]\0
+// and this layout is part of the pool format of every engine storing p<KVSlot>, so changing it
+// breaks existing pools of kvtree2 and hashmap alike.
+
+class KVSlot {                                             // persistent pointer to one record
+  public:
+    uint8_t hash() const { return get_ph(); }
+    uint8_t hash_direct(char *p) const { return *((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))); }
+    const char* key() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
+    const char* key_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
+    const uint32_t keysize() const { return get_ks(); }
+    const uint32_t keysize_direct(char *p) const { return *((uint32_t *)(p)); }
+    const char* val() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks() + 1); }
+    const char* val_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + *((uint32_t *)(p)) + 1); }
+    const uint32_t valsize() const { return get_vs(); }
+    const uint32_t valsize_direct(char *p) const { return *((uint32_t *)(p + sizeof(uint32_t))); }
+    char* buffer() const { return kv.get(); }              // record (null if empty)
+    uint32_t recordsize() const { return recordsize(get_ks(), get_vs()); }
+    static uint32_t recordsize(size_t ksize, size_t vsize) {
+        return (uint32_t) (ksize + vsize + 2 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t));
+    }
+    void clear();                                          // forget record (caller frees buffer)
+    void overwrite(const uint8_t hash, const Slice& value); // replace value in buffer holding key
+    void relocate(const char* from, char* to);             // copy record from one inline region
+                                                           // to another, if stored in first
+    void set(const uint8_t hash, const Slice& key, const Slice& value,
+             char* buffer);                                // write record to buffer (or new heap
+                                                           // buffer if null), keeping old buffer
+    void set_ph(uint8_t v) {*((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
+    void set_ph_direct(char *p, uint8_t v) {*((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
+    void set_ks(uint32_t v) {*((uint32_t *)(kv.get())) = v;}
+    void set_ks_direct(char * p, uint32_t v) {*((uint32_t *)(p)) = v;}
+    void set_vs(uint32_t v) {*((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t))) = v;}
+    void set_vs_direct(char *p, uint32_t v) {*((uint32_t *)((char *)(p) + sizeof(uint32_t))) = v;}
+    uint8_t get_ph() const {return *((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t)));}
+    uint8_t get_ph_direct(char *p) const {return *((uint8_t *)((char *)(p) + sizeof(uint32_t) + sizeof(uint32_t)));}
+    uint32_t get_ks() const {return *((uint32_t *)(kv.get()));}
+    uint32_t get_ks_direct(char *p) const {return *((uint32_t *)(p));}
+    uint32_t get_vs() const {return *((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t)));}
+    uint32_t get_vs_direct(char *p) const {return *((uint32_t *)((char *)(p) + sizeof(uint32_t)));}
+    bool empty();
+  private:
+    persistent_ptr<char[]> kv;                             // buffer for key & value
+};
+
+static_assert(sizeof(KVSlot) == sizeof(persistent_ptr<char[]>), "KVSlot must hold only its record pointer");
+
+} // namespace pmemkv
@@ -44,6 +44,8 @@
 namespace pmemkv {
 namespace kvtree {
 
+static thread_local KVTxChanges* tx_changes = nullptr;                   // set inside LeafTx
+
 KVTree::KVTree(const string& path, const size_t size) : pmpath(path) {
     if (path.find("/dev/dax") == 0) {
         LOG("Opening device dax pool, path=" << path);
@@ -126,7 +128,8 @@ KVStatus KVTree::Get(const int32_t limit, const int32_t keybytes, int32_t* value
     return NOT_FOUND;
 }
 
-KVStatus KVTree::Get(const string& key, string* value) {
+KVStatus KVTree::Get(const Slice& keyslice, string* value) {
+    const string key = keyslice.ToString();                              // compared as C-style string
     LOG("Get for key=" << key.c_str());
     auto leafnode = LeafSearch(key);
     if (leafnode) {
@@ -146,35 +149,49 @@ KVStatus KVTree::Get(const string& key, string* value) {
     return NOT_FOUND;
 }
 
-KVStatus KVTree::Put(const string& key, const string& value) {
-    LOG("Put key=" << key.c_str() << ", value.size=" << to_string(value.size()));
-    try {
+KVStatus KVTree::Get(const Slice& keyslice, void* context, KVGetCallback* callback) {
+    const string key = keyslice.ToString();                              // compared as C-style string
+    LOG("Get for key=" << key.c_str());
+    auto leafnode = LeafSearch(key);
+    if (leafnode) {
         const uint8_t hash = PearsonHash(key.c_str(), key.size());
-        auto leafnode = LeafSearch(key);
-        if (!leafnode) {
-            LOG("   adding head leaf");
-            unique_ptr<KVLeafNode> new_node(new KVLeafNode());
-            new_node->is_leaf = true;
-            transaction::exec_tx(pmpool, [&] {
-                if (!leaves_prealloc.empty()) {
-                    new_node->leaf = leaves_prealloc.back();
-                    leaves_prealloc.pop_back();
-                } else {
-                    auto root = pmpool.get_root();
-                    auto old_head = root->head;
-                    auto new_leaf = make_persistent<KVLeaf>();
-                    root->head = new_leaf;
-                    new_leaf->next = old_head;
-                    new_node->leaf = new_leaf;
+        for (int slot = LEAF_KEYS; slot--;) {
+            if (leafnode->hashes[slot] == hash) {
+                if (strcmp(leafnode->keys[slot].c_str(), key.c_str()) == 0) {
+                    auto kv = leafnode->leaf->slots[slot].get_ro();
+                    LOG("   found value, slot=" << slot << ", size=" << to_string(kv.valsize()));
+                    (*callback)(context, (int32_t) kv.valsize(), kv.val());
+                    return OK;
                 }
-                LeafFillSpecificSlot(new_node.get(), hash, key, value, 0);
-            });
-            tree_top = move(new_node);
-        } else if (LeafFillSlotForKey(leafnode, hash, key, value)) {
-            // nothing else to do
-        } else {
-            LeafSplitFull(leafnode, hash, key, value);
+            }
         }
+    }
+    LOG("   could not find key");
+    return NOT_FOUND;
+}
+
+void KVTree::MultiGet(const vector<string>& keys, void* context, KVMultiGetCallback* callback) {
+    LOG("MultiGet for count=" << to_string(keys.size()));
+    for (int32_t i = 0; i < (int32_t) keys.size(); i++) {
+        auto leafnode = LeafSearch(keys[i]);
+        if (!leafnode) return;
+        const uint8_t hash = PearsonHash(keys[i].c_str(), keys[i].size());
+        for (int slot = LEAF_KEYS; slot--;) {
+            if (leafnode->hashes[slot] == hash) {
+                if (strcmp(leafnode->keys[slot].c_str(), keys[i].c_str()) == 0) {
+                    auto kv = leafnode->leaf->slots[slot].get_ro();
+                    (*callback)(context, i, (int32_t) kv.valsize(), kv.val());
+                    break;  // no duplicate keys allowed
+                }
+            }
+        }
+    }
+}
+
+KVStatus KVTree::Put(const Slice& key, const Slice& value) {
+    LOG("Put key=" << key.ToString() << ", value.size=" << to_string(value.size()));
+    try {
+        ApplyPut(key.ToString(), value.ToString());
         return OK;
     } catch (pmem::transaction_alloc_error) {
         return FAILED;
@@ -183,41 +200,198 @@ KVStatus KVTree::Put(const string& key, const string& value) {
     }
 }
 
-KVStatus KVTree::Remove(const string& key) {
+KVStatus KVTree::Remove(const Slice& keyslice) {
+    const string key = keyslice.ToString();                              // compared as C-style string
     LOG("Remove key=" << key.c_str());
+    ApplyRemove(key);
+    return OK;
+}
+
+KVStatus KVTree::Write(const WriteBatch& batch) {
+    LOG("Write batch.count=" << to_string(batch.Count()));
+    try {
+        LeafMakeRoom(batch.Ops());                                       // so batch never splits
+        LeafTx([&] {                                                     // nested tx calls join this one
+            for (auto& op : batch.Ops()) {
+                if (op.remove) {
+                    ApplyRemove(op.key.ToString());
+                } else {
+                    ApplyPut(op.key.ToString(), op.value.ToString());
+                }
+            }
+        });
+        return OK;
+    } catch (pmem::transaction_alloc_error) {
+        return FAILED;                                                   // leaves were restored
+    } catch (pmem::transaction_error) {
+        return FAILED;
+    }
+}
+
+PMEMoid KVTree::GetRootOid() {
+  return pmpool.get_root().raw();
+}
+PMEMobjpool* KVTree::GetPool() {
+    return pmpool.get_handle();
+}
+
+
+// ===============================================================================================
+// PROTECTED LEAF METHODS
+// ===============================================================================================
+
+void KVTree::ApplyPut(const string& key, const string& value) {
+    const uint8_t hash = PearsonHash(key.c_str(), key.size());
+    auto leafnode = LeafSearch(key);
+    if (!leafnode) {
+        LOG("   adding head leaf");
+        assert(!tx_changes);                                             // batch added leaf first
+        unique_ptr<KVLeafNode> new_node(new KVLeafNode());
+        new_node->is_leaf = true;
+        LeafTx([&] {
+            new_node->leaf = LeafAllocate();
+            LeafFillSpecificSlot(new_node.get(), hash, key, value, 0);
+        });
+        tree_top = move(new_node);
+    } else if (LeafFillSlotForKey(leafnode, hash, key, value)) {
+        // nothing else to do
+    } else {
+        assert(!tx_changes);                                             // batch split leaf first
+        LeafSplitFull(leafnode, hash, key, value);
+    }
+}
+
+void KVTree::ApplyRemove(const string& key) {
     auto leafnode = LeafSearch(key);
     if (!leafnode) {
         LOG("   head not present");
-        return OK;
+        return;
     }
     const uint8_t hash = PearsonHash(key.c_str(), key.size());
     for (int slot = LEAF_KEYS; slot--;) {
         if (leafnode->hashes[slot] == hash) {
             if (strcmp(leafnode->keys[slot].c_str(), key.c_str()) == 0) {
                 LOG("   freeing slot=" << slot);
-                leafnode->hashes[slot] = 0;
-                leafnode->keys[slot].clear();
                 auto leaf = leafnode->leaf;
-                transaction::exec_tx(pmpool, [&] {
+                LeafTx([&] {
+                    LeafSave(leafnode);
+                    leafnode->hashes[slot] = 0;
+                    leafnode->keys[slot].clear();
+                    key_count--;
+                    tx_changes->key_delta--;
                     leaf->slots[slot].get_rw().clear();
                 });
                 break;  // no duplicate keys allowed
             }
         }
     }
-    return OK;
 }
-PMEMoid KVTree::GetRootOid() {
-  return pmpool.get_root().raw();
+
+void KVTree::LeafMakeRoom(const vector<WriteBatchOp>& ops) {
+    auto less = [](const string& lhs, const string& rhs) {
+        return (strcmp(lhs.c_str(), rhs.c_str()) < 0);
+    };
+    if (!tree_top && !ops.empty()) {
+        LOG("   adding head leaf");
+        unique_ptr<KVLeafNode> new_node(new KVLeafNode());
+        new_node->is_leaf = true;
+        LeafTx([&] {
+            new_node->leaf = LeafAllocate();
+        });
+        tree_top = move(new_node);
+    }
+
+    // split leaves that can't take all new keys, at median of old & new keys, until none is left
+    bool split = true;
+    while (split) {
+        split = false;
+        std::map<KVLeafNode*, vector<string>> added;                     // new keys for each leaf
+        for (auto& op : ops) {
+            if (op.remove) continue;                                     // removes may not free
+            const string key = op.key.ToString();                        // slots before puts
+            auto leafnode = LeafSearch(key);
+            const uint8_t hash = PearsonHash(key.c_str(), key.size());
+            bool found = false;
+            for (int slot = LEAF_KEYS; slot-- && !found;) {
+                found = leafnode->hashes[slot] == hash &&
+                        strcmp(leafnode->keys[slot].c_str(), key.c_str()) == 0;
+            }
+            if (!found) added[leafnode].push_back(key);
+        }
+        for (auto& entry : added) {
+            KVLeafNode* leafnode = entry.first;
+            vector<string>& keys = entry.second;
+            std::sort(keys.begin(), keys.end(), less);
+            keys.erase(std::unique(keys.begin(), keys.end(), [](const string& lhs, const string& rhs) {
+                return (strcmp(lhs.c_str(), rhs.c_str()) == 0);
+            }), keys.end());
+            size_t count = keys.size();
+            for (int slot = LEAF_KEYS; slot--;) {
+                if (leafnode->hashes[slot] != 0) count++;
+            }
+            if (count <= LEAF_KEYS) continue;
+            for (int slot = LEAF_KEYS; slot--;) {
+                if (leafnode->hashes[slot] != 0) keys.push_back(leafnode->keys[slot]);
+            }
+            std::sort(keys.begin(), keys.end(), less);
+            LeafSplit(leafnode, keys[(keys.size() - 1) / 2]);            // leaves stay valid, so
+            split = true;                                                // others can be split too
+        }
+    }
 }
-PMEMobjpool* KVTree::GetPool() {
-    return pmpool.get_handle();
+
+void KVTree::LeafTx(const std::function<void()>& func) {
+    if (tx_changes) {                                                    // nested transaction, so
+        transaction::exec_tx(pmpool, func);                              // outermost one restores
+        return;                                                          // leaves
+    }
+    KVTxChanges changes;
+    changes.key_delta = 0;
+    tx_changes = &changes;
+    try {
+        transaction::exec_tx(pmpool, func);
+    } catch (...) {
+        tx_changes = nullptr;
+        LeafUndo(changes);
+        throw;
+    }
+    tx_changes = nullptr;
 }
 
+void KVTree::LeafUndo(KVTxChanges& changes) {
+    for (auto& entry : changes.leaves) {                                 // slots were rolled back,
+        memcpy(entry.first->hashes, entry.second.hashes, sizeof(entry.second.hashes));  // so leaves
+        for (int slot = LEAF_KEYS; slot--;) {                            // match them again
+            entry.first->keys[slot] = move(entry.second.keys[slot]);
+        }
+    }
+    key_count -= changes.key_delta;
+    for (auto it = changes.reused.rbegin(); it != changes.reused.rend(); ++it) {
+        leaves_prealloc.push_back(*it);
+    }
+}
 
-// ===============================================================================================
-// PROTECTED LEAF METHODS
-// ===============================================================================================
+void KVTree::LeafSave(KVLeafNode* leafnode) {
+    if (!tx_changes || tx_changes->leaves.count(leafnode)) return;
+    KVLeafState& state = tx_changes->leaves[leafnode];
+    memcpy(state.hashes, leafnode->hashes, sizeof(state.hashes));
+    for (int slot = LEAF_KEYS; slot--;) state.keys[slot] = leafnode->keys[slot];
+}
+
+persistent_ptr<KVLeaf> KVTree::LeafAllocate() {
+    if (!leaves_prealloc.empty()) {
+        auto leaf = leaves_prealloc.back();
+        leaves_prealloc.pop_back();
+        if (tx_changes) tx_changes->reused.push_back(leaf);
+        return leaf;
+    }
+    auto root = pmpool.get_root();
+    auto old_head = root->head;
+    auto new_leaf = make_persistent<KVLeaf>();
+    root->head = new_leaf;
+    new_leaf->next = old_head;
+    return new_leaf;
+}
 
 KVLeafNode* KVTree::LeafSearch(const string& key) {
     KVNode* node = tree_top.get();
@@ -273,7 +447,7 @@ bool KVTree::LeafFillSlotForKey(KVLeafNode* leafnode, const uint8_t hash,
     int slot = key_match_slot >= 0 ? key_match_slot : last_empty_slot;
     if (slot >= 0) {
         LOG("   filling slot=" << slot);
-        transaction::exec_tx(pmpool, [&] {
+        LeafTx([&] {
             LeafFillSpecificSlot(leafnode, hash, key, value, slot);
         });
     }
@@ -283,8 +457,11 @@ bool KVTree::LeafFillSlotForKey(KVLeafNode* leafnode, const uint8_t hash,
 void KVTree::LeafFillSpecificSlot(KVLeafNode* leafnode, const uint8_t hash,
                                   const string& key, const string& value, const int slot) {
     if (leafnode->hashes[slot] == 0) {
+        LeafSave(leafnode);
         leafnode->hashes[slot] = hash;
         leafnode->keys[slot] = key;
+        key_count++;
+        tx_changes->key_delta++;
     }
     leafnode->leaf->slots[slot].get_rw().set(hash, key, value);
 }
@@ -297,29 +474,23 @@ void KVTree::LeafSplitFull(KVLeafNode* leafnode, const uint8_t hash,
     std::sort(std::begin(keys), std::end(keys), [](const string& lhs, const string& rhs) {
         return (strcmp(lhs.c_str(), rhs.c_str()) < 0);
     });
-    string split_key = keys[LEAF_KEYS_MIDPOINT];
+    LeafSplit(leafnode, keys[LEAF_KEYS_MIDPOINT], &hash, key, value);
+}
+
+void KVTree::LeafSplit(KVLeafNode* leafnode, string split_key, const uint8_t* hash,
+                       const string& key, const string& value) {
     LOG("   splitting leaf at key=" << split_key);
 
     // split leaf into two leaves, moving slots that sort above split key to new leaf
     unique_ptr<KVLeafNode> new_leafnode(new KVLeafNode());
     new_leafnode->parent = leafnode->parent;
     new_leafnode->is_leaf = true;
-    transaction::exec_tx(pmpool, [&] {
-        persistent_ptr<KVLeaf> new_leaf;
-        if (!leaves_prealloc.empty()) {
-            new_leaf = leaves_prealloc.back();
-            new_leafnode->leaf = new_leaf;
-            leaves_prealloc.pop_back();
-        } else {
-            auto root = pmpool.get_root();
-            auto old_head = root->head;
-            new_leaf = make_persistent<KVLeaf>();
-            root->head = new_leaf;
-            new_leaf->next = old_head;
-            new_leafnode->leaf = new_leaf;
-        }
+    LeafTx([&] {
+        LeafSave(leafnode);
+        persistent_ptr<KVLeaf> new_leaf = LeafAllocate();
+        new_leafnode->leaf = new_leaf;
         for (int slot = LEAF_KEYS; slot--;) {
-            if (strcmp(leafnode->keys[slot].c_str(), split_key.data()) > 0) {
+            if (leafnode->hashes[slot] != 0 && strcmp(leafnode->keys[slot].c_str(), split_key.data()) > 0) {
                 new_leaf->slots[slot].swap(leafnode->leaf->slots[slot]);
                 new_leafnode->hashes[slot] = leafnode->hashes[slot];
                 new_leafnode->keys[slot] = leafnode->keys[slot];
@@ -327,8 +498,10 @@ void KVTree::LeafSplitFull(KVLeafNode* leafnode, const uint8_t hash,
                 leafnode->keys[slot].clear();
             }
         }
-        auto target = strcmp(key.c_str(), split_key.data()) > 0 ? new_leafnode.get() : leafnode;
-        LeafFillEmptySlot(target, hash, key, value);
+        if (hash) {
+            auto target = strcmp(key.c_str(), split_key.data()) > 0 ? new_leafnode.get() : leafnode;
+            LeafFillEmptySlot(target, *hash, key, value);
+        }
     });
 
     // recursively update volatile parents outside persistent transaction
@@ -402,6 +575,8 @@ void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, st
 
 void KVTree::Recover() {
     LOG("Recovering");
+    leaves_prealloc.clear();
+    key_count = 0;
 
     // traverse persistent leaves to build list of leaves to recover
     std::list<KVRecoveredLeaf> leaves;
@@ -420,6 +595,7 @@ void KVTree::Recover() {
             const char* key = kvslot.key();
             if (max_key == nullptr || strcmp(max_key, key) < 0) max_key = (char*) key;
             leafnode->keys[slot] = key;
+            key_count++;
         }
 
         // use highest sorting key to decide how to recover the leaf
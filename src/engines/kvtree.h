@@ -32,6 +32,8 @@
 
 #pragma once
 
+#include <functional>
+#include <map>
 #include <vector>
 #include "../pmemkv.h"
 
@@ -50,11 +52,11 @@ namespace kvtree {
 
 const string ENGINE = "kvtree";                            // engine identifier
 
-#define INNER_KEYS 4                                       // maximum keys for inner nodes
-#define INNER_KEYS_MIDPOINT (INNER_KEYS / 2)               // halfway point within the node
-#define INNER_KEYS_UPPER ((INNER_KEYS / 2) + 1)            // index where upper half of keys begins
-#define LEAF_KEYS 48                                       // maximum keys in tree nodes
-#define LEAF_KEYS_MIDPOINT (LEAF_KEYS / 2)                 // halfway point within the node
+constexpr int INNER_KEYS = 4;                              // maximum keys for inner nodes
+constexpr int INNER_KEYS_MIDPOINT = INNER_KEYS / 2;        // halfway point within the node
+constexpr int INNER_KEYS_UPPER = (INNER_KEYS / 2) + 1;     // index where upper half of keys begins
+constexpr int LEAF_KEYS = 48;                              // maximum keys in tree nodes
+constexpr int LEAF_KEYS_MIDPOINT = LEAF_KEYS / 2;          // halfway point within the node
 
 class KVSlot {
   public:
@@ -103,6 +105,18 @@ struct KVLeafNode final : KVNode {                         // volatile leaf node
     persistent_ptr<KVLeaf> leaf;                           // pointer to persistent leaf
 };
 
+struct KVLeafState {                                       // volatile leaf state kept for abort
+    uint8_t hashes[LEAF_KEYS];                             // Pearson hashes of keys
+    string keys[LEAF_KEYS];                                // keys stored in leaf
+};
+
+struct KVTxChanges {                                       // volatile changes of outermost
+    std::map<KVLeafNode*, KVLeafState> leaves;             // transaction: leaves changed (restored
+                                                           // on abort)
+    long key_delta;                                        // keys added less keys removed
+    vector<persistent_ptr<KVLeaf>> reused;                 // unused leaves taken (returned on
+};                                                         // abort)
+
 struct KVRecoveredLeaf {                                   // temporary wrapper used for recovery
     unique_ptr<KVLeafNode> leafnode;                       // leaf node being recovered
     char* max_key;                                         // highest sorting key present
@@ -127,23 +141,47 @@ class KVTree : public KVEngine {                           // hybrid B+ tree eng
                  int32_t* valuebytes,
                  const char* key,
                  char* value) final;
-    KVStatus Get(const string& key,                        // append value to std::string
+    KVStatus Get(const Slice& key,                         // append value to std::string
                  string* value) final;
-    KVStatus Put(const string& key,                        // copy value from std::string
-                 const string& value) final;
-    KVStatus Remove(const string& key) final;              // remove value for key
+    KVStatus Get(const Slice& key,                         // pass value to callback without copy
+                 void* context,
+                 KVGetCallback* callback) final;
+    void MultiGet(const vector<string>& keys,              // pass each value found to callback
+                  void* context,
+                  KVMultiGetCallback* callback) final;
+    KVStatus Put(const Slice& key,                         // copy value from slice
+                 const Slice& value) final;
+    KVStatus Remove(const Slice& key) final;               // remove value for key
+    KVStatus Write(const WriteBatch& batch) final;         // apply all updates or none
+    KVIterator* NewIterator() final { return nullptr; }    // iteration not supported
     PMEMoid GetRootOid() final;
     PMEMobjpool* GetPool() final;
 
     void Analyze(KVTreeAnalysis& analysis);                // report on internal state & stats
 
+    void AllKeys(void* context,                            // listing not supported
+                 KVAllKeysCallback* callback) final {}
+    void AllKeyValues(void* context,                       // listing not supported
+                      KVAllKeyValuesCallback* callback) final {}
     void ListAllKeyValuePairs(vector<string>& kv_pairs) final {return;}
 
     void ListAllKeys(vector<string>& keys) final {return;}
 
-    size_t TotalNumKeys() final {return 0;}
+    size_t TotalNumKeys() final { return key_count; }      // count of keys in constant time
 
   protected:
+    void ApplyPut(const string& key,                       // put value, letting errors propagate
+                  const string& value);
+    void ApplyRemove(const string& key);                   // remove key, letting errors propagate
+    void LeafMakeRoom(const vector<WriteBatchOp>& ops);    // add or split leaves until batch fits
+                                                           // (before transaction)
+    void LeafTx(const std::function<void()>& func);        // run transaction, restoring leaves if
+                                                           // it aborts
+    void LeafUndo(KVTxChanges& changes);                   // restore leaves of aborted transaction
+    void LeafSave(KVLeafNode* leafnode);                   // keep leaf state for abort (inside
+                                                           // LeafTx)
+    persistent_ptr<KVLeaf> LeafAllocate();                 // reuse unused leaf or add new one
+                                                           // (inside transaction)
     KVLeafNode* LeafSearch(const string& key);             // find node for key
     void LeafFillEmptySlot(KVLeafNode* leafnode,           // write first unoccupied slot found
                            uint8_t hash,
@@ -162,6 +200,11 @@ class KVTree : public KVEngine {                           // hybrid B+ tree eng
                        uint8_t hash,
                        const string& key,
                        const string& value);
+    void LeafSplit(KVLeafNode* leafnode,                   // move keys above split key to new
+                   string split_key,                       // leaf, then write record if hash is
+                   const uint8_t* hash = nullptr,          // given
+                   const string& key = string(),
+                   const string& value = string());
     void InnerUpdateAfterSplit(KVNode* node,               // update parents after leaf split
                                unique_ptr<KVNode> newnode,
                                string* split_key);
@@ -176,6 +219,7 @@ class KVTree : public KVEngine {                           // hybrid B+ tree eng
     pool<KVRoot> pmpool;                                   // pool for persistent root
     size_t pmsize;                                         // actual size of persistent pool
     unique_ptr<KVNode> tree_top;                           // pointer to uppermost inner node
+    size_t key_count;                                      // count of keys in all leaves
 };
 
 } // namespace kvtree
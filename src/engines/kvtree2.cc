@@ -34,30 +34,64 @@
 #include <cassert>
 #include <cstring>
 #include <iostream>
-#include <list>
+#include <iterator>
+#include <thread>
 #include <unistd.h>
 #include "kvtree2.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define PROBE_X86 1
+#endif
+
 #define DO_LOG 0
 #define LOG(msg) if (DO_LOG) std::cout << "[kvtree2] " << msg << "\n"
+#ifndef DO_STATS
+#define DO_STATS 0                                                       // count lookups & compares
+#endif
 
 namespace pmemkv {
 namespace kvtree2 {
 
-KVTree::KVTree(const string& path, const size_t size) : pmpath(path) {
+static thread_local KVTxChanges* tx_changes = nullptr;               // set inside SlotTx
+
+KVTree::KVTree(const string& path, const size_t size, const KVLeafFormat format,
+               const size_t recovery_threads, const bool background_recovery, const size_t merge_keys)
+        : pmpath(path), recovery_threads(recovery_threads),
+          merge_keys(std::min(merge_keys, (size_t) LEAF_KEYS_MIDPOINT)), recovered(false),
+          recovering(false), lookups(0), key_compares(0) {
     if ((access(path.c_str(), F_OK) != 0) && (size > 0)) {
         LOG("Creating filesystem pool, path=" << path << ", size=" << to_string(size));
         pmpool = pool<KVRoot>::create(path.c_str(), LAYOUT, size, S_IRWXU);
+        transaction::exec_tx(pmpool, [&] {
+            pmpool.get_root()->format = format;
+        });
     } else {
         LOG("Opening pool, path=" << path);
         pmpool = pool<KVRoot>::open(path.c_str(), LAYOUT);
     }
-    Recover();
+    leaf_format = (KVLeafFormat) pmpool.get_root()->format.get_ro();     // zero in older pools
+    if (leaf_format != LEAF_FORMAT_PEARSON8 && leaf_format != LEAF_FORMAT_FAST16 &&
+        leaf_format != LEAF_FORMAT_INLINE) {
+        pmpool.close();
+        throw std::invalid_argument("unsupported leaf format");
+    }
+    snapshot_loaded = SnapshotLoad();
+    if (snapshot_loaded) {
+        recovered = true;
+    } else if (background_recovery) {
+        RecoverInBackground();                                           // reads scan leaves until
+    } else {                                                             // index is ready
+        Recover();                                                       // unclean close or new pool
+        recovered = true;
+    }
     LOG("Opened ok");
 }
 
 KVTree::~KVTree() {
     LOG("Closing");
+    if (recovery_thread.joinable()) recovery_thread.join();
+    if (recovered) SnapshotSave();                                       // never save partial index
     pmpool.close();
     LOG("Closed ok");
 }
@@ -68,9 +102,23 @@ KVTree::~KVTree() {
 
 void KVTree::Analyze(KVTreeAnalysis& analysis) {
     LOG("Analyzing");
+    WaitRecovered();
+    WriteGuard tree_guard(tree_lock);
     analysis.leaf_empty = 0;
     analysis.leaf_prealloc = leaves_prealloc.size();
     analysis.leaf_total = 0;
+    analysis.slot_inline = 0;
+    analysis.slot_slab = 0;
+    analysis.slab_total = slabs.size();
+    analysis.slab_used = 0;
+    for (auto& entry : slabs) {
+        const KVSlabNode* slab = entry.second.get();
+        analysis.slab_used += __builtin_popcountll(slab->used.load()) - (64 - slab->chunk_count);
+    }
+    analysis.leaf_format = leaf_format;
+    analysis.snapshot_loaded = snapshot_loaded;
+    analysis.lookups = lookups;
+    analysis.key_compares = key_compares;
     analysis.path = pmpath;
 
     // iterate persistent leaves for stats
@@ -78,10 +126,11 @@ void KVTree::Analyze(KVTreeAnalysis& analysis) {
     while (leaf) {
         bool empty = true;
         for (int slot = LEAF_KEYS; slot--;) {
-            if (!leaf->slots[slot].get_rw().empty()) {
-                empty = false;
-                break;
-            }
+            auto kvslot = leaf->slots[slot].get_ro();
+            if (kvslot.empty()) continue;
+            empty = false;
+            if (kvslot.buffer() == LeafInline(leaf, slot)) analysis.slot_inline++;
+            if (SlabFind(kvslot.buffer())) analysis.slot_slab++;
         }
         if (empty) analysis.leaf_empty++;
         analysis.leaf_total++;
@@ -90,79 +139,132 @@ void KVTree::Analyze(KVTreeAnalysis& analysis) {
     LOG("Analyzed ok");
 }
   
+void KVTree::AllKeys(void* context, KVAllKeysCallback* callback) {
+    LOG("AllKeys");
+    VisitAll(false, [&](const string& key, const string&) {
+        return (*callback)(context, (int32_t) key.size(), key.data());
+    });
+}
+
+void KVTree::AllKeyValues(void* context, KVAllKeyValuesCallback* callback) {
+    LOG("AllKeyValues");
+    VisitAll(true, [&](const string& key, const string& value) {
+        return (*callback)(context, (int32_t) key.size(), key.data(),
+                           (int32_t) value.size(), value.data());
+    });
+}
+
 void KVTree::ListAllKeyValuePairs(vector<string>& kv_pairs) {
     LOG("Listing");
-    // iterate persistent leaves for stats
-    auto leaf = pmpool.get_root()->head;
-    while (leaf) {
-        for (int slot = LEAF_KEYS; slot--;) {
-            auto kvslot = leaf->slots[slot].get_rw();
-            if (!kvslot.empty()) {
-              kv_pairs.push_back(string(kvslot.key(), kvslot.keysize()));
-              kv_pairs.push_back(string(kvslot.val(), kvslot.valsize()));
-            }
-        }
-        leaf = leaf->next;  // advance to next linked leaf
-    }
+    AllKeyValues(&kv_pairs, [](void* context, int32_t keybytes, const char* key,
+                               int32_t valuebytes, const char* value) {
+        auto kv_pairs = (vector<string>*) context;
+        kv_pairs->push_back(string(key, (size_t) keybytes));
+        kv_pairs->push_back(string(value, (size_t) valuebytes));
+        return true;
+    });
     LOG("List ok");
 }
 
 void KVTree::ListAllKeys(vector<string>& keys) {
     LOG("Listing");
-    // iterate persistent leaves for stats
-    auto leaf = pmpool.get_root()->head;
-    while (leaf) {
-        for (int slot = LEAF_KEYS; slot--;) {
-            auto kvslot = leaf->slots[slot].get_rw();
-            if (!kvslot.empty()) {
-              keys.push_back(string(kvslot.key(), kvslot.keysize()));
-            }
-        }
-        leaf = leaf->next;  // advance to next linked leaf
-    }
+    AllKeys(&keys, [](void* context, int32_t keybytes, const char* key) {
+        ((vector<string>*) context)->push_back(string(key, (size_t) keybytes));
+        return true;
+    });
     LOG("List ok");
 }
 
-size_t KVTree::TotalNumKeys() {
-    size_t size = 0;
-    LOG("Getting size");
-    // iterate persistent leaves for stats
-    auto leaf = pmpool.get_root()->head;
-    while (leaf) {
-        for (int slot = LEAF_KEYS; slot--;) {
-            auto kvslot = leaf->slots[slot].get_rw();
-            if (!kvslot.empty()) {
-              ++size;
+void KVTree::VisitAll(const bool values, const std::function<bool(const string&, const string&)>& visit) {
+    vector<std::pair<string, string>> records;                           // copied from one leaf
+    if (!WaitRecovered()) {                                              // writers are blocked, so
+        auto leaf = pmpool.get_root()->head;                             // walk persistent leaves
+        for (; leaf; leaf = leaf->next) {
+            records.clear();
+            for (int slot = LEAF_KEYS; slot--;) {
+                auto kvslot = leaf->slots[slot].get_ro();
+                if (kvslot.empty() || kvslot.hash() == 0) continue;
+                records.emplace_back(string(kvslot.key(), kvslot.keysize()),
+                                     values ? string(kvslot.val(), kvslot.valsize()) : string());
             }
+            for (auto& record : records) if (!visit(record.first, record.second)) return;
         }
-        leaf = leaf->next;  // advance to next linked leaf
+        return;
+    }
+    string from;                                                         // lowest key not visited
+    bool more = true;
+    while (more) {
+        records.clear();
+        {   // copy one leaf, so callbacks run without locks and may call back into this tree
+            ReadGuard tree_guard(tree_lock);
+            const KVInnerNode* upper;
+            int upper_idx;
+            auto leafnode = LeafSearch(from, &upper, &upper_idx);
+            if (!leafnode) return;
+            ReadGuard leaf_guard(leafnode->lock);
+            for (int slot = LEAF_KEYS; slot--;) {
+                if (leafnode->hashes[slot] == 0) continue;
+                const Slice key = LeafKey(leafnode, slot);
+                if (key.compare(from) < 0) continue;                     // visited before merge
+                auto& kvslot = leafnode->leaf->slots[slot].get_ro();
+                records.emplace_back(key.ToString(),
+                                     values ? string(kvslot.val(), kvslot.valsize()) : string());
+            }
+            more = upper != nullptr;
+            if (more) {
+                from = upper->key(upper_idx);                            // next leaf holds keys
+                from.push_back('\0');                                   // above highest key here
+            }
+        }
+        for (auto& record : records) if (!visit(record.first, record.second)) return;
     }
-    LOG("Getting size ok");
-    return size;
 }
 
 KVStatus KVTree::Get(const int32_t limit, const int32_t keybytes, int32_t* valuebytes,
                      const char* key, char* value) {
-    auto ckey = std::string(key, keybytes);
-    LOG("Get for key=" << ckey);
+    const Slice ckey(key, (size_t) keybytes);
+    LOG("Get for key=" << ckey.ToString());
+    ReadGuard tree_guard(tree_lock);
+    KVSlot kv;
+    if (!recovered) {                                                    // index not ready yet
+        if (!RecoveryFind(ckey, &kv)) return NOT_FOUND;
+        *valuebytes = kv.valsize();
+        if ((int32_t) kv.valsize() > limit) return FAILED;
+        memcpy(value, kv.val(), kv.valsize());
+        return OK;
+    }
     auto leafnode = LeafSearch(ckey);
     if (leafnode) {
-        const uint8_t hash = PearsonHash(key, (size_t) keybytes);
-        for (int slot = LEAF_KEYS; slot--;) {
-            if (leafnode->hashes[slot] == hash) {
-                if (leafnode->keys[slot].compare(ckey) == 0) {
-                    auto kv = leafnode->leaf->slots[slot].get_ro();
-                    auto vs = kv.valsize();
-                    *valuebytes = vs;
-                    if (vs <= limit) {
-                        LOG("   found value, slot=" << slot << ", size=" << to_string(vs));
-                        memcpy(value, kv.val(), vs);
-                        return OK;
-                    } else {
-                        LOG("   buffer too small, slot=" << slot << ", size=" << to_string(vs));
-                        return FAILED;
-                    }
-                }
+        const KVKeyHash hash = KeyHash(ckey);
+        for (int attempt = 0; attempt < LEAF_READ_ATTEMPTS; attempt++) {    // read without leaf lock
+            uint64_t version;
+            Slice found;
+            const int result = LeafFindValue(leafnode, hash, ckey, &version, &found);
+            if (result < 0) continue;
+            if (result == 0) {
+                LOG("   could not find key");
+                return NOT_FOUND;
+            }
+            const bool fits = (int32_t) found.size() <= limit;
+            if (fits) memcpy(value, found.data(), found.size());
+            if (!LeafUnchanged(leafnode, version)) continue;              // value may be torn
+            *valuebytes = (int32_t) found.size();
+            LOG("   found value, size=" << to_string(found.size()));
+            return fits ? OK : FAILED;
+        }
+        ReadGuard leaf_guard(leafnode->lock);                            // writers kept changing
+        const int slot = LeafFindSlot(leafnode, hash, ckey);             // leaf, so wait them out
+        if (slot >= 0) {
+            kv = leafnode->leaf->slots[slot].get_ro();
+            auto vs = kv.valsize();
+            *valuebytes = vs;
+            if ((int32_t) vs <= limit) {
+                LOG("   found value, slot=" << slot << ", size=" << to_string(vs));
+                memcpy(value, kv.val(), vs);
+                return OK;
+            } else {
+                LOG("   buffer too small, slot=" << slot << ", size=" << to_string(vs));
+                return FAILED;
             }
         }
     }
@@ -170,55 +272,125 @@ KVStatus KVTree::Get(const int32_t limit, const int32_t keybytes, int32_t* value
     return NOT_FOUND;
 }
 
-KVStatus KVTree::Get(const string& key, string* value) {
-    LOG("Get for key=" << key.c_str());
+KVStatus KVTree::Get(const Slice& key, string* value) {
+    LOG("Get for key=" << key.ToString());
+    ReadGuard tree_guard(tree_lock);
+    KVSlot kv;
+    if (!recovered) {                                                    // index not ready yet
+        if (!RecoveryFind(key, &kv)) return NOT_FOUND;
+        value->append(kv.val(), kv.valsize());
+        return OK;
+    }
     auto leafnode = LeafSearch(key);
     if (leafnode) {
-        const uint8_t hash = PearsonHash(key.c_str(), key.size());
-        for (int slot = LEAF_KEYS; slot--;) {
-            if (leafnode->hashes[slot] == hash) {
-                if (leafnode->keys[slot].compare(key) == 0) {
-                    auto kv = leafnode->leaf->slots[slot].get_ro();
-                    LOG("   found value, slot=" << slot << ", size=" << to_string(kv.valsize()));
-                    value->append(kv.val(), kv.valsize());
-                    return OK;
-                }
+        const KVKeyHash hash = KeyHash(key);
+        for (int attempt = 0; attempt < LEAF_READ_ATTEMPTS; attempt++) {    // read without leaf lock
+            uint64_t version;
+            Slice found;
+            const int result = LeafFindValue(leafnode, hash, key, &version, &found);
+            if (result < 0) continue;
+            if (result == 0) {
+                LOG("   could not find key");
+                return NOT_FOUND;
             }
+            const size_t size = value->size();
+            value->append(found.data(), found.size());
+            if (LeafUnchanged(leafnode, version)) {
+                LOG("   found value, size=" << to_string(found.size()));
+                return OK;
+            }
+            value->resize(size);                                         // value may be torn
+        }
+        ReadGuard leaf_guard(leafnode->lock);                            // writers kept changing
+        const int slot = LeafFindSlot(leafnode, hash, key);              // leaf, so wait them out
+        if (slot >= 0) {
+            kv = leafnode->leaf->slots[slot].get_ro();
+            LOG("   found value, slot=" << slot << ", size=" << to_string(kv.valsize()));
+            value->append(kv.val(), kv.valsize());
+            return OK;
         }
     }
     LOG("   could not find key");
     return NOT_FOUND;
 }
 
-KVStatus KVTree::Put(const string& key, const string& value) {
-    LOG("Put key=" << key.c_str() << ", value.size=" << to_string(value.size()));
-    try {
-        const uint8_t hash = PearsonHash(key.c_str(), key.size());
-        auto leafnode = LeafSearch(key);
+KVStatus KVTree::Get(const Slice& key, void* context, KVGetCallback* callback) {
+    LOG("Get for key=" << key.ToString());
+    ReadGuard tree_guard(tree_lock);
+    KVSlot kv;
+    if (!recovered) {                                                    // index not ready yet
+        if (!RecoveryFind(key, &kv)) return NOT_FOUND;
+        (*callback)(context, (int32_t) kv.valsize(), kv.val());
+        return OK;
+    }
+    auto leafnode = LeafSearch(key);
+    if (leafnode) {
+        ReadGuard leaf_guard(leafnode->lock);
+        const int slot = LeafFindSlot(leafnode, KeyHash(key), key);
+        if (slot >= 0) {
+            kv = leafnode->leaf->slots[slot].get_ro();
+            LOG("   found value, slot=" << slot << ", size=" << to_string(kv.valsize()));
+            (*callback)(context, (int32_t) kv.valsize(), kv.val());
+            return OK;
+        }
+    }
+    LOG("   could not find key");
+    return NOT_FOUND;
+}
+
+void KVTree::MultiGet(const vector<string>& keys, void* context, KVMultiGetCallback* callback) {
+    LOG("MultiGet for count=" << to_string(keys.size()));
+    // visit keys in sorted order, so keys that share a leaf are resolved together
+    vector<int32_t> order(keys.size());
+    for (int32_t i = 0; i < (int32_t) keys.size(); i++) order[i] = i;
+    std::sort(order.begin(), order.end(), [&](int32_t lhs, int32_t rhs) {
+        return keys[lhs].compare(keys[rhs]) < 0;
+    });
+    ReadGuard tree_guard(tree_lock);
+    if (!recovered) {                                                    // index not ready yet
+        RecoveryFindAll(keys, order, context, callback);
+        return;
+    }
+    size_t pos = 0;
+    while (pos < order.size()) {
+        const KVInnerNode* upper;
+        int upper_idx;
+        auto leafnode = LeafSearch(keys[order[pos]], &upper, &upper_idx);
         if (!leafnode) {
-            LOG("   adding head leaf");
-            unique_ptr<KVLeafNode> new_node(new KVLeafNode());
-            new_node->is_leaf = true;
-            transaction::exec_tx(pmpool, [&] {
-                if (!leaves_prealloc.empty()) {
-                    new_node->leaf = leaves_prealloc.back();
-                    leaves_prealloc.pop_back();
-                } else {
-                    auto root = pmpool.get_root();
-                    auto old_head = root->head;
-                    auto new_leaf = make_persistent<KVLeaf>();
-                    root->head = new_leaf;
-                    new_leaf->next = old_head;
-                    new_node->leaf = new_leaf;
+            LOG("   head not present");
+            return;
+        }
+        ReadGuard leaf_guard(leafnode->lock);
+        do {
+            const string& key = keys[order[pos]];
+            const int slot = LeafFindSlot(leafnode, KeyHash(key), key);
+            if (slot >= 0) {
+                auto kv = leafnode->leaf->slots[slot].get_ro();
+                (*callback)(context, order[pos], (int32_t) kv.valsize(), kv.val());
+            }
+            pos++;
+        } while (pos < order.size() && (upper == nullptr || upper->compare(keys[order[pos]], upper_idx) <= 0));
+    }
+    LOG("   MultiGet ok");
+}
+
+KVStatus KVTree::Put(const Slice& key, const Slice& value) {
+    LOG("Put key=" << key.ToString() << ", value.size=" << to_string(value.size()));
+    if (!WaitRecovered()) return FAILED;                                 // leaves must be indexed
+    try {
+        {   // fill slot in existing leaf, in parallel with updates to other leaves
+            ReadGuard tree_guard(tree_lock);
+            auto leafnode = LeafSearch(key);
+            if (leafnode) {
+                WriteGuard leaf_guard(leafnode->lock);
+                VersionGuard version_guard(leafnode->version);           // readers retry meanwhile
+                if (LeafFillSlotForKey(leafnode, KeyHash(key), key, value)) {
+                    return OK;
                 }
-                LeafFillSpecificSlot(new_node.get(), hash, key, value, 0);
-            });
-            tree_top = move(new_node);
-        } else if (LeafFillSlotForKey(leafnode, hash, key, value)) {
-            // nothing else to do
-        } else {
-            LeafSplitFull(leafnode, hash, key, value);
+            }
         }
+        WriteGuard tree_guard(tree_lock);                                // leaf must be added or split
+        ApplyPut(key, value);
         return OK;
     } catch (pmem::transaction_alloc_error) {
         return FAILED;
@@ -227,31 +399,80 @@ KVStatus KVTree::Put(const string& key, const string& value) {
     }
 }
 
-KVStatus KVTree::Remove(const string& key) {
-    LOG("Remove key=" << key.c_str());
-    auto leafnode = LeafSearch(key);
-    if (!leafnode) {
-        LOG("   head not present");
-        return OK;
+KVStatus KVTree::Remove(const Slice& key) {
+    LOG("Remove key=" << key.ToString());
+    if (!WaitRecovered()) return FAILED;                                 // leaves must be indexed
+    {   // clear slot in existing leaf, in parallel with updates to other leaves
+        ReadGuard tree_guard(tree_lock);
+        auto leafnode = LeafSearch(key);
+        if (!leafnode) {
+            LOG("   head not present");
+            return OK;
+        }
+        {
+            WriteGuard leaf_guard(leafnode->lock);
+            VersionGuard version_guard(leafnode->version);               // readers retry meanwhile
+            if (!LeafClearSlotForKey(leafnode, key)) return OK;
+        }
+        if (LeafMergeSibling(leafnode) < 0) return OK;                   // leaf isn't underfull, or
+    }                                                                    // no sibling has room
+    try {
+        WriteGuard tree_guard(tree_lock);                                // leaf may be merged
+        auto leafnode = LeafSearch(key);
+        if (leafnode) LeafMergeSparse(leafnode);
+    } catch (pmem::transaction_alloc_error) {
+        LOG("   leaves not merged");                                     // key is removed anyway
+    } catch (pmem::transaction_error) {
+        LOG("   leaves not merged");
     }
-    const uint8_t hash = PearsonHash(key.c_str(), key.size());
-    for (int slot = LEAF_KEYS; slot--;) {
-        if (leafnode->hashes[slot] == hash) {
-            if (leafnode->keys[slot].compare(key) == 0) {
-                LOG("   freeing slot=" << slot);
-                leafnode->hashes[slot] = 0;
-                leafnode->keys[slot].clear();
-                auto leaf = leafnode->leaf;
-                transaction::exec_tx(pmpool, [&] {
-                    leaf->slots[slot].get_rw().clear();
-                });
-                break;  // no duplicate keys allowed
+    return OK;
+}
+
+KVStatus KVTree::Write(const WriteBatch& batch) {
+    LOG("Write batch.count=" << to_string(batch.Count()));
+    if (!WaitRecovered()) return FAILED;                                 // leaves must be indexed
+    WriteGuard tree_guard(tree_lock);
+    try {
+        LeafMakeRoom(batch.Ops());                                       // so batch never splits
+        SlotTx([&] {                                                     // nested tx calls join this one
+            for (auto& op : batch.Ops()) {
+                if (op.remove) {
+                    ApplyRemove(op.key);
+                } else {
+                    ApplyPut(op.key, op.value);
+                }
             }
+        });
+    } catch (pmem::transaction_alloc_error) {
+        return FAILED;                                                   // leaves were restored
+    } catch (pmem::transaction_error) {
+        return FAILED;
+    }
+    for (auto& op : batch.Ops()) {                                       // merge leaves once batch
+        if (!op.remove) continue;                                        // is committed
+        try {
+            auto leafnode = LeafSearch(op.key);
+            if (leafnode) LeafMergeSparse(leafnode);
+        } catch (pmem::transaction_alloc_error) {
+            LOG("   leaves not merged");                                 // keys are removed anyway
+        } catch (pmem::transaction_error) {
+            LOG("   leaves not merged");
         }
     }
     return OK;
 }
 
+KVIterator* KVTree::NewIterator() {
+    LOG("NewIterator");
+    WaitRecovered();                                                     // iterator walks index
+    return new KVTreeIterator(this);
+}
+
+size_t KVTree::TotalNumKeys() {
+    WaitRecovered();                                                     // counted by recovery
+    return key_count;
+}
+
 PMEMoid KVTree::GetRootOid() {
   return pmpool.get_root().raw();
 }
@@ -263,120 +484,498 @@ PMEMobjpool* KVTree::GetPool() {
 // PROTECTED LEAF METHODS
 // ===============================================================================================
 
-KVLeafNode* KVTree::LeafSearch(const string& key) {
+void KVTree::ApplyPut(const Slice& key, const Slice& value) {
+    const KVKeyHash hash = KeyHash(key);
+    auto leafnode = LeafSearch(key);
+    if (!leafnode) {
+        LOG("   adding head leaf");
+        assert(!tx_changes);                                             // batch added leaf first
+        unique_ptr<KVLeafNode> new_node(new KVLeafNode());
+        new_node->is_leaf = true;
+        SlabReserve(new_node.get(), KVSlot::recordsize(key.size(), value.size()));
+        try {
+            SlotTx([&] {
+                new_node->leaf = LeafAllocate();
+                LeafFillSpecificSlot(new_node.get(), hash, key, value, 0);
+            });
+        } catch (...) {
+            SlabDisown(new_node.get());                                  // leaf is never added
+            throw;
+        }
+        tree_top = move(new_node);
+    } else if (LeafFillSlotForKey(leafnode, hash, key, value)) {
+        // nothing else to do
+    } else {
+        assert(!tx_changes);                                             // batch split leaf first
+        LeafSplitFull(leafnode, hash, key, value);
+    }
+}
+
+void KVTree::ApplyRemove(const Slice& key) {
+    auto leafnode = LeafSearch(key);
+    if (!leafnode) {
+        LOG("   head not present");
+        return;
+    }
+    LeafClearSlotForKey(leafnode, key);
+}
+
+void KVTree::LeafMakeRoom(const vector<WriteBatchOp>& ops) {
+    if (!tree_top && !ops.empty()) {
+        LOG("   adding head leaf");
+        unique_ptr<KVLeafNode> new_node(new KVLeafNode());
+        new_node->is_leaf = true;
+        SlotTx([&] {
+            new_node->leaf = LeafAllocate();
+        });
+        tree_top = move(new_node);
+    }
+
+    // split leaves that can't take all new keys, at median of old & new keys, until none is left
+    bool split = true;
+    while (split) {
+        split = false;
+        std::map<KVLeafNode*, vector<string>> added;                     // new keys for each leaf
+        for (auto& op : ops) {
+            if (op.remove) continue;                                     // removes may not free
+            auto leafnode = LeafSearch(op.key);                          // slots before puts
+            if (LeafFindSlot(leafnode, KeyHash(op.key), op.key) < 0) added[leafnode].push_back(op.key.ToString());
+        }
+        for (auto& entry : added) {
+            KVLeafNode* leafnode = entry.first;
+            vector<string>& keys = entry.second;
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+            if (LeafKeyCount(leafnode) + keys.size() <= LEAF_KEYS) continue;
+            for (int slot = LEAF_KEYS; slot--;) {
+                if (leafnode->hashes[slot] != 0) keys.push_back(LeafKey(leafnode, slot).ToString());
+            }
+            std::sort(keys.begin(), keys.end());
+            LeafSplit(leafnode, keys[(keys.size() - 1) / 2]);            // leaves stay valid, so
+            split = true;                                                // others can be split too
+        }
+    }
+}
+
+void KVTree::LeafSave(KVLeafNode* leafnode) {
+    if (!tx_changes || tx_changes->leaves.count(leafnode)) return;
+    KVLeafState& state = tx_changes->leaves[leafnode];
+    memcpy(state.hashes, leafnode->hashes, sizeof(state.hashes));
+    memcpy(state.prefixes, leafnode->prefixes, sizeof(state.prefixes));
+#if LEAF_BLOOM_BITS > 0
+    memcpy(state.bloom, leafnode->bloom, sizeof(state.bloom));
+#endif
+}
+
+void KVTree::LeafUndo(KVTxChanges& changes) {
+    for (auto& entry : changes.leaves) {                                 // slots were rolled back,
+        memcpy(entry.first->hashes, entry.second.hashes, sizeof(entry.second.hashes));  // so leaves
+        memcpy(entry.first->prefixes, entry.second.prefixes, sizeof(entry.second.prefixes));  // match
+#if LEAF_BLOOM_BITS > 0
+        memcpy(entry.first->bloom, entry.second.bloom, sizeof(entry.second.bloom));
+#endif
+    }
+    key_count -= changes.key_delta;
+    for (auto it = changes.reused.rbegin(); it != changes.reused.rend(); ++it) leaves_prealloc.push_back(*it);
+}
+
+persistent_ptr<KVLeaf> KVTree::LeafAllocate() {
+    if (!leaves_prealloc.empty()) {
+        auto leaf = leaves_prealloc.back();
+        leaves_prealloc.pop_back();
+        if (tx_changes) tx_changes->reused.push_back(leaf);
+        return leaf;
+    }
+    auto root = pmpool.get_root();
+    auto old_head = root->head;
+    persistent_ptr<KVLeaf> new_leaf;
+    if (leaf_format == LEAF_FORMAT_INLINE) {
+        new_leaf = persistent_ptr<KVLeaf>(make_persistent<KVInlineLeaf>().raw());
+    } else {
+        new_leaf = make_persistent<KVLeaf>();
+    }
+    root->head = new_leaf;
+    new_leaf->next = old_head;
+    return new_leaf;
+}
+
+char* KVTree::LeafInline(const persistent_ptr<KVLeaf>& leaf, const int slot) {
+    if (leaf_format != LEAF_FORMAT_INLINE) return nullptr;
+    return static_cast<KVInlineLeaf*>(leaf.get())->inlined[slot];
+}
+
+int KVTree::LeafFindSlot(const KVLeafNode* leafnode, const KVKeyHash& hash, const Slice& key,
+                         uint64_t* empties) {
+    if (DO_STATS) lookups++;
+    uint64_t matches, ignored;
+    if (!LeafBloomMayContain(leafnode, hash.bloom)) {                    // key surely absent, so
+        if (empties) LeafProbe(leafnode->hashes, hash.fingerprint, &ignored, empties);
+        return -1;                                                       // probe only for empties
+    }
+    LeafProbe(leafnode->hashes, hash.fingerprint, &matches, empties ? empties : &ignored);
+    if (matches == 0) return -1;
+    const uint64_t prefix = KeyPrefix(key);
+    for (; matches; matches &= matches - 1) {                            // visit each set bit
+        const int slot = __builtin_ctzll(matches);
+        if (leafnode->prefixes[slot] != prefix) continue;                // no need to read slot
+        if (DO_STATS) key_compares++;
+        if (key.compare(LeafKey(leafnode, slot)) == 0) return slot;      // no duplicate keys allowed
+    }
+    return -1;
+}
+
+int KVTree::LeafFindValue(const KVLeafNode* leafnode, const KVKeyHash& hash, const Slice& key,
+                          uint64_t* version, Slice* value) {
+    *version = leafnode->version.load(std::memory_order_acquire);
+    if (*version & 1) return -1;                                         // writer is changing leaf
+    if (DO_STATS) lookups++;
+    uint64_t matches, empties;
+    if (LeafBloomMayContain(leafnode, hash.bloom)) {                     // else surely absent
+        LeafProbe(leafnode->hashes, hash.fingerprint, &matches, &empties);
+    } else {
+        matches = 0;
+    }
+    const uint64_t prefix = KeyPrefix(key);
+    for (; matches; matches &= matches - 1) {                            // visit each set bit
+        const int slot = __builtin_ctzll(matches);
+        if (leafnode->prefixes[slot] != prefix) continue;                // no need to read slot
+        auto& kvslot = leafnode->leaf->slots[slot].get_ro();
+        char* record = kvslot.buffer();
+        if (!record) continue;                                           // cleared meanwhile
+        const uint32_t ks = kvslot.keysize_direct(record);
+        const uint32_t vs = kvslot.valsize_direct(record);
+        if (ks != key.size()) continue;
+        if (!LeafUnchanged(leafnode, *version)) return -1;               // record was live with
+        if (DO_STATS) key_compares++;                                    // these sizes, so reads
+        if (memcmp(kvslot.key_direct(record), key.data(), ks)) continue; // stay inside it
+        *value = Slice(kvslot.key_direct(record) + ks + 1, vs);
+        return 1;
+    }
+    return LeafUnchanged(leafnode, *version) ? 0 : -1;
+}
+
+bool KVTree::LeafUnchanged(const KVLeafNode* leafnode, const uint64_t version) {
+    std::atomic_thread_fence(std::memory_order_acquire);                 // reads before check
+    return leafnode->version.load(std::memory_order_relaxed) == version; // complete before it
+}
+
+uint64_t KeyPrefix(const Slice& key) {
+    uint64_t prefix = 0;
+    const size_t size = key.size() < sizeof(prefix) ? key.size() : sizeof(prefix);
+    for (size_t i = 0; i < size; i++) prefix |= (uint64_t) (uint8_t) key.data()[i] << (56 - 8 * i);
+    return prefix;
+}
+
+Slice KVTree::LeafKey(const KVLeafNode* leafnode, const int slot) {
+    auto& kvslot = leafnode->leaf->slots[slot].get_ro();
+    return Slice(kvslot.key(), kvslot.keysize());
+}
+
+bool KVTree::LeafKeyLess(const KVLeafNode* leafnode, const int lhs, const int rhs) {
+    const uint64_t lhs_prefix = leafnode->prefixes[lhs];
+    const uint64_t rhs_prefix = leafnode->prefixes[rhs];
+    if (lhs_prefix != rhs_prefix) return lhs_prefix < rhs_prefix;        // decided without slots
+    return LeafKey(leafnode, lhs).compare(LeafKey(leafnode, rhs)) < 0;
+}
+
+KVLeafNode* KVTree::LeafSearch(const Slice& key) {
+    const KVInnerNode* upper;
+    int upper_idx;
+    return LeafSearch(key, &upper, &upper_idx);
+}
+
+KVLeafNode* KVTree::LeafSearch(const Slice& key, const KVInnerNode** upper, int* upper_idx) {
+    *upper = nullptr;
     KVNode* node = tree_top.get();
     if (node == nullptr) return nullptr;
-    bool matched;
     while (!node->is_leaf) {
-        matched = false;
         auto inner = (KVInnerNode*) node;
 #ifndef NDEBUG
         inner->assert_invariants();
 #endif
-        const uint8_t keycount = inner->keycount;
-        for (uint8_t idx = 0; idx < keycount; idx++) {
-            node = inner->children[idx].get();
-            if (key.compare(inner->keys[idx]) <= 0) {
-                matched = true;
-                break;
-            }
+        const int idx = inner->find_child(key);
+        if (idx < inner->keycount) {
+            *upper = inner;                                              // deeper keys are tighter
+            *upper_idx = idx;
         }
-        if (!matched) node = inner->children[keycount].get();
+        node = inner->children[idx].get();
     }
     return (KVLeafNode*) node;
 }
 
-void KVTree::LeafFillEmptySlot(KVLeafNode* leafnode, const uint8_t hash,
-                               const string& key, const string& value) {
+bool KVTree::LeafScanForKey(const persistent_ptr<KVLeaf>& leaf, const Slice& key, KVSlot* kvslot) {
     for (int slot = LEAF_KEYS; slot--;) {
-        if (leafnode->hashes[slot] == 0) {
-            LeafFillSpecificSlot(leafnode, hash, key, value, slot);
-            return;
-        }
+        *kvslot = leaf->slots[slot].get_ro();
+        if (kvslot->empty() || kvslot->hash() == 0) continue;
+        if (key.compare(Slice(kvslot->key(), kvslot->keysize())) == 0) return true;
     }
+    return false;
 }
 
-bool KVTree::LeafFillSlotForKey(KVLeafNode* leafnode, const uint8_t hash,
-                                const string& key, const string& value) {
-    // scan for empty/matching slots
-    int last_empty_slot = -1;
-    int key_match_slot = -1;
+void KVTree::LeafScanForKeys(const persistent_ptr<KVLeaf>& leaf, const vector<string>& keys,
+                             const vector<int32_t>& order, void* context, KVMultiGetCallback* callback) {
     for (int slot = LEAF_KEYS; slot--;) {
-        auto slot_hash = leafnode->hashes[slot];
-        if (slot_hash == 0) {
-            last_empty_slot = slot;
-        } else if (slot_hash == hash) {
-            if (leafnode->keys[slot].compare(key) == 0) {
-                key_match_slot = slot;
-                break;  // no duplicate keys allowed
-            }
+        auto kvslot = leaf->slots[slot].get_ro();
+        if (kvslot.empty() || kvslot.hash() == 0) continue;
+        const Slice key(kvslot.key(), kvslot.keysize());
+        auto it = std::lower_bound(order.begin(), order.end(), key, [&](int32_t idx, const Slice& k) {
+            return Slice(keys[idx]).compare(k) < 0;
+        });
+        for (; it != order.end() && key.compare(keys[*it]) == 0; it++) {       // key may be repeated
+            (*callback)(context, *it, (int32_t) kvslot.valsize(), kvslot.val());
         }
     }
+}
+
+bool KVTree::LeafClearSlotForKey(KVLeafNode* leafnode, const Slice& key) {
+    const int slot = LeafFindSlot(leafnode, KeyHash(key), key);
+    if (slot < 0) return false;
+    LOG("   freeing slot=" << slot);
+    auto leaf = leafnode->leaf;
+    SlotTx([&] {
+        LeafSave(leafnode);
+        leafnode->hashes[slot] = 0;
+        leafnode->prefixes[slot] = 0;
+        key_count--;
+        tx_changes->key_delta--;
+        auto& kvslot = leaf->slots[slot].get_rw();
+        char* buffer = kvslot.buffer();
+        const size_t size = kvslot.recordsize();
+        kvslot.clear();
+        SlotRelease(buffer, LeafInline(leaf, slot), size);
+    });
+    return true;
+}
+
+int KVTree::LeafKeyCount(const KVLeafNode* leafnode) {
+    uint64_t matches, empties;
+    LeafProbe(leafnode->hashes, 0, &matches, &empties);
+    return LEAF_KEYS - __builtin_popcountll(empties);
+}
+
+void KVTree::LeafFillEmptySlot(KVLeafNode* leafnode, const KVKeyHash& hash,
+                               const Slice& key, const Slice& value) {
+    uint64_t matches, empties;
+    LeafProbe(leafnode->hashes, hash.fingerprint, &matches, &empties);
+    if (empties) {
+        const int slot = 63 - __builtin_clzll(empties);                  // highest empty slot
+        LeafFillSpecificSlot(leafnode, hash, key, value, slot);
+    }
+}
+
+bool KVTree::LeafFillSlotForKey(KVLeafNode* leafnode, const KVKeyHash& hash,
+                                const Slice& key, const Slice& value) {
+    // find matching slot, otherwise lowest empty slot
+    uint64_t empties;
+    int slot = LeafFindSlot(leafnode, hash, key, &empties);
+    if (slot < 0 && empties) slot = __builtin_ctzll(empties);
 
     // update suitable slot if found
-    int slot = key_match_slot >= 0 ? key_match_slot : last_empty_slot;
     if (slot >= 0) {
         LOG("   filling slot=" << slot);
-        transaction::exec_tx(pmpool, [&] {
+        const size_t size = KVSlot::recordsize(key.size(), value.size());
+        auto& kvslot = leafnode->leaf->slots[slot].get_ro();
+        if (!SlotFits(kvslot.buffer(), LeafInline(leafnode->leaf, slot), size)) {
+            SlabReserve(leafnode, size);                                 // may add slab in own tx
+        }
+        SlotTx([&] {
             LeafFillSpecificSlot(leafnode, hash, key, value, slot);
         });
     }
     return slot >= 0;
 }
 
-void KVTree::LeafFillSpecificSlot(KVLeafNode* leafnode, const uint8_t hash,
-                                  const string& key, const string& value, const int slot) {
+void KVTree::LeafFillSpecificSlot(KVLeafNode* leafnode, const KVKeyHash& hash,
+                                  const Slice& key, const Slice& value, const int slot) {
     if (leafnode->hashes[slot] == 0) {
-        leafnode->hashes[slot] = hash;
-        leafnode->keys[slot] = key;
+        LeafSave(leafnode);
+        leafnode->hashes[slot] = hash.fingerprint;
+        leafnode->prefixes[slot] = KeyPrefix(key);
+        LeafBloomAdd(leafnode, hash.bloom);
+        key_count++;
+        tx_changes->key_delta++;
     }
-    leafnode->leaf->slots[slot].get_rw().set(hash, key, value);
+    // persist Pearson hash for recovery, otherwise just mark slot as used (hash is recalculated)
+    const uint8_t persisted = (leaf_format == LEAF_FORMAT_PEARSON8) ? (uint8_t) hash.fingerprint : (uint8_t) 1;
+    auto leaf = leafnode->leaf;
+    auto& kvslot = leaf->slots[slot].get_rw();
+    char* inlined = LeafInline(leaf, slot);
+    const size_t size = KVSlot::recordsize(key.size(), value.size());
+    char* old = kvslot.buffer();
+    if (SlotFits(old, inlined, size)) {                                  // slot already holds key,
+        kvslot.overwrite(persisted, value);                              // so only value changes
+        return;
+    }
+    const size_t old_size = old ? kvslot.recordsize() : 0;
+    char* buffer = (inlined && size <= LEAF_INLINE_BYTES) ? inlined : SlabAllocate(leafnode, size);
+    kvslot.set(persisted, key, value, buffer);
+    if (old) SlotRelease(old, inlined, old_size);                       // after new record is set
 }
 
-void KVTree::LeafSplitFull(KVLeafNode* leafnode, const uint8_t hash,
-                           const string& key, const string& value) {
-    string keys[LEAF_KEYS + 1];
-    keys[LEAF_KEYS] = key;
-    for (int slot = LEAF_KEYS; slot--;) keys[slot] = leafnode->keys[slot];
-    std::sort(std::begin(keys), std::end(keys), [](const string& lhs, const string& rhs) {
-        return lhs.compare(rhs) < 0;
+void KVTree::LeafSplitFull(KVLeafNode* leafnode, const KVKeyHash& hash,
+                           const Slice& key, const Slice& value) {
+    int slots[LEAF_KEYS + 1];                                            // all slots are occupied,
+    for (int slot = LEAF_KEYS + 1; slot--;) slots[slot] = slot;          // plus new key at the end
+    const uint64_t prefix = KeyPrefix(key);
+    std::sort(std::begin(slots), std::end(slots), [&](const int lhs, const int rhs) {
+        if (lhs == LEAF_KEYS) {
+            if (prefix != leafnode->prefixes[rhs]) return prefix < leafnode->prefixes[rhs];
+            return key.compare(LeafKey(leafnode, rhs)) < 0;
+        }
+        if (rhs == LEAF_KEYS) {
+            if (leafnode->prefixes[lhs] != prefix) return leafnode->prefixes[lhs] < prefix;
+            return LeafKey(leafnode, lhs).compare(key) < 0;
+        }
+        return LeafKeyLess(leafnode, lhs, rhs);
     });
-    string split_key = keys[LEAF_KEYS_MIDPOINT];
+    const int split_slot = slots[LEAF_KEYS_MIDPOINT];
+    LeafSplit(leafnode, (split_slot == LEAF_KEYS) ? key.ToString() : LeafKey(leafnode, split_slot).ToString(),
+              &hash, key, value);
+}
+
+void KVTree::LeafSplit(KVLeafNode* leafnode, string split_key, const KVKeyHash* hash,
+                       const Slice& key, const Slice& value) {
     LOG("   splitting leaf at key=" << split_key);
 
     // split leaf into two leaves, moving slots that sort above split key to new leaf
     unique_ptr<KVLeafNode> new_leafnode(new KVLeafNode());
     new_leafnode->parent = leafnode->parent;
     new_leafnode->is_leaf = true;
-    transaction::exec_tx(pmpool, [&] {
-        persistent_ptr<KVLeaf> new_leaf;
-        if (!leaves_prealloc.empty()) {
-            new_leaf = leaves_prealloc.back();
+    if (hash) {
+        SlabReserve(key.compare(split_key) > 0 ? new_leafnode.get() : leafnode,
+                    KVSlot::recordsize(key.size(), value.size()));
+    }
+    try {
+        SlotTx([&] {
+            LeafSave(leafnode);
+            persistent_ptr<KVLeaf> new_leaf = LeafAllocate();
             new_leafnode->leaf = new_leaf;
-            leaves_prealloc.pop_back();
+            for (int slot = LEAF_KEYS; slot--;) {
+                if (leafnode->hashes[slot] != 0 && LeafKey(leafnode, slot).compare(split_key) > 0) {
+                    new_leaf->slots[slot].swap(leafnode->leaf->slots[slot]);
+                    if (leaf_format == LEAF_FORMAT_INLINE) {             // inline record must move
+                        new_leaf->slots[slot].get_rw().relocate(LeafInline(leafnode->leaf, slot),
+                                                                LeafInline(new_leaf, slot));
+                    }
+                    new_leafnode->hashes[slot] = leafnode->hashes[slot];
+                    new_leafnode->prefixes[slot] = leafnode->prefixes[slot];
+                    leafnode->hashes[slot] = 0;
+                    leafnode->prefixes[slot] = 0;
+                }
+            }
+            LeafBloomRebuild(leafnode);                                  // filters cover only
+            LeafBloomRebuild(new_leafnode.get());                        // keys left in each leaf
+            if (hash) {
+                auto target = key.compare(split_key) > 0 ? new_leafnode.get() : leafnode;
+                LeafFillEmptySlot(target, *hash, key, value);
+            }
+        });
+    } catch (...) {
+        SlabDisown(new_leafnode.get());                                  // leaf is never added
+        throw;
+    }
+
+    // recursively update volatile parents outside persistent transaction
+    InnerUpdateAfterSplit(leafnode, move(new_leafnode), &split_key);
+}
+
+int KVTree::LeafMergeSibling(KVLeafNode* leafnode) {
+    KVInnerNode* inner = leafnode->parent;
+    if (merge_keys == 0 || !inner) return -1;
+    int count;
+    {
+        ReadGuard leaf_guard(leafnode->lock);
+        count = LeafKeyCount(leafnode);
+    }
+    if ((size_t) count >= merge_keys) return -1;
+
+    // pick adjacent leaf under same parent that gives the emptiest merged leaf, locking one leaf
+    // at a time so this can run with tree shared
+    int idx = 0;
+    while (inner->children[idx].get() != leafnode) idx++;
+    int sibling = -1;
+    int merged = LEAF_KEYS + 1;
+    for (int candidate : {idx - 1, idx + 1}) {
+        if (candidate < 0 || candidate > inner->keycount) continue;
+        assert(inner->children[candidate]->is_leaf);                     // tree stays balanced
+        auto other = (KVLeafNode*) inner->children[candidate].get();
+        ReadGuard leaf_guard(other->lock);
+        const int total = count + LeafKeyCount(other);
+        if (total < merged) {
+            sibling = candidate;
+            merged = total;
+        }
+    }
+    if (count > 0 && merged + (int) merge_keys > LEAF_KEYS) return -1;  // would soon split again
+    return sibling;
+}
+
+bool KVTree::LeafMergeSparse(KVLeafNode* leafnode) {
+    const int sibling = LeafMergeSibling(leafnode);
+    if (sibling < 0) return false;
+    KVInnerNode* inner = leafnode->parent;
+    int idx = 0;
+    while (inner->children[idx].get() != leafnode) idx++;
+
+    // move slots of leaf with fewer keys into empty slots of the other
+    auto other = (KVLeafNode*) inner->children[sibling].get();
+    const int count = LeafKeyCount(leafnode);
+    const int merged = count + LeafKeyCount(other);
+    const bool keep_other = LeafKeyCount(other) >= count;
+    KVLeafNode* from = keep_other ? leafnode : other;
+    KVLeafNode* to = keep_other ? other : leafnode;
+    LOG("   merging leaves, keys=" << merged);
+    int targets[LEAF_KEYS];
+    uint64_t matches, empties;
+    LeafProbe(to->hashes, 0, &matches, &empties);
+    for (int slot = 0; slot < LEAF_KEYS; slot++) {
+        if (from->hashes[slot] == 0) {
+            targets[slot] = -1;
         } else {
-            auto root = pmpool.get_root();
-            auto old_head = root->head;
-            new_leaf = make_persistent<KVLeaf>();
-            root->head = new_leaf;
-            new_leaf->next = old_head;
-            new_leafnode->leaf = new_leaf;
+            targets[slot] = __builtin_ctzll(empties);                    // room checked above
+            empties &= empties - 1;
         }
-        for (int slot = LEAF_KEYS; slot--;) {
-            if (leafnode->keys[slot].compare(split_key) > 0) {
-                new_leaf->slots[slot].swap(leafnode->leaf->slots[slot]);
-                new_leafnode->hashes[slot] = leafnode->hashes[slot];
-                new_leafnode->keys[slot] = leafnode->keys[slot];
-                leafnode->hashes[slot] = 0;
-                leafnode->keys[slot].clear();
+    }
+    transaction::exec_tx(pmpool, [&] {
+        for (int slot = 0; slot < LEAF_KEYS; slot++) {
+            if (targets[slot] < 0) continue;
+            to->leaf->slots[targets[slot]].swap(from->leaf->slots[slot]);
+            if (leaf_format == LEAF_FORMAT_INLINE) {                     // inline record must move
+                to->leaf->slots[targets[slot]].get_rw().relocate(LeafInline(from->leaf, slot),
+                                                                 LeafInline(to->leaf, targets[slot]));
             }
         }
-        auto target = key.compare(split_key) > 0 ? new_leafnode.get() : leafnode;
-        LeafFillEmptySlot(target, hash, key, value);
     });
 
-    // recursively update volatile parents outside persistent transaction
-    InnerUpdateAfterSplit(leafnode, move(new_leafnode), &split_key);
+    // update volatile leaves outside persistent transaction, keeping emptied leaf for reuse
+    for (int slot = 0; slot < LEAF_KEYS; slot++) {
+        if (targets[slot] < 0) continue;
+        to->hashes[targets[slot]] = from->hashes[slot];
+        to->prefixes[targets[slot]] = from->prefixes[slot];
+    }
+#if LEAF_BLOOM_BITS > 0
+    for (int i = 0; i < LEAF_BLOOM_BITS / 64; i++) to->bloom[i] |= from->bloom[i];
+#endif
+    {
+        WriteGuard slab_guard(slab_lock);
+        for (int slab_class = 0; slab_class < SLAB_CLASSES; slab_class++) {
+            KVSlabNode* slab = from->slabs[slab_class];
+            if (!slab) continue;
+            if (!to->slabs[slab_class]) {                                // adopt slab, so records
+                slab->owner = to;                                        // stay close together
+                to->slabs[slab_class] = slab;
+                continue;
+            }
+            slab->owner = nullptr;
+            if (~slab->used.load() != 0 && !slab->listed) {
+                slab->listed = true;
+                slabs_free[slab_class].push_back(slab);
+            }
+        }
+    }
+    leaves_prealloc.push_back(from->leaf);
+    InnerUpdateAfterMerge(inner, std::min(idx, sibling), keep_other ? idx : sibling);
+    return true;
 }
 
 void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, string* split_key) {
@@ -384,8 +983,7 @@ void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, st
         assert(node == tree_top.get());
         LOG("   creating new top node for split_key=" << *split_key);
         unique_ptr<KVInnerNode> top(new KVInnerNode());
-        top->keycount = 1;
-        top->keys[0] = *split_key;
+        top->assign_keys({*split_key});
         node->parent = top.get();
         new_node->parent = top.get();
         top->children[0] = move(tree_top);
@@ -401,13 +999,11 @@ void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, st
     KVInnerNode* inner = node->parent;
     { // insert split_key and new_node into inner node in sorted order
         const uint8_t keycount = inner->keycount;
-        int idx = 0;  // position where split_key should be inserted
-        while (idx < keycount && inner->keys[idx].compare(*split_key) <= 0) idx++;
-        for (int i = keycount - 1; i >= idx; i--) inner->keys[i + 1] = move(inner->keys[i]);
+        int idx = inner->find_child(*split_key);  // position where split_key should be inserted
+        while (idx < keycount && inner->compare(*split_key, idx) >= 0) idx++;
         for (int i = keycount; i > idx; i--) inner->children[i + 1] = move(inner->children[i]);
-        inner->keys[idx] = *split_key;
+        inner->insert_key(idx, *split_key);
         inner->children[idx + 1] = move(new_node);
-        inner->keycount = (uint8_t) (keycount + 1);
     }
     const uint8_t keycount = inner->keycount;
     if (keycount <= INNER_KEYS) {
@@ -420,16 +1016,20 @@ void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, st
     // split inner node at the midpoint, update parents as needed
     unique_ptr<KVInnerNode> ni(new KVInnerNode());                       // create new inner node
     ni->parent = inner->parent;                                          // set parent reference
-    for (int i = INNER_KEYS_UPPER; i < keycount; i++) {                  // move all upper keys
-        ni->keys[i - INNER_KEYS_UPPER] = move(inner->keys[i]);           // move key string
+    vector<string> lower_keys, upper_keys;                               // repack both halves, so
+    for (int i = 0; i < INNER_KEYS_MIDPOINT; i++) {                      // each gets the longest
+        lower_keys.push_back(inner->key(i));                             // common bytes it can
+    }
+    for (int i = INNER_KEYS_UPPER; i < keycount; i++) {                  // copy all upper keys
+        upper_keys.push_back(inner->key(i));
     }
     for (int i = INNER_KEYS_UPPER; i < keycount + 1; i++) {              // move all upper children
         ni->children[i - INNER_KEYS_UPPER] = move(inner->children[i]);   // move child reference
         ni->children[i - INNER_KEYS_UPPER]->parent = ni.get();           // set parent reference
     }
-    ni->keycount = INNER_KEYS_MIDPOINT;                                  // always half the keys
-    string new_split_key = inner->keys[INNER_KEYS_MIDPOINT];             // save for recursion
-    inner->keycount = INNER_KEYS_MIDPOINT;                               // half of keys remain
+    ni->assign_keys(upper_keys);                                         // always half the keys
+    string new_split_key = inner->key(INNER_KEYS_MIDPOINT);              // save for recursion
+    inner->assign_keys(lower_keys);                                      // half of keys remain
 
     // perform deep check on modified inner nodes
 #ifndef NDEBUG
@@ -440,81 +1040,622 @@ void KVTree::InnerUpdateAfterSplit(KVNode* node, unique_ptr<KVNode> new_node, st
     InnerUpdateAfterSplit(inner, move(ni), &new_split_key);              // recursive update
 }
 
+void KVTree::InnerUpdateAfterMerge(KVInnerNode* inner, const int idx, const int child) {
+    LOG("   updating parents after merge, key=" << inner->key(idx));
+    const uint8_t keycount = inner->keycount;
+    inner->erase_key(idx);
+    for (int i = child; i < keycount; i++) inner->children[i] = move(inner->children[i + 1]);
+    inner->children[keycount].reset();                                   // merged child is gone
+    if (inner->keycount > 0) {
+#ifndef NDEBUG
+        inner->assert_invariants();
+#endif
+        return;                                                          // end recursion
+    }
+
+    // node with only one child left hands it to adjacent node (or takes one from a full neighbour),
+    // so no inner node is left without keys, or its child becomes top if it has no parent
+    KVInnerNode* parent = inner->parent;
+    if (!parent) {
+        LOG("   removing top node");
+        unique_ptr<KVNode> top = move(inner->children[0]);
+        top->parent = nullptr;
+        tree_top = move(top);                                            // frees emptied node
+        return;                                                          // end recursion
+    }
+    int pos = 0;
+    while (parent->children[pos].get() != inner) pos++;
+    if (pos > 0 && ((KVInnerNode*) parent->children[pos - 1].get())->keycount < INNER_KEYS) {
+        auto lower = (KVInnerNode*) parent->children[pos - 1].get();     // becomes last child
+        lower->insert_key(lower->keycount, parent->key(pos - 1));
+        lower->children[lower->keycount] = move(inner->children[0]);
+        lower->children[lower->keycount]->parent = lower;
+#ifndef NDEBUG
+        lower->assert_invariants();
+#endif
+        InnerUpdateAfterMerge(parent, pos - 1, pos);                     // recursive update
+    } else if (pos < parent->keycount && ((KVInnerNode*) parent->children[pos + 1].get())->keycount < INNER_KEYS) {
+        auto upper = (KVInnerNode*) parent->children[pos + 1].get();     // becomes first child
+        upper->insert_key(0, parent->key(pos));
+        for (int i = upper->keycount; i > 0; i--) upper->children[i] = move(upper->children[i - 1]);
+        upper->children[0] = move(inner->children[0]);
+        upper->children[0]->parent = upper;
+#ifndef NDEBUG
+        upper->assert_invariants();
+#endif
+        InnerUpdateAfterMerge(parent, pos, pos);                         // recursive update
+    } else if (pos > 0) {                                                // both are full, so take
+        auto lower = (KVInnerNode*) parent->children[pos - 1].get();     // last child of lower
+        const string raised = lower->key(lower->keycount - 1);
+        inner->children[1] = move(inner->children[0]);
+        inner->children[0] = move(lower->children[lower->keycount]);
+        inner->children[0]->parent = inner;
+        lower->erase_key(lower->keycount - 1);
+        inner->assign_keys({parent->key(pos - 1)});
+        parent->erase_key(pos - 1);                                      // separator moves down,
+        parent->insert_key(pos - 1, raised);                             // lower's last key up
+#ifndef NDEBUG
+        lower->assert_invariants();
+        inner->assert_invariants();
+        parent->assert_invariants();
+#endif
+    } else {                                                             // parent never lacks keys,
+        auto upper = (KVInnerNode*) parent->children[pos + 1].get();     // so upper exists & is
+        const string raised = upper->key(0);                             // full: take first child
+        inner->children[1] = move(upper->children[0]);
+        inner->children[1]->parent = inner;
+        for (int i = 0; i < upper->keycount; i++) upper->children[i] = move(upper->children[i + 1]);
+        upper->erase_key(0);
+        inner->assign_keys({parent->key(pos)});
+        parent->erase_key(pos);                                          // separator moves down,
+        parent->insert_key(pos, raised);                                 // upper's first key up
+#ifndef NDEBUG
+        upper->assert_invariants();
+        inner->assert_invariants();
+        parent->assert_invariants();
+#endif
+    }
+}
+
+void KVTree::InnerBuild(vector<KVRecoveredLeaf>& leaves) {
+    tree_top.reset(nullptr);
+    vector<unique_ptr<KVNode>> nodes;                                    // nodes of current level
+    vector<string> max_keys;                                             // highest key under each
+    nodes.reserve(leaves.size());
+    max_keys.reserve(leaves.size());
+    for (auto& recovered : leaves) {
+        recovered.leafnode->parent = nullptr;
+        nodes.push_back(move(recovered.leafnode));
+        max_keys.push_back(move(recovered.max_key));
+    }
+
+    // pack each level into as few inner nodes as will hold it, spreading children evenly
+    while (nodes.size() > 1) {
+        const size_t count = (nodes.size() + INNER_KEYS) / (INNER_KEYS + 1);
+        vector<unique_ptr<KVNode>> inners;
+        vector<string> inner_max_keys;
+        for (size_t i = 0; i < count; i++) {
+            const size_t first = nodes.size() * i / count;
+            const size_t last = nodes.size() * (i + 1) / count;
+            unique_ptr<KVInnerNode> inner(new KVInnerNode());
+            inner->parent = nullptr;
+            inner->assign_keys(vector<string>(std::make_move_iterator(max_keys.begin() + first),
+                                              std::make_move_iterator(max_keys.begin() + last - 1)));
+            for (size_t j = first; j < last; j++) {
+                nodes[j]->parent = inner.get();
+                inner->children[j - first] = move(nodes[j]);
+            }
+#ifndef NDEBUG
+            inner->assert_invariants();
+#endif
+            inner_max_keys.push_back(move(max_keys[last - 1]));
+            inners.push_back(move(inner));
+        }
+        nodes = move(inners);
+        max_keys = move(inner_max_keys);
+    }
+    if (!nodes.empty()) tree_top = move(nodes.front());
+}
+
 // ===============================================================================================
 // PROTECTED LIFECYCLE METHODS
 // ===============================================================================================
 
 void KVTree::Recover() {
     LOG("Recovering");
+    leaves_prealloc.clear();
+    key_count = 0;
+    SlabLoad();                                                          // chunks marked as used
+                                                                         // while leaves are read
 
-    // traverse persistent leaves to build list of leaves to recover
-    std::list<KVRecoveredLeaf> leaves;
-    auto leaf = pmpool.get_root()->head;
-    while (leaf) {
+    // traverse persistent leaves, following only next pointers so the chain can be partitioned
+    vector<persistent_ptr<KVLeaf>> chain;
+    for (auto leaf = pmpool.get_root()->head; leaf; leaf = leaf->next) chain.push_back(leaf);
+
+    // rebuild leaf nodes for each part of the chain in parallel, giving one sorted run per part
+    size_t threads = recovery_threads;
+    if (threads == 0) threads = std::max(std::thread::hardware_concurrency(), 1u);
+    threads = std::min(threads, chain.size() / RECOVERY_LEAVES_PER_THREAD + 1);
+    LOG("   recovering leaves=" << to_string(chain.size()) << ", threads=" << to_string(threads));
+    if (recovery_index) {                                                // reads scan only leaves
+        WriteGuard index_guard(recovery_index->lock);                    // not indexed from now on
+        recovery_index->chain = chain;
+        for (size_t i = 0; i < threads; i++) {
+            recovery_index->unindexed.emplace_back(chain.size() * i / threads,
+                                                   chain.size() * (i + 1) / threads);
+        }
+    }
+    vector<vector<KVRecoveredLeaf>> runs(threads);
+    vector<vector<persistent_ptr<KVLeaf>>> preallocs(threads);
+    vector<size_t> keys(threads);
+    vector<std::exception_ptr> errors(threads);
+    vector<std::thread> workers;
+    for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back([&, i] {
+            try {
+                RecoverLeaves(i, chain.data() + chain.size() * i / threads,
+                              chain.data() + chain.size() * (i + 1) / threads,
+                              &runs[i], &preallocs[i], &keys[i]);
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto& worker : workers) worker.join();
+    for (auto& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+    for (size_t i = 0; i < threads; i++) {
+        leaves_prealloc.insert(leaves_prealloc.end(), preallocs[i].begin(), preallocs[i].end());
+        key_count += keys[i];
+    }
+    SlabListFree();
+
+    // merge sorted runs pairwise until recovered leaves are in ascending key order
+    auto less = [](const KVRecoveredLeaf& lhs, const KVRecoveredLeaf& rhs) {
+        return (lhs.max_key.compare(rhs.max_key) < 0);
+    };
+    while (runs.size() > 1) {
+        vector<vector<KVRecoveredLeaf>> merged;
+        for (size_t i = 0; i + 1 < runs.size(); i += 2) {
+            merged.emplace_back();
+            merged.back().reserve(runs[i].size() + runs[i + 1].size());
+            std::merge(std::make_move_iterator(runs[i].begin()), std::make_move_iterator(runs[i].end()),
+                       std::make_move_iterator(runs[i + 1].begin()), std::make_move_iterator(runs[i + 1].end()),
+                       std::back_inserter(merged.back()), less);
+        }
+        if (runs.size() % 2) merged.push_back(move(runs.back()));      // odd run waits a round
+        runs = move(merged);
+    }
+
+    // reconstruct top/inner nodes above sorted leaves
+    InnerBuild(runs.front());
+
+    LOG("Recovered ok");
+}
+
+void KVTree::RecoverInBackground() {
+    LOG("Recovering in background");
+    recovering = true;
+    recovery_index.reset(new KVRecoveryIndex());
+    recovery_thread = std::thread([this] {
+        bool ok = true;
+        try {
+            Recover();
+        } catch (...) {
+            LOG("   background recovery failed, reads will keep scanning leaves");
+            ok = false;
+        }
+        {
+            WriteGuard tree_guard(tree_lock);                            // wait out leaf scans
+            recovered = ok;
+            if (ok) recovery_index.reset();                              // else reads keep using it
+        }
+        std::lock_guard<std::mutex> lock(recovery_mutex);
+        recovering = false;
+        recovery_done.notify_all();
+    });
+}
+
+bool KVTree::RecoveryFind(const Slice& key, KVSlot* kvslot) {
+    vector<persistent_ptr<KVLeaf>> unindexed;
+    {
+        ReadGuard index_guard(recovery_index->lock);
+        auto it = recovery_index->slots.find(key.ToString());
+        if (it != recovery_index->slots.end()) {
+            *kvslot = it->second.first->slots[it->second.second].get_ro();
+            return true;
+        }
+        RecoveryUnindexed(&unindexed);                                   // listed with same lock, so
+    }                                                                    // no leaf is missed
+    for (auto& leaf : unindexed) {
+        if (LeafScanForKey(leaf, key, kvslot)) return true;
+    }
+    return false;
+}
+
+void KVTree::RecoveryFindAll(const vector<string>& keys, const vector<int32_t>& order,
+                             void* context, KVMultiGetCallback* callback) {
+    vector<std::pair<int32_t, KVSlot>> found;
+    vector<int32_t> missing;                                             // still in key order
+    vector<persistent_ptr<KVLeaf>> unindexed;
+    {
+        ReadGuard index_guard(recovery_index->lock);
+        for (auto idx : order) {
+            auto it = recovery_index->slots.find(keys[idx]);
+            if (it != recovery_index->slots.end()) {
+                found.emplace_back(idx, it->second.first->slots[it->second.second].get_ro());
+            } else {
+                missing.push_back(idx);
+            }
+        }
+        if (!missing.empty()) RecoveryUnindexed(&unindexed);
+    }
+    for (auto& entry : found) {
+        (*callback)(context, entry.first, (int32_t) entry.second.valsize(), entry.second.val());
+    }
+    for (auto& leaf : unindexed) LeafScanForKeys(leaf, keys, missing, context, callback);
+}
+
+void KVTree::RecoveryUnindexed(vector<persistent_ptr<KVLeaf>>* leaves) {
+    if (recovery_index->unindexed.empty()) {                             // chain not read yet
+        for (auto leaf = pmpool.get_root()->head; leaf; leaf = leaf->next) leaves->push_back(leaf);
+        return;
+    }
+    for (auto& part : recovery_index->unindexed) {
+        for (size_t pos = part.first; pos < part.second; pos++) {
+            leaves->push_back(recovery_index->chain[pos]);
+        }
+    }
+}
+
+bool KVTree::WaitRecovered() {
+    if (recovered) return true;
+    std::unique_lock<std::mutex> lock(recovery_mutex);
+    recovery_done.wait(lock, [this] { return !recovering; });
+    return recovered;
+}
+
+void KVTree::RecoverLeaves(const size_t part, const persistent_ptr<KVLeaf>* first,
+                           const persistent_ptr<KVLeaf>* last, vector<KVRecoveredLeaf>* leaves,
+                           vector<persistent_ptr<KVLeaf>>* prealloc, size_t* keys) {
+    *keys = 0;
+    vector<std::pair<Slice, int>> indexed;                               // keys of leaf, for reads
+    for (auto it = first; it != last; it++) {
+        auto leaf = *it;
         unique_ptr<KVLeafNode> leafnode(new KVLeafNode());
         leafnode->leaf = leaf;
         leafnode->is_leaf = true;
 
         // find highest sorting key in leaf, while recovering all hashes
         bool empty_leaf = true;
-        string max_key;
+        Slice max_key;
+        indexed.clear();
         for (int slot = LEAF_KEYS; slot--;) {
             auto kvslot = leaf->slots[slot].get_ro();
             if (kvslot.empty()) continue;
-            leafnode->hashes[slot] = kvslot.hash();
-            if (leafnode->hashes[slot] == 0) continue;
-            const char* key = kvslot.key();
-            if (empty_leaf) {
-                max_key = string(kvslot.key(), kvslot.get_ks());
-                empty_leaf = false;
-            } else if (max_key.compare(0, string::npos, kvslot.key(), kvslot.get_ks()) < 0) {
-                max_key = string(kvslot.key(), kvslot.get_ks());
-            }
-            leafnode->keys[slot] = string(key, kvslot.get_ks());
+            if (kvslot.hash() == 0) continue;
+            const Slice key(kvslot.key(), kvslot.get_ks());
+            if (recovery_index) indexed.emplace_back(key, slot);
+            SlabMark(kvslot.buffer());
+            const KVKeyHash hash = KeyHash(key);
+            leafnode->hashes[slot] = (leaf_format == LEAF_FORMAT_PEARSON8) ? kvslot.hash() : hash.fingerprint;
+            leafnode->prefixes[slot] = KeyPrefix(key);
+            if (empty_leaf || key.compare(max_key) > 0) max_key = key;    // refers to slot data
+            empty_leaf = false;
+            LeafBloomAdd(leafnode.get(), hash.bloom);
+            (*keys)++;
         }
 
-        // use highest sorting key to decide how to recover the leaf
+        // let reads find keys of leaf in index, then use highest sorting key to decide how to
+        // recover the leaf
+        if (recovery_index) {
+            WriteGuard index_guard(recovery_index->lock);
+            for (auto& entry : indexed) {
+                recovery_index->slots.emplace(entry.first.ToString(), std::make_pair(leaf, entry.second));
+            }
+            recovery_index->unindexed[part].first++;
+        }
         if (empty_leaf) {
-            leaves_prealloc.push_back(leaf);
+            prealloc->push_back(leaf);
         } else {
-            leaves.push_back({move(leafnode), max_key});
+            leaves->push_back({move(leafnode), max_key.ToString()});
         }
-
-        leaf = leaf->next;  // advance to next linked leaf
     }
 
     // sort recovered leaves in ascending key order
-    leaves.sort([](const KVRecoveredLeaf& lhs, const KVRecoveredLeaf& rhs) {
+    std::sort(leaves->begin(), leaves->end(), [](const KVRecoveredLeaf& lhs, const KVRecoveredLeaf& rhs) {
         return (lhs.max_key.compare(rhs.max_key) < 0);
     });
+}
 
-    // reconstruct top/inner nodes using adjacent pairs of recovered leaves
-    tree_top.reset(nullptr);
+bool KVTree::SnapshotLoad() {
+    auto root = pmpool.get_root();
+    const uint64_t generation = root->generation;
+    bool loaded = false;
+    if (root->snapshot) {
+        LOG("Loading snapshot, size=" << to_string(root->snapshot_size.get_ro()));
+        loaded = SnapshotRead(root->snapshot.get(), root->snapshot_size, generation);
+        if (!loaded) LOG("   snapshot is stale or unreadable");
+    }
 
-    if (!leaves.empty()) {
-        tree_top = move(leaves.front().leafnode);
-        auto max_key = leaves.front().max_key;
-        leaves.pop_front();
+    // start new generation without snapshot, so later changes are never hidden by it after a crash
+    transaction::exec_tx(pmpool, [&] {
+        root->generation = generation + 1;
+        if (root->snapshot) {
+            delete_persistent<char[]>(root->snapshot, root->snapshot_size);
+            root->snapshot = nullptr;
+            root->snapshot_size = 0;
+        }
+    });
+    return loaded;
+}
 
-        auto prevnode = tree_top.get();
-        while (!leaves.empty()) {
-            string split_key = string(max_key);
-            auto nextnode = leaves.front().leafnode.get();
-            nextnode->parent = prevnode->parent;
-            InnerUpdateAfterSplit(prevnode, move(leaves.front().leafnode), &split_key);
-            max_key = leaves.front().max_key;
-            leaves.pop_front();
-            prevnode = nextnode;
+bool KVTree::SnapshotRead(const char* data, const size_t size, const uint64_t generation) {
+    KVSnapshotHeader header;
+    if (size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    if (header.generation != generation || header.leaf_keys != LEAF_KEYS ||
+        header.bloom_bits != LEAF_BLOOM_BITS) return false;
+    size_t pos = sizeof(header);
+
+    vector<persistent_ptr<KVLeaf>> prealloc;
+    for (uint64_t i = 0; i < header.prealloc_count; i++) {
+        PMEMoid oid;
+        if (size - pos < sizeof(oid)) return false;
+        memcpy(&oid, data + pos, sizeof(oid));
+        pos += sizeof(oid);
+        prealloc.push_back(persistent_ptr<KVLeaf>(oid));
+    }
+
+    if ((size - pos) / sizeof(KVSnapshotSlab) < header.slab_count) return false;
+    vector<KVSnapshotSlab> saved_slabs(header.slab_count);
+    for (auto& saved : saved_slabs) {
+        memcpy(&saved, data + pos, sizeof(saved));
+        pos += sizeof(saved);
+    }
+
+    vector<KVRecoveredLeaf> leaves;
+    for (uint64_t i = 0; i < header.leaf_count; i++) {
+        KVSnapshotLeaf record;
+        if (size - pos < sizeof(record)) return false;
+        memcpy(&record, data + pos, sizeof(record));
+        pos += sizeof(record);
+        if (size - pos < record.upper_size) return false;
+        unique_ptr<KVLeafNode> leafnode(new KVLeafNode());
+        leafnode->leaf = persistent_ptr<KVLeaf>(record.leaf);
+        leafnode->is_leaf = true;
+        memcpy(leafnode->hashes, record.hashes, sizeof(record.hashes));
+        memcpy(leafnode->prefixes, record.prefixes, sizeof(record.prefixes));
+#if LEAF_BLOOM_BITS > 0
+        memcpy(leafnode->bloom, record.bloom, sizeof(record.bloom));
+#endif
+        leaves.push_back({move(leafnode), string(data + pos, record.upper_size)});
+        pos += record.upper_size;
+    }
+    if (pos != size) return false;
+
+    leaves_prealloc = move(prealloc);
+    key_count = header.key_count;
+    slabs.clear();
+    for (auto& saved : saved_slabs) SlabAdd(persistent_ptr<KVSlab>(saved.slab), saved.used);
+    SlabListFree();
+    InnerBuild(leaves);
+    LOG("   loaded snapshot, leaves=" << to_string(leaves.size()));
+    return true;
+}
+
+void KVTree::SnapshotSave() {
+    vector<std::pair<KVLeafNode*, string>> leaves;
+    if (tree_top) SnapshotLeaves(tree_top.get(), string(), &leaves);
+    KVSnapshotHeader header = {};
+    header.key_count = key_count;
+    header.leaf_keys = LEAF_KEYS;
+    header.bloom_bits = LEAF_BLOOM_BITS;
+    vector<persistent_ptr<KVLeaf>> prealloc(leaves_prealloc);
+    size_t size = sizeof(header);
+    for (auto& leaf : leaves) {
+        bool empty = true;                                               // leaves emptied by
+        for (int slot = LEAF_KEYS; slot--;) {                            // removes are listed as
+            if (leaf.first->hashes[slot] != 0) empty = false;            // unused, like Recover
+        }
+        if (empty) {
+            prealloc.push_back(leaf.first->leaf);
+            leaf.first = nullptr;
+        } else {
+            header.leaf_count++;
+            size += sizeof(KVSnapshotLeaf) + leaf.second.size();
         }
     }
+    header.prealloc_count = prealloc.size();
+    size += prealloc.size() * sizeof(PMEMoid);
+    header.slab_count = slabs.size();
+    size += slabs.size() * sizeof(KVSnapshotSlab);
 
-    LOG("Recovered ok");
+    LOG("Saving snapshot, size=" << to_string(size));
+    auto root = pmpool.get_root();
+    header.generation = root->generation;
+    try {
+        transaction::exec_tx(pmpool, [&] {
+            auto snapshot = make_persistent<char[]>(size);
+            char* p = snapshot.get();
+            memcpy(p, &header, sizeof(header));
+            p += sizeof(header);
+            for (auto& leaf : prealloc) {
+                memcpy(p, &leaf.raw(), sizeof(PMEMoid));
+                p += sizeof(PMEMoid);
+            }
+            for (auto& entry : slabs) {
+                KVSnapshotSlab record;
+                memset(&record, 0, sizeof(record));
+                record.slab = entry.second->slab.raw();
+                record.used = entry.second->used;
+                memcpy(p, &record, sizeof(record));
+                p += sizeof(record);
+            }
+            for (auto& leaf : leaves) {
+                if (leaf.first == nullptr) continue;
+                KVSnapshotLeaf record;
+                memset(&record, 0, sizeof(record));
+                record.leaf = leaf.first->leaf.raw();
+                memcpy(record.hashes, leaf.first->hashes, sizeof(record.hashes));
+                memcpy(record.prefixes, leaf.first->prefixes, sizeof(record.prefixes));
+#if LEAF_BLOOM_BITS > 0
+                memcpy(record.bloom, leaf.first->bloom, sizeof(record.bloom));
+#endif
+                record.upper_size = (uint32_t) leaf.second.size();
+                memcpy(p, &record, sizeof(record));
+                p += sizeof(record);
+                memcpy(p, leaf.second.data(), leaf.second.size());
+                p += leaf.second.size();
+            }
+            root->snapshot = snapshot;
+            root->snapshot_size = size;
+        });
+    } catch (pmem::transaction_alloc_error) {
+        LOG("   snapshot not saved, next open will recover leaves");
+    } catch (pmem::transaction_error) {
+        LOG("   snapshot not saved, next open will recover leaves");
+    }
+}
+
+void KVTree::SnapshotLeaves(KVNode* node, const string& upper,
+                            vector<std::pair<KVLeafNode*, string>>* leaves) {
+    if (node->is_leaf) {
+        leaves->push_back({(KVLeafNode*) node, upper});
+        return;
+    }
+    auto inner = (KVInnerNode*) node;
+    for (int idx = 0; idx < inner->keycount; idx++) {
+        SnapshotLeaves(inner->children[idx].get(), inner->key(idx), leaves);
+    }
+    SnapshotLeaves(inner->children[inner->keycount].get(), upper, leaves);
+}
+
+// ===============================================================================================
+// ITERATOR METHODS
+// ===============================================================================================
+
+KVTreeIterator::KVTreeIterator(KVTree* tree) : tree(tree), leafnode(nullptr), pos(0) {}
+
+void KVTreeIterator::SeekToFirst() {
+    LeafLoad(LeafDescend(tree->tree_top.get(), false), true);
+}
+
+void KVTreeIterator::SeekToLast() {
+    LeafLoad(LeafDescend(tree->tree_top.get(), true), false);
+}
+
+void KVTreeIterator::Seek(const Slice& key) {
+    auto node = tree->LeafSearch(key);
+    LeafLoad(node, true);
+    if (leafnode == nullptr || leafnode != node) return;                 // later leaves sort higher
+    while (pos < slots.size() && key.compare(KVTree::LeafKey(leafnode, slots[pos])) > 0) pos++;
+    if (pos == slots.size()) LeafLoad(LeafSibling(node, true), true);
+}
+
+void KVTreeIterator::Next() {
+    assert(Valid());
+    if (++pos == slots.size()) LeafLoad(LeafSibling(leafnode, true), true);
+}
+
+void KVTreeIterator::Prev() {
+    assert(Valid());
+    if (pos == 0) {
+        LeafLoad(LeafSibling(leafnode, false), false);
+    } else {
+        pos--;
+    }
+}
+
+Slice KVTreeIterator::Key() {
+    assert(Valid());
+    return KVTree::LeafKey(leafnode, slots[pos]);
+}
+
+Slice KVTreeIterator::Value() {
+    assert(Valid());
+    auto kvslot = leafnode->leaf->slots[slots[pos]].get_ro();
+    return Slice(kvslot.val(), kvslot.valsize());
+}
+
+KVLeafNode* KVTreeIterator::LeafDescend(KVNode* node, const bool highest) {
+    if (node == nullptr) return nullptr;
+    while (!node->is_leaf) {
+        auto inner = (KVInnerNode*) node;
+        node = inner->children[highest ? inner->keycount : 0].get();
+    }
+    return (KVLeafNode*) node;
+}
+
+KVLeafNode* KVTreeIterator::LeafSibling(KVNode* node, const bool higher) {
+    while (node->parent) {
+        auto inner = node->parent;
+        int idx = 0;
+        while (inner->children[idx].get() != node) idx++;
+        if (higher && idx < inner->keycount) return LeafDescend(inner->children[idx + 1].get(), false);
+        if (!higher && idx > 0) return LeafDescend(inner->children[idx - 1].get(), true);
+        node = inner;                                                    // no sibling at this level
+    }
+    return nullptr;
+}
+
+void KVTreeIterator::LeafLoad(KVLeafNode* node, const bool higher) {
+    while (node) {
+        slots.clear();
+        for (int slot = 0; slot < LEAF_KEYS; slot++) {
+            if (node->hashes[slot] != 0) slots.push_back(slot);
+        }
+        if (!slots.empty()) {
+            std::sort(slots.begin(), slots.end(), [node](const int lhs, const int rhs) {
+                return KVTree::LeafKeyLess(node, lhs, rhs);
+            });
+            leafnode = node;
+            pos = higher ? 0 : slots.size() - 1;
+            return;
+        }
+        node = LeafSibling(node, higher);                                // skip leaf without keys
+    }
+    leafnode = nullptr;
 }
 
 // ===============================================================================================
-// PEARSON HASH METHODS
+// HASH METHODS
 // ===============================================================================================
 
+static uint64_t FastHash(const char* data, const size_t size) {         // multiplicative hash over
+    const uint64_t multiplier = 0xff51afd7ed558ccdULL;                   // 8 bytes at a time
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (size * multiplier);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        hash = (hash ^ word) * multiplier;
+        hash ^= hash >> 29;
+    }
+    if (i < size) {                                                      // remaining 1-7 bytes
+        uint64_t word = 0;
+        memcpy(&word, data + i, size - i);
+        hash = (hash ^ word) * multiplier;
+    }
+    hash ^= hash >> 33;                                                  // final avalanche
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+KVKeyHash KVTree::KeyHash(const Slice& key) {
+    KVKeyHash hash;
+    hash.bloom = BloomHash(key);                                         // filters use low 48 bits
+    if (leaf_format == LEAF_FORMAT_PEARSON8) {
+        hash.fingerprint = PearsonHash(key.data(), key.size());
+    } else {
+        hash.fingerprint = (uint16_t) (hash.bloom >> 48);                // same pass over key
+        if (hash.fingerprint == 0) hash.fingerprint = 1;                 // 0 reserved for "null"
+    }
+    return hash;
+}
+
 // Pearson hashing lookup table from RFC 3074
 const uint8_t PEARSON_LOOKUP_TABLE[256] = {
         251, 175, 119, 215, 81, 14, 79, 191, 103, 49, 181, 143, 186, 157, 0,
@@ -548,58 +1689,470 @@ uint8_t KVTree::PearsonHash(const char* data, const size_t size) {
 }
 
 // ===============================================================================================
-// SLOT CLASS METHODS
+// FINGERPRINT PROBE METHODS
 // ===============================================================================================
 
-bool KVSlot::empty() {
-    if (kv)
-        return false;
-    else
-        return true;
+static_assert(LEAF_KEYS <= 64, "slot bitmasks must fit in 64 bits");
+
+static inline uint64_t ProbeZeroHalves(const uint64_t word) {            // mask with high bit set
+    const uint64_t low15 = 0x7fff7fff7fff7fffULL;                        // in each 16-bit lane that
+    return ~(((word & low15) + low15) | word | low15);                   // is zero, exactly
+}
+
+static inline uint64_t ProbeGatherHalves(const uint64_t lanemask) {      // move high bit of each
+    return (((lanemask >> 15) * 0x0000200040008001ULL) >> 45) & 0xF;     // lane into a 4-bit mask
+}
+
+static void ProbePortable(const uint16_t* hashes, const uint16_t hash,
+                          uint64_t* matches, uint64_t* empties) {
+    const uint64_t pattern = hash * 0x0001000100010001ULL;
+    uint64_t m = 0, e = 0;
+    int slot = 0;
+    for (; slot + 4 <= LEAF_KEYS; slot += 4) {                           // 4 slots per word
+        uint64_t word;
+        memcpy(&word, hashes + slot, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = (word >> 48) | ((word >> 16) & 0xffff0000ULL)             // first slot in low lane
+               | ((word << 16) & 0xffff00000000ULL) | (word << 48);
+#endif
+        m |= ProbeGatherHalves(ProbeZeroHalves(word ^ pattern)) << slot;
+        e |= ProbeGatherHalves(ProbeZeroHalves(word)) << slot;
+    }
+    for (; slot < LEAF_KEYS; slot++) {                                   // remainder of hashes
+        m |= (uint64_t) (hashes[slot] == hash) << slot;
+        e |= (uint64_t) (hashes[slot] == 0) << slot;
+    }
+    *matches = m;
+    *empties = e;
+}
+
+#ifdef PROBE_X86
+
+__attribute__((target("sse2")))
+static void ProbeSSE2(const uint16_t* hashes, const uint16_t hash, uint64_t* matches, uint64_t* empties) {
+    const __m128i h = _mm_set1_epi16((short) hash);
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t m = 0, e = 0;
+    int slot = 0;
+    for (; slot + 16 <= LEAF_KEYS; slot += 16) {                         // pack two compares of 8
+        const __m128i lo = _mm_loadu_si128((const __m128i*) (hashes + slot));
+        const __m128i hi = _mm_loadu_si128((const __m128i*) (hashes + slot + 8));
+        const __m128i mv = _mm_packs_epi16(_mm_cmpeq_epi16(lo, h), _mm_cmpeq_epi16(hi, h));
+        const __m128i ev = _mm_packs_epi16(_mm_cmpeq_epi16(lo, zero), _mm_cmpeq_epi16(hi, zero));
+        m |= (uint64_t) (uint32_t) _mm_movemask_epi8(mv) << slot;
+        e |= (uint64_t) (uint32_t) _mm_movemask_epi8(ev) << slot;
+    }
+    for (; slot < LEAF_KEYS; slot++) {                                   // remainder of hashes
+        m |= (uint64_t) (hashes[slot] == hash) << slot;
+        e |= (uint64_t) (hashes[slot] == 0) << slot;
+    }
+    *matches = m;
+    *empties = e;
+}
+
+__attribute__((target("avx2")))
+static void ProbeAVX2(const uint16_t* hashes, const uint16_t hash, uint64_t* matches, uint64_t* empties) {
+    const __m256i h = _mm256_set1_epi16((short) hash);
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t m = 0, e = 0;
+    int slot = 0;
+    // packing two compares of 16 interleaves their 128-bit lanes, which the permute puts back
+    for (; slot + 32 <= LEAF_KEYS; slot += 32) {
+        const __m256i lo = _mm256_loadu_si256((const __m256i*) (hashes + slot));
+        const __m256i hi = _mm256_loadu_si256((const __m256i*) (hashes + slot + 16));
+        const __m256i mv = _mm256_packs_epi16(_mm256_cmpeq_epi16(lo, h), _mm256_cmpeq_epi16(hi, h));
+        const __m256i ev = _mm256_packs_epi16(_mm256_cmpeq_epi16(lo, zero), _mm256_cmpeq_epi16(hi, zero));
+        m |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_permute4x64_epi64(mv, 0xD8)) << slot;
+        e |= (uint64_t) (uint32_t) _mm256_movemask_epi8(_mm256_permute4x64_epi64(ev, 0xD8)) << slot;
+    }
+    for (; slot + 16 <= LEAF_KEYS; slot += 16) {                         // 48 slots end with one
+        const __m256i v = _mm256_loadu_si256((const __m256i*) (hashes + slot));  // compare of 16,
+        const __m256i mv = _mm256_cmpeq_epi16(v, h);                     // packed with itself so
+        const __m256i ev = _mm256_cmpeq_epi16(v, zero);                  // its low 16 bytes hold
+        const __m256i packed = _mm256_packs_epi16(mv, ev);               // matches then empties
+        const uint32_t bits = (uint32_t) _mm256_movemask_epi8(_mm256_permute4x64_epi64(packed, 0xD8));
+        m |= (uint64_t) (bits & 0xffff) << slot;
+        e |= (uint64_t) (bits >> 16) << slot;
+    }
+    for (; slot < LEAF_KEYS; slot++) {                                   // remainder of hashes
+        m |= (uint64_t) (hashes[slot] == hash) << slot;
+        e |= (uint64_t) (hashes[slot] == 0) << slot;
+    }
+    *matches = m;
+    *empties = e;
+}
+
+#endif
+
+KVProbeFunction* ProbeKernel(const KVProbeKernel kernel) {
+    switch (kernel) {
+        case PROBE_PORTABLE:
+            return ProbePortable;
+#ifdef PROBE_X86
+        case PROBE_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2") ? ProbeSSE2 : nullptr;
+        case PROBE_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2") ? ProbeAVX2 : nullptr;
+#endif
+        default:
+            return nullptr;
+    }
+}
+
+static KVProbeFunction* ProbeKernelForCPU() {                            // fastest kernel available
+    if (ProbeKernel(PROBE_AVX2)) return ProbeKernel(PROBE_AVX2);
+    if (ProbeKernel(PROBE_SSE2)) return ProbeKernel(PROBE_SSE2);
+    return ProbePortable;
+}
+
+KVProbeFunction* const KVTree::LeafProbe = ProbeKernelForCPU();          // chosen once at startup
+
+// ===============================================================================================
+// LEAF FILTER METHODS
+// ===============================================================================================
+
+uint64_t KVTree::BloomHash(const Slice& key) {
+    return FastHash(key.data(), key.size());                             // probes use low 48 bits
+}
+
+void KVTree::LeafBloomAdd(KVLeafNode* leafnode, uint64_t bloomhash) {
+#if LEAF_BLOOM_BITS > 0
+    for (int i = 0; i < LEAF_BLOOM_PROBES; i++, bloomhash >>= 16) {
+        const uint32_t bit = (uint32_t) (bloomhash % LEAF_BLOOM_BITS);
+        leafnode->bloom[bit / 64] |= (uint64_t) 1 << (bit % 64);
+    }
+#endif
 }
 
-void KVSlot::clear() {
-    if (kv) {
-        char* p = kv.get();
-        set_ph_direct(p, 0);
-        set_ks_direct(p, 0);
-        set_vs_direct(p, 0);
-        delete_persistent<char[]>(kv, sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) +
-                                      get_vs_direct(p) + 2);
-        kv = nullptr;
-    }
-}
-
-void KVSlot::set(const uint8_t hash, const string& key, const string& value) {
-    if (kv) {
-        char* p = kv.get();
-        delete_persistent<char[]>(kv, sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) +
-                                      get_vs_direct(p) + 2);
-    }
-    size_t ksize;
-    size_t vsize;
-    ksize = key.size();
-    vsize = value.size();
-    size_t size = ksize + vsize + 2 + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
-    kv = make_persistent<char[]>(size);
-    char* p = kv.get();
-    set_ph_direct(p, hash);
-    set_ks_direct(p, (uint32_t) ksize);
-    set_vs_direct(p, (uint32_t) vsize);
-    char* kvptr = p + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint8_t);
-    memcpy(kvptr, key.data(), ksize);                                       // copy key into buffer
-    kvptr += ksize + 1;                                                     // advance ptr past key
-    memcpy(kvptr, value.data(), vsize);                                     // copy value into buffer
+bool KVTree::LeafBloomMayContain(const KVLeafNode* leafnode, uint64_t bloomhash) {
+#if LEAF_BLOOM_BITS > 0
+    for (int i = 0; i < LEAF_BLOOM_PROBES; i++, bloomhash >>= 16) {
+        const uint32_t bit = (uint32_t) (bloomhash % LEAF_BLOOM_BITS);
+        if ((leafnode->bloom[bit / 64] & ((uint64_t) 1 << (bit % 64))) == 0) return false;
+    }
+#endif
+    return true;
+}
+
+void KVTree::LeafBloomRebuild(KVLeafNode* leafnode) {
+#if LEAF_BLOOM_BITS > 0
+    memset(leafnode->bloom, 0, sizeof(leafnode->bloom));
+    for (int slot = LEAF_KEYS; slot--;) {
+        if (leafnode->hashes[slot] != 0) LeafBloomAdd(leafnode, BloomHash(LeafKey(leafnode, slot)));
+    }
+#endif
 }
 
 // ===============================================================================================
-// Node invariants
+// SLAB ALLOCATOR METHODS
 // ===============================================================================================
 
+bool KVTree::SlotFits(const char* buffer, const char* inlined, const size_t size) {
+    if (!buffer) return false;
+    if (buffer == inlined) return size <= LEAF_INLINE_BYTES;
+    size_t capacity = 0;
+    {
+        ReadGuard slab_guard(slab_lock);
+        const KVSlabNode* slab = SlabFind(buffer);
+        if (slab) capacity = slab->chunk_size;
+    }
+    if (capacity == 0) capacity = pmemobj_alloc_usable_size(pmemobj_oid(buffer));
+    return size <= capacity && size * 2 >= capacity;                     // don't pin large buffers
+}
+
+void KVTree::SlotRelease(char* buffer, const char* inlined, const size_t size) {
+    if (buffer == inlined) return;                                       // inline region is
+    if (SlabFree(buffer)) return;                                        // simply left unused
+    delete_persistent<char[]>(persistent_ptr<char[]>(pmemobj_oid(buffer)), size);
+}
+
+void KVTree::SlotTx(const std::function<void()>& func) {
+    if (tx_changes) {                                                    // nested transaction, so
+        transaction::exec_tx(pmpool, func);                              // outermost one commits
+        return;                                                          // or undoes changes
+    }
+    KVTxChanges changes;
+    changes.key_delta = 0;
+    tx_changes = &changes;
+    try {
+        transaction::exec_tx(pmpool, func);
+    } catch (...) {
+        tx_changes = nullptr;
+        LeafUndo(changes);
+        SlabUndo(changes);
+        throw;
+    }
+    tx_changes = nullptr;
+    for (auto buffer : changes.released) SlabFree(buffer);               // records are gone for good
+}
+
+int KVTree::SlabClass(const size_t size) {
+    for (int slab_class = 0; slab_class < SLAB_CLASSES; slab_class++) {
+        if (size <= ((size_t) SLAB_CHUNK_MIN << slab_class)) return slab_class;
+    }
+    return -1;
+}
+
+KVSlabNode* KVTree::SlabFind(const char* buffer) {
+    if (!buffer) return nullptr;
+    auto it = slabs.upper_bound(buffer);                                 // first slab above buffer
+    if (it == slabs.begin()) return nullptr;
+    KVSlabNode* slab = (--it)->second.get();
+    if (buffer >= slab->chunks + (size_t) slab->chunk_size * slab->chunk_count) return nullptr;
+    return slab;
+}
+
+void KVTree::SlabReserve(KVLeafNode* leafnode, const size_t size) {
+    if (leaf_format == LEAF_FORMAT_INLINE && size <= LEAF_INLINE_BYTES) return;
+    const int slab_class = SlabClass(size);
+    if (slab_class < 0) return;                                          // record goes on heap
+    KVSlabNode* current = leafnode->slabs[slab_class];
+    if (current && ~current->used.load() != 0) return;                  // only owner allocates,
+                                                                         // so chunk stays unused
+    WriteGuard slab_guard(slab_lock);
+    if (current) {
+        current->owner = nullptr;                                        // give up full slab, and
+        if (~current->used.load() != 0 && !current->listed) {            // list it if chunks were
+            current->listed = true;                                      // freed meanwhile
+            slabs_free[slab_class].push_back(current);
+        }
+        leafnode->slabs[slab_class] = nullptr;
+    }
+    KVSlabNode* slab = nullptr;
+    auto& list = slabs_free[slab_class];
+    while (!slab && !list.empty()) {
+        slab = list.back();
+        list.pop_back();
+        slab->listed = false;
+        if (slab->owner || ~slab->used.load() == 0) slab = nullptr;
+    }
+    if (!slab) {                                                         // slab list is changed by
+        LOG("   adding slab for chunk size=" << to_string(SLAB_CHUNK_MIN << slab_class));
+        persistent_ptr<KVSlab> added;                                    // one thread at a time,
+        transaction::exec_tx(pmpool, [&] {                               // in a transaction of its
+            const uint32_t chunk_size = SLAB_CHUNK_MIN << slab_class;    // own unless nested
+            added = persistent_ptr<KVSlab>(make_persistent<char[]>(sizeof(KVSlab) +
+                                                                   chunk_size * SLAB_CHUNKS).raw());
+            auto root = pmpool.get_root();
+            added->next = root->slabs;
+            added->chunk_size = chunk_size;
+            added->chunk_count = SLAB_CHUNKS;
+            root->slabs = added;
+        });
+        slab = SlabAdd(added, 0);
+        if (tx_changes) tx_changes->added.push_back(slab);           // rolled back with outer tx
+    }
+    slab->owner = leafnode;
+    leafnode->slabs[slab_class] = slab;
+}
+
+char* KVTree::SlabAllocate(KVLeafNode* leafnode, const size_t size) {
+    const int slab_class = SlabClass(size);
+    if (slab_class < 0) return nullptr;
+    KVSlabNode* slab = leafnode->slabs[slab_class];
+    if (!slab) return nullptr;                                           // use heap instead
+    uint64_t used = slab->used.load();
+    while (~used != 0) {                                                 // other leaves may free
+        const int chunk = __builtin_ctzll(~used);                        // chunks concurrently
+        if (slab->used.compare_exchange_weak(used, used | ((uint64_t) 1 << chunk))) {
+            char* buffer = slab->chunks + (size_t) chunk * slab->chunk_size;
+            if (tx_changes) tx_changes->allocated.push_back(buffer);
+            return buffer;
+        }
+    }
+    return nullptr;
+}
+
+bool KVTree::SlabFree(const char* buffer) {
+    KVSlabNode* slab;
+    bool unlisted;
+    {
+        ReadGuard slab_guard(slab_lock);
+        slab = SlabFind(buffer);
+        if (!slab) return false;
+        if (tx_changes) {                                                // abort would restore
+            tx_changes->released.push_back(buffer);                      // record, so chunk is
+            return true;                                                 // freed after commit
+        }
+        const size_t chunk = (size_t) (buffer - slab->chunks) / slab->chunk_size;
+        slab->used.fetch_and(~((uint64_t) 1 << chunk));
+        unlisted = !slab->owner && !slab->listed && slab->slab_class >= 0;
+    }
+    if (unlisted) {                                                      // unowned slabs are only
+        WriteGuard slab_guard(slab_lock);                                // adopted from the list,
+        if (!slab->owner && !slab->listed) {                             // so owner is still null
+            slab->listed = true;
+            slabs_free[slab->slab_class].push_back(slab);
+        }
+    }
+    return true;
+}
+
+void KVTree::SlabDisown(KVLeafNode* leafnode) {
+    WriteGuard slab_guard(slab_lock);
+    for (int slab_class = 0; slab_class < SLAB_CLASSES; slab_class++) {
+        KVSlabNode* slab = leafnode->slabs[slab_class];
+        if (!slab) continue;
+        slab->owner = nullptr;
+        if (~slab->used.load() != 0 && !slab->listed) {
+            slab->listed = true;
+            slabs_free[slab_class].push_back(slab);
+        }
+        leafnode->slabs[slab_class] = nullptr;
+    }
+}
+
+void KVTree::SlabUndo(const KVTxChanges& changes) {
+    for (auto buffer : changes.allocated) SlabFree(buffer);              // chunks hold no records
+    if (changes.added.empty()) return;
+    WriteGuard slab_guard(slab_lock);
+    for (auto slab : changes.added) {                                    // slabs were rolled back
+        if (slab->owner) slab->owner->slabs[slab->slab_class] = nullptr;
+        if (slab->listed) {
+            auto& list = slabs_free[slab->slab_class];
+            list.erase(std::remove(list.begin(), list.end(), slab), list.end());
+        }
+        slabs.erase(slab->chunks);
+    }
+}
+
+KVSlabNode* KVTree::SlabAdd(const persistent_ptr<KVSlab>& slab, const uint64_t used) {
+    unique_ptr<KVSlabNode> node(new KVSlabNode());
+    node->slab = slab;
+    node->chunks = (char*) slab.get() + sizeof(KVSlab);
+    node->chunk_size = slab->chunk_size;
+    const int slab_class = SlabClass(node->chunk_size);                  // sizes from other builds
+    const bool known = slab_class >= 0 && ((uint32_t) SLAB_CHUNK_MIN << slab_class) == node->chunk_size;
+    node->slab_class = known ? slab_class : -1;                          // are freed but not reused
+    node->chunk_count = std::min((uint32_t) slab->chunk_count, (uint32_t) 64);
+    node->used = (node->chunk_count == 64) ? used : (used | (~(uint64_t) 0 << node->chunk_count));
+    node->owner = nullptr;
+    node->listed = false;
+    KVSlabNode* result = node.get();
+    slabs[result->chunks] = move(node);
+    return result;
+}
+
+void KVTree::SlabLoad() {
+    WriteGuard slab_guard(slab_lock);
+    slabs.clear();
+    for (auto& list : slabs_free) list.clear();
+    for (auto slab = pmpool.get_root()->slabs; slab; slab = slab->next) SlabAdd(slab, 0);
+}
+
+void KVTree::SlabMark(const char* buffer) {
+    KVSlabNode* slab = SlabFind(buffer);                                 // slabs don't change while
+    if (!slab) return;                                                   // leaves are recovered
+    const size_t chunk = (size_t) (buffer - slab->chunks) / slab->chunk_size;
+    slab->used.fetch_or((uint64_t) 1 << chunk);
+}
+
+void KVTree::SlabListFree() {
+    WriteGuard slab_guard(slab_lock);
+    for (auto& list : slabs_free) list.clear();
+    for (auto& entry : slabs) {
+        KVSlabNode* slab = entry.second.get();
+        if (slab->owner || slab->slab_class < 0 || ~slab->used.load() == 0) continue;
+        slab->listed = true;
+        slabs_free[slab->slab_class].push_back(slab);
+    }
+}
+
+// ===============================================================================================
+// INNER NODE METHODS
+// ===============================================================================================
+
+Slice KVInnerNode::suffix(const int idx) const {
+    return Slice(suffixes.data() + offsets[idx], offsets[idx + 1] - offsets[idx]);
+}
+
+string KVInnerNode::key(const int idx) const {
+    const Slice rest = suffix(idx);
+    return string(common).append(rest.data(), rest.size());
+}
+
+int KVInnerNode::compare(const Slice& key, const int idx) const {
+    const size_t size = key.size() < common.size() ? key.size() : common.size();
+    const int r = memcmp(key.data(), common.data(), size);
+    if (r != 0) return r;
+    if (key.size() < common.size()) return -1;                           // key is shorter
+    return Slice(key.data() + common.size(), key.size() - common.size()).compare(suffix(idx));
+}
+
+int KVInnerNode::find_child(const Slice& key) const {
+    if (keycount == 0) return 0;                                         // only child (never kept)
+    // keys below or above the common bytes sort before or after every key in this node
+    const size_t size = key.size() < common.size() ? key.size() : common.size();
+    const int r = memcmp(key.data(), common.data(), size);
+    if (r < 0 || (r == 0 && key.size() < common.size())) return 0;
+    if (r > 0) return keycount;
+
+    // binary search over prefixes for first key not below ours, without data-dependent branches
+    const Slice rest(key.data() + common.size(), key.size() - common.size());
+    const uint64_t prefix = KeyPrefix(rest);
+    int idx = 0;
+    for (int count = keycount; count > 1;) {
+        const int half = count / 2;
+        idx = (prefixes[idx + half] < prefix) ? idx + half : idx;
+        count -= half;
+    }
+    idx += (prefixes[idx] < prefix);
+
+    // settle keys with equal prefixes using remaining bytes
+    while (idx < keycount && prefixes[idx] == prefix && rest.compare(suffix(idx)) > 0) idx++;
+    return idx;
+}
+
+void KVInnerNode::assign_keys(const vector<string>& keys) {
+    assert(!keys.empty() && keys.size() <= INNER_KEYS + 1);
+    const string& first = keys.front();                                  // keys are sorted, so
+    const string& last = keys.back();                                    // first & last share
+    size_t size = 0;                                                     // the fewest bytes
+    while (size < first.size() && size < last.size() && first[size] == last[size]) size++;
+    common.assign(first, 0, size);
+    suffixes.clear();
+    keycount = (uint8_t) keys.size();
+    for (int i = 0; i < keycount; i++) {
+        offsets[i] = (uint32_t) suffixes.size();
+        suffixes.append(keys[i], size, string::npos);
+        prefixes[i] = KeyPrefix(Slice(keys[i].data() + size, keys[i].size() - size));
+    }
+    offsets[keycount] = (uint32_t) suffixes.size();
+}
+
+void KVInnerNode::insert_key(const int idx, const Slice& key) {
+    if (key.size() < common.size() || memcmp(key.data(), common.data(), common.size()) != 0) {
+        vector<string> keys;                                             // common bytes shrink,
+        for (int i = 0; i < keycount; i++) keys.push_back(this->key(i)); // so repack every key
+        keys.insert(keys.begin() + idx, key.ToString());
+        assign_keys(keys);
+        return;
+    }
+    const Slice rest(key.data() + common.size(), key.size() - common.size());
+    suffixes.insert(offsets[idx], rest.data(), rest.size());
+    for (int i = keycount + 1; i > idx; i--) offsets[i] = offsets[i - 1] + (uint32_t) rest.size();
+    for (int i = keycount; i > idx; i--) prefixes[i] = prefixes[i - 1];
+    prefixes[idx] = KeyPrefix(rest);
+    keycount++;
+}
+
+void KVInnerNode::erase_key(const int idx) {
+    const uint32_t size = offsets[idx + 1] - offsets[idx];
+    suffixes.erase(offsets[idx], size);                                  // common bytes only grow,
+    for (int i = idx; i < keycount; i++) offsets[i] = offsets[i + 1] - size;  // so keep them
+    for (int i = idx; i + 1 < keycount; i++) prefixes[i] = prefixes[i + 1];
+    keycount--;
+}
+
 void KVInnerNode::assert_invariants() {
     assert(keycount <= INNER_KEYS);
+    assert(offsets[keycount] == suffixes.size());
     for (auto i = 0; i < keycount; ++i) {
-        assert(keys[i].size() > 0);
+        assert(common.size() + suffix(i).size() > 0);
+        assert(i == 0 || suffix(i - 1).compare(suffix(i)) <= 0);
+        assert(prefixes[i] == KeyPrefix(suffix(i)));
         assert(children[i] != nullptr);
     }
     assert(children[keycount] != nullptr);
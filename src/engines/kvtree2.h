@@ -32,8 +32,18 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include "../pmemkv.h"
+#include "kvslot.h"
+#include "rwlock.h"
 
 using std::move;
 using std::unique_ptr;
@@ -51,53 +61,104 @@ namespace kvtree2 {
 
 const string ENGINE = "kvtree2";                           // engine identifier
 
-#define INNER_KEYS 4                                       // maximum keys for inner nodes
-#define INNER_KEYS_MIDPOINT (INNER_KEYS / 2)               // halfway point within the node
-#define INNER_KEYS_UPPER ((INNER_KEYS / 2) + 1)            // index where upper half of keys begins
-#define LEAF_KEYS 48                                       // maximum keys in tree nodes
-#define LEAF_KEYS_MIDPOINT (LEAF_KEYS / 2)                 // halfway point within the node
+constexpr int INNER_KEYS = 64;                             // maximum keys for inner nodes
+constexpr int INNER_KEYS_MIDPOINT = INNER_KEYS / 2;        // halfway point within the node
+constexpr int INNER_KEYS_UPPER = (INNER_KEYS / 2) + 1;     // index where upper half of keys begins
+constexpr int LEAF_KEYS = 48;                              // maximum keys in tree nodes
+constexpr int LEAF_KEYS_MIDPOINT = LEAF_KEYS / 2;          // halfway point within the node
+constexpr int LEAF_MERGE_KEYS = LEAF_KEYS / 4;             // default fill threshold for merging
+                                                           // leaves after removes
+#ifndef LEAF_BLOOM_BITS
+#define LEAF_BLOOM_BITS 512                                // bits in leaf Bloom filters (0 disables)
+#endif
+constexpr int LEAF_BLOOM_PROBES = 3;                       // bits set in filter for each key
+constexpr int LEAF_INLINE_BYTES = 48;                      // bytes per slot for records kept in
+                                                           // leaf (LEAF_FORMAT_INLINE only)
+constexpr int LEAF_READ_ATTEMPTS = 4;                      // optimistic reads before locking leaf
+constexpr int RECOVERY_LEAVES_PER_THREAD = 1024;           // fewest leaves worth a recovery thread
+constexpr int SLAB_CLASSES = 4;                            // count of slab chunk sizes
+constexpr int SLAB_CHUNK_MIN = 64;                         // bytes in smallest chunk (doubles for
+                                                           // each larger class)
+constexpr int SLAB_CHUNKS = 64;                            // chunks in each slab (at most 64)
 
-class KVSlot {
-  public:
-    uint8_t hash() const { return get_ph(); }
-    uint8_t hash_direct(char *p) const { return *((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))); }
-    const char* key() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
-    const char* key_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
-    const uint32_t keysize() const { return get_ks(); }
-    const uint32_t keysize_direct(char *p) const { return *((uint32_t *)(p)); }
-    const char* val() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks() + 1); }
-    const char* val_direct(char *p) const { return (p + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + *((uint32_t *)(p)) + 1); }
-    const uint32_t valsize() const { return get_vs(); }
-    const uint32_t valsize_direct(char *p) const { return *((uint32_t *)(p + sizeof(uint32_t))); }
-    void clear();
-    void set(const uint8_t hash, const string& key, const string& value);
-    void set_ph(uint8_t v) {*((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
-    void set_ph_direct(char *p, uint8_t v) {*((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
-    void set_ks(uint32_t v) {*((uint32_t *)(kv.get())) = v;}
-    void set_ks_direct(char * p, uint32_t v) {*((uint32_t *)(p)) = v;}
-    void set_vs(uint32_t v) {*((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t))) = v;}
-    void set_vs_direct(char *p, uint32_t v) {*((uint32_t *)((char *)(p) + sizeof(uint32_t))) = v;}
-    uint8_t get_ph() const {return *((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t)));}
-    uint8_t get_ph_direct(char *p) const {return *((uint8_t *)((char *)(p) + sizeof(uint32_t) + sizeof(uint32_t)));}
-    uint32_t get_ks() const {return *((uint32_t *)(kv.get()));}
-    uint32_t get_ks_direct(char *p) const {return *((uint32_t *)(p));}
-    uint32_t get_vs() const {return *((uint32_t *)((char *)(kv.get()) + sizeof(uint32_t)));}
-    uint32_t get_vs_direct(char *p) const {return *((uint32_t *)((char *)(p) + sizeof(uint32_t)));}
-    bool empty();
-  private:
-    persistent_ptr<char[]> kv;                             // buffer for key & value
+enum KVLeafFormat : uint8_t {                              // how leaf slots are fingerprinted
+    LEAF_FORMAT_PEARSON8 = 0,                              // 1-byte Pearson hash (original format)
+    LEAF_FORMAT_FAST16 = 1,                                // 2-byte multiplicative hash
+    LEAF_FORMAT_INLINE = 2                                 // as FAST16, with small records stored
+};                                                         // inside leaf instead of on heap
+
+typedef void KVProbeFunction(const uint16_t* hashes,       // compare hashes of all leaf slots at
+                             uint16_t hash,                // once, setting bit N of the masks if
+                             uint64_t* matches,            // slot N holds hash or is empty
+                             uint64_t* empties);
+
+enum KVProbeKernel {                                       // implementations of KVProbeFunction
+    PROBE_PORTABLE,                                        // plain C++, for any CPU
+    PROBE_SSE2,                                            // 16 slots per compare (x86 only)
+    PROBE_AVX2                                             // 32 slots per compare (x86 only)
 };
 
+KVProbeFunction* ProbeKernel(KVProbeKernel kernel);        // null if kernel won't run on this CPU
+
+struct KVKeyHash {                                         // hashes of key from one pass over it
+    uint16_t fingerprint;                                  // kept in leaf hashes (never 0)
+    uint64_t bloom;                                        // selects bits in leaf filters
+};
+
+uint64_t KeyPrefix(const Slice& key);                      // first 8 bytes of key, big-endian so
+                                                           // prefixes sort like keys
+
 struct KVLeaf {
     p<KVSlot> slots[LEAF_KEYS];                            // array of slot containers
     persistent_ptr<KVLeaf> next;                           // next leaf in unsorted list
 };
 
+struct KVInlineLeaf : KVLeaf {                             // leaf of LEAF_FORMAT_INLINE pools
+    char inlined[LEAF_KEYS][LEAF_INLINE_BYTES];            // records small enough to skip heap
+};
+
+struct KVSlab {                                            // persistent slab header, followed by
+    persistent_ptr<KVSlab> next;                           // chunk_count equal-size chunks
+    p<uint32_t> chunk_size;                                // bytes in each chunk
+    p<uint32_t> chunk_count;                               // count of chunks
+};
+
 struct KVRoot {                                            // persistent root object
     persistent_ptr<KVLeaf> head;                           // head of linked list of leaves
+    p<uint8_t> format;                                     // KVLeafFormat used by all leaves
+    p<uint64_t> generation;                                // count of times pool was opened
+    persistent_ptr<char[]> snapshot;                       // volatile tree saved by clean close
+    p<uint64_t> snapshot_size;                             // bytes in snapshot
+    persistent_ptr<KVSlab> slabs;                          // head of linked list of slabs
+};
+
+struct KVSnapshotHeader {                                  // start of snapshot blob
+    uint64_t generation;                                   // generation when snapshot was saved
+    uint64_t key_count;                                    // count of keys in all leaves
+    uint64_t leaf_count;                                   // count of leaf records that follow
+    uint64_t prealloc_count;                               // count of unused leaves that follow
+    uint64_t slab_count;                                   // count of slab records that follow
+    uint32_t leaf_keys;                                    // LEAF_KEYS when saved
+    uint32_t bloom_bits;                                   // LEAF_BLOOM_BITS when saved
+};
+
+struct KVSnapshotLeaf {                                    // leaf record, followed by upper bound
+    PMEMoid leaf;                                          // persistent leaf
+    uint16_t hashes[LEAF_KEYS];                            // fingerprints of keys (0 if empty)
+    uint64_t prefixes[LEAF_KEYS];                          // first 8 bytes of keys
+#if LEAF_BLOOM_BITS > 0
+    uint64_t bloom[LEAF_BLOOM_BITS / 64];                  // filter over keys
+#endif
+    uint32_t upper_size;                                   // bytes of upper bound key
+};
+
+struct KVSnapshotSlab {                                    // slab record
+    PMEMoid slab;                                          // persistent slab
+    uint64_t used;                                         // chunks holding records
 };
 
 struct KVInnerNode;
+struct KVSlabNode;
 
 struct KVNode {                                            // volatile nodes of the tree
     bool is_leaf = false;                                  // indicate inner or leaf node
@@ -107,32 +168,107 @@ struct KVNode {                                            // volatile nodes of
 
 struct KVInnerNode final : KVNode {                        // volatile inner nodes of the tree
     uint8_t keycount;                                      // count of keys in this node
-    string keys[INNER_KEYS + 1];                           // child keys plus one overflow slot
+    string common;                                         // leading bytes shared by all keys
+    string suffixes;                                       // rest of each key, stored back to back
+    uint32_t offsets[INNER_KEYS + 2];                      // where each suffix starts, plus end
+    uint64_t prefixes[INNER_KEYS + 1];                     // KeyPrefix of each suffix
     unique_ptr<KVNode> children[INNER_KEYS + 2];           // child nodes plus one overflow slot
+    Slice suffix(int idx) const;                           // key at index without common bytes
+    string key(int idx) const;                             // full key at index
+    int compare(const Slice& key, int idx) const;          // compare key with key at index
+    int find_child(const Slice& key) const;                // index of child that holds key
+    void assign_keys(const vector<string>& keys);          // replace all keys (children unchanged)
+    void insert_key(int idx, const Slice& key);            // insert key before index
+    void erase_key(int idx);                               // remove key at index (children
+                                                           // unchanged)
     void assert_invariants();
 };
 
 struct KVLeafNode final : KVNode {                         // volatile leaf nodes of the tree
-    uint8_t hashes[LEAF_KEYS];                             // Pearson hashes of keys
-    string keys[LEAF_KEYS];                                // keys stored in this leaf
+    uint16_t hashes[LEAF_KEYS];                            // fingerprints of keys (0 if empty)
+    uint64_t prefixes[LEAF_KEYS];                          // first 8 bytes of keys, big-endian so
+                                                           // they sort like keys (full keys are
+                                                           // only kept in persistent slots)
+#if LEAF_BLOOM_BITS > 0
+    uint64_t bloom[LEAF_BLOOM_BITS / 64];                  // filter over keys (removed keys linger
+#endif                                                     // until leaf is split or recovered)
     persistent_ptr<KVLeaf> leaf;                           // pointer to persistent leaf
+    KVSlabNode* slabs[SLAB_CLASSES];                       // slabs this leaf carves chunks from
+    RWLock lock;                                           // guards hashes, prefixes, filter,
+                                                           // slots & slabs
+    std::atomic<uint64_t> version;                         // odd while writer under shared tree
+};                                                         // lock changes leaf, bumped when done
+
+struct KVSlabNode {                                        // volatile state of persistent slab
+    persistent_ptr<KVSlab> slab;                           // pointer to persistent slab
+    char* chunks;                                          // first chunk
+    uint32_t chunk_size;                                   // bytes in each chunk
+    uint32_t chunk_count;                                  // count of chunks
+    int slab_class;                                        // index of chunk size (-1 if unknown)
+    std::atomic<uint64_t> used;                            // bit N set if chunk N holds a record
+                                                           // (or does not exist)
+    KVLeafNode* owner;                                     // leaf carving chunks (null if none)
+    bool listed;                                           // in free list of its class
+};
+
+struct KVLeafState {                                       // volatile leaf state kept for abort
+    uint16_t hashes[LEAF_KEYS];                            // fingerprints of keys
+    uint64_t prefixes[LEAF_KEYS];                          // first 8 bytes of keys
+#if LEAF_BLOOM_BITS > 0
+    uint64_t bloom[LEAF_BLOOM_BITS / 64];                  // filter over keys
+#endif
+};
+
+struct KVTxChanges {                                       // volatile changes of outermost
+    std::map<KVLeafNode*, KVLeafState> leaves;             // transaction: leaves changed (restored
+                                                           // on abort)
+    long key_delta;                                        // keys added less keys removed
+    vector<persistent_ptr<KVLeaf>> reused;                 // unused leaves taken (returned on abort)
+    vector<char*> allocated;                               // chunks taken (returned on abort)
+    vector<const char*> released;                          // chunks given back (freed on commit)
+    vector<KVSlabNode*> added;                             // slabs created (dropped on abort)
 };
 
 struct KVRecoveredLeaf {                                   // temporary wrapper used for recovery
     unique_ptr<KVLeafNode> leafnode;                       // leaf node being recovered
-    string max_key;                                        // highest sorting key present
-};
+    string max_key;                                        // highest sorting key present (or
+};                                                         // upper bound, if from snapshot)
+
+struct KVRecoveryIndex {                                   // keys of leaves recovered so far, so
+    RWLock lock;                                           // reads during background recovery
+    vector<persistent_ptr<KVLeaf>> chain;                  // scan only leaves not yet indexed
+    vector<std::pair<size_t, size_t>> unindexed;           // chain positions left for each thread
+                                                           // (empty until chain is read)
+    std::unordered_map<string, std::pair<persistent_ptr<KVLeaf>, int>> slots;  // leaf & slot of
+};                                                         // each key indexed
 
 struct KVTreeAnalysis {                                    // tree analysis structure
     size_t leaf_empty;                                     // count of persisted leaves w/o keys
     size_t leaf_prealloc;                                  // count of persisted but unused leaves
     size_t leaf_total;                                     // count of all persisted leaves
+    size_t slot_inline;                                    // count of records stored in leaves
+    size_t slot_slab;                                      // count of records stored in slabs
+    size_t slab_total;                                     // count of all persisted slabs
+    size_t slab_used;                                      // count of slab chunks marked used
+    KVLeafFormat leaf_format;                              // format of persisted leaves
+    bool snapshot_loaded;                                  // opened from snapshot, not leaves
+    size_t lookups;                                        // searches of leaves for a key
+    size_t key_compares;                                   // full key compares while searching
     string path;                                           // path when constructed
 };
 
-class KVTree : public KVEngine {                           // hybrid B+ tree engine
+class KVTree : public KVEngine {                           // hybrid B+ tree engine (thread-safe
+                                                           // except for iterators)
   public:
-    KVTree(const string& path, size_t size);               // default constructor
+    KVTree(const string& path,                             // default constructor
+           size_t size,
+           KVLeafFormat format = LEAF_FORMAT_FAST16,       // format used when creating pool
+           size_t recovery_threads = 0,                    // threads rebuilding leaves (0 for one
+                                                           // per CPU)
+           bool background_recovery = false,               // return before leaves are recovered
+                                                           // (read-only until recovery ends)
+           size_t merge_keys = LEAF_MERGE_KEYS);           // merge leaves holding fewer keys into
+                                                           // a sibling (0 disables)
     ~KVTree();                                             // default destructor
 
     string Engine() final { return ENGINE; }               // engine identifier
@@ -141,55 +277,233 @@ class KVTree : public KVEngine {                           // hybrid B+ tree eng
                  int32_t* valuebytes,
                  const char* key,
                  char* value) final;
-    KVStatus Get(const string& key,                        // append value to std::string
+    KVStatus Get(const Slice& key,                         // append value to std::string
                  string* value) final;
-    KVStatus Put(const string& key,                        // copy value from std::string
-                 const string& value) final;
-    KVStatus Remove(const string& key) final;              // remove value for key
+    KVStatus Get(const Slice& key,                         // pass value to callback without copy
+                 void* context,
+                 KVGetCallback* callback) final;
+    void MultiGet(const vector<string>& keys,              // pass each value found to callback
+                  void* context,
+                  KVMultiGetCallback* callback) final;
+    KVStatus Put(const Slice& key,                         // copy value from slice
+                 const Slice& value) final;
+    KVStatus Remove(const Slice& key) final;               // remove value for key
+    KVStatus Write(const WriteBatch& batch) final;         // apply all updates or none
+    KVIterator* NewIterator() final;                       // ordered iterator over all keys
 
     PMEMoid GetRootOid() final;
     PMEMobjpool* GetPool() final;
 
     void Analyze(KVTreeAnalysis& analysis);                // report on internal state & stats
 
+    void AllKeys(void* context,                            // pass each key to callback
+                 KVAllKeysCallback* callback) final;
+    void AllKeyValues(void* context,                       // pass each key & value to callback
+                      KVAllKeyValuesCallback* callback) final;
+
     void ListAllKeyValuePairs(vector<string>& kv_pairs) final;      // list all the key value pairs
 
     void ListAllKeys(vector<string>& keys) final;      // list all the keys
 
-    size_t TotalNumKeys() final;
+    size_t TotalNumKeys() final;                           // count of keys in constant time
 
   protected:
-    KVLeafNode* LeafSearch(const string& key);             // find node for key
+    void ApplyPut(const Slice& key,                        // put value, letting errors propagate
+                  const Slice& value);
+    void ApplyRemove(const Slice& key);                    // remove key without merging leaves,
+                                                           // letting errors propagate
+    void LeafMakeRoom(const vector<WriteBatchOp>& ops);    // add or split leaves until batch fits
+                                                           // (before transaction)
+    void LeafSave(KVLeafNode* leafnode);                   // keep leaf state for abort (inside
+                                                           // SlotTx)
+    void LeafUndo(KVTxChanges& changes);                   // restore leaves of aborted transaction
+    static KVProbeFunction* const LeafProbe;               // fastest probe kernel for this CPU
+    static Slice LeafKey(const KVLeafNode* leafnode,       // key held by occupied slot
+                         int slot);
+    persistent_ptr<KVLeaf> LeafAllocate();                 // reuse unused leaf or add new one
+                                                           // (inside transaction)
+    char* LeafInline(const persistent_ptr<KVLeaf>& leaf,   // inline region for slot (null if leaf
+                     int slot);                            // format has none)
+    static bool LeafKeyLess(const KVLeafNode* leafnode,    // compare keys held by occupied slots
+                            int lhs,
+                            int rhs);
+    int LeafFindSlot(const KVLeafNode* leafnode,           // find slot holding key (-1 if none)
+                     const KVKeyHash& hash,
+                     const Slice& key,
+                     uint64_t* empties = nullptr);         // mask of empty slots, if wanted
+    int LeafFindValue(const KVLeafNode* leafnode,          // find value without leaf lock (-1 if
+                      const KVKeyHash& hash,               // leaf changed meanwhile, 0 if none,
+                      const Slice& key,                    // 1 if found), value may change until
+                      uint64_t* version,                   // version is checked by LeafUnchanged
+                      Slice* value);
+    static bool LeafUnchanged(const KVLeafNode* leafnode,  // no writer changed leaf since version
+                              uint64_t version);           // was read
+    void VisitAll(bool values,                             // copy records leaf by leaf in key
+                  const std::function<bool(const string&,  // order, visiting copies with no lock
+                                           const string&)>& visit);  // held (stops on false)
+    KVLeafNode* LeafSearch(const Slice& key);              // find node for key
+    KVLeafNode* LeafSearch(const Slice& key,               // find node for key, and inner node &
+                           const KVInnerNode** upper,      // index of highest key that node can
+                           int* upper_idx);                // hold (null if none)
+    bool LeafClearSlotForKey(KVLeafNode* leafnode,         // clear slot for matching key (false
+                             const Slice& key);            // if not found)
+    static int LeafKeyCount(const KVLeafNode* leafnode);   // count of occupied slots
+    int LeafMergeSibling(KVLeafNode* leafnode);            // sibling to merge underfull leaf with
+                                                           // (-1 if leaf isn't underfull or no
+                                                           // sibling has room)
+    bool LeafMergeSparse(KVLeafNode* leafnode);            // merge underfull leaf with sibling
+                                                           // (false if neither has room)
     void LeafFillEmptySlot(KVLeafNode* leafnode,           // write first unoccupied slot found
-                           uint8_t hash,
-                           const string& key,
-                           const string& value);
+                           const KVKeyHash& hash,
+                           const Slice& key,
+                           const Slice& value);
     bool LeafFillSlotForKey(KVLeafNode* leafnode,          // write slot for matching key if found
-                            uint8_t hash,
-                            const string& key,
-                            const string& value);
+                            const KVKeyHash& hash,
+                            const Slice& key,
+                            const Slice& value);
     void LeafFillSpecificSlot(KVLeafNode* leafnode,        // write slot at specific index
-                              uint8_t hash,
-                              const string& key,
-                              const string& value,
+                              const KVKeyHash& hash,
+                              const Slice& key,
+                              const Slice& value,
                               int slot);
     void LeafSplitFull(KVLeafNode* leafnode,               // split full leaf into two leaves
-                       uint8_t hash,
-                       const string& key,
-                       const string& value);
+                       const KVKeyHash& hash,
+                       const Slice& key,
+                       const Slice& value);
+    void LeafSplit(KVLeafNode* leafnode,                   // move keys above split key to new
+                   string split_key,                       // leaf, then write record if hash is
+                   const KVKeyHash* hash = nullptr,        // given
+                   const Slice& key = Slice(),
+                   const Slice& value = Slice());
     void InnerUpdateAfterSplit(KVNode* node,               // update parents after leaf split
                                unique_ptr<KVNode> newnode,
                                string* split_key);
+    void InnerUpdateAfterMerge(KVInnerNode* inner,         // drop separator & merged child, then
+                               int idx,                    // give away or borrow a child so no
+                               int child);                 // node is left without keys
+    void InnerBuild(vector<KVRecoveredLeaf>& leaves);      // build inner nodes over sorted leaves
+    KVKeyHash KeyHash(const Slice& key);                   // calculate fingerprint for leaf format
+                                                           // & filter hash
     uint8_t PearsonHash(const char* data,                  // calculate 1-byte hash for string
                         size_t size);
+    uint64_t BloomHash(const Slice& key);                  // calculate hash for leaf filters
+    void LeafBloomAdd(KVLeafNode* leafnode,                // add key to leaf filter
+                      uint64_t bloomhash);
+    bool LeafBloomMayContain(const KVLeafNode* leafnode,   // false if key is surely not in leaf
+                             uint64_t bloomhash);
+    void LeafBloomRebuild(KVLeafNode* leafnode);           // drop removed keys from leaf filter
+    bool SlotFits(const char* buffer,                      // true if record of given size can
+                  const char* inlined,                     // replace one in buffer
+                  size_t size);
+    void SlotRelease(char* buffer,                         // free record buffer unless inline
+                     const char* inlined,                  // (inside transaction)
+                     size_t size);
+    void SlotTx(const std::function<void()>& func);        // run transaction, committing or
+                                                           // undoing chunk changes with it
+    static int SlabClass(size_t size);                     // class for record (-1 if too large)
+    KVSlabNode* SlabFind(const char* buffer);              // slab holding buffer (null if none)
+    void SlabReserve(KVLeafNode* leafnode,                 // give leaf a slab with an unused chunk
+                     size_t size);                         // for record (before transaction)
+    char* SlabAllocate(KVLeafNode* leafnode,               // carve chunk from leaf's slab (null if
+                       size_t size);                       // none reserved)
+    bool SlabFree(const char* buffer);                     // return chunk to its slab, after
+                                                           // commit if in SlotTx (false if
+                                                           // buffer is not in a slab)
+    void SlabDisown(KVLeafNode* leafnode);                 // give up slabs of leaf not added
+    void SlabUndo(const KVTxChanges& changes);             // drop changes of aborted transaction
+    KVSlabNode* SlabAdd(const persistent_ptr<KVSlab>& slab, // track persistent slab
+                        uint64_t used);
+    void SlabLoad();                                       // track all persistent slabs as unused
+    void SlabMark(const char* buffer);                     // mark chunk used (while recovering)
+    void SlabListFree();                                   // list unowned slabs with unused chunks
     void Recover();                                        // reload state from persistent pool
+    bool LeafScanForKey(const persistent_ptr<KVLeaf>& leaf, // find key by scanning persistent
+                        const Slice& key,                  // leaf (while recovering)
+                        KVSlot* kvslot);
+    void LeafScanForKeys(const persistent_ptr<KVLeaf>& leaf, // find sorted keys by scanning
+                         const vector<string>& keys,       // persistent leaf (while recovering)
+                         const vector<int32_t>& order,
+                         void* context,
+                         KVMultiGetCallback* callback);
+    void RecoverInBackground();                            // recover on thread, then use index
+    bool RecoveryFind(const Slice& key,                    // find key in leaves recovered so far,
+                      KVSlot* kvslot);                     // else scan the others
+    void RecoveryFindAll(const vector<string>& keys,       // find sorted keys in leaves recovered
+                         const vector<int32_t>& order,     // so far, else scan the others
+                         void* context,
+                         KVMultiGetCallback* callback);
+    void RecoveryUnindexed(                                // list leaves not indexed yet (with
+        vector<persistent_ptr<KVLeaf>>* leaves);           // index lock held)
+    bool WaitRecovered();                                  // block until recovery ends (false if
+                                                           // it failed)
+    bool SnapshotLoad();                                   // reload state from snapshot if valid,
+                                                           // then drop snapshot
+    bool SnapshotRead(const char* data,                    // rebuild volatile tree from snapshot
+                      size_t size,
+                      uint64_t generation);
+    void SnapshotSave();                                   // save volatile tree for next open
+    void SnapshotLeaves(KVNode* node,                      // list leaves in key order, with the
+                        const string& upper,               // highest key each can hold
+                        vector<std::pair<KVLeafNode*, string>>* leaves);
+    void RecoverLeaves(size_t part,                        // rebuild part of chain, sorted by
+                       const persistent_ptr<KVLeaf>* first, // highest key, and keep empty leaves
+                       const persistent_ptr<KVLeaf>* last, // for reuse (indexing keys of each
+                       vector<KVRecoveredLeaf>* leaves,    // leaf if recovering in background)
+                       vector<persistent_ptr<KVLeaf>>* prealloc,
+                       size_t* keys);
   private:
+    friend class KVTreeIterator;                           // iterator walks volatile nodes
     KVTree(const KVTree&);                                 // prevent copying
     void operator=(const KVTree&);                         // prevent assigning
     vector<persistent_ptr<KVLeaf>> leaves_prealloc;        // persisted but unused leaves
     const string pmpath;                                   // path when constructed
     pool<KVRoot> pmpool;                                   // pool for persistent root
+    KVLeafFormat leaf_format;                              // format of persisted leaves
+    const size_t recovery_threads;                         // threads rebuilding leaves (0 if auto)
+    const size_t merge_keys;                               // fill threshold for merging leaves
+    bool snapshot_loaded;                                  // opened from snapshot, not leaves
+    std::atomic<bool> recovered;                           // index is ready (else scan leaves)
+    bool recovering;                                       // background recovery is running
+    std::mutex recovery_mutex;                             // guards recovering
+    std::condition_variable recovery_done;                 // signaled when recovery ends
+    std::thread recovery_thread;                           // rebuilds index in background
+    unique_ptr<KVRecoveryIndex> recovery_index;            // keys indexed so far (while recovering
+                                                           // in background)
     unique_ptr<KVNode> tree_top;                           // pointer to uppermost inner node
+    std::atomic<size_t> key_count;                         // count of keys in all leaves
+    std::atomic<size_t> lookups;                           // searches of leaves (if DO_STATS)
+    std::atomic<size_t> key_compares;                      // full key compares (if DO_STATS)
+    StripedRWLock tree_lock;                               // shared to search & fill leaves,
+                                                           // exclusive to change tree structure
+    std::map<const char*, unique_ptr<KVSlabNode>> slabs;   // all slabs, by address of first chunk
+    vector<KVSlabNode*> slabs_free[SLAB_CLASSES];          // unowned slabs with unused chunks
+    RWLock slab_lock;                                      // shared to find slabs, exclusive to add
+                                                           // slabs or change owners & lists
+};
+
+class KVTreeIterator final : public KVIterator {           // iterator over volatile tree nodes
+  public:
+    explicit KVTreeIterator(KVTree* tree);                 // default constructor
+
+    bool Valid() final { return leafnode != nullptr; }     // positioned at a key?
+    void SeekToFirst() final;                              // position at lowest key
+    void SeekToLast() final;                               // position at highest key
+    void Seek(const Slice& key) final;                     // position at first key >= given key
+    void Next() final;                                     // advance to next higher key
+    void Prev() final;                                     // back up to next lower key
+    Slice Key() final;                                     // current key (valid until moved)
+    Slice Value() final;                                   // current value (valid until moved)
+  private:
+    static KVLeafNode* LeafDescend(KVNode* node,           // find lowest or highest leaf in subtree
+                                   bool highest);
+    static KVLeafNode* LeafSibling(KVNode* node,           // find adjacent leaf (null if none)
+                                   bool higher);
+    void LeafLoad(KVLeafNode* node,                        // sort slots of first leaf with keys,
+                  bool higher);                            // moving in given direction
+    KVTree* tree;                                          // tree being iterated
+    KVLeafNode* leafnode;                                  // current leaf (null if not valid)
+    vector<int> slots;                                     // occupied slots in key order
+    size_t pos;                                            // current index into sorted slots
 };
 
 } // namespace kvtree
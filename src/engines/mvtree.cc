@@ -44,13 +44,15 @@
 namespace pmemkv {
 namespace mvtree {
 
+static thread_local KVTxChanges* tx_changes = nullptr;                   // set inside LeafTx
 
 static const string PMPATH_NO_PATH = "nopath";
 // ===============================================================================================
 // MVTree METHODS
 // ===============================================================================================
 
-MVTree::MVTree (const string& path, size_t size): pmpath(path) {
+MVTree::MVTree (const string& path, size_t size, bool background_recovery)
+    : pmpath(path), recovered(false), recovering(false) {
   if ((access(path.c_str(), F_OK) != 0) && (size > 0)) {
     LOG("Creating filesystem pool, path=" << path << ", size=" << to_string(size));
     pool<KVRoot> pop = pool<KVRoot>::create(path.c_str(), LAYOUT, size, S_IRWXU);
@@ -62,12 +64,18 @@ MVTree::MVTree (const string& path, size_t size): pmpath(path) {
     pmpool = pop;
     kv_root = pop.get_root();
   }
-  Recover();
+  if (background_recovery) {
+    RecoverInBackground();                                               // reads use index of
+  } else {                                                               // leaves recovered so far
+    Recover();
+    recovered = true;
+  }
   LOG("Opened ok");
 }
 
 // For this ctor, require pop is already opened, and we won't call pop.close in dtor
-MVTree::MVTree (PMEMobjpool* pop , PMEMoid oid, size_t size): pmpool(pop), pmpath(PMPATH_NO_PATH) {
+MVTree::MVTree (PMEMobjpool* pop , PMEMoid oid, size_t size)
+    : pmpool(pop), pmpath(PMPATH_NO_PATH), recovered(false), recovering(false) {
   if(pop == nullptr) {
     throw std::invalid_argument( "received PMEMobjpool* nullptr" );
   }
@@ -82,11 +90,13 @@ MVTree::MVTree (PMEMobjpool* pop , PMEMoid oid, size_t size): pmpool(pop), pmpat
   }
 
   Recover();
+  recovered = true;
   LOG("Opened ok");
 }
 
 
-MVTree::MVTree (const string& path, PMEMoid oid, size_t size): pmpath(path) {
+MVTree::MVTree (const string& path, PMEMoid oid, size_t size)
+    : pmpath(path), recovered(false), recovering(false) {
   if ((access(path.c_str(), F_OK) != 0) && (size > 0)) {
     if(!OID_IS_NULL(oid)) {
       LOG("Invalid Parameters, new path with an existing PMEMoid is not allowed.");
@@ -112,11 +122,13 @@ MVTree::MVTree (const string& path, PMEMoid oid, size_t size): pmpath(path) {
   }
 
   Recover();
+  recovered = true;
   LOG("Opened ok");
 }
 
 MVTree::~MVTree() {
   LOG("Closing");
+  if (recovery_thread.joinable()) recovery_thread.join();
   if(PMPATH_NO_PATH != pmpath) {
     pmpool.close();
   }
@@ -138,6 +150,8 @@ PMEMobjpool* MVTree::GetPool() {
 
 void MVTree::Analyze(KVTreeAnalysis &analysis) {
   LOG("Analyzing");
+  WaitRecovered();
+  WriteGuard tree_guard(tree_lock);
   analysis.leaf_empty = 0;
   analysis.leaf_prealloc = leaves_prealloc.size();
   analysis.leaf_total = 0;
@@ -160,16 +174,120 @@ void MVTree::Analyze(KVTreeAnalysis &analysis) {
   LOG("Analyzed ok");
 }
 
+void MVTree::AllKeys(void *context, KVAllKeysCallback *callback) {
+  LOG("AllKeys");
+  VisitAll(false, [&](const string &key, const string &) {
+             return (*callback)(context, (int32_t) key.size(), key.data());
+           });
+}
+
+void MVTree::AllKeyValues(void *context, KVAllKeyValuesCallback *callback) {
+  LOG("AllKeyValues");
+  VisitAll(true, [&](const string &key, const string &value) {
+             return (*callback)(context, (int32_t) key.size(), key.data(),
+                                (int32_t) value.size(), value.data());
+           });
+}
+
+void MVTree::ListAllKeyValuePairs(vector<string> &kv_pairs) {
+  LOG("Listing");
+  AllKeyValues(&kv_pairs, [](void *context, int32_t keybytes, const char *key,
+                             int32_t valuebytes, const char *value) {
+    auto kv_pairs = (vector<string> *) context;
+    kv_pairs->push_back(string(key, (size_t) keybytes));
+    kv_pairs->push_back(string(value, (size_t) valuebytes));
+    return true;
+  });
+  LOG("List ok");
+}
+
+void MVTree::ListAllKeys(vector<string> &keys) {
+  LOG("Listing");
+  AllKeys(&keys, [](void *context, int32_t keybytes, const char *key) {
+    ((vector<string> *) context)->push_back(string(key, (size_t) keybytes));
+    return true;
+  });
+  LOG("List ok");
+}
+
+void MVTree::VisitAll(const bool values, const std::function<bool(const string &, const string &)> &visit) {
+  vector<std::pair<string, string>> records;                             // copied from one leaf
+  if (!WaitRecovered()) {                                                // writers are blocked, so
+    for (auto leaf = kv_root->head; leaf; leaf = leaf->next) {           // walk persistent leaves
+      records.clear();
+      for (int slot = LEAF_KEYS; slot--;) {
+        auto kvslot = leaf->slots[slot].get_ro();
+        if (kvslot.empty() || kvslot.hash() == 0) continue;
+        records.emplace_back(string(kvslot.key(), kvslot.keysize()),
+                             values ? string(kvslot.val(), kvslot.valsize()) : string());
+      }
+      for (auto &record : records) if (!visit(record.first, record.second)) return;
+    }
+    return;
+  }
+  string from;                                                           // lowest key not visited
+  bool more = true;
+  while (more) {
+    records.clear();
+    {   // copy one leaf, so callbacks run without locks and may call back into this tree
+      ReadGuard tree_guard(tree_lock);
+      const string *upper;
+      auto leafnode = LeafSearch(from, &upper);
+      if (!leafnode) return;
+      ReadGuard leaf_guard(leafnode->lock);
+      for (int slot = LEAF_KEYS; slot--;) {
+        if (leafnode->hashes[slot] == 0) continue;
+        if (leafnode->keys[slot].compare(from) < 0) continue;            // visited already
+        auto &kvslot = leafnode->leaf->slots[slot].get_ro();
+        records.emplace_back(leafnode->keys[slot],
+                             values ? string(kvslot.val(), kvslot.valsize()) : string());
+      }
+      more = upper != nullptr;
+      if (more) {
+        from = *upper;                                                   // next leaf holds keys
+        from.push_back('\0');                                           // above highest key here
+      }
+    }
+    for (auto &record : records) if (!visit(record.first, record.second)) return;
+  }
+}
+
 KVStatus MVTree::Get(const int32_t limit, const int32_t keybytes, int32_t *valuebytes,
                          const char *key, char *value) {
-  auto ckey = std::string(key, keybytes);
-  LOG("Get for key=" << ckey);
+  const Slice ckey(key, (size_t) keybytes);
+  LOG("Get for key=" << ckey.ToString());
+  ReadGuard tree_guard(tree_lock);
+  if (!recovered) {                                                      // index not ready yet
+    KVSlot kv;
+    if (!RecoveryFind(ckey, &kv)) return NOT_FOUND;
+    *valuebytes = kv.valsize();
+    if ((int32_t) kv.valsize() > limit) return FAILED;
+    memcpy(value, kv.val(), kv.valsize());
+    return OK;
+  }
   auto leafnode = LeafSearch(ckey);
   if (leafnode) {
     const uint8_t hash = PearsonHash(key, (size_t) keybytes);
-    for (int slot = LEAF_KEYS; slot--;) {
+    for (int attempt = 0; attempt < LEAF_READ_ATTEMPTS; attempt++) {      // read without leaf lock
+      uint64_t version;
+      Slice found;
+      const int result = LeafFindValue(leafnode, hash, ckey, &version, &found);
+      if (result < 0) continue;
+      if (result == 0) {
+        LOG("   could not find key");
+        return NOT_FOUND;
+      }
+      const bool fits = (int32_t) found.size() <= limit;
+      if (fits) memcpy(value, found.data(), found.size());
+      if (!LeafUnchanged(leafnode, version)) continue;                   // value may be torn
+      *valuebytes = (int32_t) found.size();
+      LOG("   found value, size=" << to_string(found.size()));
+      return fits ? OK : FAILED;
+    }
+    ReadGuard leaf_guard(leafnode->lock);                                // writers kept changing
+    for (int slot = LEAF_KEYS; slot--;) {                                // leaf, so wait them out
       if (leafnode->hashes[slot] == hash) {
-        if (leafnode->keys[slot].compare(ckey) == 0) {
+        if (ckey.compare(leafnode->keys[slot]) == 0) {
           auto kv = leafnode->leaf->slots[slot].get_ro();
           auto vs = kv.valsize();
           *valuebytes = vs;
@@ -189,17 +307,70 @@ KVStatus MVTree::Get(const int32_t limit, const int32_t keybytes, int32_t *value
   return NOT_FOUND;
 }
 
-KVStatus MVTree::Get(const string &key, string *value) {
-  LOG("Get for key=" << key.c_str());
+KVStatus MVTree::Get(const Slice &key, string *value) {
+  LOG("Get for key=" << key.ToString());
+  ReadGuard tree_guard(tree_lock);
+  if (!recovered) {                                                      // index not ready yet
+    KVSlot kv;
+    if (!RecoveryFind(key, &kv)) return NOT_FOUND;
+    value->append(kv.val(), kv.valsize());
+    return OK;
+  }
+  auto leafnode = LeafSearch(key);
+  if (leafnode) {
+    const uint8_t hash = PearsonHash(key.data(), key.size());
+    for (int attempt = 0; attempt < LEAF_READ_ATTEMPTS; attempt++) {      // read without leaf lock
+      uint64_t version;
+      Slice found;
+      const int result = LeafFindValue(leafnode, hash, key, &version, &found);
+      if (result < 0) continue;
+      if (result == 0) {
+        LOG("   could not find key");
+        return NOT_FOUND;
+      }
+      const size_t size = value->size();
+      value->append(found.data(), found.size());
+      if (LeafUnchanged(leafnode, version)) {
+        LOG("   found value, size=" << to_string(found.size()));
+        return OK;
+      }
+      value->resize(size);                                               // value may be torn
+    }
+    ReadGuard leaf_guard(leafnode->lock);                                // writers kept changing
+    for (int slot = LEAF_KEYS; slot--;) {                                // leaf, so wait them out
+      if (leafnode->hashes[slot] == hash) {
+        if (key.compare(leafnode->keys[slot]) == 0) {
+          auto kv = leafnode->leaf->slots[slot].get_ro();
+          LOG("   found value, slot=" << slot << ", size=" << to_string(kv.valsize()));
+          value->append(kv.val(), kv.valsize());
+          return OK;
+        }
+      }
+    }
+  }
+  LOG("   could not find key");
+  return NOT_FOUND;
+}
+
+KVStatus MVTree::Get(const Slice &key, void *context, KVGetCallback *callback) {
+  LOG("Get for key=" << key.ToString());
+  ReadGuard tree_guard(tree_lock);
+  if (!recovered) {                                                      // index not ready yet
+    KVSlot kv;
+    if (!RecoveryFind(key, &kv)) return NOT_FOUND;
+    (*callback)(context, (int32_t) kv.valsize(), kv.val());
+    return OK;
+  }
   auto leafnode = LeafSearch(key);
   if (leafnode) {
-    const uint8_t hash = PearsonHash(key.c_str(), key.size());
+    ReadGuard leaf_guard(leafnode->lock);
+    const uint8_t hash = PearsonHash(key.data(), key.size());
     for (int slot = LEAF_KEYS; slot--;) {
       if (leafnode->hashes[slot] == hash) {
-        if (leafnode->keys[slot].compare(key) == 0) {
+        if (key.compare(leafnode->keys[slot]) == 0) {
           auto kv = leafnode->leaf->slots[slot].get_ro();
           LOG("   found value, slot=" << slot << ", size=" << to_string(kv.valsize()));
-          value->append(kv.val(), kv.valsize());
+          (*callback)(context, (int32_t) kv.valsize(), kv.val());
           return OK;
         }
       }
@@ -209,35 +380,63 @@ KVStatus MVTree::Get(const string &key, string *value) {
   return NOT_FOUND;
 }
 
-KVStatus MVTree::Put(const string &key, const string &value) {
-  LOG("Put key=" << key.c_str() << ", value.size=" << to_string(value.size()));
-  try {
-    const uint8_t hash = PearsonHash(key.c_str(), key.size());
-    auto leafnode = LeafSearch(key);
+void MVTree::MultiGet(const vector<string> &keys, void *context, KVMultiGetCallback *callback) {
+  LOG("MultiGet for count=" << to_string(keys.size()));
+  // visit keys in sorted order, so keys that share a leaf are resolved together
+  vector<int32_t> order(keys.size());
+  for (int32_t i = 0; i < (int32_t) keys.size(); i++) order[i] = i;
+  std::sort(order.begin(), order.end(), [&](int32_t lhs, int32_t rhs) {
+              return keys[lhs].compare(keys[rhs]) < 0;
+            });
+  ReadGuard tree_guard(tree_lock);
+  if (!recovered) {                                                      // index not ready yet
+    RecoveryFindAll(keys, order, context, callback);
+    return;
+  }
+  size_t pos = 0;
+  while (pos < order.size()) {
+    const string *upper;
+    auto leafnode = LeafSearch(keys[order[pos]], &upper);
     if (!leafnode) {
-      LOG("   adding head leaf");
-      unique_ptr<KVLeafNode> new_node(new KVLeafNode());
-      new_node->is_leaf = true;
-      transaction::exec_tx(pmpool, [&] {
-                                     if (!leaves_prealloc.empty()) {
-                                       new_node->leaf = leaves_prealloc.back();
-                                       leaves_prealloc.pop_back();
-                                     } else {
-                                       auto root = kv_root;
-                                       auto old_head = root->head;
-                                       auto new_leaf = make_persistent<KVLeaf>();
-                                       root->head = new_leaf;
-                                       new_leaf->next = old_head;
-                                       new_node->leaf = new_leaf;
-                                     }
-                                     LeafFillSpecificSlot(new_node.get(), hash, key, value, 0);
-                                   });
-      tree_top = move(new_node);
-    } else if (LeafFillSlotForKey(leafnode, hash, key, value)) {
-      // nothing else to do
-    } else {
-      LeafSplitFull(leafnode, hash, key, value);
+      LOG("   head not present");
+      return;
     }
+    ReadGuard leaf_guard(leafnode->lock);
+    do {
+      const string &key = keys[order[pos]];
+      const uint8_t hash = PearsonHash(key.data(), key.size());
+      for (int slot = LEAF_KEYS; slot--;) {
+        if (leafnode->hashes[slot] == hash) {
+          if (key.compare(leafnode->keys[slot]) == 0) {
+            auto kv = leafnode->leaf->slots[slot].get_ro();
+            (*callback)(context, order[pos], (int32_t) kv.valsize(), kv.val());
+            break;  // no duplicate keys allowed
+          }
+        }
+      }
+      pos++;
+    } while (pos < order.size() && (upper == nullptr || keys[order[pos]].compare(*upper) <= 0));
+  }
+  LOG("   MultiGet ok");
+}
+
+KVStatus MVTree::Put(const Slice &key, const Slice &value) {
+  LOG("Put key=" << key.ToString() << ", value.size=" << to_string(value.size()));
+  if (!WaitRecovered()) return FAILED;                                   // leaves must be indexed
+  try {
+    {   // fill slot in existing leaf, in parallel with updates to other leaves
+      ReadGuard tree_guard(tree_lock);
+      auto leafnode = LeafSearch(key);
+      if (leafnode) {
+        WriteGuard leaf_guard(leafnode->lock);
+        VersionGuard version_guard(leafnode->version);                   // readers retry meanwhile
+        if (LeafFillSlotForKey(leafnode, PearsonHash(key.data(), key.size()), key, value)) {
+          return OK;
+        }
+      }
+    }
+    WriteGuard tree_guard(tree_lock);                                    // leaf must be added or split
+    ApplyPut(key, value);
     return OK;
   } catch (pmem::transaction_alloc_error) {
     return FAILED;
@@ -246,36 +445,219 @@ KVStatus MVTree::Put(const string &key, const string &value) {
   }
 }
 
-KVStatus MVTree::Remove(const string &key) {
-  LOG("Remove key=" << key.c_str());
+KVStatus MVTree::Remove(const Slice &key) {
+  LOG("Remove key=" << key.ToString());
+  if (!WaitRecovered()) return FAILED;                                   // leaves must be indexed
+  ReadGuard tree_guard(tree_lock);
   auto leafnode = LeafSearch(key);
   if (!leafnode) {
     LOG("   head not present");
     return OK;
   }
-  const uint8_t hash = PearsonHash(key.c_str(), key.size());
-  for (int slot = LEAF_KEYS; slot--;) {
-    if (leafnode->hashes[slot] == hash) {
-      if (leafnode->keys[slot].compare(key) == 0) {
-        LOG("   freeing slot=" << slot);
-        leafnode->hashes[slot] = 0;
-        leafnode->keys[slot].clear();
-        auto leaf = leafnode->leaf;
-        transaction::exec_tx(pmpool, [&] {
-                                       leaf->slots[slot].get_rw().clear();
-                                     });
-        break;  // no duplicate keys allowed
-      }
-    }
-  }
+  WriteGuard leaf_guard(leafnode->lock);
+  VersionGuard version_guard(leafnode->version);                         // readers retry meanwhile
+  LeafClearSlotForKey(leafnode, key);
   return OK;
 }
 
+KVStatus MVTree::Write(const WriteBatch &batch) {
+  LOG("Write batch.count=" << to_string(batch.Count()));
+  if (!WaitRecovered()) return FAILED;                                   // leaves must be indexed
+  WriteGuard tree_guard(tree_lock);
+  try {
+    LeafMakeRoom(batch.Ops());                                           // so batch never splits
+    LeafTx(pmpool, [&] {                                                 // nested tx calls join this one
+                     for (auto &op : batch.Ops()) {
+                       if (op.remove) {
+                         ApplyRemove(op.key);
+                       } else {
+                         ApplyPut(op.key, op.value);
+                       }
+                     }
+                   });
+    return OK;
+  } catch (pmem::transaction_alloc_error) {
+    return FAILED;                                                       // leaves were restored
+  } catch (pmem::transaction_error) {
+    return FAILED;
+  }
+}
+
+KVIterator *MVTree::NewIterator() {
+  LOG("NewIterator");
+  WaitRecovered();                                                       // iterator walks index
+  return new MVTreeIterator(this);
+}
+
+size_t MVTree::TotalNumKeys() {
+  WaitRecovered();                                                       // counted by recovery
+  return key_count;
+}
+
 // ===============================================================================================
 // PROTECTED LEAF METHODS
 // ===============================================================================================
 
-KVLeafNode *MVTree::LeafSearch(const string &key) {
+void MVTree::ApplyPut(const Slice &key, const Slice &value) {
+  const uint8_t hash = PearsonHash(key.data(), key.size());
+  auto leafnode = LeafSearch(key);
+  if (!leafnode) {
+    LOG("   adding head leaf");
+    assert(!tx_changes);                                                 // batch added leaf first
+    unique_ptr<KVLeafNode> new_node(new KVLeafNode());
+    new_node->is_leaf = true;
+    LeafTx(pmpool, [&] {
+                     new_node->leaf = LeafAllocate();
+                     LeafFillSpecificSlot(new_node.get(), hash, key, value, 0);
+                   });
+    tree_top = move(new_node);
+  } else if (LeafFillSlotForKey(leafnode, hash, key, value)) {
+    // nothing else to do
+  } else {
+    assert(!tx_changes);                                                 // batch split leaf first
+    LeafSplitFull(leafnode, hash, key, value);
+  }
+}
+
+void MVTree::ApplyRemove(const Slice &key) {
+  auto leafnode = LeafSearch(key);
+  if (!leafnode) {
+    LOG("   head not present");
+    return;
+  }
+  LeafClearSlotForKey(leafnode, key);
+}
+
+void MVTree::LeafMakeRoom(const vector<WriteBatchOp> &ops) {
+  if (!tree_top && !ops.empty()) {
+    LOG("   adding head leaf");
+    unique_ptr<KVLeafNode> new_node(new KVLeafNode());
+    new_node->is_leaf = true;
+    LeafTx(pmpool, [&] {
+                     new_node->leaf = LeafAllocate();
+                   });
+    tree_top = move(new_node);
+  }
+
+  // split leaves that can't take all new keys, at median of old & new keys, until none is left
+  bool split = true;
+  while (split) {
+    split = false;
+    std::map<KVLeafNode *, vector<string>> added;                        // new keys for each leaf
+    for (auto &op : ops) {
+      if (op.remove) continue;                                           // removes may not free
+      auto leafnode = LeafSearch(op.key);                                // slots before puts
+      const uint8_t hash = PearsonHash(op.key.data(), op.key.size());
+      bool found = false;
+      for (int slot = LEAF_KEYS; slot-- && !found;) {
+        found = leafnode->hashes[slot] == hash && op.key.compare(leafnode->keys[slot]) == 0;
+      }
+      if (!found) added[leafnode].push_back(op.key.ToString());
+    }
+    for (auto &entry : added) {
+      KVLeafNode *leafnode = entry.first;
+      vector<string> &keys = entry.second;
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+      size_t count = keys.size();
+      for (int slot = LEAF_KEYS; slot--;) {
+        if (leafnode->hashes[slot] != 0) count++;
+      }
+      if (count <= LEAF_KEYS) continue;
+      for (int slot = LEAF_KEYS; slot--;) {
+        if (leafnode->hashes[slot] != 0) keys.push_back(leafnode->keys[slot]);
+      }
+      std::sort(keys.begin(), keys.end());
+      LeafSplit(leafnode, keys[(keys.size() - 1) / 2]);                  // leaves stay valid, so
+      split = true;                                                      // others can be split too
+    }
+  }
+}
+
+void MVTree::LeafTx(pool_base &pop, const std::function<void()> &func) {
+  if (tx_changes) {                                                      // nested transaction, so
+    transaction::exec_tx(pop, func);                                     // outermost one restores
+    return;                                                              // leaves
+  }
+  KVTxChanges changes;
+  tx_changes = &changes;
+  try {
+    transaction::exec_tx(pop, func);
+  } catch (...) {
+    tx_changes = nullptr;
+    LeafUndo(changes);
+    throw;
+  }
+  tx_changes = nullptr;
+}
+
+void MVTree::LeafUndo(KVTxChanges &changes) {
+  for (auto &entry : changes.leaves) {                                   // slots were rolled back,
+    memcpy(entry.first->hashes, entry.second.hashes, sizeof(entry.second.hashes));  // so leaves
+    for (int slot = LEAF_KEYS; slot--;) {                                // match them again
+      entry.first->keys[slot] = move(entry.second.keys[slot]);
+    }
+  }
+  for (auto &entry : changes.key_deltas) entry.first->key_count -= entry.second;
+  for (auto it = changes.reused.rbegin(); it != changes.reused.rend(); ++it) {
+    it->first->leaves_prealloc.push_back(it->second);
+  }
+}
+
+void MVTree::LeafSave(KVLeafNode *leafnode) {
+  if (!tx_changes || tx_changes->leaves.count(leafnode)) return;
+  KVLeafState &state = tx_changes->leaves[leafnode];
+  memcpy(state.hashes, leafnode->hashes, sizeof(state.hashes));
+  for (int slot = LEAF_KEYS; slot--;) state.keys[slot] = leafnode->keys[slot];
+}
+
+persistent_ptr<KVLeaf> MVTree::LeafAllocate() {
+  if (!leaves_prealloc.empty()) {
+    auto leaf = leaves_prealloc.back();
+    leaves_prealloc.pop_back();
+    if (tx_changes) tx_changes->reused.emplace_back(this, leaf);
+    return leaf;
+  }
+  auto root = kv_root;
+  auto old_head = root->head;
+  auto new_leaf = make_persistent<KVLeaf>();
+  root->head = new_leaf;
+  new_leaf->next = old_head;
+  return new_leaf;
+}
+
+int MVTree::LeafFindValue(const KVLeafNode *leafnode, const uint8_t hash, const Slice &key,
+                          uint64_t *version, Slice *value) {
+  *version = leafnode->version.load(std::memory_order_acquire);
+  if (*version & 1) return -1;                                           // writer is changing leaf
+  for (int slot = LEAF_KEYS; slot--;) {
+    if (leafnode->hashes[slot] != hash) continue;                        // no need to read slot
+    auto &kvslot = leafnode->leaf->slots[slot].get_ro();
+    char *record = kvslot.buffer();
+    if (!record) continue;                                               // cleared meanwhile
+    const uint32_t ks = kvslot.keysize_direct(record);
+    const uint32_t vs = kvslot.valsize_direct(record);
+    if (ks != key.size()) continue;
+    if (!LeafUnchanged(leafnode, *version)) return -1;                   // record was live with
+    if (memcmp(kvslot.key_direct(record), key.data(), ks)) continue;     // these sizes, so reads
+    *value = Slice(kvslot.key_direct(record) + ks + 1, vs);              // stay inside it
+    return 1;
+  }
+  return LeafUnchanged(leafnode, *version) ? 0 : -1;
+}
+
+bool MVTree::LeafUnchanged(const KVLeafNode *leafnode, const uint64_t version) {
+  std::atomic_thread_fence(std::memory_order_acquire);                   // reads before check
+  return leafnode->version.load(std::memory_order_relaxed) == version;   // complete before it
+}
+
+KVLeafNode *MVTree::LeafSearch(const Slice &key) {
+  const string *upper;
+  return LeafSearch(key, &upper);
+}
+
+KVLeafNode *MVTree::LeafSearch(const Slice &key, const string **upper) {
+  *upper = nullptr;
   KVNode *node = tree_top.get();
   if (node == nullptr) return nullptr;
   bool matched;
@@ -289,6 +671,7 @@ KVLeafNode *MVTree::LeafSearch(const string &key) {
     for (uint8_t idx = 0; idx < keycount; idx++) {
       node = inner->children[idx].get();
       if (key.compare(inner->keys[idx]) <= 0) {
+        *upper = &inner->keys[idx];                              // deeper keys are tighter
         matched = true;
         break;
       }
@@ -298,8 +681,29 @@ KVLeafNode *MVTree::LeafSearch(const string &key) {
   return (KVLeafNode *) node;
 }
 
+void MVTree::LeafClearSlotForKey(KVLeafNode *leafnode, const Slice &key) {
+  const uint8_t hash = PearsonHash(key.data(), key.size());
+  for (int slot = LEAF_KEYS; slot--;) {
+    if (leafnode->hashes[slot] == hash) {
+      if (key.compare(leafnode->keys[slot]) == 0) {
+        LOG("   freeing slot=" << slot);
+        auto leaf = leafnode->leaf;
+        LeafTx(pmpool, [&] {
+                         LeafSave(leafnode);
+                         leafnode->hashes[slot] = 0;
+                         leafnode->keys[slot].clear();
+                         key_count--;
+                         tx_changes->key_deltas[this]--;
+                         leaf->slots[slot].get_rw().clear();
+                       });
+        break;  // no duplicate keys allowed
+      }
+    }
+  }
+}
+
 void MVTree::LeafFillEmptySlot(KVLeafNode *leafnode, const uint8_t hash,
-                                   const string &key, const string &value) {
+                                   const Slice &key, const Slice &value) {
   for (int slot = LEAF_KEYS; slot--;) {
     if (leafnode->hashes[slot] == 0) {
       LeafFillSpecificSlot(leafnode, hash, key, value, slot);
@@ -309,7 +713,7 @@ void MVTree::LeafFillEmptySlot(KVLeafNode *leafnode, const uint8_t hash,
 }
 
 bool MVTree::LeafFillSlotForKey(KVLeafNode *leafnode, const uint8_t hash,
-                                    const string &key, const string &value) {
+                                    const Slice &key, const Slice &value) {
   // scan for empty/matching slots
   int last_empty_slot = -1;
   int key_match_slot = -1;
@@ -318,7 +722,7 @@ bool MVTree::LeafFillSlotForKey(KVLeafNode *leafnode, const uint8_t hash,
     if (slot_hash == 0) {
       last_empty_slot = slot;
     } else if (slot_hash == hash) {
-      if (leafnode->keys[slot].compare(key) == 0) {
+      if (key.compare(leafnode->keys[slot]) == 0) {
         key_match_slot = slot;
         break;  // no duplicate keys allowed
       }
@@ -329,63 +733,62 @@ bool MVTree::LeafFillSlotForKey(KVLeafNode *leafnode, const uint8_t hash,
   int slot = key_match_slot >= 0 ? key_match_slot : last_empty_slot;
   if (slot >= 0) {
     LOG("   filling slot=" << slot);
-    transaction::exec_tx(pmpool, [&] {
-                                   LeafFillSpecificSlot(leafnode, hash, key, value, slot);
-                                 });
+    LeafTx(pmpool, [&] {
+                     LeafFillSpecificSlot(leafnode, hash, key, value, slot);
+                   });
   }
   return slot >= 0;
 }
 
 void MVTree::LeafFillSpecificSlot(KVLeafNode *leafnode, const uint8_t hash,
-                                      const string &key, const string &value, const int slot) {
+                                      const Slice &key, const Slice &value, const int slot) {
   if (leafnode->hashes[slot] == 0) {
+    LeafSave(leafnode);
     leafnode->hashes[slot] = hash;
-    leafnode->keys[slot] = key;
+    leafnode->keys[slot].assign(key.data(), key.size());
+    key_count++;
+    tx_changes->key_deltas[this]++;
   }
   leafnode->leaf->slots[slot].get_rw().set(hash, key, value);
 }
 
 void MVTree::LeafSplitFull(KVLeafNode *leafnode, const uint8_t hash,
-                               const string &key, const string &value) {
+                               const Slice &key, const Slice &value) {
   string keys[LEAF_KEYS + 1];
-  keys[LEAF_KEYS] = key;
+  keys[LEAF_KEYS] = key.ToString();
   for (int slot = LEAF_KEYS; slot--;) keys[slot] = leafnode->keys[slot];
   std::sort(std::begin(keys), std::end(keys), [](const string &lhs, const string &rhs) {
                                                 return lhs.compare(rhs) < 0;
                                               });
-  string split_key = keys[LEAF_KEYS_MIDPOINT];
+  LeafSplit(leafnode, keys[LEAF_KEYS_MIDPOINT], &hash, key, value);
+}
+
+void MVTree::LeafSplit(KVLeafNode *leafnode, string split_key, const uint8_t *hash,
+                       const Slice &key, const Slice &value) {
   LOG("   splitting leaf at key=" << split_key);
 
   // split leaf into two leaves, moving slots that sort above split key to new leaf
   unique_ptr<KVLeafNode> new_leafnode(new KVLeafNode());
   new_leafnode->parent = leafnode->parent;
   new_leafnode->is_leaf = true;
-  transaction::exec_tx(pmpool, [&] {
-                                 persistent_ptr<KVLeaf> new_leaf;
-                                 if (!leaves_prealloc.empty()) {
-                                   new_leaf = leaves_prealloc.back();
-                                   new_leafnode->leaf = new_leaf;
-                                   leaves_prealloc.pop_back();
-                                 } else {
-                                   auto root = kv_root;
-                                   auto old_head = root->head;
-                                   new_leaf = make_persistent<KVLeaf>();
-                                   root->head = new_leaf;
-                                   new_leaf->next = old_head;
-                                   new_leafnode->leaf = new_leaf;
-                                 }
-                                 for (int slot = LEAF_KEYS; slot--;) {
-                                   if (leafnode->keys[slot].compare(split_key) > 0) {
-                                     new_leaf->slots[slot].swap(leafnode->leaf->slots[slot]);
-                                     new_leafnode->hashes[slot] = leafnode->hashes[slot];
-                                     new_leafnode->keys[slot] = leafnode->keys[slot];
-                                     leafnode->hashes[slot] = 0;
-                                     leafnode->keys[slot].clear();
-                                   }
-                                 }
-                                 auto target = key.compare(split_key) > 0 ? new_leafnode.get() : leafnode;
-                                 LeafFillEmptySlot(target, hash, key, value);
-                               });
+  LeafTx(pmpool, [&] {
+                   LeafSave(leafnode);
+                   persistent_ptr<KVLeaf> new_leaf = LeafAllocate();
+                   new_leafnode->leaf = new_leaf;
+                   for (int slot = LEAF_KEYS; slot--;) {
+                     if (leafnode->hashes[slot] != 0 && leafnode->keys[slot].compare(split_key) > 0) {
+                       new_leaf->slots[slot].swap(leafnode->leaf->slots[slot]);
+                       new_leafnode->hashes[slot] = leafnode->hashes[slot];
+                       new_leafnode->keys[slot] = leafnode->keys[slot];
+                       leafnode->hashes[slot] = 0;
+                       leafnode->keys[slot].clear();
+                     }
+                   }
+                   if (hash) {
+                     auto target = key.compare(split_key) > 0 ? new_leafnode.get() : leafnode;
+                     LeafFillEmptySlot(target, *hash, key, value);
+                   }
+                 });
 
   // recursively update volatile parents outside persistent transaction
   InnerUpdateAfterSplit(leafnode, move(new_leafnode), &split_key);
@@ -458,6 +861,8 @@ void MVTree::InnerUpdateAfterSplit(KVNode *node, unique_ptr<KVNode> new_node, st
 
 void MVTree::Recover() {
   LOG("Recovering");
+  leaves_prealloc.clear();
+  key_count = 0;
 
   // traverse persistent leaves to build list of leaves to recover
   std::list<KVRecoveredLeaf> leaves;
@@ -483,9 +888,20 @@ void MVTree::Recover() {
         max_key = string(kvslot.key(), kvslot.get_ks());
       }
       leafnode->keys[slot] = string(key, kvslot.get_ks());
+      key_count++;
     }
 
-    // use highest sorting key to decide how to recover the leaf
+    // let reads find keys of leaf in index, then use highest sorting key to decide how to
+    // recover the leaf
+    if (recovery_index) {
+      WriteGuard index_guard(recovery_index->lock);
+      for (int slot = LEAF_KEYS; slot--;) {
+        if (leafnode->hashes[slot] != 0) {
+          recovery_index->slots.emplace(leafnode->keys[slot], std::make_pair(leaf, slot));
+        }
+      }
+      recovery_index->unindexed = leaf->next;
+    }
     if (empty_leaf) {
       leaves_prealloc.push_back(leaf);
     } else {
@@ -523,6 +939,191 @@ void MVTree::Recover() {
   LOG("Recovered ok");
 }
 
+void MVTree::RecoverInBackground() {
+  LOG("Recovering in background");
+  recovering = true;
+  recovery_index.reset(new KVRecoveryIndex());
+  recovery_index->unindexed = kv_root->head;
+  recovery_thread = std::thread([this] {
+                                  bool ok = true;
+                                  try {
+                                    Recover();
+                                  } catch (...) {
+                                    LOG("   background recovery failed, reads will keep scanning leaves");
+                                    ok = false;
+                                  }
+                                  {
+                                    WriteGuard tree_guard(tree_lock);    // wait out leaf scans
+                                    recovered = ok;
+                                    if (ok) recovery_index.reset();      // else reads keep using it
+                                  }
+                                  std::lock_guard<std::mutex> lock(recovery_mutex);
+                                  recovering = false;
+                                  recovery_done.notify_all();
+                                });
+}
+
+bool MVTree::WaitRecovered() {
+  if (recovered) return true;
+  std::unique_lock<std::mutex> lock(recovery_mutex);
+  recovery_done.wait(lock, [this] { return !recovering; });
+  return recovered;
+}
+
+bool MVTree::RecoveryFind(const Slice &key, KVSlot *kvslot) {
+  persistent_ptr<KVLeaf> unindexed;
+  {
+    ReadGuard index_guard(recovery_index->lock);
+    auto it = recovery_index->slots.find(key.ToString());
+    if (it != recovery_index->slots.end()) {
+      *kvslot = it->second.first->slots[it->second.second].get_ro();
+      return true;
+    }
+    unindexed = recovery_index->unindexed;                               // read with same lock, so
+  }                                                                      // no leaf is missed
+  for (auto leaf = unindexed; leaf; leaf = leaf->next) {
+    if (LeafScanForKey(leaf, key, kvslot)) return true;
+  }
+  return false;
+}
+
+void MVTree::RecoveryFindAll(const vector<string> &keys, const vector<int32_t> &order,
+                             void *context, KVMultiGetCallback *callback) {
+  vector<std::pair<int32_t, KVSlot>> found;
+  vector<int32_t> missing;                                               // still in key order
+  persistent_ptr<KVLeaf> unindexed;
+  {
+    ReadGuard index_guard(recovery_index->lock);
+    for (auto idx : order) {
+      auto it = recovery_index->slots.find(keys[idx]);
+      if (it != recovery_index->slots.end()) {
+        found.emplace_back(idx, it->second.first->slots[it->second.second].get_ro());
+      } else {
+        missing.push_back(idx);
+      }
+    }
+    unindexed = recovery_index->unindexed;
+  }
+  for (auto &entry : found) {
+    (*callback)(context, entry.first, (int32_t) entry.second.valsize(), entry.second.val());
+  }
+  if (missing.empty()) return;
+  for (auto leaf = unindexed; leaf; leaf = leaf->next) {
+    LeafScanForKeys(leaf, keys, missing, context, callback);
+  }
+}
+
+bool MVTree::LeafScanForKey(const persistent_ptr<KVLeaf> &leaf, const Slice &key, KVSlot *kvslot) {
+  for (int slot = LEAF_KEYS; slot--;) {
+    *kvslot = leaf->slots[slot].get_ro();
+    if (kvslot->empty() || kvslot->hash() == 0) continue;
+    if (key.compare(Slice(kvslot->key(), kvslot->keysize())) == 0) return true;
+  }
+  return false;
+}
+
+void MVTree::LeafScanForKeys(const persistent_ptr<KVLeaf> &leaf, const vector<string> &keys,
+                             const vector<int32_t> &order, void *context, KVMultiGetCallback *callback) {
+  for (int slot = LEAF_KEYS; slot--;) {
+    auto kvslot = leaf->slots[slot].get_ro();
+    if (kvslot.empty() || kvslot.hash() == 0) continue;
+    const Slice key(kvslot.key(), kvslot.keysize());
+    auto it = std::lower_bound(order.begin(), order.end(), key, [&](int32_t idx, const Slice &k) {
+                                 return Slice(keys[idx]).compare(k) < 0;
+                               });
+    for (; it != order.end() && key.compare(keys[*it]) == 0; it++) {     // key may be repeated
+      (*callback)(context, *it, (int32_t) kvslot.valsize(), kvslot.val());
+    }
+  }
+}
+
+// ===============================================================================================
+// ITERATOR METHODS
+// ===============================================================================================
+
+MVTreeIterator::MVTreeIterator(MVTree *tree) : tree(tree), leafnode(nullptr), pos(0) {}
+
+void MVTreeIterator::SeekToFirst() {
+  LeafLoad(LeafDescend(tree->tree_top.get(), false), true);
+}
+
+void MVTreeIterator::SeekToLast() {
+  LeafLoad(LeafDescend(tree->tree_top.get(), true), false);
+}
+
+void MVTreeIterator::Seek(const Slice &key) {
+  auto node = tree->LeafSearch(key);
+  LeafLoad(node, true);
+  if (leafnode == nullptr || leafnode != node) return;                   // later leaves sort higher
+  while (pos < slots.size() && key.compare(leafnode->keys[slots[pos]]) > 0) pos++;
+  if (pos == slots.size()) LeafLoad(LeafSibling(node, true), true);
+}
+
+void MVTreeIterator::Next() {
+  assert(Valid());
+  if (++pos == slots.size()) LeafLoad(LeafSibling(leafnode, true), true);
+}
+
+void MVTreeIterator::Prev() {
+  assert(Valid());
+  if (pos == 0) {
+    LeafLoad(LeafSibling(leafnode, false), false);
+  } else {
+    pos--;
+  }
+}
+
+Slice MVTreeIterator::Key() {
+  assert(Valid());
+  return leafnode->keys[slots[pos]];
+}
+
+Slice MVTreeIterator::Value() {
+  assert(Valid());
+  auto kvslot = leafnode->leaf->slots[slots[pos]].get_ro();
+  return Slice(kvslot.val(), kvslot.valsize());
+}
+
+KVLeafNode *MVTreeIterator::LeafDescend(KVNode *node, const bool highest) {
+  if (node == nullptr) return nullptr;
+  while (!node->is_leaf) {
+    auto inner = (KVInnerNode *) node;
+    node = inner->children[highest ? inner->keycount : 0].get();
+  }
+  return (KVLeafNode *) node;
+}
+
+KVLeafNode *MVTreeIterator::LeafSibling(KVNode *node, const bool higher) {
+  while (node->parent) {
+    auto inner = node->parent;
+    int idx = 0;
+    while (inner->children[idx].get() != node) idx++;
+    if (higher && idx < inner->keycount) return LeafDescend(inner->children[idx + 1].get(), false);
+    if (!higher && idx > 0) return LeafDescend(inner->children[idx - 1].get(), true);
+    node = inner;                                                        // no sibling at this level
+  }
+  return nullptr;
+}
+
+void MVTreeIterator::LeafLoad(KVLeafNode *node, const bool higher) {
+  while (node) {
+    slots.clear();
+    for (int slot = 0; slot < LEAF_KEYS; slot++) {
+      if (node->hashes[slot] != 0) slots.push_back(slot);
+    }
+    if (!slots.empty()) {
+      std::sort(slots.begin(), slots.end(), [node](const int lhs, const int rhs) {
+        return node->keys[lhs].compare(node->keys[rhs]) < 0;
+      });
+      leafnode = node;
+      pos = higher ? 0 : slots.size() - 1;
+      return;
+    }
+    node = LeafSibling(node, higher);                                    // skip leaf without keys
+  }
+  leafnode = nullptr;
+}
+
 // ===============================================================================================
 // PEARSON HASH METHODS
 // ===============================================================================================
@@ -573,6 +1174,8 @@ bool KVSlot::empty() {
 void KVSlot::clear() {
     if (kv) {
         char* p = kv.get();
+        if (pmemobj_tx_add_range_direct(p, sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)))
+            throw pmem::transaction_error("failed to snapshot slot");    // header survives abort
         set_ph_direct(p, 0);
         set_ks_direct(p, 0);
         set_vs_direct(p, 0);
@@ -582,7 +1185,7 @@ void KVSlot::clear() {
     }
 }
 
-void KVSlot::set(const uint8_t hash, const string& key, const string& value) {
+void KVSlot::set(const uint8_t hash, const Slice& key, const Slice& value) {
     if (kv) {
         char* p = kv.get();
         delete_persistent<char[]>(kv, sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t) + get_ks_direct(p) +
@@ -32,8 +32,17 @@
 
 #pragma once
 
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include "../pmemkv.h"
+#include "rwlock.h"
 
 using std::move;
 using std::unique_ptr;
@@ -48,18 +57,21 @@ using pmem::obj::pool;
 using pmem::obj::pool_base;
 
 namespace pmemkv {
+namespace sharded { class ShardedEngine; }
 namespace mvtree {
 
 const string ENGINE = "mvtree";                           // engine identifier
 
-#define INNER_KEYS 4                                       // maximum keys for inner nodes
-#define INNER_KEYS_MIDPOINT (INNER_KEYS / 2)               // halfway point within the node
-#define INNER_KEYS_UPPER ((INNER_KEYS / 2) + 1)            // index where upper half of keys begins
-#define LEAF_KEYS 48                                       // maximum keys in tree nodes
-#define LEAF_KEYS_MIDPOINT (LEAF_KEYS / 2)                 // halfway point within the node
+constexpr int INNER_KEYS = 4;                              // maximum keys for inner nodes
+constexpr int INNER_KEYS_MIDPOINT = INNER_KEYS / 2;        // halfway point within the node
+constexpr int INNER_KEYS_UPPER = (INNER_KEYS / 2) + 1;     // index where upper half of keys begins
+constexpr int LEAF_KEYS = 48;                              // maximum keys in tree nodes
+constexpr int LEAF_KEYS_MIDPOINT = LEAF_KEYS / 2;          // halfway point within the node
+constexpr int LEAF_READ_ATTEMPTS = 4;                      // optimistic reads before locking leaf
 
 class KVSlot {
   public:
+    char* buffer() const { return (char *)(kv.get()); }
     uint8_t hash() const { return get_ph(); }
     uint8_t hash_direct(char *p) const { return *((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))); }
     const char* key() const { return ((char *)(kv.get()) + sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint32_t)); }
@@ -71,7 +83,7 @@ class KVSlot {
     const uint32_t valsize() const { return get_vs(); }
     const uint32_t valsize_direct(char *p) const { return *((uint32_t *)(p + sizeof(uint32_t))); }
     void clear();
-    void set(const uint8_t hash, const string& key, const string& value);
+    void set(const uint8_t hash, const Slice& key, const Slice& value);
     void set_ph(uint8_t v) {*((uint8_t *)((char *)(kv.get()) + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
     void set_ph_direct(char *p, uint8_t v) {*((uint8_t *)(p + sizeof(uint32_t) + sizeof(uint32_t))) = v;}
     void set_ks(uint32_t v) {*((uint32_t *)(kv.get())) = v;}
@@ -117,13 +129,36 @@ struct KVLeafNode final : KVNode {                         // volatile leaf node
     uint8_t hashes[LEAF_KEYS];                             // Pearson hashes of keys
     string keys[LEAF_KEYS];                                // keys stored in this leaf
     persistent_ptr<KVLeaf> leaf;                           // pointer to persistent leaf
+    RWLock lock;                                           // guards hashes, keys & leaf slots
+    std::atomic<uint64_t> version;                         // odd while writer under shared tree
+};                                                         // lock changes leaf
+
+class MVTree;
+
+struct KVLeafState {                                       // volatile leaf state kept for abort
+    uint8_t hashes[LEAF_KEYS];                             // Pearson hashes of keys
+    string keys[LEAF_KEYS];                                // keys stored in leaf
 };
 
+struct KVTxChanges {                                       // volatile changes of outermost
+    std::map<KVLeafNode*, KVLeafState> leaves;             // transaction: leaves changed (restored
+                                                           // on abort)
+    std::map<MVTree*, long> key_deltas;                    // keys added less keys removed
+    vector<std::pair<MVTree*, persistent_ptr<KVLeaf>>> reused;  // unused leaves taken (returned
+};                                                         // on abort)
+
 struct KVRecoveredLeaf {                                   // temporary wrapper used for recovery
     unique_ptr<KVLeafNode> leafnode;                       // leaf node being recovered
     string max_key;                                        // highest sorting key present
 };
 
+struct KVRecoveryIndex {                                   // keys of leaves recovered so far, so
+    RWLock lock;                                           // reads during background recovery
+    persistent_ptr<KVLeaf> unindexed;                      // scan only leaves not yet indexed
+                                                           // (from this one to end of chain)
+    std::unordered_map<string, std::pair<persistent_ptr<KVLeaf>, int>> slots;  // leaf & slot of
+};                                                         // each key indexed
+
 struct KVTreeAnalysis {                                    // tree analysis structure
     size_t leaf_empty;                                     // count of persisted leaves w/o keys
     size_t leaf_prealloc;                                  // count of persisted but unused leaves
@@ -131,7 +166,8 @@ struct KVTreeAnalysis {                                    // tree analysis stru
     string path;                                           // path when constructed
 };
 
-class MVTree : public KVEngine {                           // hybrid B+ tree engine
+class MVTree : public KVEngine {                           // hybrid B+ tree engine (thread-safe
+                                                           // except for iterators)
   public:
 
     static KVEngine* Open(const string& engine,            // open storage engine
@@ -148,7 +184,9 @@ class MVTree : public KVEngine {                           // hybrid B+ tree eng
                           size_t size);                    // size used when creating pool
 
 
-    MVTree (const string& path, size_t size);  // default constructor
+    MVTree (const string& path, size_t size,               // default constructor
+            bool background_recovery = false);             // return before leaves are recovered
+                                                           // (read-only until recovery ends)
     // OID_NULL means create a new tree, using a new pmemobj as the kvroot
     MVTree (const string& path, PMEMoid oid, size_t size);  // default constructor
 
@@ -161,42 +199,108 @@ class MVTree : public KVEngine {                           // hybrid B+ tree eng
                  int32_t* valuebytes,
                  const char* key,
                  char* value) final;
-    KVStatus Get(const string& key,                        // append value to std::string
+    KVStatus Get(const Slice& key,                         // append value to std::string
                  string* value) final;
-    KVStatus Put(const string& key,                        // copy value from std::string
-                 const string& value) final;
+    KVStatus Get(const Slice& key,                         // pass value to callback without copy
+                 void* context,
+                 KVGetCallback* callback) final;
+    void MultiGet(const vector<string>& keys,              // pass each value found to callback
+                  void* context,
+                  KVMultiGetCallback* callback) final;
+    KVStatus Put(const Slice& key,                         // copy value from slice
+                 const Slice& value) final;
 
     PMEMoid GetRootOid() final;
     PMEMobjpool* GetPool() final;
-    KVStatus Remove(const string& key) final;              // remove value for key
+    KVStatus Remove(const Slice& key) final;               // remove value for key
+    KVStatus Write(const WriteBatch& batch) final;         // apply all updates or none
+    KVIterator* NewIterator() final;                       // ordered iterator over all keys
 
     void Analyze(KVTreeAnalysis& analysis);                // report on internal state & stats
+
+    void AllKeys(void* context,                            // pass each key to callback
+                 KVAllKeysCallback* callback) final;
+    void AllKeyValues(void* context,                       // pass each key & value to callback
+                      KVAllKeyValuesCallback* callback) final;
+    void ListAllKeyValuePairs(vector<string>& kv_pairs) final; // list all key value pairs
+    void ListAllKeys(vector<string>& keys) final;          // list all keys
+    size_t TotalNumKeys() final;                           // count of keys in constant time
   protected:
-    KVLeafNode* LeafSearch(const string& key);             // find node for key
+    void ApplyPut(const Slice& key,                        // put value, letting errors propagate
+                  const Slice& value);
+    void ApplyRemove(const Slice& key);                    // remove key, letting errors propagate
+    void LeafMakeRoom(const vector<WriteBatchOp>& ops);    // add or split leaves until batch fits
+                                                           // (before transaction)
+    static void LeafTx(pool_base& pop,                     // run transaction, restoring leaves of
+                       const std::function<void()>& func); // all trees in it if it aborts
+    static void LeafUndo(KVTxChanges& changes);            // restore leaves of aborted transaction
+    void LeafSave(KVLeafNode* leafnode);                   // keep leaf state for abort (inside
+                                                           // LeafTx)
+    persistent_ptr<KVLeaf> LeafAllocate();                 // reuse unused leaf or add new one
+                                                           // (inside transaction)
+    int LeafFindValue(const KVLeafNode* leafnode,          // find value without leaf lock (-1 if
+                      uint8_t hash,                        // leaf changed meanwhile, 0 if none,
+                      const Slice& key,                    // 1 if found), value may change until
+                      uint64_t* version,                   // version is checked by LeafUnchanged
+                      Slice* value);
+    static bool LeafUnchanged(const KVLeafNode* leafnode,  // no writer changed leaf since version
+                              uint64_t version);           // was read
+    void VisitAll(bool values,                             // copy records leaf by leaf in key
+                  const std::function<bool(const string&,  // order, visiting copies with no lock
+                                           const string&)>& visit);  // held (stops on false)
+    KVLeafNode* LeafSearch(const Slice& key);              // find node for key
+    KVLeafNode* LeafSearch(const Slice& key,               // find node for key, and highest key
+                           const string** upper);          // that node can hold (null if none)
+    void LeafClearSlotForKey(KVLeafNode* leafnode,         // clear slot for matching key if found
+                             const Slice& key);
     void LeafFillEmptySlot(KVLeafNode* leafnode,           // write first unoccupied slot found
                            uint8_t hash,
-                           const string& key,
-                           const string& value);
+                           const Slice& key,
+                           const Slice& value);
     bool LeafFillSlotForKey(KVLeafNode* leafnode,          // write slot for matching key if found
                             uint8_t hash,
-                            const string& key,
-                            const string& value);
+                            const Slice& key,
+                            const Slice& value);
     void LeafFillSpecificSlot(KVLeafNode* leafnode,        // write slot at specific index
                               uint8_t hash,
-                              const string& key,
-                              const string& value,
+                              const Slice& key,
+                              const Slice& value,
                               int slot);
     void LeafSplitFull(KVLeafNode* leafnode,               // split full leaf into two leaves
                        uint8_t hash,
-                       const string& key,
-                       const string& value);
+                       const Slice& key,
+                       const Slice& value);
+    void LeafSplit(KVLeafNode* leafnode,                   // move keys above split key to new
+                   string split_key,                       // leaf, then write record if hash is
+                   const uint8_t* hash = nullptr,          // given
+                   const Slice& key = Slice(),
+                   const Slice& value = Slice());
     void InnerUpdateAfterSplit(KVNode* node,               // update parents after leaf split
                                unique_ptr<KVNode> newnode,
                                string* split_key);
     uint8_t PearsonHash(const char* data,                  // calculate 1-byte hash for string
                         size_t size);
     void Recover();                                        // reload state from persistent pool
+    bool LeafScanForKey(const persistent_ptr<KVLeaf>& leaf, // find key by scanning persistent
+                        const Slice& key,                  // leaf (while recovering)
+                        KVSlot* kvslot);
+    void LeafScanForKeys(const persistent_ptr<KVLeaf>& leaf, // find sorted keys by scanning
+                         const vector<string>& keys,       // persistent leaf (while recovering)
+                         const vector<int32_t>& order,
+                         void* context,
+                         KVMultiGetCallback* callback);
+    void RecoverInBackground();                            // recover on thread, then use index
+    bool WaitRecovered();                                  // block until recovery ends (false if
+                                                           // it failed)
+    bool RecoveryFind(const Slice& key,                    // find key in leaves recovered so far,
+                      KVSlot* kvslot);                     // else scan the others
+    void RecoveryFindAll(const vector<string>& keys,       // find sorted keys in leaves recovered
+                         const vector<int32_t>& order,     // so far, else scan the others
+                         void* context,
+                         KVMultiGetCallback* callback);
   private:
+    friend class MVTreeIterator;                           // iterator walks volatile nodes
+    friend class sharded::ShardedEngine;                   // applies batches across shards
     MVTree(const MVTree&);                                 // prevent copying
     void operator=(const MVTree&);                         // prevent assigning
     vector<persistent_ptr<KVLeaf>> leaves_prealloc;        // persisted but unused leaves
@@ -204,6 +308,41 @@ class MVTree : public KVEngine {                           // hybrid B+ tree eng
     pool_base pmpool;
     persistent_ptr<KVRoot> kv_root;                                      // pointer to persistent root
     unique_ptr<KVNode> tree_top;                           // pointer to uppermost inner node
+    std::atomic<size_t> key_count;                         // count of keys in all leaves
+    std::atomic<bool> recovered;                           // index is ready (else scan leaves)
+    bool recovering;                                       // background recovery is running
+    std::mutex recovery_mutex;                             // guards recovering
+    std::condition_variable recovery_done;                 // signaled when recovery ends
+    std::thread recovery_thread;                           // rebuilds index in background
+    unique_ptr<KVRecoveryIndex> recovery_index;            // keys indexed so far (while recovering
+                                                           // in background)
+    StripedRWLock tree_lock;                               // shared to search & fill leaves,
+                                                           // exclusive to change tree structure
+};
+
+class MVTreeIterator final : public KVIterator {           // iterator over volatile tree nodes
+  public:
+    explicit MVTreeIterator(MVTree* tree);                 // default constructor
+
+    bool Valid() final { return leafnode != nullptr; }     // positioned at a key?
+    void SeekToFirst() final;                              // position at lowest key
+    void SeekToLast() final;                               // position at highest key
+    void Seek(const Slice& key) final;                     // position at first key >= given key
+    void Next() final;                                     // advance to next higher key
+    void Prev() final;                                     // back up to next lower key
+    Slice Key() final;                                     // current key (valid until moved)
+    Slice Value() final;                                   // current value (valid until moved)
+  private:
+    static KVLeafNode* LeafDescend(KVNode* node,           // find lowest or highest leaf in subtree
+                                   bool highest);
+    static KVLeafNode* LeafSibling(KVNode* node,           // find adjacent leaf (null if none)
+                                   bool higher);
+    void LeafLoad(KVLeafNode* node,                        // sort slots of first leaf with keys,
+                  bool higher);                            // moving in given direction
+    MVTree* tree;                                          // tree being iterated
+    KVLeafNode* leafnode;                                  // current leaf (null if not valid)
+    vector<int> slots;                                     // occupied slots in key order
+    size_t pos;                                            // current index into sorted slots
 };
 
 } // namespace mvtree
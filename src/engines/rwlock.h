@@ -0,0 +1,148 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <pthread.h>
+#include <system_error>
+
+namespace pmemkv {
+
+class RWLock {                                             // volatile reader-writer lock
+  public:
+    RWLock() {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+        pthread_rwlockattr_setkind_np(&attr,                // keep writers from starving
+                                      PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+        pthread_rwlock_init(&rwlock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+    ~RWLock() { pthread_rwlock_destroy(&rwlock); }
+
+    void lock_shared() {                                   // acquire for reading
+        Check(pthread_rwlock_rdlock(&rwlock));
+    }
+    void unlock_shared() { Unlocked(pthread_rwlock_unlock(&rwlock)); }
+    void lock() { Check(pthread_rwlock_wrlock(&rwlock)); } // acquire for writing
+    void unlock() { Unlocked(pthread_rwlock_unlock(&rwlock)); }
+  private:
+    RWLock(const RWLock&);                                 // prevent copying
+    void operator=(const RWLock&);                         // prevent assigning
+    static void Check(const int error) {                   // throw if lock wasn't acquired, e.g.
+        if (error) {                                       // EDEADLK when already held by caller
+            throw std::system_error(error, std::generic_category(), "pthread_rwlock");
+        }
+    }
+    static void Unlocked(const int error) {                // unlock only fails if lock wasn't
+        assert(error == 0);                                // held, which is a caller bug
+        (void) error;
+    }
+    pthread_rwlock_t rwlock;
+};
+
+#define RWLOCK_STRIPES 16                                  // locks that shared lockers spread over
+
+class StripedRWLock {                                      // reader-writer lock whose shared
+  public:                                                  // lockers on different threads don't
+    StripedRWLock() {}                                     // write the same cacheline
+    RWLock& stripe() { return stripes[Stripe()].lock; }    // lock held shared by calling thread
+    void lock() {                                          // acquire all stripes for writing
+        int i = 0;
+        try {
+            for (; i < RWLOCK_STRIPES; i++) stripes[i].lock.lock();
+        } catch (...) {
+            while (i--) stripes[i].lock.unlock();          // release stripes already acquired
+            throw;
+        }
+    }
+    void unlock() {
+        for (int i = RWLOCK_STRIPES - 1; i >= 0; i--) stripes[i].lock.unlock();
+    }
+  private:
+    StripedRWLock(const StripedRWLock&);                   // prevent copying
+    void operator=(const StripedRWLock&);                  // prevent assigning
+    static int Stripe() {                                  // stripe fixed for calling thread
+        static std::atomic<int> threads(0);
+        static thread_local int stripe = threads++ % RWLOCK_STRIPES;
+        return stripe;
+    }
+    struct PaddedRWLock {                                  // never shares cacheline with another
+        RWLock lock;
+        char padding[128 - sizeof(RWLock)];
+    };
+    PaddedRWLock stripes[RWLOCK_STRIPES];
+};
+
+class ReadGuard {                                          // holds shared lock within scope
+  public:
+    explicit ReadGuard(RWLock& lock) : lock(lock) { lock.lock_shared(); }
+    explicit ReadGuard(StripedRWLock& lock) : lock(lock.stripe()) { this->lock.lock_shared(); }
+    ~ReadGuard() { lock.unlock_shared(); }
+  private:
+    ReadGuard(const ReadGuard&);                           // prevent copying
+    void operator=(const ReadGuard&);                      // prevent assigning
+    RWLock& lock;
+};
+
+class WriteGuard {                                         // holds exclusive lock within scope
+  public:
+    explicit WriteGuard(RWLock& lock) : lock(&lock), striped(nullptr) { lock.lock(); }
+    explicit WriteGuard(StripedRWLock& lock) : lock(nullptr), striped(&lock) { lock.lock(); }
+    ~WriteGuard() {
+        if (lock) lock->unlock();
+        else striped->unlock();
+    }
+  private:
+    WriteGuard(const WriteGuard&);                         // prevent copying
+    void operator=(const WriteGuard&);                     // prevent assigning
+    RWLock* lock;
+    StripedRWLock* striped;
+};
+
+class VersionGuard {                                       // keeps version odd within scope, so
+  public:                                                  // optimistic readers know to retry
+    explicit VersionGuard(std::atomic<uint64_t>& version) : version(version) {
+        version.fetch_add(1, std::memory_order_acq_rel);   // changes can't move above this
+    }
+    ~VersionGuard() { version.fetch_add(1, std::memory_order_release); }
+  private:
+    VersionGuard(const VersionGuard&);                     // prevent copying
+    void operator=(const VersionGuard&);                   // prevent assigning
+    std::atomic<uint64_t>& version;
+};
+
+} // namespace pmemkv
@@ -0,0 +1,354 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <cassert>
+#include <exception>
+#include <iostream>
+#include <thread>
+#include <unistd.h>
+#include "fnv.h"
+#include "sharded.h"
+
+#define DO_LOG 0
+#define LOG(msg) if (DO_LOG) std::cout << "[sharded] " << msg << "\n"
+
+namespace pmemkv {
+namespace sharded {
+
+ShardedEngine::ShardedEngine(const string& path, const size_t size, const uint32_t shard_count) {
+    if ((access(path.c_str(), F_OK) != 0) && (size > 0)) {
+        LOG("Creating filesystem pool, path=" << path << ", size=" << to_string(size));
+        pmpool = pool<ShardDirectory>::create(path.c_str(), LAYOUT, size, S_IRWXU);
+    } else {
+        LOG("Opening pool, path=" << path);
+        pmpool = pool<ShardDirectory>::open(path.c_str(), LAYOUT);
+    }
+    auto directory = pmpool.get_root();
+    if (directory->count == 0) {
+        if (shard_count == 0 || shard_count > MAX_SHARDS) {
+            pmpool.close();
+            throw std::invalid_argument("shard count out of range");
+        }
+        LOG("Creating directory, shards=" << to_string(shard_count));
+        transaction::exec_tx(pmpool, [&] {
+            for (uint32_t i = 0; i < shard_count; i++) {
+                directory->roots[i] = make_persistent<mvtree::KVRoot>();
+            }
+            directory->count = shard_count;
+        });
+    }
+    Recover();
+    LOG("Opened ok");
+}
+
+ShardedEngine::~ShardedEngine() {
+    LOG("Closing");
+    shards.clear();                                                      // shards share our pool
+    pmpool.close();
+    LOG("Closed ok");
+}
+
+// ===============================================================================================
+// KEY/VALUE METHODS
+// ===============================================================================================
+
+KVStatus ShardedEngine::Get(const int32_t limit, const int32_t keybytes, int32_t* valuebytes,
+                            const char* key, char* value) {
+    return shards[ShardFor(Slice(key, (size_t) keybytes))]->Get(limit, keybytes, valuebytes, key, value);
+}
+
+KVStatus ShardedEngine::Get(const Slice& key, string* value) {
+    return shards[ShardFor(key)]->Get(key, value);
+}
+
+KVStatus ShardedEngine::Get(const Slice& key, void* context, KVGetCallback* callback) {
+    return shards[ShardFor(key)]->Get(key, context, callback);
+}
+
+struct ShardedMultiGetContext {                                          // maps shard positions
+    void* context;                                                       // back to request order
+    KVMultiGetCallback* callback;
+    const vector<int32_t>* indexes;
+};
+
+void ShardedEngine::MultiGet(const vector<string>& keys, void* context, KVMultiGetCallback* callback) {
+    LOG("MultiGet for count=" << to_string(keys.size()));
+    vector<vector<string>> shard_keys(shards.size());
+    vector<vector<int32_t>> shard_indexes(shards.size());
+    for (int32_t i = 0; i < (int32_t) keys.size(); i++) {
+        const size_t shard = ShardFor(keys[i]);
+        shard_keys[shard].push_back(keys[i]);
+        shard_indexes[shard].push_back(i);
+    }
+    for (size_t shard = 0; shard < shards.size(); shard++) {
+        if (shard_keys[shard].empty()) continue;
+        ShardedMultiGetContext sc = {context, callback, &shard_indexes[shard]};
+        shards[shard]->MultiGet(shard_keys[shard], &sc, [](void* context, int32_t index,
+                                                           int32_t valuebytes, const char* value) {
+            auto sc = (ShardedMultiGetContext*) context;
+            (*sc->callback)(sc->context, (*sc->indexes)[index], valuebytes, value);
+        });
+    }
+}
+
+KVStatus ShardedEngine::Put(const Slice& key, const Slice& value) {
+    return shards[ShardFor(key)]->Put(key, value);
+}
+
+KVStatus ShardedEngine::Remove(const Slice& key) {
+    return shards[ShardFor(key)]->Remove(key);
+}
+
+KVStatus ShardedEngine::Write(const WriteBatch& batch) {
+    LOG("Write batch.count=" << to_string(batch.Count()));
+    vector<size_t> owners;
+    vector<vector<WriteBatchOp>> shard_ops(shards.size());
+    for (auto& op : batch.Ops()) {
+        owners.push_back(ShardFor(op.key));
+        shard_ops[owners.back()].push_back(op);
+    }
+    vector<unique_ptr<WriteGuard>> guards;                               // lock in shard order, so
+    for (size_t shard = 0; shard < shards.size(); shard++) {             // batches cannot deadlock
+        if (!shard_ops[shard].empty()) guards.emplace_back(new WriteGuard(shards[shard]->tree_lock));
+    }
+    try {
+        for (size_t shard = 0; shard < shards.size(); shard++) {         // so batch never splits
+            if (!shard_ops[shard].empty()) shards[shard]->LeafMakeRoom(shard_ops[shard]);
+        }
+        mvtree::MVTree::LeafTx(pmpool, [&] {                             // shard updates join this tx
+            for (size_t i = 0; i < owners.size(); i++) {
+                auto& op = batch.Ops()[i];
+                if (op.remove) {
+                    shards[owners[i]]->ApplyRemove(op.key);
+                } else {
+                    shards[owners[i]]->ApplyPut(op.key, op.value);
+                }
+            }
+        });
+        return OK;
+    } catch (pmem::transaction_alloc_error) {
+        return FAILED;                                                   // shard leaves were restored
+    } catch (pmem::transaction_error) {
+        return FAILED;
+    }
+}
+
+KVIterator* ShardedEngine::NewIterator() {
+    LOG("NewIterator");
+    vector<unique_ptr<KVIterator>> children;
+    for (auto& shard : shards) children.emplace_back(shard->NewIterator());
+    return new ShardedIterator(move(children));
+}
+
+PMEMoid ShardedEngine::GetRootOid() {
+    return pmpool.get_root().raw();
+}
+
+PMEMobjpool* ShardedEngine::GetPool() {
+    return pmpool.get_handle();
+}
+
+struct ShardedAllKeysContext {                                           // stops remaining shards
+    void* context;                                                       // once callback says so
+    KVAllKeysCallback* callback;
+    bool stopped;
+};
+
+void ShardedEngine::AllKeys(void* context, KVAllKeysCallback* callback) {
+    LOG("AllKeys");
+    ShardedAllKeysContext sc = {context, callback, false};
+    for (auto& shard : shards) {
+        shard->AllKeys(&sc, [](void* context, int32_t keybytes, const char* key) {
+            auto sc = (ShardedAllKeysContext*) context;
+            sc->stopped = !(*sc->callback)(sc->context, keybytes, key);
+            return !sc->stopped;
+        });
+        if (sc.stopped) return;
+    }
+}
+
+struct ShardedAllKeyValuesContext {                                      // stops remaining shards
+    void* context;                                                       // once callback says so
+    KVAllKeyValuesCallback* callback;
+    bool stopped;
+};
+
+void ShardedEngine::AllKeyValues(void* context, KVAllKeyValuesCallback* callback) {
+    LOG("AllKeyValues");
+    ShardedAllKeyValuesContext sc = {context, callback, false};
+    for (auto& shard : shards) {
+        shard->AllKeyValues(&sc, [](void* context, int32_t keybytes, const char* key,
+                                    int32_t valuebytes, const char* value) {
+            auto sc = (ShardedAllKeyValuesContext*) context;
+            sc->stopped = !(*sc->callback)(sc->context, keybytes, key, valuebytes, value);
+            return !sc->stopped;
+        });
+        if (sc.stopped) return;
+    }
+}
+
+void ShardedEngine::ListAllKeyValuePairs(vector<string>& kv_pairs) {
+    LOG("Listing");
+    AllKeyValues(&kv_pairs, [](void* context, int32_t keybytes, const char* key,
+                               int32_t valuebytes, const char* value) {
+        auto kv_pairs = (vector<string>*) context;
+        kv_pairs->push_back(string(key, (size_t) keybytes));
+        kv_pairs->push_back(string(value, (size_t) valuebytes));
+        return true;
+    });
+    LOG("List ok");
+}
+
+void ShardedEngine::ListAllKeys(vector<string>& keys) {
+    LOG("Listing");
+    AllKeys(&keys, [](void* context, int32_t keybytes, const char* key) {
+        ((vector<string>*) context)->push_back(string(key, (size_t) keybytes));
+        return true;
+    });
+    LOG("List ok");
+}
+
+size_t ShardedEngine::TotalNumKeys() {
+    size_t total = 0;
+    for (auto& shard : shards) total += shard->TotalNumKeys();
+    return total;
+}
+
+size_t ShardedEngine::ShardFor(const Slice& key) {
+    return (size_t) (FNV1aHash(key) % shards.size());
+}
+
+// ===============================================================================================
+// PRIVATE LIFECYCLE METHODS
+// ===============================================================================================
+
+void ShardedEngine::Recover() {
+    auto directory = pmpool.get_root();
+    const uint32_t count = directory->count;
+    LOG("Recovering shards=" << to_string(count));
+    shards.resize(count);
+    vector<std::exception_ptr> errors(count);
+    vector<std::thread> threads;
+    for (uint32_t i = 0; i < count; i++) {
+        threads.emplace_back([&, i] {                                    // trees rebuild in parallel
+            try {
+                shards[i].reset(new mvtree::MVTree(pmpool.get_handle(), directory->roots[i].raw(), 0));
+            } catch (...) {
+                errors[i] = std::current_exception();
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    for (auto& error : errors) {
+        if (error) std::rethrow_exception(error);
+    }
+    LOG("Recovered ok");
+}
+
+// ===============================================================================================
+// ITERATOR METHODS
+// ===============================================================================================
+
+ShardedIterator::ShardedIterator(vector<unique_ptr<KVIterator>> children)
+        : children(move(children)), current(nullptr), forward(true) {}
+
+void ShardedIterator::SeekToFirst() {
+    for (auto& child : children) child->SeekToFirst();
+    forward = true;
+    FindSmallest();
+}
+
+void ShardedIterator::SeekToLast() {
+    for (auto& child : children) child->SeekToLast();
+    forward = false;
+    FindLargest();
+}
+
+void ShardedIterator::Seek(const Slice& key) {
+    for (auto& child : children) child->Seek(key);
+    forward = true;
+    FindSmallest();
+}
+
+void ShardedIterator::Next() {
+    assert(Valid());
+    if (!forward) {                                                      // shards hold disjoint keys,
+        const string key = current->Key().ToString();                    // so others land above it
+        for (auto& child : children) {
+            if (child.get() != current) child->Seek(key);
+        }
+        forward = true;
+    }
+    current->Next();
+    FindSmallest();
+}
+
+void ShardedIterator::Prev() {
+    assert(Valid());
+    if (forward) {                                                       // position others at their
+        const string key = current->Key().ToString();                    // highest key below it
+        for (auto& child : children) {
+            if (child.get() == current) continue;
+            child->Seek(key);
+            if (child->Valid()) {
+                child->Prev();
+            } else {
+                child->SeekToLast();
+            }
+        }
+        forward = false;
+    }
+    current->Prev();
+    FindLargest();
+}
+
+void ShardedIterator::FindSmallest() {
+    current = nullptr;
+    for (auto& child : children) {
+        if (child->Valid() && (current == nullptr || child->Key().compare(current->Key()) < 0)) {
+            current = child.get();
+        }
+    }
+}
+
+void ShardedIterator::FindLargest() {
+    current = nullptr;
+    for (auto& child : children) {
+        if (child->Valid() && (current == nullptr || child->Key().compare(current->Key()) > 0)) {
+            current = child.get();
+        }
+    }
+}
+
+} // namespace sharded
+} // namespace pmemkv
@@ -0,0 +1,123 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <memory>
+#include <vector>
+#include "../pmemkv.h"
+#include "mvtree.h"
+
+namespace pmemkv {
+namespace sharded {
+
+const string ENGINE = "sharded";                           // engine identifier
+
+#define MAX_SHARDS 64                                      // maximum shards in directory
+#define DEFAULT_SHARDS 8                                   // shards used when creating pool
+
+struct ShardDirectory {                                    // persistent root object
+    p<uint32_t> count;                                     // number of shards (zero until created)
+    persistent_ptr<mvtree::KVRoot> roots[MAX_SHARDS];      // root of each shard's tree
+};
+
+class ShardedEngine : public KVEngine {                    // mvtree instances sharing one pool
+  public:
+    ShardedEngine(const string& path,                      // default constructor
+                  size_t size,
+                  uint32_t shards = DEFAULT_SHARDS);       // (ignored if pool already has shards)
+    ~ShardedEngine();                                      // default destructor
+
+    string Engine() final { return ENGINE; }               // engine identifier
+    KVStatus Get(int32_t limit,                            // copy value to fixed-size buffer
+                 int32_t keybytes,
+                 int32_t* valuebytes,
+                 const char* key,
+                 char* value) final;
+    KVStatus Get(const Slice& key,                         // append value to std::string
+                 string* value) final;
+    KVStatus Get(const Slice& key,                         // pass value to callback without copy
+                 void* context,
+                 KVGetCallback* callback) final;
+    void MultiGet(const vector<string>& keys,              // pass each value found to callback
+                  void* context,
+                  KVMultiGetCallback* callback) final;
+    KVStatus Put(const Slice& key,                         // copy value from slice
+                 const Slice& value) final;
+    KVStatus Remove(const Slice& key) final;               // remove value for key
+    KVStatus Write(const WriteBatch& batch) final;         // apply all updates or none
+    KVIterator* NewIterator() final;                       // ordered iterator over all shards
+
+    PMEMoid GetRootOid() final;
+    PMEMobjpool* GetPool() final;
+
+    void AllKeys(void* context,                            // pass each key to callback
+                 KVAllKeysCallback* callback) final;
+    void AllKeyValues(void* context,                       // pass each key & value to callback
+                      KVAllKeyValuesCallback* callback) final;
+    void ListAllKeyValuePairs(vector<string>& kv_pairs) final;      // list all the key value pairs
+    void ListAllKeys(vector<string>& keys) final;          // list all the keys
+    size_t TotalNumKeys() final;                           // sum of key counts of all shards
+
+    size_t ShardCount() { return shards.size(); }          // number of shards in use
+    size_t ShardFor(const Slice& key);                     // index of shard owning key
+  private:
+    ShardedEngine(const ShardedEngine&);                   // prevent copying
+    void operator=(const ShardedEngine&);                  // prevent assigning
+    void Recover();                                        // open all shards in parallel
+    pool<ShardDirectory> pmpool;                           // pool for persistent directory
+    vector<unique_ptr<mvtree::MVTree>> shards;             // trees rooted in directory
+};
+
+class ShardedIterator final : public KVIterator {          // merges ordered shard iterators
+  public:
+    explicit ShardedIterator(vector<unique_ptr<KVIterator>> children);
+
+    bool Valid() final { return current != nullptr; }      // positioned at a key?
+    void SeekToFirst() final;                              // position at lowest key
+    void SeekToLast() final;                               // position at highest key
+    void Seek(const Slice& key) final;                     // position at first key >= given key
+    void Next() final;                                     // advance to next higher key
+    void Prev() final;                                     // back up to next lower key
+    Slice Key() final { return current->Key(); }           // current key (valid until moved)
+    Slice Value() final { return current->Value(); }       // current value (valid until moved)
+  private:
+    void FindSmallest();                                   // pick lowest valid child
+    void FindLargest();                                    // pick highest valid child
+    vector<unique_ptr<KVIterator>> children;               // one iterator per shard
+    KVIterator* current;                                   // child at current key (null if none)
+    bool forward;                                          // direction of last move
+};
+
+} // namespace sharded
+} // namespace pmemkv
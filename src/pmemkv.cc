@@ -30,15 +30,98 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <cstdlib>
+#include <map>
 #include "engines/blackhole.h"
+#include "engines/cache.h"
 #include "engines/kvtree.h"
 #include "engines/kvtree2.h"
 #include "engines/btree.h"
+#include "engines/hashmap.h"
 #include "engines/mvtree.h"
+#include "engines/sharded.h"
 
 namespace pmemkv {
 
+// parses "cache:<engine>" or "cache=<bytes>:<engine>", which layers a value cache over engine
+static bool ParseCacheOption(const string& engine, string* cached_engine, size_t* capacity) {
+    const auto sep = engine.find(':');
+    if (sep == string::npos || engine.compare(0, cache::ENGINE.size(), cache::ENGINE) != 0) {
+        return false;
+    }
+    *cached_engine = engine.substr(sep + 1);
+    *capacity = DEFAULT_CACHE_BYTES;
+    if (sep == cache::ENGINE.size()) return true;
+    if (engine[cache::ENGINE.size()] != '=') return false;
+    const string bytes = engine.substr(cache::ENGINE.size() + 1, sep - cache::ENGINE.size() - 1);
+    char* end;
+    *capacity = (size_t) strtoull(bytes.c_str(), &end, 10);
+    return !bytes.empty() && *end == '\0';
+}
+
+// parses "<engine>,<option>=<value>,...", which passes options to the engine's constructor
+static bool ParseEngineOptions(const string& engine, string* name, std::map<string, string>* options) {
+    auto sep = engine.find(',');
+    *name = engine.substr(0, sep);
+    options->clear();
+    while (sep != string::npos) {
+        const auto next = engine.find(',', sep + 1);
+        const string option = engine.substr(sep + 1, next == string::npos ? next : next - sep - 1);
+        const auto eq = option.find('=');
+        if (eq == string::npos || eq == 0) return false;
+        (*options)[option.substr(0, eq)] = option.substr(eq + 1);
+        sep = next;
+    }
+    return true;
+}
+
+// parses unsigned decimal option value
+static bool ParseCount(const string& value, size_t* count) {
+    char* end;
+    *count = (size_t) strtoull(value.c_str(), &end, 10);
+    return !value.empty() && value[0] != '-' && *end == '\0';
+}
+
+// creates kvtree2 engine with options from "kvtree2,..." (null if any option is unknown or bad)
+static KVEngine* OpenKVTree2(const string& path, const size_t size, const std::map<string, string>& options) {
+    auto format = kvtree2::LEAF_FORMAT_FAST16;
+    size_t recovery_threads = 0;
+    size_t background_recovery = 0;
+    size_t merge_keys = kvtree2::LEAF_MERGE_KEYS;
+    for (auto& option : options) {
+        if (option.first == "format") {                    // only used when creating pool
+            if (option.second == "pearson8") {
+                format = kvtree2::LEAF_FORMAT_PEARSON8;
+            } else if (option.second == "fast16") {
+                format = kvtree2::LEAF_FORMAT_FAST16;
+            } else if (option.second == "inline") {
+                format = kvtree2::LEAF_FORMAT_INLINE;
+            } else {
+                return nullptr;
+            }
+        } else if (option.first == "recovery_threads") {   // 0 for one per CPU
+            if (!ParseCount(option.second, &recovery_threads)) return nullptr;
+        } else if (option.first == "background_recovery") {
+            if (!ParseCount(option.second, &background_recovery) || background_recovery > 1) return nullptr;
+        } else if (option.first == "merge_keys") {         // 0 disables merging
+            if (!ParseCount(option.second, &merge_keys)) return nullptr;
+        } else {
+            return nullptr;
+        }
+    }
+    return new kvtree2::KVTree(path, size, format, recovery_threads, background_recovery == 1, merge_keys);
+}
+
 KVEngine* KVEngine::Open(const string& engine, const string& path, const size_t size) {
+    string cached_engine;
+    size_t capacity;
+    if (ParseCacheOption(engine, &cached_engine, &capacity)) {
+        auto kv = Open(cached_engine, path, size);
+        return kv ? new cache::CachedEngine(kv, capacity) : nullptr;
+    }
+    string name;
+    std::map<string, string> options;
+    if (!ParseEngineOptions(engine, &name, &options)) return nullptr;
     try {
         if (engine == blackhole::ENGINE) {
             return new blackhole::Blackhole();
@@ -46,10 +129,14 @@ KVEngine* KVEngine::Open(const string& engine, const string& path, const size_t
             return new mvtree::MVTree(path, size);
         } else if (engine == kvtree::ENGINE) {
             return new kvtree::KVTree(path, size);
-        } else if (engine == kvtree2::ENGINE) {
-            return new kvtree2::KVTree(path, size);
+        } else if (name == kvtree2::ENGINE) {
+            return OpenKVTree2(path, size, options);
         } else if (engine == btree::ENGINE) {
             return new btree::BTreeEngine(path, size);
+        } else if (engine == sharded::ENGINE) {
+            return new sharded::ShardedEngine(path, size);
+        } else if (engine == hashmap::ENGINE) {
+            return new hashmap::HashMap(path, size);
         } else {
             return nullptr;
         }
@@ -59,6 +146,15 @@ KVEngine* KVEngine::Open(const string& engine, const string& path, const size_t
 }
 
 KVEngine* KVEngine::OpenOid(const string& engine, const string& path, PMEMoid oid, const size_t size) {
+    string cached_engine;
+    size_t capacity;
+    if (ParseCacheOption(engine, &cached_engine, &capacity)) {
+        auto kv = OpenOid(cached_engine, path, oid, size);
+        return kv ? new cache::CachedEngine(kv, capacity) : nullptr;
+    }
+    string name;
+    std::map<string, string> options;
+    if (!ParseEngineOptions(engine, &name, &options)) return nullptr;
     try {
         if (engine == blackhole::ENGINE) {
             return new blackhole::Blackhole();
@@ -66,10 +162,14 @@ KVEngine* KVEngine::OpenOid(const string& engine, const string& path, PMEMoid oi
             return new mvtree::MVTree(path, oid, size);
         } else if (engine == kvtree::ENGINE) {
             return new kvtree::KVTree(path, size);
-        } else if (engine == kvtree2::ENGINE) {
-            return new kvtree2::KVTree(path, size);
+        } else if (name == kvtree2::ENGINE) {
+            return OpenKVTree2(path, size, options);
         } else if (engine == btree::ENGINE) {
             return new btree::BTreeEngine(path, size);
+        } else if (engine == sharded::ENGINE) {
+            return new sharded::ShardedEngine(path, size);
+        } else if (engine == hashmap::ENGINE) {
+            return new hashmap::HashMap(path, size);
         } else {
             return nullptr;
         }
@@ -79,6 +179,12 @@ KVEngine* KVEngine::OpenOid(const string& engine, const string& path, PMEMoid oi
 }
 
 KVEngine* KVEngine::OpenPopOid(const string& engine, PMEMobjpool* pop, PMEMoid oid, const size_t size) {
+    string cached_engine;
+    size_t capacity;
+    if (ParseCacheOption(engine, &cached_engine, &capacity)) {
+        auto kv = OpenPopOid(cached_engine, pop, oid, size);
+        return kv ? new cache::CachedEngine(kv, capacity) : nullptr;
+    }
     try {
         if(engine == mvtree::ENGINE) {
             return new mvtree::MVTree(pop, oid, size);
@@ -91,9 +197,38 @@ KVEngine* KVEngine::OpenPopOid(const string& engine, PMEMobjpool* pop, PMEMoid o
 }
 
 
+void WriteBatch::Put(const Slice& key, const Slice& value) {
+    owned.emplace_back();                                  // key & value share one copy
+    string& bytes = owned.back();
+    bytes.reserve(key.size() + value.size());
+    bytes.append(key.data(), key.size());
+    bytes.append(value.data(), value.size());
+    PutNoCopy(Slice(bytes.data(), key.size()), Slice(bytes.data() + key.size(), value.size()));
+}
+
+void WriteBatch::PutNoCopy(const Slice& key, const Slice& value) {
+    ops.push_back({false, key, value});
+}
+
+void WriteBatch::Remove(const Slice& key) {
+    owned.emplace_back(key.data(), key.size());
+    RemoveNoCopy(owned.back());
+}
+
+void WriteBatch::RemoveNoCopy(const Slice& key) {
+    ops.push_back({true, key, Slice()});
+}
+
+void WriteBatch::Clear() {
+    ops.clear();
+    owned.clear();
+}
+
 void KVEngine::Close(KVEngine* kv) {
     auto engine = kv->Engine();
-    if (engine == blackhole::ENGINE) {
+    if (engine.compare(0, cache::ENGINE.size() + 1, cache::ENGINE + ":") == 0) {
+        delete (cache::CachedEngine*) kv;
+    } else if (engine == blackhole::ENGINE) {
         delete (blackhole::Blackhole*) kv;
     } else if (engine == mvtree::ENGINE) {
         delete (mvtree::MVTree*) kv;
@@ -103,6 +238,10 @@ void KVEngine::Close(KVEngine* kv) {
         delete (kvtree2::KVTree*) kv;
     } else if (engine == btree::ENGINE) {
         delete (btree::BTreeEngine*) kv;
+    } else if (engine == sharded::ENGINE) {
+        delete (sharded::ShardedEngine*) kv;
+    } else if (engine == hashmap::ENGINE) {
+        delete (hashmap::HashMap*) kv;
     }
 }
 
@@ -123,27 +262,128 @@ extern "C" int8_t kvengine_get(KVEngine* kv, const int32_t limit, const int32_t
     return kv->Get(limit, keybytes, valuebytes, key, value);
 }
 
+extern "C" int8_t kvengine_get_callback(KVEngine* kv, const int32_t keybytes, const char* key,
+                                        void* context, KVGetCallback* callback) {
+    return kv->Get(Slice(key, (size_t) keybytes), context, callback);
+}
+
+extern "C" void kvengine_all_keys(KVEngine* kv, void* context, KVAllKeysCallback* callback) {
+    kv->AllKeys(context, callback);
+}
+
+extern "C" void kvengine_all_key_values(KVEngine* kv, void* context, KVAllKeyValuesCallback* callback) {
+    kv->AllKeyValues(context, callback);
+}
+
 extern "C" int8_t kvengine_put(KVEngine* kv, const int32_t keybytes, int32_t* valuebytes,
                                const char* key, const char* value) {
-    return kv->Put(string(key, (size_t) keybytes), string(value, (size_t) *valuebytes));
+    return kv->Put(Slice(key, (size_t) keybytes), Slice(value, (size_t) *valuebytes));
 }
 
 extern "C" int8_t kvengine_remove(KVEngine* kv, const int32_t keybytes, const char* key) {
-    return kv->Remove(string(key, (size_t) keybytes));
+    return kv->Remove(Slice(key, (size_t) keybytes));
 };
 
+extern "C" int8_t kvengine_write(KVEngine* kv, const WriteBatch* batch) {
+    return kv->Write(*batch);
+}
+
+extern "C" WriteBatch* kvengine_batch_create() {
+    return new WriteBatch();
+}
+
+extern "C" void kvengine_batch_destroy(WriteBatch* batch) {
+    delete batch;
+}
+
+extern "C" void kvengine_batch_put(WriteBatch* batch, const int32_t keybytes, const int32_t valuebytes,
+                                   const char* key, const char* value) {
+    batch->Put(Slice(key, (size_t) keybytes), Slice(value, (size_t) valuebytes));
+}
+
+extern "C" void kvengine_batch_remove(WriteBatch* batch, const int32_t keybytes, const char* key) {
+    batch->Remove(Slice(key, (size_t) keybytes));
+}
+
+extern "C" void kvengine_batch_clear(WriteBatch* batch) {
+    batch->Clear();
+}
+
 extern "C" int8_t kvengine_get_ffi(FFIBuffer* buf) {
     return buf->kv->Get(buf->limit, buf->keybytes, &buf->valuebytes,
                         buf->data, buf->data + buf->keybytes);
 }
 
 extern "C" int8_t kvengine_put_ffi(const FFIBuffer* buf) {
-    return buf->kv->Put(string(buf->data, (size_t) buf->keybytes),
-                        string(buf->data + buf->keybytes, (size_t) buf->valuebytes));
+    return buf->kv->Put(Slice(buf->data, (size_t) buf->keybytes),
+                        Slice(buf->data + buf->keybytes, (size_t) buf->valuebytes));
 }
 
 extern "C" int8_t kvengine_remove_ffi(const FFIBuffer* buf) {
-    return buf->kv->Remove(string(buf->data, (size_t) buf->keybytes));
+    return buf->kv->Remove(Slice(buf->data, (size_t) buf->keybytes));
+}
+
+extern "C" void kvengine_batch_put_ffi(WriteBatch* batch, const FFIBuffer* buf) {
+    batch->Put(Slice(buf->data, (size_t) buf->keybytes),
+               Slice(buf->data + buf->keybytes, (size_t) buf->valuebytes));
+}
+
+extern "C" void kvengine_batch_remove_ffi(WriteBatch* batch, const FFIBuffer* buf) {
+    batch->Remove(Slice(buf->data, (size_t) buf->keybytes));
+}
+
+extern "C" int8_t kvengine_exec_batch_ffi(FFIBatchBuffer* buf) {
+    KVEngine* kv = buf->kv;
+    int8_t result = OK;
+    WriteBatch batch;
+    vector<FFIBatchEntry*> pending;                        // writes sharing the next transaction
+    auto flush = [&]() {
+        if (pending.empty()) return;
+        const int8_t s = kv->Write(batch);
+        for (auto entry : pending) entry->status = s;
+        if (s == FAILED) result = FAILED;
+        batch.Clear();
+        pending.clear();
+    };
+    char* p = buf->data;
+    char* const end = buf->data + buf->databytes;
+    for (int32_t i = 0; i < buf->count; i++) {
+        if (end - p < (ptrdiff_t) sizeof(FFIBatchEntry)) { // truncated entry header
+            result = FAILED;
+            break;
+        }
+        auto entry = (FFIBatchEntry*) p;
+        const int32_t payload = entry->op == GET_OP ? entry->limit :
+                                entry->op == PUT_OP ? entry->valuebytes : 0;
+        if (entry->keybytes < 0 || payload < 0 ||
+            (int64_t) entry->keybytes + payload > end - entry->data) {
+            entry->status = FAILED;                        // would read past buffer, stop here
+            result = FAILED;
+            break;
+        }
+        char* value = entry->data + entry->keybytes;
+        const Slice key(entry->data, (size_t) entry->keybytes);
+        if (entry->op == GET_OP) {
+            flush();                                       // gets must see preceding writes
+            entry->status = kv->Get(entry->limit, entry->keybytes, &entry->valuebytes, entry->data, value);
+            if (entry->status == FAILED) result = FAILED;
+            p = value + entry->limit;
+        } else if (entry->op == PUT_OP) {                  // buffer outlives batch, so
+            batch.PutNoCopy(key, Slice(value, (size_t) entry->valuebytes));  // no copies
+            pending.push_back(entry);
+            p = value + entry->valuebytes;
+        } else if (entry->op == REMOVE_OP) {
+            batch.RemoveNoCopy(key);
+            pending.push_back(entry);
+            p = value;
+        } else {
+            entry->status = FAILED;                        // entry size unknown, stop here
+            result = FAILED;
+            break;
+        }
+    }
+    flush();
+    return result;
 }
 
 extern "C" PMEMoid kvengine_get_rootoid(KVEngine* kv) {
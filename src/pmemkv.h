@@ -38,8 +38,38 @@ typedef enum {                                             // status enumeration
     OK = 1                                                 // successful completion
 } KVStatus;
 
+typedef enum {                                             // packed batch operations
+    GET_OP = 0,                                            // read value into entry
+    PUT_OP = 1,                                            // write value from entry
+    REMOVE_OP = 2                                          // remove key
+} KVBatchOp;
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef void (KVGetCallback)(void* context,                // receives value without copying
+                             int32_t valuebytes,           // (value is only valid during call)
+                             const char* value);
+
+typedef bool (KVAllKeysCallback)(void* context,            // receives each key, returns false
+                                 int32_t keybytes,         // to stop (key only valid during call)
+                                 const char* key);
+
+typedef bool (KVAllKeyValuesCallback)(void* context,       // receives each pair, returns false
+                                      int32_t keybytes,    // to stop (pair only valid during call)
+                                      const char* key,
+                                      int32_t valuebytes,
+                                      const char* value);
+
+typedef void (KVMultiGetCallback)(void* context,           // receives each value found by MultiGet
+                                  int32_t index,           // (position of key in request)
+                                  int32_t valuebytes,      // (value is only valid during call)
+                                  const char* value);
+
 #ifdef __cplusplus
 
+#include <cstring>
+#include <deque>
 #include <string>
 #include <libpmemobj++/make_persistent.hpp>
 #include <libpmemobj++/make_persistent_array.hpp>
@@ -60,6 +90,77 @@ namespace pmemkv {
 
 const string LAYOUT = "pmemkv";                            // pool layout identifier
 
+class Slice {                                              // non-owning reference to bytes
+  public:
+    Slice() : ptr(""), len(0) {}                           // empty slice
+    Slice(const char* data, size_t size)                   // refer to sized buffer
+            : ptr(data), len(size) {}
+    Slice(const string& s) : ptr(s.data()), len(s.size()) {}   // refer to std::string contents
+    Slice(const char* s) : ptr(s), len(strlen(s)) {}       // refer to C-style string
+
+    const char* data() const { return ptr; }               // pointer to first byte
+    size_t size() const { return len; }                    // count of bytes
+    bool empty() const { return len == 0; }                // indicate zero-length slice
+    string ToString() const { return string(ptr, len); }   // copy into std::string
+    int compare(const Slice& other) const {                // order like std::string::compare
+        const size_t min = len < other.len ? len : other.len;
+        int r = memcmp(ptr, other.ptr, min);
+        if (r == 0) r = (len < other.len) ? -1 : (len > other.len) ? 1 : 0;
+        return r;
+    }
+  private:
+    const char* ptr;                                       // referenced bytes (not owned)
+    size_t len;                                            // count of referenced bytes
+};
+
+inline bool operator==(const Slice& lhs, const Slice& rhs) {
+    return lhs.size() == rhs.size() && memcmp(lhs.data(), rhs.data(), lhs.size()) == 0;
+}
+
+inline bool operator!=(const Slice& lhs, const Slice& rhs) {
+    return !(lhs == rhs);
+}
+
+struct WriteBatchOp {                                      // single update held by batch
+    bool remove;                                           // remove key rather than put value
+    Slice key;                                             // key to update
+    Slice value;                                           // value to put (empty for remove)
+};
+
+class WriteBatch {                                         // updates applied together by Write
+  public:
+    WriteBatch() {}                                        // default constructor
+    void Put(const Slice& key,                             // add put of value for key (copies
+             const Slice& value);                          // key & value into batch)
+    void PutNoCopy(const Slice& key,                       // add put of value for key (caller
+                   const Slice& value);                    // keeps bytes valid until batch is
+                                                           // written or cleared)
+    void Remove(const Slice& key);                         // add removal of key (copies key)
+    void RemoveNoCopy(const Slice& key);                   // add removal of key (caller keeps
+                                                           // bytes valid as for PutNoCopy)
+    void Clear();                                          // discard all updates
+    size_t Count() const { return ops.size(); }            // count of updates held
+    const vector<WriteBatchOp>& Ops() const { return ops; } // updates in order added
+  private:
+    WriteBatch(const WriteBatch&);                         // prevent copying (ops refer to
+    void operator=(const WriteBatch&);                     // bytes owned by this batch)
+    vector<WriteBatchOp> ops;                              // updates in order added
+    std::deque<string> owned;                              // copied bytes (stay put as added to)
+};
+
+class KVIterator {                                         // ordered cursor over engine keys
+  public:
+    virtual ~KVIterator() = default;                       // default destructor
+    virtual bool Valid() = 0;                              // positioned at a key?
+    virtual void SeekToFirst() = 0;                        // position at lowest key
+    virtual void SeekToLast() = 0;                         // position at highest key
+    virtual void Seek(const Slice& key) = 0;               // position at first key >= given key
+    virtual void Next() = 0;                               // advance to next higher key
+    virtual void Prev() = 0;                               // back up to next lower key
+    virtual Slice Key() = 0;                               // current key (valid until moved)
+    virtual Slice Value() = 0;                             // current value (valid until moved)
+};
+
 class KVEngine {                                           // storage engine implementations
   public:
     static KVEngine* Open(const string& engine,            // open storage engine
@@ -86,15 +187,29 @@ class KVEngine {                                           // storage engine imp
                          int32_t* valuebytes,
                          const char* key,
                          char* value) = 0;
-    virtual KVStatus Get(const string& key,                // append value to std::string
+    virtual KVStatus Get(const Slice& key,                 // append value to std::string
                          string* value) = 0;
-    virtual KVStatus Put(const string& key,                // copy value from std::string
-                         const string& value) = 0;
-    virtual KVStatus Remove(const string& key) = 0;        // remove value for key
+    virtual KVStatus Get(const Slice& key,                 // pass value to callback without copy
+                         void* context,
+                         KVGetCallback* callback) = 0;
+    virtual void MultiGet(const vector<string>& keys,      // pass each value found to callback
+                          void* context,
+                          KVMultiGetCallback* callback) = 0;
+    virtual KVStatus Put(const Slice& key,                 // copy value from slice
+                         const Slice& value) = 0;
+    virtual KVStatus Remove(const Slice& key) = 0;         // remove value for key
+    virtual KVStatus Write(const WriteBatch& batch) = 0;   // apply all updates or none
+    virtual KVIterator* NewIterator() = 0;                 // unpositioned iterator, or null if not
+                                                           // supported (invalidated by any write)
 
     virtual PMEMoid GetRootOid() = 0;
     virtual PMEMobjpool* GetPool() = 0;
 
+    virtual void AllKeys(void* context,                    // pass each key to callback
+                         KVAllKeysCallback* callback) = 0;
+    virtual void AllKeyValues(void* context,               // pass each key & value to callback
+                              KVAllKeyValuesCallback* callback) = 0;
+
     virtual void ListAllKeyValuePairs(vector<string>& kv_pairs) = 0; // list all key value pairs
 
     virtual void ListAllKeys(vector<string>& keys) = 0; // list all keys
@@ -111,6 +226,22 @@ struct FFIBuffer {                                         // FFI buffer providi
     int32_t valuebytes;
     char data[];
 };
+
+struct FFIBatchEntry {                                     // one packed batch operation
+    int8_t op;                                             // KVBatchOp code
+    int8_t status;                                         // KVStatus written back
+    int32_t limit;                                         // value capacity reserved for get
+    int32_t keybytes;
+    int32_t valuebytes;                                    // put length, or get result length
+    char data[];                                           // key then value (limit bytes for get,
+};                                                         // valuebytes for put, none for remove)
+
+struct FFIBatchBuffer {                                    // FFI buffer of many operations
+    KVEngine* kv;
+    int32_t count;                                         // number of entries
+    int32_t databytes;                                     // length of data, entries must fit
+    char data[];                                           // entries packed back to back
+};
 #pragma pack(pop)
 
 extern "C" {
@@ -123,6 +254,10 @@ struct KVEngine;                                           // define types as si
 typedef struct KVEngine KVEngine;
 struct FFIBuffer;
 typedef struct FFIBuffer FFIBuffer;
+struct FFIBatchBuffer;
+typedef struct FFIBatchBuffer FFIBatchBuffer;
+struct WriteBatch;
+typedef struct WriteBatch WriteBatch;
 
 KVEngine* kvengine_open(const char* engine,                // open storage engine
                         const char* path,
@@ -150,6 +285,20 @@ int8_t kvengine_get(KVEngine* kv,                          // copy value to fixe
                     const char* key,
                     char* value);
 
+int8_t kvengine_get_callback(KVEngine* kv,                 // pass value to callback without copy
+                             int32_t keybytes,
+                             const char* key,
+                             void* context,
+                             KVGetCallback* callback);
+
+void kvengine_all_keys(KVEngine* kv,                       // pass each key to callback
+                       void* context,
+                       KVAllKeysCallback* callback);
+
+void kvengine_all_key_values(KVEngine* kv,                 // pass each key & value to callback
+                             void* context,
+                             KVAllKeyValuesCallback* callback);
+
 int8_t kvengine_put(KVEngine* kv,                          // copy value from fixed-size buffer
                     int32_t keybytes,
                     int32_t* valuebytes,
@@ -160,9 +309,31 @@ int8_t kvengine_remove(KVEngine* kv,                       // remove value for k
                        int32_t keybytes,
                        const char* key);
 
+int8_t kvengine_write(KVEngine* kv,                        // apply all batched updates or none
+                      const WriteBatch* batch);
+
+WriteBatch* kvengine_batch_create();                       // create empty batch
+
+void kvengine_batch_destroy(WriteBatch* batch);            // release batch
+
+void kvengine_batch_put(WriteBatch* batch,                 // add put of value for key
+                        int32_t keybytes,
+                        int32_t valuebytes,
+                        const char* key,
+                        const char* value);
+
+void kvengine_batch_remove(WriteBatch* batch,              // add removal of key
+                           int32_t keybytes,
+                           const char* key);
+
+void kvengine_batch_clear(WriteBatch* batch);              // discard all updates
+
 int8_t kvengine_get_ffi(FFIBuffer* buf);                   // FFI optimized methods
 int8_t kvengine_put_ffi(const FFIBuffer* buf);
 int8_t kvengine_remove_ffi(const FFIBuffer* buf);
+void kvengine_batch_put_ffi(WriteBatch* batch, const FFIBuffer* buf);
+void kvengine_batch_remove_ffi(WriteBatch* batch, const FFIBuffer* buf);
+int8_t kvengine_exec_batch_ffi(FFIBatchBuffer* buf);       // run all entries in order, FAILED if any did
 
 PMEMoid kvengine_get_rootoid(KVEngine* kv);
 PMEMobjpool* kvengine_get_pool(KVEngine* kv);
@@ -33,16 +33,21 @@
 #include <sys/types.h>
 #include <cstdio>
 #include <cstdlib>
+#include <thread>
+#include <vector>
 #include "leveldb/env.h"
 #include "port/port_posix.h"
 #include "histogram.h"
 #include "mutexlock.h"
 #include "random.h"
 #include "pmemkv.h"
+#include "engines/kvtree2.h"
+#include "engines/mvtree.h"
 
 static const string USAGE =
         "pmemkv_bench\n"
         "--engine=<name>            (storage engine name, default: kvtree2)\n"
+        "                           (kvtree2, kvtree, mvtree, btree, hashmap, sharded, blackhole)\n"
         "--db=<location>            (path to persistent pool, default: /dev/shm/pmemkv)\n"
         "                           (note: file on DAX filesystem, DAX device, or poolset file)\n"
         "--db_size_in_gb=<integer>  (size of persistent pool to create in GB, default: 0)\n"
@@ -50,8 +55,18 @@ static const string USAGE =
         "--histogram=<0|1>          (show histograms when reporting latencies)\n"
         "--num=<integer>            (number of keys to place in database, default: 1000000)\n"
         "--reads=<integer>          (number of read operations, default: 1000000)\n"
-        "--threads=<integer>        (number of concurrent threads, default: 1)\n"
+        "--threads=<integer>,       (number of concurrent threads, default: 1)\n"
+        "                           (note: a list like 1,2,4,8,16,32,64 runs each benchmark\n"
+        "                           once per count, giving a scaling curve)\n"
         "--value_size=<integer>     (size of values in bytes, default: 100)\n"
+        "--batch_size=<integer>     (number of keys per batch operation, default: 100)\n"
+        "--recovery_threads=<integer>\n"
+        "                           (threads rebuilding kvtree2 on open, default: one per CPU)\n"
+        "--background_recovery=<0|1>\n"
+        "                           (open kvtree2 or mvtree before leaves are recovered, and\n"
+        "                           report time until writes are accepted, default: 0)\n"
+        "--inline_records=<0|1>     (store small records inside new kvtree2 leaves, default: 0)\n"
+        "--merge_keys=<integer>     (merge kvtree2 leaves holding fewer keys, default: 12, 0 disables)\n"
         "--benchmarks=<name>,       (comma-separated list of benchmarks to run)\n"
         "    fillseq                (load N values in sequential key order)\n"
         "    fillrandom             (load N values in random key order)\n"
@@ -59,8 +74,10 @@ static const string USAGE =
         "    readseq                (read N values in sequential key order)\n"
         "    readrandom             (read N values in random key order)\n"
         "    readmissing            (read N missing values in random key order)\n"
+        "    multigetrandom         (read N values in random key order, in batches)\n"
         "    deleteseq              (delete N values in sequential key order)\n"
-        "    deleterandom           (delete N values in random key order)\n";
+        "    deleterandom           (delete N values in random key order)\n"
+        "    reopen                 (close and reopen database, timing recovery of N values)\n";
 
 // Default list of comma-separated operations to run
 static const char *FLAGS_benchmarks =
@@ -75,12 +92,27 @@ static int FLAGS_num = 1000000;
 // Number of read operations to do.  If negative, do FLAGS_num reads.
 static int FLAGS_reads = -1;
 
-// Number of concurrent threads to run.
-static int FLAGS_threads = 1;
+// Numbers of concurrent threads to run each benchmark with.
+static std::vector<int> FLAGS_threads(1, 1);
 
 // Size of each value
 static int FLAGS_value_size = 100;
 
+// Number of keys per batch operation
+static int FLAGS_batch_size = 100;
+
+// Number of threads rebuilding kvtree2 on open.  If zero, use one per CPU.
+static int FLAGS_recovery_threads = 0;
+
+// Return from opening kvtree2 before leaves are recovered
+static bool FLAGS_background_recovery = false;
+
+// Store small records inside leaves when creating kvtree2 pool
+static bool FLAGS_inline_records = false;
+
+// Merge kvtree2 leaves left holding fewer keys by deletes.  If zero, never merge.
+static int FLAGS_merge_keys = pmemkv::kvtree2::LEAF_MERGE_KEYS;
+
 // Print histogram of operation timings
 static bool FLAGS_histogram = false;
 
@@ -110,6 +142,19 @@ static Slice TrimSpace(Slice s) {
 
 #endif
 
+static bool ParseThreads(const char *list, std::vector<int> *counts) {
+    counts->clear();
+    for (;;) {
+        char *end;
+        const long n = strtol(list, &end, 10);
+        if (end == list || n < 1 || n > 1024) return false;
+        counts->push_back((int) n);
+        if (*end == '\0') return true;
+        if (*end != ',') return false;
+        list = end + 1;
+    }
+}
+
 static void AppendWithSpace(std::string *str, Slice msg) {
     if (msg.empty()) return;
     if (!str->empty()) {
@@ -167,6 +212,10 @@ public:
     }
 
     void FinishedSingleOp() {
+        FinishedOps(1);
+    }
+
+    void FinishedOps(int n) {
         if (FLAGS_histogram) {
             double now = g_env->NowMicros();
             double micros = now - last_op_finish_;
@@ -178,7 +227,7 @@ public:
             last_op_finish_ = now;
         }
 
-        done_++;
+        done_ += n;
         if (done_ >= next_report_) {
             if (next_report_ < 1000) next_report_ += 100;
             else if (next_report_ < 5000) next_report_ += 500;
@@ -264,6 +313,10 @@ private:
     int num_;
     int value_size_;
     int reads_;
+    size_t lookups_;       // leaf lookups reported by kvtree2 so far
+    size_t key_compares_;  // key compares reported by kvtree2 so far
+    std::thread writable_watch_;  // waits out background recovery after open
+    uint64_t writable_micros_;    // from start of open until writes are accepted
 
     void PrintHeader() {
         const int kKeySize = 16;
@@ -330,10 +383,14 @@ public:
             kv_(NULL),
             num_(FLAGS_num),
             value_size_(FLAGS_value_size),
-            reads_(FLAGS_reads < 0 ? FLAGS_num : FLAGS_reads) {
+            reads_(FLAGS_reads < 0 ? FLAGS_num : FLAGS_reads),
+            lookups_(0),
+            key_compares_(0),
+            writable_micros_(0) {
     }
 
     ~Benchmark() {
+        ReportWritable();
         delete kv_;
     }
 
@@ -359,7 +416,6 @@ public:
 
             void (Benchmark::*method)(ThreadState *) = NULL;
             bool fresh_db = false;
-            int num_threads = FLAGS_threads;
 
             if (name == Slice("fillseq")) {
                 fresh_db = true;
@@ -375,34 +431,48 @@ public:
                 method = &Benchmark::ReadRandom;
             } else if (name == Slice("readmissing")) {
                 method = &Benchmark::ReadMissing;
+            } else if (name == Slice("multigetrandom")) {
+                method = &Benchmark::MultiGetRandom;
             } else if (name == Slice("deleteseq")) {
                 method = &Benchmark::DeleteSeq;
             } else if (name == Slice("deleterandom")) {
                 method = &Benchmark::DeleteRandom;
+            } else if (name == Slice("reopen")) {
+                if (kv_ != NULL) {
+                    ReportWritable();
+                    pmemkv::KVEngine::Close(kv_);                 // timed by Open below
+                    kv_ = NULL;
+                }
             } else {
                 if (name != Slice()) {  // No error message for empty name
                     fprintf(stderr, "unknown benchmark '%s'\n", name.ToString().c_str());
                 }
             }
 
-            if (fresh_db) {
-                if (kv_ != NULL) {
-                    pmemkv::KVEngine::Close(kv_);
-                    kv_ = NULL;
+            for (size_t run = 0; run < FLAGS_threads.size(); run++) {
+                if (fresh_db) {
+                    if (kv_ != NULL) {
+                        ReportWritable();
+                        pmemkv::KVEngine::Close(kv_);
+                        kv_ = NULL;
+                    }
+                    if (FLAGS_db_size_in_gb > 0) {
+                        auto start = g_env->NowMicros();
+                        std::remove(FLAGS_db);
+                        fprintf(stdout, "%-12s : %11.3f millis/op;\n", "removed", ((g_env->NowMicros() - start) * 1e-3));
+                    }
                 }
-                if (FLAGS_db_size_in_gb > 0) {
-                    auto start = g_env->NowMicros();
-                    std::remove(FLAGS_db);
-                    fprintf(stdout, "%-12s : %11.3f millis/op;\n", "removed", ((g_env->NowMicros() - start) * 1e-3));
-                }
-            }
 
-            if (kv_ == NULL) {
-                Open();
-            }
+                if (kv_ == NULL) {
+                    Open();
+                }
 
-            if (method != NULL) {
-                RunBenchmark(num_threads, name, method);
+                if (method == NULL) break;                        // reopen isn't repeated
+                const int num_threads = FLAGS_threads[run];
+                std::string label = name.ToString();
+                if (FLAGS_threads.size() > 1) label += "/" + std::to_string(num_threads);
+                RunBenchmark(num_threads, label, method);
+                ReportWritable();                                 // once recovery has ended
             }
         }
     }
@@ -478,6 +548,7 @@ private:
             arg[0].thread->stats.Merge(arg[i].thread->stats);
         }
         arg[0].thread->stats.Report(name);
+        ReportKeyCompares();
 
         for (int i = 0; i < n; i++) {
             delete arg[i].thread;
@@ -488,12 +559,62 @@ private:
     void Open() {
         assert(kv_ == NULL);
         auto start = g_env->NowMicros();
-        kv_ = pmemkv::KVEngine::Open(FLAGS_engine, FLAGS_db, ((size_t) 1024 * 1024 * 1024 * FLAGS_db_size_in_gb));
+        const size_t size = (size_t) 1024 * 1024 * 1024 * FLAGS_db_size_in_gb;
+        if (strcmp(FLAGS_engine, "kvtree2") == 0) {
+            try {
+                const auto format = FLAGS_inline_records ? pmemkv::kvtree2::LEAF_FORMAT_INLINE
+                                                         : pmemkv::kvtree2::LEAF_FORMAT_FAST16;
+                kv_ = new pmemkv::kvtree2::KVTree(FLAGS_db, size, format,
+                                                  (size_t) FLAGS_recovery_threads, FLAGS_background_recovery,
+                                                  (size_t) FLAGS_merge_keys);
+            } catch (...) {
+                kv_ = nullptr;
+            }
+        } else if (strcmp(FLAGS_engine, "mvtree") == 0 && FLAGS_background_recovery) {
+            try {
+                kv_ = new pmemkv::mvtree::MVTree(FLAGS_db, size, true);
+            } catch (...) {
+                kv_ = nullptr;
+            }
+        } else {
+            kv_ = pmemkv::KVEngine::Open(FLAGS_engine, FLAGS_db, size);
+        }
         if (kv_ == nullptr) {
             fprintf(stderr, "Cannot open db (%s) with %i GB capacity\n", FLAGS_db, FLAGS_db_size_in_gb);
             exit(-42);
         }
         fprintf(stdout, "%-12s : %11.3f millis/op;\n", "open", ((g_env->NowMicros() - start) * 1e-3));
+        lookups_ = 0;
+        key_compares_ = 0;
+        if (FLAGS_background_recovery &&
+            (strcmp(FLAGS_engine, "kvtree2") == 0 || strcmp(FLAGS_engine, "mvtree") == 0)) {
+            // writes block until background recovery ends, and so does counting keys
+            writable_watch_ = std::thread([this, start] {
+                kv_->TotalNumKeys();
+                writable_micros_ = g_env->NowMicros() - start;
+            });
+        }
+    }
+
+    void ReportWritable() {
+        // time from open until first write could start, when recovering in background
+        if (!writable_watch_.joinable()) return;
+        writable_watch_.join();
+        fprintf(stdout, "%-12s : %11.3f millis/op;\n", "writable", writable_micros_ * 1e-3);
+    }
+
+    void ReportKeyCompares() {
+        // only kvtree2 counts key compares, and only when built with -DDO_STATS=1
+        auto tree = dynamic_cast<pmemkv::kvtree2::KVTree *>(kv_);
+        if (tree == nullptr) return;
+        pmemkv::kvtree2::KVTreeAnalysis analysis = {};
+        tree->Analyze(analysis);
+        if (analysis.lookups > lookups_) {
+            fprintf(stdout, "%-12s : %11.3f key compares/lookup;\n", "",
+                    (double) (analysis.key_compares - key_compares_) / (analysis.lookups - lookups_));
+        }
+        lookups_ = analysis.lookups;
+        key_compares_ = analysis.key_compares;
     }
 
     void DoWrite(ThreadState *thread, bool seq) {
@@ -561,6 +682,39 @@ private:
         DoRead(thread, false, true);
     }
 
+    struct MultiGetResult {
+        int found;
+        int64_t bytes;
+    };
+
+    static void MultiGetFound(void *context, int32_t index, int32_t valuebytes, const char *value) {
+        auto result = (MultiGetResult *) context;
+        result->found++;
+        result->bytes += valuebytes;
+    }
+
+    void MultiGetRandom(ThreadState *thread) {
+        MultiGetResult result = {0, 0};
+        vector<string> keys;
+        keys.reserve(FLAGS_batch_size);
+        for (int i = 0; i < reads_; i += FLAGS_batch_size) {
+            keys.clear();
+            for (int j = i; j < reads_ && j < i + FLAGS_batch_size; j++) {
+                const int k = thread->rand.Next() % FLAGS_num;
+                char key[100];
+                snprintf(key, sizeof(key), "%016d", k);
+                keys.push_back(key);
+                result.bytes += strlen(key);
+            }
+            kv_->MultiGet(keys, &result, MultiGetFound);
+            thread->stats.FinishedOps((int) keys.size());
+        }
+        thread->stats.AddBytes(result.bytes);
+        char msg[100];
+        snprintf(msg, sizeof(msg), "(%d of %d found)", result.found, reads_);
+        thread->stats.AddMessage(msg);
+    }
+
     void DoDelete(ThreadState *thread, bool seq) {
         for (int i = 0; i < num_; i++) {
             const int k = seq ? i : (thread->rand.Next() % FLAGS_num);
@@ -595,6 +749,7 @@ int main(int argc, char **argv) {
     for (int i = 1; i < argc; i++) {
         int n;
         char junk;
+        std::vector<int> counts;
         if (leveldb::Slice(argv[i]).starts_with("--benchmarks=")) {
             FLAGS_benchmarks = argv[i] + strlen("--benchmarks=");
         } else if (strncmp(argv[i], "--engine=", 9) == 0) {
@@ -605,10 +760,20 @@ int main(int argc, char **argv) {
             FLAGS_num = n;
         } else if (sscanf(argv[i], "--reads=%d%c", &n, &junk) == 1) {
             FLAGS_reads = n;
-        } else if (sscanf(argv[i], "--threads=%d%c", &n, &junk) == 1) {
-            FLAGS_threads = n;
+        } else if (strncmp(argv[i], "--threads=", 10) == 0 && ParseThreads(argv[i] + 10, &counts)) {
+            FLAGS_threads = counts;
         } else if (sscanf(argv[i], "--value_size=%d%c", &n, &junk) == 1) {
             FLAGS_value_size = n;
+        } else if (sscanf(argv[i], "--batch_size=%d%c", &n, &junk) == 1 && n > 0) {
+            FLAGS_batch_size = n;
+        } else if (sscanf(argv[i], "--recovery_threads=%d%c", &n, &junk) == 1 && n >= 0) {
+            FLAGS_recovery_threads = n;
+        } else if (sscanf(argv[i], "--background_recovery=%d%c", &n, &junk) == 1 && (n == 0 || n == 1)) {
+            FLAGS_background_recovery = n;
+        } else if (sscanf(argv[i], "--inline_records=%d%c", &n, &junk) == 1 && (n == 0 || n == 1)) {
+            FLAGS_inline_records = n;
+        } else if (sscanf(argv[i], "--merge_keys=%d%c", &n, &junk) == 1 && n >= 0) {
+            FLAGS_merge_keys = n;
         } else if (strncmp(argv[i], "--db=", 5) == 0) {
             FLAGS_db = argv[i] + 5;
         } else if (sscanf(argv[i], "--db_size_in_gb=%d%c", &n, &junk) == 1) {
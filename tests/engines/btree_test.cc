@@ -30,10 +30,13 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
 #include "gtest/gtest.h"
 #include "../../src/engines/btree.h"
 
 using namespace pmemkv::btree;
+using pmemkv::KVIterator;
+using pmemkv::WriteBatch;
 
 const string PATH = "/dev/shm/pmemkv";
 const size_t SIZE = 1024ull * 1024ull * 512ull;
@@ -75,6 +78,41 @@ TEST_F(BTreeEngineTest, SimpleTest) {
     ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
 }
 
+TEST_F(BTreeEngineTest, AllKeysTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key3", "value3") == OK) << pmemobj_errormsg();
+    vector<string> keys;
+    kv->AllKeys(&keys, [](void* context, int32_t keybytes, const char* key) {
+        ((vector<string>*) context)->push_back(string(key, (size_t) keybytes));
+        return true;
+    });
+    std::sort(keys.begin(), keys.end());
+    ASSERT_EQ(keys, vector<string>({"key1", "key2", "key3"}));
+    keys.clear();
+    kv->ListAllKeys(keys);
+    std::sort(keys.begin(), keys.end());
+    ASSERT_EQ(keys, vector<string>({"key1", "key2", "key3"}));
+    ASSERT_EQ(kv->TotalNumKeys(), 3);
+}
+
+TEST_F(BTreeEngineTest, AllKeyValuesTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key3", "value3") == OK) << pmemobj_errormsg();
+    string pairs;
+    kv->AllKeyValues(&pairs, [](void* context, int32_t keybytes, const char* key,
+                                int32_t valuebytes, const char* value) {
+        auto pairs = (string*) context;
+        pairs->append(key, (size_t) keybytes).append("=").append(value, (size_t) valuebytes);
+        return pairs->size() < 20;                            // stop after second pair
+    });
+    ASSERT_EQ(pairs.size(), 22);
+    vector<string> kv_pairs;
+    kv->ListAllKeyValuePairs(kv_pairs);
+    ASSERT_EQ(kv_pairs.size(), 6);
+}
+
 TEST_F(BTreeEngineTest, BinaryKeyTest) {
     ASSERT_TRUE(kv->Put("a", "should_not_change") == OK) << pmemobj_errormsg();
     string key1 = string("a\0b", 3);
@@ -124,6 +162,34 @@ TEST_F(BTreeEngineTest, GetAppendToExternalValueTest) {
     ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "supercool");
 }
 
+TEST_F(BTreeEngineTest, GetWithCallbackTest) {
+    ASSERT_TRUE(kv->Put("key1", string("A\0B", 3)) == OK) << pmemobj_errormsg();
+    string value;
+    auto append = [](void* context, int32_t valuebytes, const char* v) {
+        ((string*) context)->append(v, (size_t) valuebytes);
+    };
+    ASSERT_TRUE(kv->Get("key1", &value, append) == OK);
+    ASSERT_TRUE(value == string("A\0B", 3));
+    string value2;
+    ASSERT_TRUE(kv->Get("key2", &value2, append) == NOT_FOUND);
+    ASSERT_TRUE(value2.empty());
+}
+
+TEST_F(BTreeEngineTest, MultiGetTest) {
+    ASSERT_TRUE(kv->Put("abc", "A1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("def", "B2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("hij", "C3") == OK) << pmemobj_errormsg();
+    vector<string> keys = {"hij", "nope", "abc"};
+    vector<string> values(keys.size());
+    auto found = [](void* context, int32_t index, int32_t valuebytes, const char* value) {
+        ((vector<string>*) context)->at(index).append(value, (size_t) valuebytes);
+    };
+    kv->MultiGet(keys, &values, found);
+    ASSERT_EQ(values[0], "C3");
+    ASSERT_TRUE(values[1].empty());
+    ASSERT_EQ(values[2], "A1");
+}
+
 TEST_F(BTreeEngineTest, GetHeadlessTest) {
     string value;
     ASSERT_TRUE(kv->Get("waldo", &value) == NOT_FOUND);
@@ -284,10 +350,85 @@ TEST_F(BTreeEngineTest, RemoveNonexistentTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }*/
 
+TEST_F(BTreeEngineTest, IteratorTest) {
+    std::unique_ptr<KVIterator> it(kv->NewIterator());
+    ASSERT_FALSE(it->Valid());                                           // not positioned yet
+    it->SeekToFirst();
+    ASSERT_FALSE(it->Valid());
+    it->SeekToLast();
+    ASSERT_FALSE(it->Valid());
+    it->Seek("key");
+    ASSERT_FALSE(it->Valid());
+    ASSERT_TRUE(kv->Put("key3", "value3") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    it.reset(kv->NewIterator());
+    ASSERT_FALSE(it->Valid());
+    it->SeekToFirst();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key1" && it->Value() == "value1");
+    it->Next();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key2" && it->Value() == "value2");
+    it->Next();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key3" && it->Value() == "value3");
+    it->Next();
+    ASSERT_FALSE(it->Valid());
+    it->SeekToLast();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key3");
+    it->Prev();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key2");
+    it->Prev();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key1");
+    it->Prev();
+    ASSERT_FALSE(it->Valid());
+    it->Seek("key2");
+    ASSERT_TRUE(it->Valid() && it->Key() == "key2");
+    it->Seek("key10");
+    ASSERT_TRUE(it->Valid() && it->Key() == "key2");
+    it->Seek("k");
+    ASSERT_TRUE(it->Valid() && it->Key() == "key1");
+    it->Seek("key4");
+    ASSERT_FALSE(it->Valid());
+}
+
+TEST_F(BTreeEngineTest, WriteBatchTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    WriteBatch batch;
+    batch.Put("key2", "value2");
+    batch.Put("key1", "VALUE1");
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "VALUE1");
+    value = "";
+    ASSERT_TRUE(kv->Get("key2", &value) == OK && value == "value2");
+}
+
+TEST_F(BTreeEngineTest, WriteBatchWithRemoveFailsTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    WriteBatch batch;
+    batch.Put("key2", "value2");
+    batch.Put("key1", "VALUE1");
+    batch.Remove("key1");
+    ASSERT_TRUE(kv->Write(batch) == FAILED);
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");  // nothing applied
+    ASSERT_TRUE(kv->Get("key2", &value) == NOT_FOUND);
+    ASSERT_EQ(kv->TotalNumKeys(), 1);
+}
+
 // =============================================================================================
 // TEST RECOVERY OF SINGLE-LEAF TREE
 // =============================================================================================
 
+TEST_F(BTreeEngineTest, TotalNumKeysAfterRecoveryTest) {
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key1", "VALUE1") == OK) << pmemobj_errormsg();
+    ASSERT_EQ(kv->TotalNumKeys(), 2);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), 2);
+}
+
 TEST_F(BTreeEngineTest, GetHeadlessAfterRecoveryTest) {
     Reopen();
     string value;
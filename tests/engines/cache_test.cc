@@ -0,0 +1,199 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "gtest/gtest.h"
+#include "../mock_tx_alloc.h"
+#include "../../src/engines/cache.h"
+
+using namespace pmemkv::cache;
+using pmemkv::KVEngine;
+using pmemkv::WriteBatch;
+
+const string PATH = "/dev/shm/pmemkv";
+const size_t SIZE = ((size_t) (1024 * 1024 * 1104));
+const size_t SMALL_CACHE = 64 * 1024;
+
+class CacheTest : public testing::Test {
+public:
+    CacheAnalysis analysis;
+    CachedEngine* kv;
+
+    CacheTest() {
+        std::remove(PATH.c_str());
+        kv = (CachedEngine*) KVEngine::Open("cache=" + to_string(SMALL_CACHE) + ":kvtree2", PATH, SIZE);
+    }
+
+    ~CacheTest() { KVEngine::Close(kv); }
+
+    void Analyze() {
+        analysis = {};
+        kv->Analyze(analysis);
+    }
+};
+
+// =============================================================================================
+// TEST FACTORY OPTION
+// =============================================================================================
+
+TEST_F(CacheTest, OpenThroughFactoryTest) {
+    ASSERT_TRUE(kv != nullptr);
+    ASSERT_EQ(kv->Engine(), "cache:kvtree2");
+    ASSERT_EQ(kv->Underlying()->Engine(), "kvtree2");
+    Analyze();
+    ASSERT_EQ(analysis.capacity, SMALL_CACHE);
+}
+
+TEST_F(CacheTest, DefaultCapacityTest) {
+    KVEngine* other = KVEngine::Open("cache:blackhole", PATH, SIZE);
+    ASSERT_TRUE(other != nullptr);
+    CacheAnalysis other_analysis = {};
+    ((CachedEngine*) other)->Analyze(other_analysis);
+    ASSERT_EQ(other_analysis.capacity, DEFAULT_CACHE_BYTES);
+    KVEngine::Close(other);
+}
+
+TEST_F(CacheTest, RejectsBadOptionTest) {
+    ASSERT_TRUE(KVEngine::Open("cache=abc:blackhole", PATH, SIZE) == nullptr);
+    ASSERT_TRUE(KVEngine::Open("cache=:blackhole", PATH, SIZE) == nullptr);
+    ASSERT_TRUE(KVEngine::Open("cache:nope", PATH, SIZE) == nullptr);
+}
+
+// =============================================================================================
+// TEST CACHED READS
+// =============================================================================================
+
+TEST_F(CacheTest, HitMissTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+    value.clear();
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+    ASSERT_TRUE(kv->Get("key2", &value) == NOT_FOUND);
+    Analyze();
+    ASSERT_EQ(analysis.hits, 1);
+    ASSERT_EQ(analysis.misses, 2);
+    ASSERT_GT(analysis.bytes, 0);
+}
+
+TEST_F(CacheTest, GetHeadlessTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    char buffer[8];
+    int32_t valuebytes = 0;
+    ASSERT_TRUE(kv->Get(4, 4, &valuebytes, "key1", buffer) == FAILED);  // miss, too small
+    ASSERT_EQ(valuebytes, 6);
+    ASSERT_TRUE(kv->Get(sizeof(buffer), 4, &valuebytes, "key1", buffer) == OK);  // hit
+    ASSERT_EQ(string(buffer, (size_t) valuebytes), "value1");
+    Analyze();
+    ASSERT_EQ(analysis.hits, 1);
+}
+
+TEST_F(CacheTest, MultiGetTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK);
+    vector<string> keys = {"key2", "nada", "key1"};
+    vector<string> values(keys.size());
+    kv->MultiGet(keys, &values, [](void* context, int32_t index, int32_t valuebytes, const char* value) {
+        (*(vector<string>*) context)[index] = string(value, (size_t) valuebytes);
+    });
+    ASSERT_EQ(values, vector<string>({"value2", "", "value1"}));
+    Analyze();
+    ASSERT_EQ(analysis.hits, 1);
+    ASSERT_EQ(analysis.misses, 3);
+}
+
+// =============================================================================================
+// TEST COHERENCE WITH UPDATES
+// =============================================================================================
+
+TEST_F(CacheTest, CoherentPutRemoveTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+    ASSERT_TRUE(kv->Put("key1", "VALUE1") == OK) << pmemobj_errormsg();
+    value.clear();
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "VALUE1");
+    ASSERT_TRUE(kv->Remove("key1") == OK);
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+}
+
+TEST_F(CacheTest, CoherentWriteBatchTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK);
+    ASSERT_TRUE(kv->Get("key2", &value) == OK);
+    WriteBatch batch;
+    batch.Remove("key1");
+    batch.Put("key2", "VALUE2");
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+    value.clear();
+    ASSERT_TRUE(kv->Get("key2", &value) == OK && value == "VALUE2");
+}
+
+// =============================================================================================
+// TEST EVICTION
+// =============================================================================================
+
+TEST_F(CacheTest, StaysWithinBudgetTest) {
+    const string big(200, 'X');
+    for (int i = 0; i < 1000; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, big) == OK) << pmemobj_errormsg();
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == big);
+    }
+    Analyze();
+    ASSERT_GT(analysis.bytes, 0);
+    ASSERT_LE(analysis.bytes, SMALL_CACHE);
+}
+
+TEST_F(CacheTest, ScanResistanceTest) {
+    const string val(100, 'V');
+    for (int i = 0; i < 3020; i++) ASSERT_TRUE(kv->Put(to_string(i), val) == OK);
+    string value;
+    for (int scan = 20; scan < 3020; scan += 100) {                      // hot reads between scans
+        for (int i = 0; i < 20; i++) ASSERT_TRUE(kv->Get(to_string(i), &value) == OK);
+        for (int i = scan; i < scan + 100; i++) ASSERT_TRUE(kv->Get(to_string(i), &value) == OK);
+    }
+    Analyze();
+    const uint64_t hits_before = analysis.hits;
+    for (int i = 0; i < 20; i++) {
+        value.clear();
+        ASSERT_TRUE(kv->Get(to_string(i), &value) == OK && value == val);
+    }
+    Analyze();
+    ASSERT_EQ(analysis.hits - hits_before, 20);
+}
@@ -0,0 +1,318 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <atomic>
+#include <thread>
+#include "gtest/gtest.h"
+#include "../mock_tx_alloc.h"
+#include "../../src/engines/hashmap.h"
+
+using namespace pmemkv::hashmap;
+using pmemkv::WriteBatch;
+
+const string PATH = "/dev/shm/pmemkv";
+const size_t SIZE = ((size_t) (1024 * 1024 * 1104));
+
+class HashMapEmptyTest : public testing::Test {
+public:
+    HashMapEmptyTest() {
+        std::remove(PATH.c_str());
+    }
+};
+
+class HashMapTest : public testing::Test {
+public:
+    HashMapAnalysis analysis;
+    HashMap* kv;
+
+    HashMapTest() {
+        std::remove(PATH.c_str());
+        Open();
+    }
+
+    ~HashMapTest() { delete kv; }
+
+    void Analyze() {
+        analysis = {};
+        kv->Analyze(analysis);
+        ASSERT_TRUE(analysis.path == PATH);
+    }
+
+    void Reopen() {
+        delete kv;
+        Open();
+    }
+
+    size_t HeapObjects() {                                   // count of allocated objects
+        size_t count = 0;
+        for (PMEMoid oid = pmemobj_first(kv->GetPool()); !OID_IS_NULL(oid); oid = pmemobj_next(oid)) {
+            count++;
+        }
+        return count;
+    }
+
+private:
+    void Open() {
+        kv = new HashMap(PATH, SIZE);
+    }
+};
+
+// =============================================================================================
+// TEST EMPTY TABLE
+// =============================================================================================
+
+TEST_F(HashMapEmptyTest, CreateInstanceTest) {
+    HashMap* kv = new HashMap(PATH, PMEMOBJ_MIN_POOL);
+    HashMapAnalysis analysis = {};
+    kv->Analyze(analysis);
+    ASSERT_EQ(analysis.buckets, INITIAL_BUCKETS);
+    ASSERT_EQ(analysis.buckets_draining, 0);
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    delete kv;
+}
+
+TEST_F(HashMapEmptyTest, FailsToCreateInstanceWithInvalidPath) {
+    try {
+        new HashMap("/tmp/123/234/345/456/567/678/nope.nope", PMEMOBJ_MIN_POOL);
+        FAIL();
+    } catch (...) {
+        // do nothing, expected to happen
+    }
+}
+
+// =============================================================================================
+// TEST SINGLE KEYS
+// =============================================================================================
+
+TEST_F(HashMapTest, SimpleTest) {
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+    ASSERT_EQ(kv->TotalNumKeys(), 1);
+}
+
+TEST_F(HashMapTest, BinaryKeyTest) {
+    ASSERT_TRUE(kv->Put("a", "should_not_change") == OK) << pmemobj_errormsg();
+    string key1 = string("a\0b", 3);
+    ASSERT_TRUE(kv->Put(key1, "stuff") == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get(key1, &value) == OK && value == "stuff");
+    ASSERT_TRUE(kv->Remove(key1) == OK);
+    string value2;
+    ASSERT_TRUE(kv->Get(key1, &value2) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("a", &value2) == OK && value2 == "should_not_change");
+}
+
+TEST_F(HashMapTest, GetHeadlessTest) {
+    char buffer[4];
+    int32_t valuebytes = 0;
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Get(sizeof(buffer), 4, &valuebytes, "key1", buffer) == FAILED);
+    ASSERT_EQ(valuebytes, 6);
+    ASSERT_TRUE(kv->Get(sizeof(buffer), 4, &valuebytes, "key2", buffer) == NOT_FOUND);
+}
+
+TEST_F(HashMapTest, OverwriteTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key1", "VALUE1") == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "VALUE1");
+    ASSERT_EQ(kv->TotalNumKeys(), 1);
+}
+
+TEST_F(HashMapTest, RemoveTest) {
+    ASSERT_TRUE(kv->Remove("nada") == OK);
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Remove("key1") == OK);
+    ASSERT_TRUE(kv->Remove("key1") == OK);
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+}
+
+TEST_F(HashMapTest, OverwriteAndRemoveFreeRecordsTest) {
+    const size_t before = HeapObjects();
+    for (int i = 0; i < 100; i++) {
+        ASSERT_TRUE(kv->Put(to_string(i), "!") == OK) << pmemobj_errormsg();
+    }
+    const size_t filled = HeapObjects();
+    ASSERT_EQ(filled, before + 200);                         // one entry & one record per key
+    for (int pass = 1; pass <= 5; pass++) {
+        for (int i = 0; i < 100; i++) {
+            ASSERT_TRUE(kv->Put(to_string(i), string(pass * 50, '*')) == OK) << pmemobj_errormsg();
+        }
+        ASSERT_EQ(HeapObjects(), filled) << pass;            // old records are freed
+    }
+    for (int i = 0; i < 100; i++) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    ASSERT_EQ(HeapObjects(), before);
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+}
+
+TEST_F(HashMapTest, MultiGetTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key3", "value3") == OK) << pmemobj_errormsg();
+    vector<string> keys = {"key3", "key2", "key1"};
+    vector<string> values(keys.size());
+    kv->MultiGet(keys, &values, [](void* context, int32_t index, int32_t valuebytes, const char* value) {
+        (*(vector<string>*) context)[index] = string(value, (size_t) valuebytes);
+    });
+    ASSERT_EQ(values, vector<string>({"value3", "", "value1"}));
+}
+
+TEST_F(HashMapTest, WriteBatchTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    WriteBatch batch;
+    batch.Put("key2", "value2");
+    batch.Remove("key1");
+    batch.Put("key2", "VALUE2");
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("key2", &value) == OK && value == "VALUE2");
+    ASSERT_EQ(kv->TotalNumKeys(), 1);
+}
+
+TEST_F(HashMapTest, NoIteratorTest) {
+    ASSERT_TRUE(kv->NewIterator() == nullptr);
+}
+
+// =============================================================================================
+// TEST GROWING TABLE
+// =============================================================================================
+
+const int GROW_LIMIT = INITIAL_BUCKETS * MAX_LOAD * 4;
+
+TEST_F(HashMapTest, GrowTest) {
+    for (int i = 1; i <= GROW_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+    }
+    Analyze();
+    ASSERT_GE(analysis.buckets, GROW_LIMIT / MAX_LOAD);
+    ASSERT_EQ(kv->TotalNumKeys(), GROW_LIMIT);
+    for (int i = 1; i <= GROW_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+    }
+    vector<string> keys;
+    kv->ListAllKeys(keys);
+    ASSERT_EQ(keys.size(), GROW_LIMIT);
+}
+
+TEST_F(HashMapTest, GrowWhileDrainingAfterRecoveryTest) {
+    int i = 1;
+    for (; i <= INITIAL_BUCKETS * MAX_LOAD + 1; i++) {                    // just past first growth
+        ASSERT_TRUE(kv->Put(to_string(i), to_string(i)) == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    ASSERT_EQ(analysis.buckets, INITIAL_BUCKETS * 2);
+    ASSERT_EQ(analysis.buckets_draining, INITIAL_BUCKETS);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), INITIAL_BUCKETS * MAX_LOAD + 1);
+    for (; i <= GROW_LIMIT; i++) {
+        ASSERT_TRUE(kv->Put(to_string(i), to_string(i)) == OK) << pmemobj_errormsg();
+    }
+    for (int j = 1; j <= GROW_LIMIT; j += 2) ASSERT_TRUE(kv->Remove(to_string(j)) == OK);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), GROW_LIMIT / 2);
+    for (int j = 1; j <= GROW_LIMIT; j++) {
+        string value;
+        if (j % 2 == 1) {
+            ASSERT_TRUE(kv->Get(to_string(j), &value) == NOT_FOUND);
+        } else {
+            ASSERT_TRUE(kv->Get(to_string(j), &value) == OK && value == to_string(j));
+        }
+    }
+}
+
+// =============================================================================================
+// TEST CONCURRENT ACCESS
+// =============================================================================================
+
+TEST_F(HashMapTest, ConcurrentPutGetRemoveTest) {
+    const int threads_count = 8;
+    const int limit = 5000;
+    std::atomic<int> errors(0);
+    vector<std::thread> threads;
+    for (int t = 0; t < threads_count; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < limit; i++) {
+                string istr = to_string(t) + "-" + to_string(i);
+                if (kv->Put(istr, istr + "!") != OK) errors++;
+                string value;
+                if (kv->Get(istr, &value) != OK || value != istr + "!") errors++;
+                if (i % 2 == 1 && kv->Remove(istr) != OK) errors++;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    ASSERT_EQ(errors, 0);
+    ASSERT_EQ(kv->TotalNumKeys(), threads_count * limit / 2);
+    Analyze();
+    ASSERT_GE(analysis.buckets, INITIAL_BUCKETS * 2);
+}
+
+TEST_F(HashMapTest, AllKeyValuesCallbackUpdatesTest) {
+    const int limit = INITIAL_BUCKETS * MAX_LOAD * 2;
+    for (int i = 0; i < limit; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+    }
+    struct Visit {
+        HashMap* kv;
+        int visited;
+        int errors;
+    } visit = {kv, 0, 0};
+    kv->AllKeyValues(&visit, [](void* context, int32_t keybytes, const char* key,
+                                int32_t valuebytes, const char* value) {
+        auto visit = (Visit*) context;                        // no lock is held, so callback
+        const string k(key, (size_t) keybytes);               // may use the engine
+        string current;
+        if (string(value, (size_t) valuebytes) != k) visit->errors++;
+        if (visit->kv->Get(k, &current) != OK || current != k) visit->errors++;
+        if (visit->kv->Put(k, k + "!") != OK) visit->errors++;
+        visit->visited++;
+        return true;
+    });
+    ASSERT_EQ(visit.errors, 0);
+    ASSERT_EQ(visit.visited, limit);                          // each key visited once
+    for (int i = 0; i < limit; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+    }
+}
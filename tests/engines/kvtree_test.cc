@@ -30,11 +30,19 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include "gtest/gtest.h"
 #include "../mock_tx_alloc.h"
 #include "../../src/engines/kvtree2.h"
 
 using namespace pmemkv::kvtree2;
+using pmemkv::FFIBatchBuffer;
+using pmemkv::FFIBatchEntry;
+using pmemkv::KVIterator;
+using pmemkv::Slice;
+using pmemkv::WriteBatch;
 
 const string PATH = "/dev/shm/pmemkv";
 const string PATH_CACHED = "/tmp/pmemkv";
@@ -117,10 +125,124 @@ TEST_F(KVEmptyTest, FailsToCreateInstanceWithTinySize) {
     }
 }
 
+TEST_F(KVEmptyTest, CreateInstanceWithOptionsTest) {
+    auto kv = (KVTree*) pmemkv::KVEngine::Open("kvtree2,format=pearson8", PATH, PMEMOBJ_MIN_POOL);
+    ASSERT_TRUE(kv != nullptr);
+    ASSERT_EQ(kv->Engine(), ENGINE);
+    KVTreeAnalysis analysis = {};
+    kv->Analyze(analysis);
+    ASSERT_EQ(analysis.leaf_format, LEAF_FORMAT_PEARSON8);
+    pmemkv::KVEngine::Close(kv);
+}
+
+TEST_F(KVEmptyTest, CreateInlineInstanceWithOptionsTest) {
+    auto cached = pmemkv::KVEngine::Open("cache:kvtree2,format=inline", PATH, PMEMOBJ_MIN_POOL);
+    ASSERT_TRUE(cached != nullptr);
+    ASSERT_EQ(cached->Engine(), "cache:" + ENGINE);
+    ASSERT_TRUE(cached->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    pmemkv::KVEngine::Close(cached);
+    auto kv = new KVTree(PATH, 0);
+    KVTreeAnalysis analysis = {};
+    kv->Analyze(analysis);
+    ASSERT_EQ(analysis.leaf_format, LEAF_FORMAT_INLINE);
+    ASSERT_EQ(analysis.slot_inline, 1);
+    delete kv;
+}
+
+TEST_F(KVEmptyTest, RecoverWithOptionsTest) {
+    auto kv = pmemkv::KVEngine::Open("kvtree2", PATH, PMEMOBJ_MIN_POOL);
+    ASSERT_TRUE(kv != nullptr);
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    pmemkv::KVEngine::Close(kv);
+    kv = pmemkv::KVEngine::Open("kvtree2,recovery_threads=2,background_recovery=1", PATH, 0);
+    ASSERT_TRUE(kv != nullptr);
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "value1");
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();  // waits for recovery
+    pmemkv::KVEngine::Close(kv);
+}
+
+TEST_F(KVEmptyTest, FailsToCreateInstanceWithInvalidOptions) {
+    for (auto name : {"kvtree2,format=nope", "kvtree2,format", "kvtree2,=fast16", "kvtree2,nope=1",
+                      "kvtree2,recovery_threads=-1", "kvtree2,background_recovery=2",
+                      "kvtree2,merge_keys=x", "kvtree2,", "blackhole,format=fast16"}) {
+        ASSERT_TRUE(pmemkv::KVEngine::Open(name, PATH, PMEMOBJ_MIN_POOL) == nullptr) << name;
+    }
+}
+
+// =============================================================================================
+// TEST FINGERPRINT PROBES
+// =============================================================================================
+
+TEST(KVProbeTest, KernelsMatchPortableTest) {
+    auto portable = ProbeKernel(PROBE_PORTABLE);
+    ASSERT_TRUE(portable != nullptr);
+    uint16_t hashes[LEAF_KEYS];
+    for (int slot = 0; slot < LEAF_KEYS; slot++) {
+        hashes[slot] = (uint16_t) (slot % 3 == 0 ? 0 : (slot % 7 + 1) * 0x0101);
+    }
+    hashes[5] = 0x8001;                                       // differs only in high bits
+    for (auto kernel : {PROBE_SSE2, PROBE_AVX2}) {
+        auto probe = ProbeKernel(kernel);
+        if (probe == nullptr) continue;                        // not supported by this CPU
+        for (int hash = 1; hash < 65536; hash++) {
+            uint64_t expected_matches, expected_empties, matches, empties;
+            portable(hashes, (uint16_t) hash, &expected_matches, &expected_empties);
+            probe(hashes, (uint16_t) hash, &matches, &empties);
+            ASSERT_EQ(matches, expected_matches) << "kernel=" << kernel << ", hash=" << hash;
+            ASSERT_EQ(empties, expected_empties) << "kernel=" << kernel << ", hash=" << hash;
+        }
+    }
+    uint64_t matches, empties;
+    portable(hashes, 0x0303, &matches, &empties);
+    ASSERT_EQ(matches, 0x102000810004ULL);                    // slots 2, 16, 23, 37 & 44
+    ASSERT_EQ(empties, 0x249249249249ULL);                    // every third slot
+    portable(hashes, 0x8001, &matches, &empties);
+    ASSERT_EQ(matches, 0x20ULL);
+    portable(hashes, 0x0001, &matches, &empties);
+    ASSERT_EQ(matches, 0ULL);
+}
+
 // =============================================================================================
 // TEST SINGLE-LEAF TREE
 // =============================================================================================
 
+TEST_F(KVTest, AllKeysTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key3", "value3") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Remove("key2") == OK);
+    vector<string> keys;
+    kv->AllKeys(&keys, [](void* context, int32_t keybytes, const char* key) {
+        ((vector<string>*) context)->push_back(string(key, (size_t) keybytes));
+        return true;
+    });
+    std::sort(keys.begin(), keys.end());
+    ASSERT_EQ(keys, vector<string>({"key1", "key3"}));
+    keys.clear();
+    kv->ListAllKeys(keys);
+    std::sort(keys.begin(), keys.end());
+    ASSERT_EQ(keys, vector<string>({"key1", "key3"}));
+    ASSERT_EQ(kv->TotalNumKeys(), 2);
+}
+
+TEST_F(KVTest, AllKeyValuesTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key3", "value3") == OK) << pmemobj_errormsg();
+    string pairs;
+    kv->AllKeyValues(&pairs, [](void* context, int32_t keybytes, const char* key,
+                                int32_t valuebytes, const char* value) {
+        auto pairs = (string*) context;
+        pairs->append(key, (size_t) keybytes).append("=").append(value, (size_t) valuebytes);
+        return pairs->size() < 20;                            // stop after second pair
+    });
+    ASSERT_EQ(pairs.size(), 22);
+    vector<string> kv_pairs;
+    kv->ListAllKeyValuePairs(kv_pairs);
+    ASSERT_EQ(kv_pairs.size(), 6);
+}
+
 TEST_F(KVTest, BinaryKeyTest) {
     ASSERT_TRUE(kv->Put("a", "should_not_change") == OK) << pmemobj_errormsg();
     string key1 = string("a\0b", 3);
@@ -146,6 +268,17 @@ TEST_F(KVTest, BinaryValueTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+TEST_F(KVTest, SliceTest) {
+    const char buf[] = "key1value1trailing";
+    ASSERT_TRUE(kv->Put(Slice(buf, 4), Slice(buf + 4, 6)) == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get(Slice(buf, 4), &value) == OK && value == "value1");
+    ASSERT_TRUE(kv->Get(Slice(buf, 3), &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get(Slice(buf, 5), &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Remove(Slice(buf, 4)) == OK);
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+}
+
 TEST_F(KVTest, EmptyKeyTest) {
     ASSERT_TRUE(kv->Put("", "empty") == OK) << pmemobj_errormsg();
     ASSERT_TRUE(kv->Put(" ", "single-space") == OK) << pmemobj_errormsg();
@@ -188,6 +321,19 @@ TEST_F(KVTest, GetAppendToExternalValueTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+TEST_F(KVTest, GetWithCallbackTest) {
+    ASSERT_TRUE(kv->Put("key1", string("A\0B", 3)) == OK) << pmemobj_errormsg();
+    string value;
+    auto append = [](void* context, int32_t valuebytes, const char* v) {
+        ((string*) context)->append(v, (size_t) valuebytes);
+    };
+    ASSERT_TRUE(kv->Get("key1", &value, append) == OK);
+    ASSERT_TRUE(value == string("A\0B", 3));
+    string value2;
+    ASSERT_TRUE(kv->Get("key2", &value2, append) == NOT_FOUND);
+    ASSERT_TRUE(value2.empty());
+}
+
 TEST_F(KVTest, GetHeadlessTest) {
     string value;
     ASSERT_TRUE(kv->Get("waldo", &value) == NOT_FOUND);
@@ -313,6 +459,36 @@ TEST_F(KVTest, PutValuesOfDifferentSizesTest) {
     ASSERT_TRUE(kv->Get("E", &value5) == OK && value5 == "123456789ABCDEFGHI");
 }
 
+TEST_F(KVTest, PutOverwritesValueInPlaceTest) {
+    for (int i = 0; i <= 100; i++) {                                              // same size
+        ASSERT_TRUE(kv->Put("key1", to_string(1000000000 + i)) == OK) << pmemobj_errormsg();
+    }
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "1000000100");
+
+    string value2;
+    ASSERT_TRUE(kv->Put("key1", "12345") == OK) << pmemobj_errormsg();            // shorter size
+    ASSERT_TRUE(kv->Get("key1", &value2) == OK && value2 == "12345");
+
+    string value3;
+    ASSERT_TRUE(kv->Put("key1", "1234567") == OK) << pmemobj_errormsg();          // longer, still fits
+    ASSERT_TRUE(kv->Get("key1", &value3) == OK && value3 == "1234567");
+
+    string value4;
+    ASSERT_TRUE(kv->Put("key1", string(100, 'x')) == OK) << pmemobj_errormsg();   // does not fit
+    ASSERT_TRUE(kv->Get("key1", &value4) == OK && value4 == string(100, 'x'));
+
+    string value5;
+    ASSERT_TRUE(kv->Put("key1", "?") == OK) << pmemobj_errormsg();                // too small to reuse
+    ASSERT_TRUE(kv->Get("key1", &value5) == OK && value5 == "?");
+    ASSERT_TRUE(kv->Put("key1", "!") == OK) << pmemobj_errormsg();
+    Reopen();
+
+    string value6;
+    ASSERT_TRUE(kv->Get("key1", &value6) == OK && value6 == "!");
+    ASSERT_EQ(kv->TotalNumKeys(), 1);
+}
+
 TEST_F(KVTest, PutValuesOfMaximumSizeTest) {
     // todo finish this when max is decided (#61)
 }
@@ -374,6 +550,156 @@ TEST_F(KVTest, RemoveNonexistentTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+TEST_F(KVTest, IteratorTest) {
+    std::unique_ptr<KVIterator> it(kv->NewIterator());
+    it->SeekToFirst();
+    ASSERT_FALSE(it->Valid());
+    it->SeekToLast();
+    ASSERT_FALSE(it->Valid());
+    it->Seek("key");
+    ASSERT_FALSE(it->Valid());
+    ASSERT_TRUE(kv->Put("key3", "value3") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    it.reset(kv->NewIterator());
+    it->SeekToFirst();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key1" && it->Value() == "value1");
+    it->Next();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key2" && it->Value() == "value2");
+    it->Next();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key3" && it->Value() == "value3");
+    it->Next();
+    ASSERT_FALSE(it->Valid());
+    it->SeekToLast();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key3");
+    it->Prev();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key2");
+    it->Prev();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key1");
+    it->Prev();
+    ASSERT_FALSE(it->Valid());
+    it->Seek("key2");
+    ASSERT_TRUE(it->Valid() && it->Key() == "key2");
+    it->Seek("key10");
+    ASSERT_TRUE(it->Valid() && it->Key() == "key2");
+    it->Seek("k");
+    ASSERT_TRUE(it->Valid() && it->Key() == "key1");
+    it->Seek("key4");
+    ASSERT_FALSE(it->Valid());
+}
+
+TEST_F(KVTest, WriteBatchTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    WriteBatch batch;
+    batch.Put("key3", "value3");
+    batch.Remove("key1");
+    batch.Put("key2", "VALUE2");
+    batch.Put("key4", "value4");
+    batch.Remove("key4");
+    batch.Remove("nada");
+    ASSERT_EQ(batch.Count(), 6);
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("key2", &value) == OK && value == "VALUE2");
+    value = "";
+    ASSERT_TRUE(kv->Get("key3", &value) == OK && value == "value3");
+    ASSERT_TRUE(kv->Get("key4", &value) == NOT_FOUND);
+    batch.Clear();
+    ASSERT_EQ(batch.Count(), 0);
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, 0);
+    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    ASSERT_EQ(analysis.leaf_total, 1);
+}
+
+TEST_F(KVTest, WriteBatchNoCopyTest) {
+    string key = "key1", value = "value1", removed = "key2";
+    ASSERT_TRUE(kv->Put(removed, "value2") == OK) << pmemobj_errormsg();
+    WriteBatch batch;
+    batch.Put(key, value);                                               // copied now
+    batch.PutNoCopy("key3", value);                                      // read when written
+    batch.RemoveNoCopy(removed);
+    key[3] = value[5] = 'X';
+    ASSERT_EQ(batch.Ops()[0].key, "key1");
+    ASSERT_EQ(batch.Ops()[1].value, "valueX");
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    string result;
+    ASSERT_TRUE(kv->Get("key1", &result) == OK && result == "value1");
+    result = "";
+    ASSERT_TRUE(kv->Get("key3", &result) == OK && result == "valueX");
+    ASSERT_TRUE(kv->Get("key2", &result) == NOT_FOUND);
+}
+
+TEST_F(KVTest, ExecBatchFFITest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    vector<char> buf(sizeof(FFIBatchBuffer));
+    vector<size_t> offsets;
+    auto append = [&](int8_t op, const string& key, const string& value, int32_t limit) {
+        offsets.push_back(buf.size());
+        FFIBatchEntry entry = {op, 0, limit, (int32_t) key.size(), (int32_t) value.size()};
+        auto e = (const char*) &entry;
+        buf.insert(buf.end(), e, e + sizeof(FFIBatchEntry));
+        buf.insert(buf.end(), key.begin(), key.end());
+        buf.insert(buf.end(), value.begin(), value.end());
+        buf.resize(buf.size() + (op == GET_OP ? limit : 0));
+    };
+    append(PUT_OP, "key2", "value2", 0);
+    append(REMOVE_OP, "key1", "", 0);
+    append(GET_OP, "key2", "", 16);
+    append(GET_OP, "key1", "", 16);
+    append(GET_OP, "key2", "", 2);
+    append(PUT_OP, "key3", "value3", 0);
+    auto batch = (FFIBatchBuffer*) buf.data();
+    batch->kv = kv;
+    batch->count = (int32_t) offsets.size();
+    batch->databytes = (int32_t) (buf.size() - sizeof(FFIBatchBuffer));
+    ASSERT_TRUE(pmemkv::kvengine_exec_batch_ffi(batch) == FAILED);  // undersized get buffer
+    auto entry = [&](int i) { return (FFIBatchEntry*) (buf.data() + offsets[i]); };
+    ASSERT_EQ(entry(0)->status, OK);
+    ASSERT_EQ(entry(1)->status, OK);
+    ASSERT_EQ(entry(2)->status, OK);
+    ASSERT_EQ(entry(2)->valuebytes, 6);
+    ASSERT_EQ(string(entry(2)->data + 4, 6), "value2");
+    ASSERT_EQ(entry(3)->status, NOT_FOUND);
+    ASSERT_EQ(entry(4)->status, FAILED);
+    ASSERT_EQ(entry(4)->valuebytes, 6);
+    ASSERT_EQ(entry(5)->status, OK);
+    string value;
+    ASSERT_TRUE(kv->Get("key3", &value) == OK && value == "value3");
+    ASSERT_EQ(kv->TotalNumKeys(), 2);
+}
+
+TEST_F(KVTest, ExecBatchFFIOverreadTest) {
+    vector<char> buf(sizeof(FFIBatchBuffer));
+    auto append = [&](int8_t op, const string& key, int32_t valuebytes) {
+        FFIBatchEntry entry = {op, 0, 0, (int32_t) key.size(), valuebytes};
+        auto e = (const char*) &entry;
+        buf.insert(buf.end(), e, e + sizeof(FFIBatchEntry));
+        buf.insert(buf.end(), key.begin(), key.end());
+    };
+    append(PUT_OP, "key1", 0);
+    append(PUT_OP, "key2", 1000);                             // value past end of buffer
+    auto batch = (FFIBatchBuffer*) buf.data();
+    batch->kv = kv;
+    batch->count = 2;
+    batch->databytes = (int32_t) (buf.size() - sizeof(FFIBatchBuffer));
+    ASSERT_TRUE(pmemkv::kvengine_exec_batch_ffi(batch) == FAILED);
+    auto entry2 = (FFIBatchEntry*) (buf.data() + sizeof(FFIBatchBuffer) + sizeof(FFIBatchEntry) + 4);
+    ASSERT_EQ(entry2->status, FAILED);
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == OK && value == "");
+    ASSERT_TRUE(kv->Get("key2", &value) == NOT_FOUND);
+    batch->count = 3;                                         // more entries than databytes
+    batch->databytes = (int32_t) (2 * (sizeof(FFIBatchEntry) + 4));
+    entry2->valuebytes = 0;
+    ASSERT_TRUE(pmemkv::kvengine_exec_batch_ffi(batch) == FAILED);
+    ASSERT_TRUE(kv->Get("key2", &value) == OK && value == "");
+    ASSERT_EQ(kv->TotalNumKeys(), 2);
+}
+
 // =============================================================================================
 // TEST RECOVERY OF SINGLE-LEAF TREE
 // =============================================================================================
@@ -551,7 +877,7 @@ TEST_F(KVTest, UsePreallocAfterSingleLeafRecoveryTest) {
 // TEST TREE WITH SINGLE INNER NODE
 // =============================================================================================
 
-const int SINGLE_INNER_LIMIT = LEAF_KEYS * (INNER_KEYS - 1);
+const int SINGLE_INNER_LIMIT = LEAF_KEYS * 3;                            // leaves under one inner node
 
 TEST_F(KVTest, SingleInnerNodeAscendingTest) {
     for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
@@ -625,6 +951,174 @@ TEST_F(KVTest, SingleInnerNodeDescendingTest2) {
     ASSERT_EQ(analysis.leaf_total, 5);
 }
 
+TEST_F(KVTest, SingleInnerNodeMultiGetTest) {
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    vector<string> keys;
+    for (int i = (10000 + SINGLE_INNER_LIMIT + 5); i >= 9995; i -= 3) keys.push_back(to_string(i));
+    keys.push_back("10042");                                  // duplicate keys are allowed
+    keys.push_back("10042");
+    vector<string> values(keys.size());
+    auto found = [](void* context, int32_t index, int32_t valuebytes, const char* value) {
+        auto values = (vector<string>*) context;
+        ASSERT_TRUE(values->at(index).empty());
+        values->at(index).append(value, (size_t) valuebytes);
+    };
+    kv->MultiGet(keys, &values, found);
+    for (int i = 0; i < keys.size(); i++) {
+        int k = std::stoi(keys[i]);
+        if (k >= 10000 && k <= (10000 + SINGLE_INNER_LIMIT)) {
+            ASSERT_EQ(values[i], keys[i] + "!");
+        } else {
+            ASSERT_TRUE(values[i].empty());
+        }
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_total, 5);
+}
+
+TEST_F(KVTest, SingleInnerNodeMissingKeysTest) {
+    for (int i = 0; i < SINGLE_INNER_LIMIT; i++) {
+        ASSERT_TRUE(kv->Put(to_string(20000 + i * 2), "!") == OK) << pmemobj_errormsg();
+    }
+    for (int i = 0; i < SINGLE_INNER_LIMIT; i += 2) ASSERT_TRUE(kv->Remove(to_string(20000 + i * 2)) == OK);
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 19990; i < 20000 + SINGLE_INNER_LIMIT * 2 + 10; i++) {
+            string value;
+            const bool present = i >= 20000 && i < 20000 + SINGLE_INNER_LIMIT * 2 && i % 4 == 2;
+            ASSERT_TRUE(kv->Get(to_string(i), &value) == (present ? OK : NOT_FOUND)) << i;
+        }
+        Reopen();                                            // filters are rebuilt by recovery
+    }
+}
+
+TEST_F(KVTest, SingleInnerNodeIteratorTest) {
+    for (int i = (10000 + SINGLE_INNER_LIMIT); i >= 10000; i--) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    for (int i = 10040; i < 10100; i++) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, 2);                         // iterator must skip empty leaves
+    std::unique_ptr<KVIterator> it(kv->NewIterator());
+    int expected = 10000;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        if (expected == 10040) expected = 10100;
+        ASSERT_EQ(it->Key(), to_string(expected));
+        ASSERT_EQ(it->Value(), to_string(expected) + "!");
+        expected++;
+    }
+    ASSERT_EQ(expected, 10000 + SINGLE_INNER_LIMIT + 1);
+    for (it->SeekToLast(); it->Valid(); it->Prev()) {
+        expected--;
+        if (expected == 10099) expected = 10039;
+        ASSERT_EQ(it->Key(), to_string(expected));
+    }
+    ASSERT_EQ(expected, 10000);
+    it->Seek("10050");
+    ASSERT_TRUE(it->Valid() && it->Key() == "10100");
+    it->Prev();
+    ASSERT_TRUE(it->Valid() && it->Key() == "10039");
+}
+
+TEST_F(KVTest, SingleInnerNodeWriteBatchTest) {
+    WriteBatch batch;
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        batch.Put(istr, istr + "!");
+    }
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_total, 4);                        // split at median of batch keys
+}
+
+TEST_F(KVTest, SingleInnerNodeWriteBatchAbortedTest) {
+    for (int i = 10000; i < (10000 + LEAF_KEYS * 2); i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    for (int i = 10001; i < (10000 + LEAF_KEYS * 2); i += 2) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    Analyze();
+    const KVTreeAnalysis before = analysis;
+    WriteBatch batch;
+    for (int i = 10000; i < (10000 + LEAF_KEYS * 2); i++) {
+        string istr = to_string(i);
+        if (i % 2) {
+            batch.Put(istr, istr + "?");                      // carves chunks freed above
+        } else {
+            batch.Remove(istr);                               // frees chunks only on commit
+        }
+    }
+    batch.Put("20000", string(1000, '!'));                    // fails to allocate on heap
+    tx_alloc_should_fail = true;
+    ASSERT_TRUE(kv->Write(batch) == FAILED);
+    tx_alloc_should_fail = false;
+    ASSERT_EQ(kv->TotalNumKeys(), LEAF_KEYS);
+    for (int i = 10000; i < (10000 + LEAF_KEYS * 2); i++) {
+        string istr = to_string(i);
+        string value;
+        if (i % 2) {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND) << istr;
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!")) << istr;
+        }
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_total, before.leaf_total);
+    ASSERT_EQ(analysis.slab_total, before.slab_total);
+    ASSERT_EQ(analysis.slab_used, before.slab_used);
+
+    batch.Clear();                                            // same batch commits without the
+    for (int i = 10000; i < (10000 + LEAF_KEYS * 2); i++) {   // failing put
+        string istr = to_string(i);
+        if (i % 2) {
+            batch.Put(istr, istr + "?");
+        } else {
+            batch.Remove(istr);
+        }
+    }
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    ASSERT_EQ(kv->TotalNumKeys(), LEAF_KEYS);
+    for (int i = 10000; i < (10000 + LEAF_KEYS * 2); i++) {
+        string istr = to_string(i);
+        string value;
+        if (i % 2) {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "?")) << istr;
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND) << istr;
+        }
+    }
+    Analyze();
+    ASSERT_EQ(analysis.slab_used, analysis.slot_slab);
+}
+
+TEST_F(KVTest, SingleInnerNodeMergeRetriedTest) {
+    const int lower = LEAF_KEYS_MIDPOINT + 1;                 // keys left in lower leaf by split
+    const int upper = LEAF_MERGE_KEYS + LEAF_KEYS_MIDPOINT - 5;  // too many to merge at first
+    for (int i = 0; i < lower + upper; i++) {
+        ASSERT_TRUE(kv->Put(to_string(100000 + i), "!") == OK) << pmemobj_errormsg();
+    }
+    for (int i = 0; i <= lower - LEAF_MERGE_KEYS; i++) {      // lower leaf becomes underfull
+        ASSERT_TRUE(kv->Remove(to_string(100000 + i)) == OK);
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    for (int i = lower; i < lower + 5; i++) ASSERT_TRUE(kv->Remove(to_string(100000 + i)) == OK);
+    Analyze();
+    ASSERT_EQ(analysis.leaf_prealloc, 0);                    // upper leaf isn't underfull
+    ASSERT_TRUE(kv->Remove(to_string(100000 + lower - 1)) == OK);
+    Analyze();
+    ASSERT_EQ(analysis.leaf_prealloc, 1);                    // next remove retries merge
+    ASSERT_EQ(kv->TotalNumKeys(), LEAF_MERGE_KEYS - 2 + upper - 5);
+}
+
 // =============================================================================================
 // TEST RECOVERY OF TREE WITH SINGLE INNER NODE
 // =============================================================================================
@@ -697,6 +1191,44 @@ TEST_F(KVTest, SingleInnerNodeDescendingAfterRecoveryTest2) {
     ASSERT_EQ(analysis.leaf_total, 5);
 }
 
+TEST_F(KVTest, SingleInnerNodeTotalNumKeysAfterRecoveryTest) {
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT + 1);
+    ASSERT_TRUE(kv->Remove("10000") == OK);
+    ASSERT_TRUE(kv->Remove("10000") == OK);
+    ASSERT_TRUE(kv->Remove("nada") == OK);
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT);
+    ASSERT_TRUE(kv->Put("10000", "10000!") == OK) << pmemobj_errormsg();
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT + 1);
+}
+
+TEST_F(KVTest, SingleInnerNodeWriteBatchAfterRecoveryTest) {
+    WriteBatch batch;
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        batch.Put(istr, istr + "!");
+        if (i % 2 == 0) batch.Remove(istr);
+    }
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    Reopen();
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        string value;
+        if (i % 2 == 0) {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+    }
+}
+
 TEST_F(KVTest, UsePreallocAfterMultipleLeafRecoveryTest) {
     for (int i = 1; i <= LEAF_KEYS + 1; i++)
         ASSERT_EQ(kv->Put(to_string(i), "!"), OK) << pmemobj_errormsg();
@@ -709,7 +1241,7 @@ TEST_F(KVTest, UsePreallocAfterMultipleLeafRecoveryTest) {
     for (int i = 1; i <= LEAF_KEYS; i++) ASSERT_EQ(kv->Remove(to_string(i)), OK);
     Analyze();
     ASSERT_EQ(analysis.leaf_empty, 1);
-    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    ASSERT_EQ(analysis.leaf_prealloc, 1);                    // merged before recovery
     ASSERT_EQ(analysis.leaf_total, 2);
     Reopen();
     Analyze();
@@ -741,6 +1273,463 @@ TEST_F(KVTest, UsePreallocAfterMultipleLeafRecoveryTest) {
     ASSERT_EQ(analysis.leaf_total, 2);
 }
 
+// =============================================================================================
+// TEST LEAF FORMATS
+// =============================================================================================
+
+TEST_F(KVTest, NewPoolUsesFast16FormatTest) {
+    Analyze();
+    ASSERT_EQ(analysis.leaf_format, LEAF_FORMAT_FAST16);
+}
+
+TEST_F(KVTest, Pearson8FormatPersistsTest) {
+    delete kv;
+    std::remove(PATH.c_str());
+    kv = new KVTree(PATH, SIZE, LEAF_FORMAT_PEARSON8);
+    for (int i = 0; i < SINGLE_INNER_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    ASSERT_TRUE(kv->Remove("42") == OK);
+    Reopen();                                                 // requests FAST16 for new pools
+    Analyze();
+    ASSERT_EQ(analysis.leaf_format, LEAF_FORMAT_PEARSON8);
+    for (int i = 0; i < SINGLE_INNER_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == (i == 42 ? NOT_FOUND : OK)) << istr;
+        if (i != 42) ASSERT_EQ(value, istr + "!");
+    }
+    ASSERT_TRUE(kv->Put("42", "new") == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("42", &value) == OK && value == "new");
+}
+
+TEST_F(KVTest, Fast16FormatAfterRecoveryTest) {
+    for (int i = 0; i < SINGLE_INNER_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    Reopen();                                                 // fingerprints are recalculated
+    for (int i = 0; i < SINGLE_INNER_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!") << istr;
+        ASSERT_TRUE(kv->Put(istr, istr + "?") == OK) << pmemobj_errormsg();  // same slot updated
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT);
+}
+
+TEST_F(KVTest, InlineFormatSpillsLargeRecordsTest) {
+    delete kv;
+    std::remove(PATH.c_str());
+    kv = new KVTree(PATH, SIZE, LEAF_FORMAT_INLINE);
+    const string large(LEAF_INLINE_BYTES, '*');               // too big to store in leaf
+    for (int i = 0; i < SINGLE_INNER_LIMIT; i++) {            // leaves split, moving records
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, (i % 2) ? istr + "!" : large + istr) == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_format, LEAF_FORMAT_INLINE);
+    ASSERT_EQ(analysis.slot_inline, SINGLE_INNER_LIMIT / 2);
+    ASSERT_TRUE(kv->Remove("42") == OK);
+    ASSERT_TRUE(kv->Put("43", large) == OK) << pmemobj_errormsg();             // moves to heap
+    ASSERT_TRUE(kv->Put("44", "44!") == OK) << pmemobj_errormsg();             // moves into leaf
+    Reopen();
+    Analyze();
+    ASSERT_EQ(analysis.leaf_format, LEAF_FORMAT_INLINE);
+    ASSERT_EQ(analysis.slot_inline, SINGLE_INNER_LIMIT / 2);
+    for (int i = 0; i < SINGLE_INNER_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == (i == 42 ? NOT_FOUND : OK)) << istr;
+        if (i == 42) continue;
+        ASSERT_EQ(value, (i == 43) ? large : (i == 44 || i % 2) ? istr + "!" : large + istr);
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT - 1);
+}
+
+// =============================================================================================
+// TEST TREE WITH MULTIPLE INNER NODES
+// =============================================================================================
+
+const int MULTIPLE_INNER_LIMIT = LEAF_KEYS * INNER_KEYS * 4;
+
+TEST_F(KVTest, MultipleInnerNodeSharedPrefixTest) {
+    const string prefix = "users/profile/";                  // longer than one inner key prefix
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {
+        const int k = (i * 7919) % MULTIPLE_INNER_LIMIT;       // visit all keys out of order
+        string kstr = prefix + to_string(k);
+        ASSERT_TRUE(kv->Put(kstr, to_string(k)) == OK) << pmemobj_errormsg();
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = -10; i < MULTIPLE_INNER_LIMIT + 10; i++) {
+            string kstr = prefix + to_string(i);
+            string value;
+            if (i >= 0 && i < MULTIPLE_INNER_LIMIT) {
+                ASSERT_TRUE(kv->Get(kstr, &value) == OK && value == to_string(i)) << kstr;
+            } else {
+                ASSERT_TRUE(kv->Get(kstr, &value) == NOT_FOUND) << kstr;
+            }
+            ASSERT_TRUE(kv->Get(kstr + "x", &value) == NOT_FOUND) << kstr;
+            ASSERT_TRUE(kv->Get(prefix.substr(0, 6) + to_string(i), &value) == NOT_FOUND) << kstr;
+        }
+        Reopen();                                            // inner nodes are rebuilt
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), MULTIPLE_INNER_LIMIT);
+}
+
+TEST_F(KVTest, MultipleInnerNodeParallelRecoveryTest) {
+    const int limit = LEAF_KEYS * RECOVERY_LEAVES_PER_THREAD * 2;  // enough leaves for 4 threads
+    for (int i = 0; i < limit; i++) {
+        string istr = to_string(100000 + i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    for (int i = 5000; i < 5500; i++) ASSERT_TRUE(kv->Remove(to_string(100000 + i)) == OK);
+    Analyze();
+    const size_t leaf_empty = analysis.leaf_empty;
+    const size_t leaf_total = analysis.leaf_total;
+    ASSERT_GT(leaf_empty, 0);
+    for (size_t threads : {1, 4, 0}) {
+        delete kv;
+        kv = new KVTree(PATH, SIZE, LEAF_FORMAT_FAST16, threads);
+        Analyze();
+        ASSERT_EQ(analysis.leaf_prealloc, leaf_empty) << threads;  // empty leaves kept for reuse
+        ASSERT_EQ(analysis.leaf_total, leaf_total) << threads;
+        ASSERT_EQ(kv->TotalNumKeys(), limit - 500) << threads;
+        std::unique_ptr<KVIterator> it(kv->NewIterator());
+        int expected = 0;
+        for (it->SeekToFirst(); it->Valid(); it->Next()) {
+            if (expected == 5000) expected = 5500;
+            ASSERT_EQ(it->Key(), to_string(100000 + expected)) << threads;
+            expected++;
+        }
+        ASSERT_EQ(expected, limit) << threads;
+    }
+}
+
+TEST_F(KVTest, MultipleInnerNodePutAfterRecoveryTest) {
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i += 2) {
+        string istr = to_string(100000 + i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+    }
+    Reopen();                                                 // inner nodes are packed full
+    for (int i = 1; i < MULTIPLE_INNER_LIMIT; i += 2) {       // so these must split them
+        string istr = to_string(100000 + i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {
+        string istr = to_string(100000 + i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr) << istr;
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), MULTIPLE_INNER_LIMIT);
+}
+
+TEST_F(KVTest, MultipleInnerNodeMergeSparseLeavesTest) {
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {
+        string istr = to_string(100000 + i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    const size_t leaf_total = analysis.leaf_total;
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {          // purge most keys
+        if (i % 16 != 0) ASSERT_TRUE(kv->Remove(to_string(100000 + i)) == OK);
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_total, leaf_total);               // merged leaves kept for reuse
+    ASSERT_LT(analysis.leaf_total - analysis.leaf_prealloc, leaf_total / 8);
+    WriteBatch batch;                                         // batches merge leaves too
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT / 2; i += 32) batch.Remove(to_string(100000 + i));
+    ASSERT_TRUE(kv->Write(batch) == OK);
+    const int remaining = MULTIPLE_INNER_LIMIT / 16 - MULTIPLE_INNER_LIMIT / 64;
+    for (int pass = 0; pass < 2; pass++) {
+        ASSERT_EQ(kv->TotalNumKeys(), remaining);
+        for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {
+            string istr = to_string(100000 + i);
+            string value;
+            if (i % 16 == 0 && (i % 32 != 0 || i >= MULTIPLE_INNER_LIMIT / 2)) {
+                ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!") << istr;
+            } else {
+                ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND) << istr;
+            }
+        }
+        std::unique_ptr<KVIterator> it(kv->NewIterator());
+        int count = 0;
+        string last;
+        for (it->SeekToFirst(); it->Valid(); it->Next()) {
+            ASSERT_TRUE(it->Key().ToString() > last);
+            last = it->Key().ToString();
+            count++;
+        }
+        ASSERT_EQ(count, remaining);
+        Reopen();                                            // merged tree is saved & reloaded
+    }
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {          // remove the rest, then refill
+        ASSERT_TRUE(kv->Remove(to_string(100000 + i)) == OK);
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, analysis.leaf_total);
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {
+        string istr = to_string(100000 + i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+    }
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {
+        string istr = to_string(100000 + i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr) << istr;
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), MULTIPLE_INNER_LIMIT);
+}
+
+TEST_F(KVTest, MultipleInnerNodeMergeBetweenFullNodesTest) {
+    const int leaves = (INNER_KEYS + 1) * 3;                  // packs into three full inner nodes
+    const int per_leaf = LEAF_KEYS_MIDPOINT + 1;              // ascending puts leave this many
+    const int limit = per_leaf * leaves;
+    for (int i = 0; i < limit; i++) {
+        string istr = to_string(100000 + i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    Reopen();
+    Analyze();
+    ASSERT_EQ(analysis.leaf_total, leaves);
+    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    const int first = per_leaf * (INNER_KEYS + 1);            // empty every leaf of middle node
+    const int last = per_leaf * (INNER_KEYS + 1) * 2;
+    for (int i = first; i < last; i++) ASSERT_TRUE(kv->Remove(to_string(100000 + i)) == OK);
+    for (int pass = 0; pass < 2; pass++) {
+        ASSERT_EQ(kv->TotalNumKeys(), limit - (last - first));
+        for (int i = 0; i < limit; i++) {
+            string istr = to_string(100000 + i);
+            string value;
+            if (i >= first && i < last) {
+                ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND) << istr;
+            } else {
+                ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!") << istr;
+            }
+        }
+        std::unique_ptr<KVIterator> it(kv->NewIterator());
+        int expected = 0;
+        for (it->SeekToFirst(); it->Valid(); it->Next()) {
+            if (expected == first) expected = last;
+            ASSERT_EQ(it->Key(), to_string(100000 + expected));
+            expected++;
+        }
+        ASSERT_EQ(expected, limit);
+        if (pass == 0) {
+            for (int i = first; i < last; i++) {                  // refill, splitting leaves again
+                ASSERT_TRUE(kv->Put(to_string(100000 + i), "?") == OK) << pmemobj_errormsg();
+            }
+            for (int i = first; i < last; i++) ASSERT_TRUE(kv->Remove(to_string(100000 + i)) == OK);
+            Reopen();
+        }
+    }
+}
+
+TEST_F(KVTest, MultipleInnerNodeMergeDisabledTest) {
+    delete kv;
+    kv = (KVTree*) pmemkv::KVEngine::Open("kvtree2,merge_keys=0", PATH, SIZE);
+    ASSERT_TRUE(kv != nullptr);
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {
+        string istr = to_string(100000 + i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {
+        if (i % 16 != 0) ASSERT_TRUE(kv->Remove(to_string(100000 + i)) == OK);
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_prealloc, 0);                    // sparse leaves stay in tree
+    ASSERT_EQ(kv->TotalNumKeys(), MULTIPLE_INNER_LIMIT / 16);
+}
+
+// =============================================================================================
+// TEST SNAPSHOT OF VOLATILE TREE
+// =============================================================================================
+
+TEST_F(KVTest, SnapshotAfterCleanCloseTest) {
+    Analyze();
+    ASSERT_FALSE(analysis.snapshot_loaded);                  // new pool has nothing to load
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {
+        string istr = to_string(100000 + i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    for (int i = 5000; i < 5500; i++) ASSERT_TRUE(kv->Remove(to_string(100000 + i)) == OK);
+    Reopen();
+    Analyze();
+    ASSERT_TRUE(analysis.snapshot_loaded);
+    const size_t leaf_prealloc = analysis.leaf_prealloc;
+    ASSERT_EQ(leaf_prealloc, analysis.leaf_empty);           // same as full recovery
+    ASSERT_EQ(kv->TotalNumKeys(), MULTIPLE_INNER_LIMIT - 500);
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {
+        string istr = to_string(100000 + i);
+        string value;
+        if (i >= 5000 && i < 5500) {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND) << istr;
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!") << istr;
+        }
+    }
+    ASSERT_TRUE(kv->Put("100000", "changed") == OK) << pmemobj_errormsg();
+    Reopen();                                                 // later changes are saved again
+    Analyze();
+    ASSERT_TRUE(analysis.snapshot_loaded);
+    ASSERT_EQ(analysis.leaf_prealloc, leaf_prealloc);
+    string value;
+    ASSERT_TRUE(kv->Get("100000", &value) == OK && value == "changed");
+}
+
+TEST_F(KVTest, SnapshotIgnoredAfterCrashTest) {
+    const string crashed = PATH + "_crashed";
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {
+        string istr = to_string(100000 + i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    Reopen();                                                 // snapshot is dropped when loaded
+    ASSERT_TRUE(kv->Put("100000", "changed") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(std::system(("cp -f " + PATH + " " + crashed).c_str()) == 0);  // copy while open
+    delete kv;
+    kv = new KVTree(crashed, SIZE);
+    KVTreeAnalysis crashed_analysis = {};
+    kv->Analyze(crashed_analysis);
+    ASSERT_FALSE(crashed_analysis.snapshot_loaded);          // leaves are recovered instead
+    ASSERT_EQ(kv->TotalNumKeys(), MULTIPLE_INNER_LIMIT);
+    string value;
+    ASSERT_TRUE(kv->Get("100000", &value) == OK && value == "changed");
+    delete kv;
+    std::remove(crashed.c_str());
+    kv = new KVTree(PATH, SIZE);
+}
+
+TEST_F(KVTest, BackgroundRecoveryTest) {
+    const string crashed = PATH + "_crashed";
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {
+        string istr = to_string(100000 + i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    ASSERT_TRUE(std::system(("cp -f " + PATH + " " + crashed).c_str()) == 0);  // has no snapshot
+    delete kv;
+    kv = new KVTree(crashed, SIZE, LEAF_FORMAT_FAST16, 0, true);
+    vector<string> keys = {"100002", "nope", "100001", "100002"};       // served by scan or index
+    vector<string> values(keys.size());
+    kv->MultiGet(keys, &values, [](void* context, int32_t index, int32_t valuebytes, const char* value) {
+        (*(vector<string>*) context)[index].assign(value, (size_t) valuebytes);
+    });
+    ASSERT_EQ(values, vector<string>({"100002!", "", "100001!", "100002!"}));
+    string value;
+    for (int i = 0; i < MULTIPLE_INNER_LIMIT; i++) {          // found in index or by scanning
+        string istr = to_string(100000 + i);                  // leaves not indexed yet
+        value.clear();
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!") << istr;
+    }
+    ASSERT_TRUE(kv->Get("nope", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put("100000", "changed") == OK) << pmemobj_errormsg();  // waits for index
+    for (int i = 1; i < MULTIPLE_INNER_LIMIT; i++) {
+        string istr = to_string(100000 + i);
+        value.clear();
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!") << istr;
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), MULTIPLE_INNER_LIMIT);
+    delete kv;
+    std::remove(crashed.c_str());
+    kv = new KVTree(PATH, SIZE);
+}
+
+// =============================================================================================
+// TEST SLAB ALLOCATOR
+// =============================================================================================
+
+TEST_F(KVTest, SlabChunksAreReusedTest) {
+    const string crashed = PATH + "_crashed";
+    const string value(100, '*');                             // all records use same chunk size
+    for (int i = 0; i < LEAF_KEYS - 8; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, value + istr) == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    ASSERT_EQ(analysis.slab_total, 1);
+    ASSERT_EQ(analysis.slot_slab, LEAF_KEYS - 8);
+    for (int i = 0; i < 20; i++) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    for (int i = 100; i < 120; i++) {                         // freed chunks are carved again
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, value + istr) == OK) << pmemobj_errormsg();
+    }
+    ASSERT_TRUE(kv->Put("100", string(1000, '!')) == OK) << pmemobj_errormsg();  // too large
+    Analyze();
+    ASSERT_EQ(analysis.slab_total, 1);
+    ASSERT_EQ(analysis.slot_slab, LEAF_KEYS - 9);
+
+    Reopen();                                                 // used chunks kept by snapshot
+    Analyze();
+    ASSERT_TRUE(analysis.snapshot_loaded);
+    ASSERT_EQ(analysis.slab_total, 1);
+    ASSERT_EQ(analysis.slot_slab, LEAF_KEYS - 9);
+    ASSERT_TRUE(kv->Put("100", value + "100") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(std::system(("cp -f " + PATH + " " + crashed).c_str()) == 0);  // copy while open
+    delete kv;
+
+    kv = new KVTree(crashed, SIZE);                           // used chunks found in leaves
+    KVTreeAnalysis crashed_analysis = {};
+    kv->Analyze(crashed_analysis);
+    ASSERT_FALSE(crashed_analysis.snapshot_loaded);
+    ASSERT_EQ(crashed_analysis.slab_total, 1);
+    ASSERT_EQ(crashed_analysis.slot_slab, LEAF_KEYS - 8);
+    ASSERT_TRUE(kv->Put("200", value) == OK) << pmemobj_errormsg();
+    for (int i = 20; i < 120; i++) {
+        if (i >= LEAF_KEYS - 8 && i < 100) continue;
+        string istr = to_string(i);
+        string actual;
+        ASSERT_TRUE(kv->Get(istr, &actual) == OK && actual == value + istr) << istr;
+    }
+    crashed_analysis = {};
+    kv->Analyze(crashed_analysis);
+    ASSERT_EQ(crashed_analysis.slab_total, 1);
+    ASSERT_EQ(crashed_analysis.slot_slab, LEAF_KEYS - 7);
+    delete kv;
+    std::remove(crashed.c_str());
+    kv = new KVTree(PATH, SIZE);
+}
+
+TEST_F(KVTest, SlabChunksFreedAfterAbortTest) {
+    const string value(100, '*');
+    for (int i = 0; i < 10; i++) ASSERT_TRUE(kv->Put(to_string(i), value) == OK) << pmemobj_errormsg();
+    WriteBatch batch;
+    batch.Put("10", value);                                   // carves chunk from slab, then
+    batch.Put("11", string(1000, '!'));                       // fails to allocate on heap
+    tx_alloc_should_fail = true;
+    ASSERT_TRUE(kv->Write(batch) == FAILED);
+    tx_alloc_should_fail = false;
+    Analyze();
+    ASSERT_EQ(analysis.slot_slab, 10);
+    ASSERT_EQ(analysis.slab_used, 10);
+    string actual;
+    ASSERT_TRUE(kv->Get("10", &actual) == NOT_FOUND);
+    Reopen();                                                 // bitmaps saved by snapshot
+    Analyze();
+    ASSERT_TRUE(analysis.snapshot_loaded);
+    ASSERT_EQ(analysis.slab_used, 10);
+}
+
+TEST_F(KVTest, SlabReusedAfterAbortedSplitTest) {
+    const string value(100, '*');
+    ASSERT_TRUE(kv->Put("a", string(200, '*')) == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Remove("a") == OK);                       // leaves slab of larger chunks
+    for (int i = 0; i < LEAF_KEYS; i++) {
+        ASSERT_TRUE(kv->Put(to_string(i), value) == OK) << pmemobj_errormsg();
+    }
+    Reopen();                                                 // all slabs are listed as free
+    Analyze();
+    ASSERT_EQ(analysis.slab_total, 2);
+    tx_alloc_should_fail = true;                              // new leaf takes listed slab,
+    ASSERT_TRUE(kv->Put("z", string(200, '!')) == FAILED);    // then fails to allocate leaf
+    tx_alloc_should_fail = false;
+    ASSERT_TRUE(kv->Put("z", string(200, '!')) == OK) << pmemobj_errormsg();
+    Analyze();
+    ASSERT_EQ(analysis.slab_total, 2);                        // slab was given back and reused
+    ASSERT_EQ(analysis.slab_used, LEAF_KEYS + 1);
+    string actual;
+    ASSERT_TRUE(kv->Get("z", &actual) == OK && actual == string(200, '!'));
+}
+
 // =============================================================================================
 // TEST LARGE TREE
 // =============================================================================================
@@ -821,6 +1810,121 @@ TEST_F(KVTest, LargeDescendingAfterRecoveryTest) {
     ASSERT_EQ(analysis.leaf_total, 150000);
 }
 
+// =============================================================================================
+// TEST CONCURRENT ACCESS
+// =============================================================================================
+
+const int CONCURRENT_THREADS = 8;
+const int CONCURRENT_LIMIT = 5000;
+
+TEST_F(KVTest, ConcurrentPutGetRemoveTest) {
+    std::atomic<int> errors(0);
+    vector<std::thread> threads;
+    for (int t = 0; t < CONCURRENT_THREADS; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < CONCURRENT_LIMIT; i++) {
+                string istr = to_string(t) + "-" + to_string(i);
+                if (kv->Put(istr, istr + "!") != OK) errors++;
+                string value;
+                if (kv->Get(istr, &value) != OK || value != istr + "!") errors++;
+                if (i % 2 == 1 && kv->Remove(istr) != OK) errors++;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    ASSERT_EQ(errors, 0);
+    ASSERT_EQ(kv->TotalNumKeys(), CONCURRENT_THREADS * CONCURRENT_LIMIT / 2);
+    for (int t = 0; t < CONCURRENT_THREADS; t++) {
+        for (int i = 0; i < CONCURRENT_LIMIT; i++) {
+            string istr = to_string(t) + "-" + to_string(i);
+            string value;
+            if (i % 2 == 1) {
+                ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+            } else {
+                ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+            }
+        }
+    }
+}
+
+TEST_F(KVTest, ConcurrentOverwriteGetTest) {
+    const int keys = LEAF_KEYS_MIDPOINT;                                 // all in one leaf
+    for (int i = 0; i < keys; i++) ASSERT_TRUE(kv->Put(to_string(i), to_string(i) + ":") == OK);
+    auto valid = [](const string& key, const string& value) {           // key, colon, then x's
+        if (value.compare(0, key.size() + 1, key + ":") != 0) return false;
+        return value.find_first_not_of('x', key.size() + 1) == string::npos;
+    };
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+    vector<std::thread> threads;
+    for (int t = 0; t < CONCURRENT_THREADS; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; (t % 2 == 0) ? i < CONCURRENT_LIMIT : !done; i++) {
+                const string key = to_string(i % keys);
+                if (t % 2 == 0) {                                        // writers resize values
+                    if (i % 7 == 6) {                                    // and remove keys
+                        if (kv->Remove(key) != OK) errors++;
+                    } else if (kv->Put(key, key + ":" + string((size_t) (i * 37 % 300), 'x')) != OK) {
+                        errors++;
+                    }
+                } else if (t % 4 == 1) {                                 // readers append value
+                    string value;
+                    const KVStatus s = kv->Get(key, &value);
+                    if (s == OK ? !valid(key, value) : s != NOT_FOUND) errors++;
+                } else {                                                 // readers copy value
+                    char buffer[400];
+                    int32_t size = 0;
+                    const KVStatus s = kv->Get(sizeof(buffer), (int32_t) key.size(), &size,
+                                               key.c_str(), buffer);
+                    if (s == OK ? !valid(key, string(buffer, (size_t) size)) : s != NOT_FOUND) {
+                        errors++;
+                    }
+                }
+            }
+        });
+    }
+    for (int t = 0; t < CONCURRENT_THREADS; t += 2) threads[t].join();
+    done = true;
+    for (int t = 1; t < CONCURRENT_THREADS; t += 2) threads[t].join();
+    ASSERT_EQ(errors, 0);
+    for (int i = 0; i < keys; i++) {
+        string value;
+        const KVStatus s = kv->Get(to_string(i), &value);
+        ASSERT_TRUE(s == NOT_FOUND || (s == OK && valid(to_string(i), value)));
+    }
+}
+
+TEST_F(KVTest, AllKeyValuesCallbackUpdatesTest) {
+    const int limit = LEAF_KEYS * 8;
+    for (int i = 0; i < limit; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+    }
+    struct Visit {
+        KVTree* kv;
+        int visited;
+        int errors;
+    } visit = {kv, 0, 0};
+    kv->AllKeyValues(&visit, [](void* context, int32_t keybytes, const char* key,
+                                int32_t valuebytes, const char* value) {
+        auto visit = (Visit*) context;                        // no lock is held, so callback
+        const string k(key, (size_t) keybytes);               // may use the engine
+        string current;
+        if (string(value, (size_t) valuebytes) != k) visit->errors++;
+        if (visit->kv->Get(k, &current) != OK || current != k) visit->errors++;
+        if (visit->kv->Put(k, k + "!") != OK) visit->errors++;
+        visit->visited++;
+        return true;
+    });
+    ASSERT_EQ(visit.errors, 0);
+    ASSERT_EQ(visit.visited, limit);                          // each key visited once
+    for (int i = 0; i < limit; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+    }
+}
+
 // =============================================================================================
 // TEST RUNNING OUT OF SPACE
 // =============================================================================================
@@ -886,7 +1990,11 @@ const string LONGSTR = "123456789A123456789A123456789A123456789A123456789A123456
 
 TEST_F(KVFullTest, OutOfSpace1Test) {
     tx_alloc_should_fail = true;
-    ASSERT_TRUE(kv->Put("100", "?") == FAILED);
+    ASSERT_TRUE(kv->Put("100", "?") == OK);                   // overwritten in place
+    string value;
+    ASSERT_TRUE(kv->Get("100", &value) == OK && value == "?");
+    ASSERT_TRUE(kv->Put("100", "100!") == OK);
+    ASSERT_TRUE(kv->Put("100", string(1000, '?')) == FAILED); // needs new record
     tx_alloc_should_fail = false;
     Validate();
 }
@@ -929,7 +2037,7 @@ TEST_F(KVFullTest, OutOfSpace3bTest) {
 
 TEST_F(KVFullTest, OutOfSpace4aTest) {
     tx_alloc_should_fail = true;
-    ASSERT_TRUE(kv->Put(to_string(LARGE_LIMIT + 1), "1") == FAILED);
+    ASSERT_TRUE(kv->Put(to_string(LARGE_LIMIT + 1), string(1000, '1')) == FAILED);  // not in slab
     tx_alloc_should_fail = false;
     Validate();
 }
@@ -937,7 +2045,7 @@ TEST_F(KVFullTest, OutOfSpace4aTest) {
 TEST_F(KVFullTest, OutOfSpace4bTest) {
     tx_alloc_should_fail = true;
     for (int i = 0; i <= 99999; i++) {
-        ASSERT_TRUE(kv->Put(to_string(LARGE_LIMIT + 1), "1") == FAILED);
+        ASSERT_TRUE(kv->Put(to_string(LARGE_LIMIT + 1), string(1000, '1')) == FAILED);
     }
     tx_alloc_should_fail = false;
     ASSERT_TRUE(kv->Remove("98765") == OK);
@@ -965,6 +2073,20 @@ TEST_F(KVFullTest, OutOfSpace5bTest) {
     Validate();
 }
 
+TEST_F(KVFullTest, OutOfSpaceWriteBatchTest) {
+    WriteBatch batch;
+    batch.Remove("100");
+    batch.Put("123456", "1");
+    batch.Put(LONGSTR, LONGSTR);
+    tx_alloc_should_fail = true;
+    ASSERT_TRUE(kv->Write(batch) == FAILED);
+    tx_alloc_should_fail = false;
+    string value;
+    ASSERT_TRUE(kv->Get("123456", &value) == OK && value == "123456!");
+    ASSERT_TRUE(kv->Get(LONGSTR, &value) == NOT_FOUND);
+    Validate();
+}
+
 //TEST_F(KVFullTest, OutOfSpace6Test) {
 //    tx_alloc_should_fail = true;
 //    ASSERT_TRUE(kv->Put(LONGSTR, "?") == FAILED);
@@ -30,11 +30,17 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include "gtest/gtest.h"
 #include "../mock_tx_alloc.h"
 #include "../../src/engines/mvtree.h"
 
 using namespace pmemkv::mvtree;
+using pmemkv::KVIterator;
+using pmemkv::Slice;
+using pmemkv::WriteBatch;
 
 const string PATH = "/dev/shm/pmemkv";
 const string PATH_CACHED = "/tmp/pmemkv";
@@ -121,6 +127,42 @@ TEST_F(MVEmptyTest, FailsToCreateInstanceWithTinySize) {
 // TEST SINGLE-LEAF TREE 
 // =============================================================================================
 
+TEST_F(MVTest, AllKeysTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key3", "value3") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Remove("key2") == OK);
+    vector<string> keys;
+    kv->AllKeys(&keys, [](void* context, int32_t keybytes, const char* key) {
+        ((vector<string>*) context)->push_back(string(key, (size_t) keybytes));
+        return true;
+    });
+    std::sort(keys.begin(), keys.end());
+    ASSERT_EQ(keys, vector<string>({"key1", "key3"}));
+    keys.clear();
+    kv->ListAllKeys(keys);
+    std::sort(keys.begin(), keys.end());
+    ASSERT_EQ(keys, vector<string>({"key1", "key3"}));
+    ASSERT_EQ(kv->TotalNumKeys(), 2);
+}
+
+TEST_F(MVTest, AllKeyValuesTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key3", "value3") == OK) << pmemobj_errormsg();
+    string pairs;
+    kv->AllKeyValues(&pairs, [](void* context, int32_t keybytes, const char* key,
+                                int32_t valuebytes, const char* value) {
+        auto pairs = (string*) context;
+        pairs->append(key, (size_t) keybytes).append("=").append(value, (size_t) valuebytes);
+        return pairs->size() < 20;                            // stop after second pair
+    });
+    ASSERT_EQ(pairs.size(), 22);
+    vector<string> kv_pairs;
+    kv->ListAllKeyValuePairs(kv_pairs);
+    ASSERT_EQ(kv_pairs.size(), 6);
+}
+
 TEST_F(MVTest, BinaryKeyTest) {
     ASSERT_TRUE(kv->Put("a", "should_not_change") == OK) << pmemobj_errormsg();
     string key1 = string("a\0b", 3);
@@ -146,6 +188,17 @@ TEST_F(MVTest, BinaryValueTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+TEST_F(MVTest, SliceTest) {
+    const char buf[] = "key1value1trailing";
+    ASSERT_TRUE(kv->Put(Slice(buf, 4), Slice(buf + 4, 6)) == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get(Slice(buf, 4), &value) == OK && value == "value1");
+    ASSERT_TRUE(kv->Get(Slice(buf, 3), &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get(Slice(buf, 5), &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Remove(Slice(buf, 4)) == OK);
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+}
+
 TEST_F(MVTest, EmptyKeyTest) {
     ASSERT_TRUE(kv->Put("", "empty") == OK) << pmemobj_errormsg();
     ASSERT_TRUE(kv->Put(" ", "single-space") == OK) << pmemobj_errormsg();
@@ -188,6 +241,19 @@ TEST_F(MVTest, GetAppendToExternalValueTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+TEST_F(MVTest, GetWithCallbackTest) {
+    ASSERT_TRUE(kv->Put("key1", string("A\0B", 3)) == OK) << pmemobj_errormsg();
+    string value;
+    auto append = [](void* context, int32_t valuebytes, const char* v) {
+        ((string*) context)->append(v, (size_t) valuebytes);
+    };
+    ASSERT_TRUE(kv->Get("key1", &value, append) == OK);
+    ASSERT_TRUE(value == string("A\0B", 3));
+    string value2;
+    ASSERT_TRUE(kv->Get("key2", &value2, append) == NOT_FOUND);
+    ASSERT_TRUE(value2.empty());
+}
+
 TEST_F(MVTest, GetHeadlessTest) {
     string value;
     ASSERT_TRUE(kv->Get("waldo", &value) == NOT_FOUND);
@@ -374,6 +440,71 @@ TEST_F(MVTest, RemoveNonexistentTest) {
     ASSERT_EQ(analysis.leaf_total, 1);
 }
 
+TEST_F(MVTest, IteratorTest) {
+    std::unique_ptr<KVIterator> it(kv->NewIterator());
+    it->SeekToFirst();
+    ASSERT_FALSE(it->Valid());
+    it->SeekToLast();
+    ASSERT_FALSE(it->Valid());
+    it->Seek("key");
+    ASSERT_FALSE(it->Valid());
+    ASSERT_TRUE(kv->Put("key3", "value3") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    it.reset(kv->NewIterator());
+    it->SeekToFirst();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key1" && it->Value() == "value1");
+    it->Next();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key2" && it->Value() == "value2");
+    it->Next();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key3" && it->Value() == "value3");
+    it->Next();
+    ASSERT_FALSE(it->Valid());
+    it->SeekToLast();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key3");
+    it->Prev();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key2");
+    it->Prev();
+    ASSERT_TRUE(it->Valid() && it->Key() == "key1");
+    it->Prev();
+    ASSERT_FALSE(it->Valid());
+    it->Seek("key2");
+    ASSERT_TRUE(it->Valid() && it->Key() == "key2");
+    it->Seek("key10");
+    ASSERT_TRUE(it->Valid() && it->Key() == "key2");
+    it->Seek("k");
+    ASSERT_TRUE(it->Valid() && it->Key() == "key1");
+    it->Seek("key4");
+    ASSERT_FALSE(it->Valid());
+}
+
+TEST_F(MVTest, WriteBatchTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    ASSERT_TRUE(kv->Put("key2", "value2") == OK) << pmemobj_errormsg();
+    WriteBatch batch;
+    batch.Put("key3", "value3");
+    batch.Remove("key1");
+    batch.Put("key2", "VALUE2");
+    batch.Put("key4", "value4");
+    batch.Remove("key4");
+    batch.Remove("nada");
+    ASSERT_EQ(batch.Count(), 6);
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("key2", &value) == OK && value == "VALUE2");
+    value = "";
+    ASSERT_TRUE(kv->Get("key3", &value) == OK && value == "value3");
+    ASSERT_TRUE(kv->Get("key4", &value) == NOT_FOUND);
+    batch.Clear();
+    ASSERT_EQ(batch.Count(), 0);
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, 0);
+    ASSERT_EQ(analysis.leaf_prealloc, 0);
+    ASSERT_EQ(analysis.leaf_total, 1);
+}
+
 // =============================================================================================
 // TEST RECOVERY OF SINGLE-LEAF TREE
 // =============================================================================================
@@ -625,6 +756,110 @@ TEST_F(MVTest, SingleInnerNodeDescendingTest2) {
     ASSERT_EQ(analysis.leaf_total, 5);
 }
 
+TEST_F(MVTest, SingleInnerNodeMultiGetTest) {
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    vector<string> keys;
+    for (int i = (10000 + SINGLE_INNER_LIMIT + 5); i >= 9995; i -= 3) keys.push_back(to_string(i));
+    keys.push_back("10042");                                  // duplicate keys are allowed
+    keys.push_back("10042");
+    vector<string> values(keys.size());
+    auto found = [](void* context, int32_t index, int32_t valuebytes, const char* value) {
+        auto values = (vector<string>*) context;
+        ASSERT_TRUE(values->at(index).empty());
+        values->at(index).append(value, (size_t) valuebytes);
+    };
+    kv->MultiGet(keys, &values, found);
+    for (int i = 0; i < keys.size(); i++) {
+        int k = std::stoi(keys[i]);
+        if (k >= 10000 && k <= (10000 + SINGLE_INNER_LIMIT)) {
+            ASSERT_EQ(values[i], keys[i] + "!");
+        } else {
+            ASSERT_TRUE(values[i].empty());
+        }
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_total, 5);
+}
+
+TEST_F(MVTest, SingleInnerNodeIteratorTest) {
+    for (int i = (10000 + SINGLE_INNER_LIMIT); i >= 10000; i--) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    for (int i = 10040; i < 10100; i++) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    Analyze();
+    ASSERT_EQ(analysis.leaf_empty, 2);                         // iterator must skip empty leaves
+    std::unique_ptr<KVIterator> it(kv->NewIterator());
+    int expected = 10000;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        if (expected == 10040) expected = 10100;
+        ASSERT_EQ(it->Key(), to_string(expected));
+        ASSERT_EQ(it->Value(), to_string(expected) + "!");
+        expected++;
+    }
+    ASSERT_EQ(expected, 10000 + SINGLE_INNER_LIMIT + 1);
+    for (it->SeekToLast(); it->Valid(); it->Prev()) {
+        expected--;
+        if (expected == 10099) expected = 10039;
+        ASSERT_EQ(it->Key(), to_string(expected));
+    }
+    ASSERT_EQ(expected, 10000);
+    it->Seek("10050");
+    ASSERT_TRUE(it->Valid() && it->Key() == "10100");
+    it->Prev();
+    ASSERT_TRUE(it->Valid() && it->Key() == "10039");
+}
+
+TEST_F(MVTest, SingleInnerNodeWriteBatchTest) {
+    WriteBatch batch;
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        batch.Put(istr, istr + "!");
+    }
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_total, 4);                        // split at median of batch keys
+}
+
+TEST_F(MVTest, SingleInnerNodeWriteBatchAbortedTest) {
+    for (int i = 10000; i < (10000 + LEAF_KEYS * 2); i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    Analyze();
+    const size_t leaf_total = analysis.leaf_total;
+    WriteBatch batch;
+    for (int i = 10000; i < (10000 + LEAF_KEYS * 2); i += 2) batch.Remove(to_string(i));
+    for (int i = 10001; i < (10000 + LEAF_KEYS * 2); i += 2) {
+        string istr = to_string(i);
+        batch.Put(istr, istr + "?");                          // fails to allocate record
+    }
+    tx_alloc_should_fail = true;
+    ASSERT_TRUE(kv->Write(batch) == FAILED);
+    tx_alloc_should_fail = false;
+    ASSERT_EQ(kv->TotalNumKeys(), LEAF_KEYS * 2);
+    for (int i = 10000; i < (10000 + LEAF_KEYS * 2); i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!")) << istr;
+    }
+    Analyze();
+    ASSERT_EQ(analysis.leaf_total, leaf_total);
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    ASSERT_EQ(kv->TotalNumKeys(), LEAF_KEYS);
+    string value;
+    ASSERT_TRUE(kv->Get("10000", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("10001", &value) == OK && value == "10001?");
+}
+
 // =============================================================================================
 // TEST RECOVERY OF TREE WITH SINGLE INNER NODE
 // =============================================================================================
@@ -697,6 +932,44 @@ TEST_F(MVTest, SingleInnerNodeDescendingAfterRecoveryTest2) {
     ASSERT_EQ(analysis.leaf_total, 5);
 }
 
+TEST_F(MVTest, SingleInnerNodeTotalNumKeysAfterRecoveryTest) {
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT + 1);
+    ASSERT_TRUE(kv->Remove("10000") == OK);
+    ASSERT_TRUE(kv->Remove("10000") == OK);
+    ASSERT_TRUE(kv->Remove("nada") == OK);
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT);
+    Reopen();
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT);
+    ASSERT_TRUE(kv->Put("10000", "10000!") == OK) << pmemobj_errormsg();
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT + 1);
+}
+
+TEST_F(MVTest, SingleInnerNodeWriteBatchAfterRecoveryTest) {
+    WriteBatch batch;
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        batch.Put(istr, istr + "!");
+        if (i % 2 == 0) batch.Remove(istr);
+    }
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    Reopen();
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        string value;
+        if (i % 2 == 0) {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == (istr + "!"));
+        }
+    }
+}
+
 TEST_F(MVTest, UsePreallocAfterMultipleLeafRecoveryTest) {
     for (int i = 1; i <= LEAF_KEYS + 1; i++)
         ASSERT_EQ(kv->Put(to_string(i), "!"), OK) << pmemobj_errormsg();
@@ -741,6 +1014,32 @@ TEST_F(MVTest, UsePreallocAfterMultipleLeafRecoveryTest) {
     ASSERT_EQ(analysis.leaf_total, 2);
 }
 
+TEST_F(MVTest, BackgroundRecoveryTest) {
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    delete kv;
+    kv = new MVTree(PATH, SIZE, true);
+    vector<string> keys = {"10002", "nope", "10001", "10002"};  // served by scan or index
+    vector<string> values(keys.size());
+    kv->MultiGet(keys, &values, [](void* context, int32_t index, int32_t valuebytes, const char* value) {
+        (*(vector<string>*) context)[index].assign(value, (size_t) valuebytes);
+    });
+    ASSERT_EQ(values, vector<string>({"10002!", "", "10001!", "10002!"}));
+    string value;
+    for (int i = 10000; i <= (10000 + SINGLE_INNER_LIMIT); i++) {  // found in index or by
+        string istr = to_string(i);                              // scanning leaves not indexed
+        value.clear();
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!") << istr;
+    }
+    ASSERT_TRUE(kv->Get("nope", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Put("10000", "changed") == OK) << pmemobj_errormsg();  // waits for index
+    value.clear();
+    ASSERT_TRUE(kv->Get("10000", &value) == OK && value == "changed");
+    ASSERT_EQ(kv->TotalNumKeys(), SINGLE_INNER_LIMIT + 1);
+}
+
 // =============================================================================================
 // TEST LARGE TREE
 // =============================================================================================
@@ -822,6 +1121,121 @@ TEST_F(MVTest, LargeDescendingAfterRecoveryTest) {
 }
 
 
+// =============================================================================================
+// TEST CONCURRENT ACCESS
+// =============================================================================================
+
+const int CONCURRENT_THREADS = 8;
+const int CONCURRENT_LIMIT = 5000;
+
+TEST_F(MVTest, ConcurrentPutGetRemoveTest) {
+    std::atomic<int> errors(0);
+    vector<std::thread> threads;
+    for (int t = 0; t < CONCURRENT_THREADS; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < CONCURRENT_LIMIT; i++) {
+                string istr = to_string(t) + "-" + to_string(i);
+                if (kv->Put(istr, istr + "!") != OK) errors++;
+                string value;
+                if (kv->Get(istr, &value) != OK || value != istr + "!") errors++;
+                if (i % 2 == 1 && kv->Remove(istr) != OK) errors++;
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    ASSERT_EQ(errors, 0);
+    ASSERT_EQ(kv->TotalNumKeys(), CONCURRENT_THREADS * CONCURRENT_LIMIT / 2);
+    for (int t = 0; t < CONCURRENT_THREADS; t++) {
+        for (int i = 0; i < CONCURRENT_LIMIT; i++) {
+            string istr = to_string(t) + "-" + to_string(i);
+            string value;
+            if (i % 2 == 1) {
+                ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+            } else {
+                ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+            }
+        }
+    }
+}
+
+TEST_F(MVTest, ConcurrentOverwriteGetTest) {
+    const int keys = LEAF_KEYS_MIDPOINT;                                 // all in one leaf
+    for (int i = 0; i < keys; i++) ASSERT_TRUE(kv->Put(to_string(i), to_string(i) + ":") == OK);
+    auto valid = [](const string& key, const string& value) {           // key, colon, then x's
+        if (value.compare(0, key.size() + 1, key + ":") != 0) return false;
+        return value.find_first_not_of('x', key.size() + 1) == string::npos;
+    };
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+    vector<std::thread> threads;
+    for (int t = 0; t < CONCURRENT_THREADS; t++) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; (t % 2 == 0) ? i < CONCURRENT_LIMIT : !done; i++) {
+                const string key = to_string(i % keys);
+                if (t % 2 == 0) {                                        // writers resize values
+                    if (i % 7 == 6) {                                    // and remove keys
+                        if (kv->Remove(key) != OK) errors++;
+                    } else if (kv->Put(key, key + ":" + string((size_t) (i * 37 % 300), 'x')) != OK) {
+                        errors++;
+                    }
+                } else if (t % 4 == 1) {                                 // readers append value
+                    string value;
+                    const KVStatus s = kv->Get(key, &value);
+                    if (s == OK ? !valid(key, value) : s != NOT_FOUND) errors++;
+                } else {                                                 // readers copy value
+                    char buffer[400];
+                    int32_t size = 0;
+                    const KVStatus s = kv->Get(sizeof(buffer), (int32_t) key.size(), &size,
+                                               key.c_str(), buffer);
+                    if (s == OK ? !valid(key, string(buffer, (size_t) size)) : s != NOT_FOUND) {
+                        errors++;
+                    }
+                }
+            }
+        });
+    }
+    for (int t = 0; t < CONCURRENT_THREADS; t += 2) threads[t].join();
+    done = true;
+    for (int t = 1; t < CONCURRENT_THREADS; t += 2) threads[t].join();
+    ASSERT_EQ(errors, 0);
+    for (int i = 0; i < keys; i++) {
+        string value;
+        const KVStatus s = kv->Get(to_string(i), &value);
+        ASSERT_TRUE(s == NOT_FOUND || (s == OK && valid(to_string(i), value)));
+    }
+}
+
+TEST_F(MVTest, AllKeyValuesCallbackUpdatesTest) {
+    const int limit = LEAF_KEYS * 8;
+    for (int i = 0; i < limit; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr) == OK) << pmemobj_errormsg();
+    }
+    struct Visit {
+        MVTree* kv;
+        int visited;
+        int errors;
+    } visit = {kv, 0, 0};
+    kv->AllKeyValues(&visit, [](void* context, int32_t keybytes, const char* key,
+                                int32_t valuebytes, const char* value) {
+        auto visit = (Visit*) context;                        // no lock is held, so callback
+        const string k(key, (size_t) keybytes);               // may use the engine
+        string current;
+        if (string(value, (size_t) valuebytes) != k) visit->errors++;
+        if (visit->kv->Get(k, &current) != OK || current != k) visit->errors++;
+        if (visit->kv->Put(k, k + "!") != OK) visit->errors++;
+        visit->visited++;
+        return true;
+    });
+    ASSERT_EQ(visit.errors, 0);
+    ASSERT_EQ(visit.visited, limit);                          // each key visited once
+    for (int i = 0; i < limit; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+    }
+}
+
 // =============================================================================================
 // TEST RUNNING OUT OF SPACE
 // =============================================================================================
@@ -966,6 +1380,20 @@ TEST_F(MVFullTest, OutOfSpace5bTest) {
     Validate();
 }
 
+TEST_F(MVFullTest, OutOfSpaceWriteBatchTest) {
+    WriteBatch batch;
+    batch.Remove("100");
+    batch.Put("123456", "1");
+    batch.Put(LONGSTR, LONGSTR);
+    tx_alloc_should_fail = true;
+    ASSERT_TRUE(kv->Write(batch) == FAILED);
+    tx_alloc_should_fail = false;
+    string value;
+    ASSERT_TRUE(kv->Get("123456", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get(LONGSTR, &value) == NOT_FOUND);
+    Validate();
+}
+
 //TEST_F(MVFullTest, OutOfSpace6Test) {
 //    tx_alloc_should_fail = true;
 //    ASSERT_TRUE(kv->Put(LONGSTR, "?") == FAILED);
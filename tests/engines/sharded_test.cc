@@ -0,0 +1,241 @@
+/*
+ * Copyright 2017-2018, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <algorithm>
+#include "gtest/gtest.h"
+#include "../mock_tx_alloc.h"
+#include "../../src/engines/sharded.h"
+
+using namespace pmemkv::sharded;
+using pmemkv::KVIterator;
+using pmemkv::WriteBatch;
+
+const string PATH = "/dev/shm/pmemkv";
+const size_t SIZE = ((size_t) (1024 * 1024 * 1104));
+
+class ShardedEmptyTest : public testing::Test {
+public:
+    ShardedEmptyTest() {
+        std::remove(PATH.c_str());
+    }
+};
+
+class ShardedTest : public testing::Test {
+public:
+    ShardedEngine* kv;
+
+    ShardedTest() {
+        std::remove(PATH.c_str());
+        Open();
+    }
+
+    ~ShardedTest() { delete kv; }
+
+    void Reopen() {
+        delete kv;
+        Open();
+    }
+
+private:
+    void Open() {
+        kv = new ShardedEngine(PATH, SIZE);
+    }
+};
+
+const int SHARDED_LIMIT = 2000;
+
+// =============================================================================================
+// TEST EMPTY ENGINE
+// =============================================================================================
+
+TEST_F(ShardedEmptyTest, CreateInstanceTest) {
+    ShardedEngine* kv = new ShardedEngine(PATH, PMEMOBJ_MIN_POOL * 4);
+    ASSERT_EQ(kv->ShardCount(), DEFAULT_SHARDS);
+    ASSERT_EQ(kv->TotalNumKeys(), 0);
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+    delete kv;
+}
+
+TEST_F(ShardedEmptyTest, FailsToCreateInstanceWithInvalidPath) {
+    try {
+        new ShardedEngine("/tmp/123/234/345/456/567/678/nope.nope", PMEMOBJ_MIN_POOL);
+        FAIL();
+    } catch (...) {
+        // do nothing, expected to happen
+    }
+}
+
+TEST_F(ShardedEmptyTest, FailsToCreateInstanceWithTooManyShards) {
+    try {
+        new ShardedEngine(PATH, PMEMOBJ_MIN_POOL, MAX_SHARDS + 1);
+        FAIL();
+    } catch (...) {
+        // do nothing, expected to happen
+    }
+}
+
+TEST_F(ShardedEmptyTest, PersistsShardCountTest) {
+    ShardedEngine* kv = new ShardedEngine(PATH, PMEMOBJ_MIN_POOL * 4, 3);
+    ASSERT_EQ(kv->ShardCount(), 3);
+    delete kv;
+    kv = new ShardedEngine(PATH, PMEMOBJ_MIN_POOL * 4, 5);                // count from directory wins
+    ASSERT_EQ(kv->ShardCount(), 3);
+    delete kv;
+}
+
+// =============================================================================================
+// TEST KEYS SPREAD ACROSS SHARDS
+// =============================================================================================
+
+TEST_F(ShardedTest, PutGetRemoveTest) {
+    vector<size_t> per_shard(kv->ShardCount(), 0);
+    for (int i = 0; i < SHARDED_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+        per_shard[kv->ShardFor(istr)]++;
+    }
+    for (auto count : per_shard) ASSERT_GT(count, 0);
+    ASSERT_EQ(kv->TotalNumKeys(), SHARDED_LIMIT);
+    for (int i = 0; i < SHARDED_LIMIT; i += 2) ASSERT_TRUE(kv->Remove(to_string(i)) == OK);
+    for (int i = 0; i < SHARDED_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        if (i % 2 == 0) {
+            ASSERT_TRUE(kv->Get(istr, &value) == NOT_FOUND);
+        } else {
+            ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+        }
+    }
+    ASSERT_EQ(kv->TotalNumKeys(), SHARDED_LIMIT / 2);
+}
+
+TEST_F(ShardedTest, MultiGetTest) {
+    for (int i = 0; i < 100; i++) ASSERT_TRUE(kv->Put(to_string(i), "v" + to_string(i)) == OK);
+    vector<string> keys = {"42", "nada", "7", "99", "0", "100"};
+    vector<string> values(keys.size());
+    kv->MultiGet(keys, &values, [](void* context, int32_t index, int32_t valuebytes, const char* value) {
+        (*(vector<string>*) context)[index] = string(value, (size_t) valuebytes);
+    });
+    ASSERT_EQ(values, vector<string>({"v42", "", "v7", "v99", "v0", ""}));
+}
+
+TEST_F(ShardedTest, WriteBatchTest) {
+    ASSERT_TRUE(kv->Put("key1", "value1") == OK) << pmemobj_errormsg();
+    WriteBatch batch;
+    for (int i = 0; i < 100; i++) batch.Put(to_string(i), to_string(i));
+    batch.Remove("key1");
+    batch.Remove("50");
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    string value;
+    ASSERT_TRUE(kv->Get("key1", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("50", &value) == NOT_FOUND);
+    ASSERT_TRUE(kv->Get("99", &value) == OK && value == "99");
+    ASSERT_EQ(kv->TotalNumKeys(), 99);
+}
+
+TEST_F(ShardedTest, WriteBatchAbortedTest) {
+    for (int i = 0; i < 100; i++) ASSERT_TRUE(kv->Put(to_string(i), to_string(i)) == OK) << pmemobj_errormsg();
+    WriteBatch batch;
+    for (int i = 0; i < 100; i += 2) batch.Remove(to_string(i));         // removes in all shards,
+    for (int i = 1; i < 100; i += 2) batch.Put(to_string(i), "?");        // then puts fail
+    tx_alloc_should_fail = true;
+    ASSERT_TRUE(kv->Write(batch) == FAILED);
+    tx_alloc_should_fail = false;
+    ASSERT_EQ(kv->TotalNumKeys(), 100);
+    for (int i = 0; i < 100; i++) {
+        string value;
+        ASSERT_TRUE(kv->Get(to_string(i), &value) == OK && value == to_string(i)) << i;
+    }
+    ASSERT_TRUE(kv->Write(batch) == OK) << pmemobj_errormsg();
+    ASSERT_EQ(kv->TotalNumKeys(), 50);
+}
+
+TEST_F(ShardedTest, IteratorTest) {
+    vector<string> expected;
+    for (int i = 0; i < SHARDED_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+        expected.push_back(istr);
+    }
+    std::sort(expected.begin(), expected.end());
+    unique_ptr<KVIterator> it(kv->NewIterator());
+    size_t idx = 0;
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+        ASSERT_EQ(it->Key(), expected[idx]);
+        ASSERT_EQ(it->Value(), expected[idx] + "!");
+        idx++;
+    }
+    ASSERT_EQ(idx, expected.size());
+    for (it->SeekToLast(); it->Valid(); it->Prev()) ASSERT_EQ(it->Key(), expected[--idx]);
+    ASSERT_EQ(idx, 0);
+    it->Seek("500");                                                     // change direction twice
+    ASSERT_TRUE(it->Valid() && it->Key() == "500");
+    it->Prev();
+    ASSERT_TRUE(it->Valid() && it->Key() == "50");
+    it->Next();
+    ASSERT_TRUE(it->Valid() && it->Key() == "500");
+    it->Next();
+    ASSERT_TRUE(it->Valid() && it->Key() == "501");
+}
+
+TEST_F(ShardedTest, AllKeysStopsEarlyTest) {
+    for (int i = 0; i < SHARDED_LIMIT; i++) ASSERT_TRUE(kv->Put(to_string(i), "") == OK);
+    int visited = 0;
+    kv->AllKeys(&visited, [](void* context, int32_t keybytes, const char* key) {
+        return ++*((int*) context) < 10;
+    });
+    ASSERT_EQ(visited, 10);
+    vector<string> keys;
+    kv->ListAllKeys(keys);
+    ASSERT_EQ(keys.size(), SHARDED_LIMIT);
+}
+
+// =============================================================================================
+// TEST RECOVERY OF SHARDS
+// =============================================================================================
+
+TEST_F(ShardedTest, RecoveryTest) {
+    for (int i = 0; i < SHARDED_LIMIT; i++) {
+        string istr = to_string(i);
+        ASSERT_TRUE(kv->Put(istr, istr + "!") == OK) << pmemobj_errormsg();
+    }
+    Reopen();
+    ASSERT_EQ(kv->ShardCount(), DEFAULT_SHARDS);
+    ASSERT_EQ(kv->TotalNumKeys(), SHARDED_LIMIT);
+    for (int i = 0; i < SHARDED_LIMIT; i++) {
+        string istr = to_string(i);
+        string value;
+        ASSERT_TRUE(kv->Get(istr, &value) == OK && value == istr + "!");
+    }
+}